@@ -1,6 +1,7 @@
 # DO NOT EDIT, GENERATED BY SCRIPT
 set(llfio_HEADERS
   "include/llfio/v2.0/deadline.h"
+  "include/kvstore/detail/impl/kvstore.ipp"
   "include/kvstore/kvstore.hpp"
   "include/llfio.hpp"
   "include/llfio/llfio.hpp"
@@ -10,6 +11,7 @@ set(llfio_HEADERS
   "include/llfio/v2.0/algorithm/handle_adapter/cached_parent.hpp"
   "include/llfio/v2.0/algorithm/handle_adapter/combining.hpp"
   "include/llfio/v2.0/algorithm/handle_adapter/xor.hpp"
+  "include/llfio/v2.0/algorithm/shared_fs_mutex/async_lock.hpp"
   "include/llfio/v2.0/algorithm/shared_fs_mutex/atomic_append.hpp"
   "include/llfio/v2.0/algorithm/shared_fs_mutex/base.hpp"
   "include/llfio/v2.0/algorithm/shared_fs_mutex/byte_ranges.hpp"
@@ -14,9 +14,12 @@ set(llfio_TESTS
   "test/tests/directory_handle_create_close/runner.cpp"
   "test/tests/directory_handle_enumerate/runner.cpp"
   "test/tests/fast_random_file_handle.cpp"
+  "test/tests/file_handle_extents.cpp"
   "test/tests/file_handle_create_close/runner.cpp"
   "test/tests/file_handle_lock_unlock.cpp"
+  "test/tests/file_handle_read_ranges.cpp"
   "test/tests/handle_adapter_xor.cpp"
+  "test/tests/kvstore.cpp"
   "test/tests/large_pages.cpp"
   "test/tests/map_handle_create_close/runner.cpp"
   "test/tests/mapped.cpp"
@@ -0,0 +1,850 @@
+/* Standard key-value store for C++
+
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License in the accompanying file
+Licence.txt or at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+
+Distributed under the Boost Software License, Version 1.0.
+    (See accompanying file Licence.txt or copy at
+          http://www.boost.org/LICENSE_1_0.txt)
+*/
+
+#include "../../kvstore.hpp"
+#include "../../../llfio/v2.0/mapped_file_handle.hpp"
+#include "../../../llfio/v2.0/utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+KVSTORE_V1_NAMESPACE_BEGIN
+
+namespace detail
+{
+  using llfio::errc;
+  using llfio::success;
+
+  /* The `single_file` store, kept in a single sparse file mapped as shared memory into every
+  process using it.
+
+  The file begins with a page of header, followed by a linear probed table of key slots, followed
+  by an append only heap of value records. Until the store is laid out by the first write or URI
+  fetch, the file holds only the header. Thereafter it is extended to its full size in one go and
+  never remapped, so pointers into the map remain valid for the lifetime of the store.
+
+  Writing a value appends a new record pointing at the record it replaces, and publishes it into
+  the key's slot with the store's incremented version. Values are therefore stable, and a snapshot
+  is merely the store's version at a moment in time, reads from it walking each key's records back
+  to the latest not newer than that version.
+
+  Claiming a slot for a new key and publishing a record into a slot are excluded by spinning on
+  words in the map, recording the `llfio::utils::current_process_identity()` of whoever holds them.
+  Waiters check about once a second if it has died and if so, break the claim or lock. A process
+  dying in the instant between taking one and recording itself will hang every user of that slot.
+  */
+  class single_file_kvstore final : public basic_key_value_store
+  {
+    struct _header
+    {
+      char magic[8];
+      uint64_t key_size;
+      std::atomic<uint64_t> slots;  // Zero until laid out
+      uint64_t key_index_size;
+      uint64_t items_quota;
+      uint64_t heap_offset, heap_size;
+      std::atomic<uint64_t> version;    // Incremented by every write
+      std::atomic<uint64_t> heap_used;  // Bump allocator of the heap
+      std::atomic<uint64_t> items;      // Keys with a value
+      std::atomic<uint64_t> bytes;      // Total of the latest values of all keys
+    };
+    struct _slot
+    {
+      std::atomic<uint32_t> lock;             // Odd whilst held to publish a new record, incremented to take and release it
+      std::atomic<uint32_t> state;            // 0 = empty, 1 = being claimed, 2 = claimed
+      std::atomic<uint64_t> latest;           // Heap offset of latest record, zero if none
+      std::atomic<uint64_t> owner;            // Process identity of whoever is claiming the slot or holds its lock, else zero
+      std::atomic<uint64_t> owner_namespace;  // PID namespace of the owner, set before owner
+
+      byte *key() noexcept { return reinterpret_cast<byte *>(this + 1); }
+    };
+    struct _record
+    {
+      uint64_t prev;     // Heap offset of the record this replaced, zero if none
+      uint64_t version;  // The store version at which this record was published
+      uint64_t length;   // Length of the value following
+      uint64_t _padding;
+
+      byte *value() noexcept { return reinterpret_cast<byte *>(this + 1); }
+    };
+    struct _state
+    {
+      llfio::mapped_file_handle mfh;
+      llfio::mapped_file_handle::extent_guard inuse;  // shared on _inuse_offset() whilst the store is open
+      std::mutex layoutlock;
+      std::atomic<bool> laid_out{false};
+      _header *header{nullptr};
+      byte *slots{nullptr}, *heap{nullptr};
+      size_t slot_size{0};
+      uint64_t slot_mask{0};
+    };
+    std::shared_ptr<_state> _s;
+    bool _is_snapshot{false};
+    uint64_t _snapshot_version{0};
+
+    static const char *_magic() noexcept { return "AFKVSF01"; }
+    static constexpr uint64_t _header_bytes() noexcept { return 4096; }
+    static constexpr uint64_t _default_items_quota() noexcept { return 65536; }
+    static constexpr uint64_t _default_bytes_quota() noexcept { return 64 * 1024 * 1024; }
+    // The byte range locked whilst creating, laying out or clearing the store
+    static constexpr extent_type _lock_offset() noexcept { return INT64_MAX; }
+    // The byte range every handle to the store holds a shared lock upon
+    static constexpr extent_type _inuse_offset() noexcept { return INT64_MAX - 1; }
+    static_assert(sizeof(_header) <= 4096, "_header does not fit into its page");
+    static_assert(sizeof(_record) == 32, "_record is not the size expected");
+
+    static capacity_type _to_capacity(uint64_t v) noexcept
+    {
+      capacity_type ret;
+      ret.as_longlongs[0] = v;
+      ret.as_longlongs[1] = 0;
+      return ret;
+    }
+    static uint64_t _from_capacity(const capacity_type &v) noexcept { return (v.as_longlongs[1] != 0) ? UINT64_MAX : v.as_longlongs[0]; }
+    static uint64_t _hash(key_type key) noexcept
+    {
+      // FNV-1a
+      uint64_t ret = 14695981039346656037ULL;
+      for(auto b : key)
+      {
+        ret ^= static_cast<uint64_t>(b);
+        ret *= 1099511628211ULL;
+      }
+      return ret;
+    }
+    static bool _is_file_uri(const uri_type &uri) noexcept { return uri.size() > 7 && uri.compare(0, 7, "file://") == 0; }
+
+    _slot *_slot_at(uint64_t idx) const noexcept { return reinterpret_cast<_slot *>(_s->slots + idx * _s->slot_size); }
+    _record *_record_at(uint64_t offset) const noexcept { return reinterpret_cast<_record *>(_s->heap + offset); }
+
+    // Calls f with the header, holding the layout lock if the store may yet be remapped
+    template <class F> auto _with_header(F &&f) const noexcept -> decltype(f(std::declval<const _header &>()))
+    {
+      if(_s->laid_out.load(std::memory_order_acquire))
+      {
+        return f(*_s->header);
+      }
+      std::lock_guard<std::mutex> g(_s->layoutlock);
+      return f(*_s->header);
+    }
+
+    // Sets up the pointers into a laid out store. Called with the layout lock held.
+    void _map() noexcept
+    {
+      byte *base = _s->mfh.address();
+      _s->header = reinterpret_cast<_header *>(base);
+      _s->slot_size = (sizeof(_slot) + _key_size + 15) & ~static_cast<size_t>(15);
+      _s->slot_mask = _s->header->slots.load(std::memory_order_acquire) - 1;
+      _s->slots = base + _header_bytes();
+      _s->heap = base + _s->header->heap_offset;
+      _key_index_size = static_cast<size_type>(_s->header->key_index_size);
+      _items_quota = _to_capacity(_s->header->items_quota);
+      _bytes_quota = _to_capacity(_s->header->heap_size);
+      _frozen = true;
+      _s->laid_out.store(true, std::memory_order_release);
+    }
+
+    // Maps the whole store if it has been laid out by anybody, returning whether it has
+    result<bool> _attach() noexcept
+    {
+      if(_s->laid_out.load(std::memory_order_acquire))
+      {
+        return true;
+      }
+      std::lock_guard<std::mutex> g(_s->layoutlock);
+      if(_s->laid_out.load(std::memory_order_relaxed))
+      {
+        return true;
+      }
+      if(_s->header->slots.load(std::memory_order_acquire) == 0)
+      {
+        return false;
+      }
+      OUTCOME_TRY(_s->mfh.reserve());
+      _map();
+      return true;
+    }
+
+    // Extends the file to its full size and lays out the store if nobody has yet
+    result<void> _layout() noexcept
+    {
+      OUTCOME_TRY(laidout, _attach());
+      if(laidout)
+      {
+        return success();
+      }
+      if(!_s->mfh.is_writable())
+      {
+        return errc::operation_not_permitted;
+      }
+      std::lock_guard<std::mutex> g(_s->layoutlock);
+      if(_s->laid_out.load(std::memory_order_relaxed))
+      {
+        return success();
+      }
+      OUTCOME_TRY(guard, _s->mfh.lock(_lock_offset(), 1, true));
+      OUTCOME_TRY(length, _s->mfh.underlying_file_maximum_extent());
+      if(length > _header_bytes())
+      {
+        // Another process laid it out since we last looked
+        OUTCOME_TRY(_s->mfh.reserve());
+        _map();
+        return success();
+      }
+      uint64_t items = _from_capacity(_items_quota), bytes = _from_capacity(_bytes_quota);
+      if(items == 0)
+      {
+        items = _default_items_quota();
+      }
+      if(bytes == 0)
+      {
+        bytes = _default_bytes_quota();
+      }
+      // Keep the table no more than three quarters full
+      uint64_t slots = 64;
+      while(slots < items + items / 3)
+      {
+        slots <<= 1;
+      }
+      const uint64_t slot_size = (sizeof(_slot) + _key_size + 15) & ~static_cast<uint64_t>(15);
+      const uint64_t heap_offset = (_header_bytes() + slots * slot_size + 4095) & ~static_cast<uint64_t>(4095);
+      // The first 64 bytes of the heap are never allocated, so offset zero can mean none
+      const uint64_t heap_size = (bytes + 64 + 4095) & ~static_cast<uint64_t>(4095);
+      OUTCOME_TRY(_s->mfh.truncate(heap_offset + heap_size));
+      auto *header = reinterpret_cast<_header *>(_s->mfh.address());
+      header->key_index_size = _key_index_size;
+      header->items_quota = items;
+      header->heap_offset = heap_offset;
+      header->heap_size = heap_size;
+      header->heap_used.store(64, std::memory_order_relaxed);
+      header->slots.store(slots, std::memory_order_release);
+      _map();
+      return success();
+    }
+
+    // Returns the heap offset of a newly allocated record of the given size
+    result<uint64_t> _allocate(uint64_t bytes) noexcept
+    {
+      _header *header = _s->header;
+      uint64_t used = header->heap_used.load(std::memory_order_relaxed);
+      do
+      {
+        if(header->heap_size - used < bytes)
+        {
+          return errc::no_space_on_device;
+        }
+      } while(!header->heap_used.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+      return used;
+    }
+
+    // How long to wait on a slot before checking if whoever holds it has died
+    static std::chrono::nanoseconds _owner_check_interval() noexcept { return std::chrono::seconds(1); }
+    // Returns true once per interval, from an interval after the first call
+    static bool _owner_check_due(std::chrono::steady_clock::time_point &next) noexcept
+    {
+      const auto now = std::chrono::steady_clock::now();
+      if(next != std::chrono::steady_clock::time_point() && now < next)
+      {
+        return false;
+      }
+      const bool due = (next != std::chrono::steady_clock::time_point());
+      next = now + _owner_check_interval();
+      return due;
+    }
+    static void _set_owner(_slot *s) noexcept
+    {
+      s->owner_namespace.store(llfio::utils::current_process_namespace(), std::memory_order_relaxed);
+      s->owner.store(llfio::utils::current_process_identity(), std::memory_order_release);
+    }
+    /* Returns true if the owner of the slot, which took word when it became held, has died, in
+    which case only this caller sees true and must release word on its behalf. The owner and its
+    namespace are only believed if word still has the value it took.
+    */
+    static bool _owner_died(_slot *s, const std::atomic<uint32_t> &word, uint32_t held) noexcept
+    {
+      uint64_t owner = s->owner.load(std::memory_order_acquire);
+      const uint64_t owner_namespace = s->owner_namespace.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(owner == 0 || word.load(std::memory_order_relaxed) != held || llfio::utils::process_identity_is_running(owner, owner_namespace))
+      {
+        return false;
+      }
+      return s->owner.compare_exchange_strong(owner, 0, std::memory_order_acq_rel);
+    }
+    // Waits until the slot's lock is not held, breaking it if its holder died, returning its value
+    static uint32_t _wait_unlocked(_slot *s) noexcept
+    {
+      std::chrono::steady_clock::time_point next_check;
+      for(;;)
+      {
+        const uint32_t lock = s->lock.load(std::memory_order_acquire);
+        if((lock & 1) == 0)
+        {
+          return lock;
+        }
+        if(_owner_check_due(next_check) && _owner_died(s, s->lock, lock))
+        {
+          // The dead holder's record is either published or was never reachable
+          s->lock.store(lock + 1, std::memory_order_release);
+          continue;
+        }
+        std::this_thread::yield();
+      }
+    }
+    static void _lock_slot(_slot *s) noexcept
+    {
+      for(;;)
+      {
+        uint32_t lock = _wait_unlocked(s);
+        if(s->lock.compare_exchange_weak(lock, lock + 1, std::memory_order_acquire, std::memory_order_relaxed))
+        {
+          _set_owner(s);
+          return;
+        }
+      }
+    }
+    static void _unlock_slot(_slot *s) noexcept
+    {
+      s->owner.store(0, std::memory_order_relaxed);
+      s->lock.fetch_add(1, std::memory_order_release);
+    }
+
+    // Returns the slot for the key, claiming an empty one if insert is true. Null if not found or full.
+    _slot *_find(key_type key, bool insert) const noexcept
+    {
+      const uint64_t mask = _s->slot_mask;
+      uint64_t idx = _hash(key) & mask;
+      std::chrono::steady_clock::time_point next_check;
+      for(uint64_t n = 0; n <= mask; n++, idx = (idx + 1) & mask)
+      {
+        _slot *s = _slot_at(idx);
+        for(;;)
+        {
+          uint32_t state = s->state.load(std::memory_order_acquire);
+          if(state == 2)
+          {
+            if(0 == memcmp(s->key(), key.data(), _key_size))
+            {
+              return s;
+            }
+            break;
+          }
+          if(state == 1)
+          {
+            if(_owner_check_due(next_check) && _owner_died(s, s->state, 1))
+            {
+              // Nobody probes past a slot being claimed, so the dead claimer's slot may be empty again
+              s->state.store(0, std::memory_order_release);
+              continue;
+            }
+            std::this_thread::yield();
+            continue;
+          }
+          if(!insert)
+          {
+            return nullptr;
+          }
+          if(s->state.compare_exchange_weak(state, 1, std::memory_order_acquire, std::memory_order_relaxed))
+          {
+            _set_owner(s);
+            memcpy(s->key(), key.data(), _key_size);
+            s->owner.store(0, std::memory_order_relaxed);
+            s->state.store(2, std::memory_order_release);
+            return s;
+          }
+        }
+      }
+      return nullptr;
+    }
+
+    // Returns the record visible to this store or snapshot, or null if none
+    _record *_current(_slot *s) const noexcept
+    {
+      if(!_is_snapshot)
+      {
+        const uint64_t offset = s->latest.load(std::memory_order_acquire);
+        return (offset != 0) ? _record_at(offset) : nullptr;
+      }
+      // Any write still publishing may carry a version within our snapshot, so wait it out
+      _wait_unlocked(s);
+      for(uint64_t offset = s->latest.load(std::memory_order_acquire); offset != 0;)
+      {
+        _record *r = _record_at(offset);
+        if(r->version <= _snapshot_version)
+        {
+          return r;
+        }
+        offset = r->prev;
+      }
+      return nullptr;
+    }
+
+  public:
+    single_file_kvstore() = default;
+
+    static int score(const uri_type &uri, mode /*unused*/, creation _creation) noexcept
+    {
+      if(!_is_file_uri(uri))
+      {
+        return -1;
+      }
+      auto fh = llfio::file({}, uri.c_str() + 7);
+      if(!fh)
+      {
+        return (_creation == creation::open_existing) ? -1 : 1;
+      }
+      if(_creation == creation::only_if_not_exist)
+      {
+        return -1;
+      }
+      if(_creation == creation::truncate)
+      {
+        return 1;
+      }
+      byte buffer[8];
+      handle_type::buffer_type reqs[] = {{buffer, sizeof(buffer)}};
+      auto read = fh.value().read({reqs, 0});
+      if(!read)
+      {
+        return -1;
+      }
+      if(read.bytes_transferred() == 0)
+      {
+        return 1;
+      }
+      if(read.bytes_transferred() < sizeof(buffer) || 0 != memcmp(read.value()[0].data(), _magic(), sizeof(buffer)))
+      {
+        return 0;
+      }
+      return 1;
+    }
+
+    static result<std::unique_ptr<basic_key_value_store>> create(const uri_type &uri, size_type key_size, features /*unused*/, mode _mode, creation _creation, caching _caching) noexcept
+    {
+      if(!_is_file_uri(uri))
+      {
+        return errc::invalid_argument;
+      }
+      try
+      {
+        std::unique_ptr<single_file_kvstore> ret(new single_file_kvstore);
+        ret->_s = std::make_shared<_state>();
+        OUTCOME_TRY(mfh, llfio::mapped_file({}, uri.c_str() + 7, _mode, _creation, _caching));
+        {
+          // Exclude other processes creating or laying out the same store
+          OUTCOME_TRY(guard, mfh.lock(_lock_offset(), 1, mfh.is_writable()));
+          OUTCOME_TRY(length, mfh.underlying_file_maximum_extent());
+          if(length == 0)
+          {
+            if(key_size == 0 || !mfh.is_writable())
+            {
+              return errc::invalid_argument;
+            }
+            OUTCOME_TRY(mfh.truncate(_header_bytes()));
+            auto *header = reinterpret_cast<_header *>(mfh.address());
+            header->key_size = key_size;
+            memcpy(header->magic, _magic(), sizeof(header->magic));
+          }
+          else
+          {
+            auto *header = reinterpret_cast<_header *>(mfh.address());
+            if(length < _header_bytes() || 0 != memcmp(header->magic, _magic(), sizeof(header->magic)))
+            {
+              return errc::illegal_byte_sequence;
+            }
+            if(key_size != 0 && key_size != header->key_size)
+            {
+              return errc::invalid_argument;
+            }
+            key_size = static_cast<size_type>(header->key_size);
+          }
+          // Taken before the lock above is released, so clear() either sees us or excludes us
+          OUTCOME_TRY(inuse, mfh.lock(_inuse_offset(), 1, false));
+          ret->_s->inuse = std::move(inuse);
+        }
+        ret->_uri = uri;
+        ret->_key_size = key_size;
+        ret->_s->mfh = std::move(mfh);
+        ret->_s->inuse.set_handle(&ret->_s->mfh);
+        ret->_s->header = reinterpret_cast<_header *>(ret->_s->mfh.address());
+        OUTCOME_TRY(ret->_attach());
+        return std::unique_ptr<basic_key_value_store>(std::move(ret));
+      }
+      catch(...)
+      {
+        return llfio::error_from_exception();
+      }
+    }
+
+    virtual result<uri_type> uri() noexcept override
+    {
+      if(_s->mfh.is_writable())
+      {
+        OUTCOME_TRY(_layout());
+      }
+      else
+      {
+        OUTCOME_TRY(_attach());
+      }
+      return _uri;
+    }
+
+    virtual bool empty() const noexcept override
+    {
+      return _with_header([](const _header &h) { return h.items.load(std::memory_order_relaxed) == 0; });
+    }
+    virtual result<capacity_type> max_size() const noexcept override
+    {
+      return _with_header([this](const _header &h) {
+        if(h.slots.load(std::memory_order_relaxed) != 0)
+        {
+          return _to_capacity(h.items_quota);
+        }
+        return (_from_capacity(_items_quota) != 0) ? _items_quota : _to_capacity(_default_items_quota());
+      });
+    }
+    virtual result<void> max_size(capacity_type quota) noexcept override
+    {
+      OUTCOME_TRY(laidout, _attach());
+      if(laidout || _is_snapshot)
+      {
+        return errc::operation_not_permitted;
+      }
+      _items_quota = quota;
+      return success();
+    }
+    virtual result<capacity_type> size() const noexcept override
+    {
+      return _with_header([](const _header &h) { return _to_capacity(h.items.load(std::memory_order_relaxed)); });
+    }
+    virtual result<capacity_type> max_bytes_stored() const noexcept override
+    {
+      return _with_header([this](const _header &h) {
+        if(h.slots.load(std::memory_order_relaxed) != 0)
+        {
+          return _to_capacity(h.heap_size - 64);
+        }
+        return (_from_capacity(_bytes_quota) != 0) ? _bytes_quota : _to_capacity(_default_bytes_quota());
+      });
+    }
+    virtual result<void> max_bytes_stored(capacity_type quota) noexcept override
+    {
+      OUTCOME_TRY(laidout, _attach());
+      if(laidout || _is_snapshot)
+      {
+        return errc::operation_not_permitted;
+      }
+      _bytes_quota = quota;
+      return success();
+    }
+    virtual result<capacity_type> bytes_stored() const noexcept override
+    {
+      return _with_header([](const _header &h) { return _to_capacity(h.bytes.load(std::memory_order_relaxed)); });
+    }
+    virtual result<extent_type> max_value_size() const noexcept override
+    {
+      OUTCOME_TRY(bytes, max_bytes_stored());
+      const uint64_t b = _from_capacity(bytes);
+      return (b > sizeof(_record)) ? (b - sizeof(_record)) : 0;
+    }
+
+    //! The key index is recorded in the store, but matching is always a linear scan.
+    virtual result<void> key_index_size(size_type bytes) noexcept override
+    {
+      if(bytes > _key_size)
+      {
+        return errc::invalid_argument;
+      }
+      OUTCOME_TRY(laidout, _attach());
+      if(laidout || _is_snapshot)
+      {
+        return errc::operation_not_permitted;
+      }
+      _key_index_size = bytes;
+      return success();
+    }
+
+    /*! Values are read in place, so the heap cannot be reused whilst anybody may be reading it.
+    Fails with `errc::device_or_resource_busy` if snapshots of this store exist, or other handles
+    to it exist in any process. Values read before clearing must not be used after it.
+    */
+    virtual result<void> clear() noexcept override
+    {
+      if(_is_snapshot || !_s->mfh.is_writable())
+      {
+        return errc::operation_not_permitted;
+      }
+      // Snapshots share our state
+      if(_s.use_count() > 1)
+      {
+        return errc::device_or_resource_busy;
+      }
+      OUTCOME_TRY(laidout, _attach());
+      if(!laidout)
+      {
+        return success();
+      }
+      std::lock_guard<std::mutex> g(_s->layoutlock);
+      // Exclude other processes opening the store whilst it is cleared
+      OUTCOME_TRY(guard, _s->mfh.lock(_lock_offset(), 1, true));
+      // Every handle to the store holds a shared lock on the in use byte, so swap mine for an exclusive
+      // lock which can only succeed if no other handle to the store exists
+      _s->inuse.unlock();
+      auto exclusive = _s->mfh.try_lock(_inuse_offset(), 1, true);
+      if(exclusive)
+      {
+        _header *header = _s->header;
+        memset(_s->slots, 0, static_cast<size_t>((_s->slot_mask + 1) * _s->slot_size));
+        header->items.store(0, std::memory_order_relaxed);
+        header->bytes.store(0, std::memory_order_relaxed);
+        header->heap_used.store(64, std::memory_order_release);
+        exclusive.value().unlock();
+      }
+      OUTCOME_TRY(inuse, _s->mfh.lock(_inuse_offset(), 1, false));
+      _s->inuse = std::move(inuse);
+      if(!exclusive)
+      {
+        if(exclusive.error() == errc::timed_out)
+        {
+          return errc::device_or_resource_busy;
+        }
+        return std::move(exclusive).error();
+      }
+      return success();
+    }
+
+    virtual result<key_type> match(filter_state_type &state, key_type mask = {}, key_type bits = {}) noexcept override
+    {
+      if(mask.size() > _key_size || bits.size() != mask.size())
+      {
+        return errc::invalid_argument;
+      }
+      OUTCOME_TRY(laidout, _attach());
+      if(laidout)
+      {
+        for(; state <= _s->slot_mask; state++)
+        {
+          _slot *s = _slot_at(state);
+          if(s->state.load(std::memory_order_acquire) != 2 || _current(s) == nullptr)
+          {
+            continue;
+          }
+          const byte *key = s->key();
+          bool matches = true;
+          for(size_t n = 0; matches && n < mask.size(); n++)
+          {
+            matches = ((key[n] & mask[n]) == bits[n]);
+          }
+          if(matches)
+          {
+            state++;
+            return key_type(key, _key_size);
+          }
+        }
+      }
+      return errc::no_such_file_or_directory;
+    }
+
+    virtual result<handle_type> open(key_type /*unused*/, mode /*unused*/) noexcept override { return errc::operation_not_supported; }
+
+    virtual io_result<buffers_type> read(io_request<buffers_type> reqs, key_type key, llfio::deadline /*unused*/) noexcept override
+    {
+      if(key.size() != _key_size)
+      {
+        return errc::invalid_argument;
+      }
+      OUTCOME_TRY(laidout, _attach());
+      _slot *s = laidout ? _find(key, false) : nullptr;
+      _record *r = (s != nullptr) ? _current(s) : nullptr;
+      if(r == nullptr)
+      {
+        return errc::no_such_file_or_directory;
+      }
+      if(reqs.buffers.empty())
+      {
+        return reqs.buffers;
+      }
+      // Values never change once written, so return the mapped value itself
+      const uint64_t offset = (reqs.offset < r->length) ? reqs.offset : r->length;
+      reqs.buffers[0] = {r->value() + offset, static_cast<size_t>(r->length - offset)};
+      return buffers_type(reqs.buffers.data(), 1);
+    }
+
+    virtual io_result<const_buffers_type> write(key_type key, io_request<const_buffers_type> reqs, llfio::deadline /*unused*/) noexcept override
+    {
+      if(_is_snapshot)
+      {
+        return errc::operation_not_permitted;
+      }
+      // Values are stable and there are no update deltas, so only whole values may be written
+      if(key.size() != _key_size || reqs.offset != 0)
+      {
+        return errc::invalid_argument;
+      }
+      OUTCOME_TRYV(_layout());
+      uint64_t length = 0;
+      for(auto &b : reqs.buffers)
+      {
+        length += b.size();
+      }
+      _header *header = _s->header;
+      // A claimed slot can never be released, as later keys may have probed past it, so reserve the
+      // item and the heap space before claiming one for a new key
+      _slot *s = _find(key, false);
+      const bool reserved = (s == nullptr || s->latest.load(std::memory_order_acquire) == 0);
+      if(reserved && header->items.fetch_add(1, std::memory_order_relaxed) >= header->items_quota)
+      {
+        header->items.fetch_sub(1, std::memory_order_relaxed);
+        return errc::no_space_on_device;
+      }
+      auto offset = _allocate((sizeof(_record) + length + 63) & ~static_cast<uint64_t>(63));
+      if(!offset)
+      {
+        if(reserved)
+        {
+          header->items.fetch_sub(1, std::memory_order_relaxed);
+        }
+        return std::move(offset).error();
+      }
+      if(s == nullptr && (s = _find(key, true)) == nullptr)
+      {
+        // The table has a third more slots than the items quota, so this never happens in practice.
+        // The heap is only ever bump allocated, so the record allocated is lost until clear().
+        header->items.fetch_sub(1, std::memory_order_relaxed);
+        return errc::no_space_on_device;
+      }
+      _record *r = _record_at(offset.value());
+      r->length = length;
+      byte *out = r->value();
+      for(auto &b : reqs.buffers)
+      {
+        memcpy(out, b.data(), b.size());
+        out += b.size();
+      }
+      _lock_slot(s);
+      const uint64_t prev = s->latest.load(std::memory_order_relaxed);
+      if(prev != 0 && reserved)
+      {
+        // Another writer of this new key published it first, so this is an update after all
+        header->items.fetch_sub(1, std::memory_order_relaxed);
+      }
+      // Take the version whilst holding the lock, so record versions always ascend down the chain
+      r->prev = prev;
+      r->version = header->version.fetch_add(1, std::memory_order_acq_rel) + 1;
+      s->latest.store(offset.value(), std::memory_order_release);
+      header->bytes.fetch_add(length - ((prev != 0) ? _record_at(prev)->length : 0), std::memory_order_relaxed);
+      _unlock_slot(s);
+      return reqs.buffers;
+    }
+
+    virtual result<std::unique_ptr<basic_key_value_store>> snapshot() noexcept override
+    {
+      if(_s->mfh.is_writable())
+      {
+        OUTCOME_TRYV(_layout());
+      }
+      else
+      {
+        OUTCOME_TRY(laidout, _attach());
+        if(!laidout)
+        {
+          return errc::operation_not_permitted;
+        }
+      }
+      try
+      {
+        std::unique_ptr<single_file_kvstore> ret(new single_file_kvstore);
+        ret->_uri = _uri;
+        ret->_frozen = _frozen;
+        ret->_key_size = _key_size;
+        ret->_key_index_size = _key_index_size;
+        ret->_items_quota = _items_quota;
+        ret->_bytes_quota = _bytes_quota;
+        ret->_s = _s;
+        ret->_is_snapshot = true;
+        ret->_snapshot_version = _is_snapshot ? _snapshot_version : _s->header->version.load(std::memory_order_acquire);
+        return std::unique_ptr<basic_key_value_store>(std::move(ret));
+      }
+      catch(...)
+      {
+        return llfio::error_from_exception();
+      }
+    }
+
+    virtual result<std::unique_ptr<transaction>> begin_transaction() noexcept override { return errc::operation_not_supported; }
+  };
+
+  inline span<const basic_key_value_store_info> builtin_kvstores() noexcept
+  {
+    using features = basic_key_value_store_info::features;
+    static const basic_key_value_store_info infos[] = {
+    {"single_file", 1, 65535, 0, static_cast<basic_key_value_store_info::extent_type>(-1), features::none | features::shared_memory | features::stable_values | features::atomic_snapshots, &single_file_kvstore::score, &single_file_kvstore::create}  //
+    };
+    return {infos, sizeof(infos) / sizeof(infos[0])};
+  }
+}  // namespace detail
+
+LLFIO_HEADERS_ONLY_FUNC_SPEC result<std::unique_ptr<basic_key_value_store>> create_kvstore(const basic_key_value_store::uri_type &uri, basic_key_value_store::size_type key_size, basic_key_value_store::features _features, basic_key_value_store::mode _mode, basic_key_value_store::creation _creation,
+                                                                                           basic_key_value_store::caching _caching)
+{
+  const basic_key_value_store_info *best = nullptr;
+  int bestscore = 0;
+  for(auto &i : detail::builtin_kvstores())
+  {
+    if(!!(_features & ~i.supported) || (key_size != 0 && (key_size < i.min_key_size || key_size > i.max_key_size)))
+    {
+      continue;
+    }
+    const int score = i.score(uri, _mode, _creation);
+    if(score > bestscore)
+    {
+      best = &i;
+      bestscore = score;
+    }
+  }
+  if(best == nullptr)
+  {
+    return llfio::errc::protocol_not_supported;
+  }
+  return best->create(uri, key_size, _features, _mode, _creation, _caching);
+}
+
+LLFIO_HEADERS_ONLY_FUNC_SPEC result<std::unique_ptr<basic_key_value_store>> open_kvstore(const basic_key_value_store::uri_type &uri, basic_key_value_store::mode _mode, basic_key_value_store::caching _caching)
+{
+  return create_kvstore(uri, 0, basic_key_value_store::features::none, _mode, basic_key_value_store::creation::open_existing, _caching);
+}
+
+LLFIO_HEADERS_ONLY_FUNC_SPEC result<span<basic_key_value_store_info>> enumerate_kvstores(span<basic_key_value_store_info> lst)
+{
+  auto builtin = detail::builtin_kvstores();
+  size_t n = 0;
+  for(; n < lst.size() && n < static_cast<size_t>(builtin.size()); n++)
+  {
+    lst[n] = builtin[n];
+  }
+  return lst.subspan(0, n);
+}
+
+KVSTORE_V1_NAMESPACE_END
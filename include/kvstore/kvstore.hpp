@@ -27,6 +27,8 @@ Distributed under the Boost Software License, Version 1.0.
 
 #include "../llfio/v2.0/file_handle.hpp"
 
+#include <memory>
+
 #ifdef __has_include
 #if __has_include("../llfio/v2.0/quickcpplib/include/memory_resource.hpp")
 #include "../llfio/v2.0/quickcpplib/include/memory_resource.hpp"
@@ -208,6 +210,8 @@ enum class kvstore_errc
   transaction_aborted_collision,  //!< The transaction could not be committed due to dependent key update.
 };
 
+class basic_key_value_store;
+
 /*! \brief Information about an available key value store implementation.
 */
 struct basic_key_value_store_info
@@ -246,7 +250,7 @@ struct basic_key_value_store_info
     atomic_transactions = 1U << 7U  //!< The ability to update many items with dependencies on other items as a single, all-or-nothing, change.
   }
   QUICKCPPLIB_BITFIELD_END(features)
-  features features;  //!< The features this store implementation provides
+  features supported;  //!< The features this store implementation provides
   /*! Examine the specified URI for suitability for this store implementation.
   Zero means that the URI location is suitable, but the format at that location
   is not compatible. Negative means the URI location is not possible.
@@ -255,13 +259,14 @@ struct basic_key_value_store_info
   int (*score)(const uri_type &uri, handle_type::mode, handle_type::creation creation);
   /*! Construct a store implementation.
   */
-  result<basic_key_value_store> (*create)(const basic_key_value_store::uri_type &uri, size_type key_size, features _features, mode _mode, creation _creation, caching _caching);
+  result<std::unique_ptr<basic_key_value_store>> (*create)(const uri_type &uri, size_type key_size, features _features, mode _mode, creation _creation, caching _caching);
 };
 
 /*! \class basic_key_value_store
 \brief A possibly hardware-implemented basic key-value store.
 
-\warning This class has not been implemented nor will be any time soon. It is here for various folk to study the API design.
+Instances are obtained from `create_kvstore()` or `open_kvstore()`. The only built-in implementation
+is currently `single_file`, see `create_kvstore()` for details.
 
 Reference document https://www.snia.org/sites/default/files/technical_work/PublicReview/KV%20Storage%20API%200.16.pdf
 */
@@ -306,7 +311,7 @@ public:
   template <class T> using io_result = handle_type::io_result<T>;
 
   //! Features requested, or provided by, this store.
-  using features = struct basic_key_value_store_info::features;
+  using features = basic_key_value_store_info::features;
 
 protected:
   uri_type _uri{};
@@ -315,6 +320,7 @@ protected:
   capacity_type _items_quota{0}, _bytes_quota{0};
   allocator_type _allocator{};
 
+  basic_key_value_store() = default;
   // Cannot be copied
   basic_key_value_store(const basic_key_value_store &) = delete;
   basic_key_value_store &operator=(const basic_key_value_store &) = delete;
@@ -379,9 +385,11 @@ public:
 
   To begin a match, pass a default initialised `filter_state_type`. An error matching
   `errc::no_such_file_or_directory` will be returned if no more keys match. The default
-  initialised mask and bits causes matching of all keys in the store.
+  initialised mask and bits causes matching of all keys in the store. The key returned
+  may refer to storage within the store, and so remains valid only until the store is
+  cleared or destroyed.
   */
-  virtual result<void> match(filter_state_type &state, key_type mask = {}, key_type bits = {}) noexcept = 0;
+  virtual result<key_type> match(filter_state_type &state, key_type mask = {}, key_type bits = {}) noexcept = 0;
 
   /*! Returns a handle type which gives access to a key's value. The lifetime of the
   returned handle *may* pin the key's value at the time of retrieval if this store
@@ -455,7 +463,7 @@ public:
   If a store implementation does not implement `features::atomic_snapshot`, this function returns
   an error code comparing equal to `errc::operation_not_supported`.
   */
-  virtual result<basic_key_value_store> snapshot() noexcept = 0;
+  virtual result<std::unique_ptr<basic_key_value_store>> snapshot() noexcept = 0;
 
   class transaction;
   /*! Begin a transaction on this key value store.
@@ -469,7 +477,7 @@ public:
   If a store implementation does not implement `features::atomic_transactions`, this function returns
   an error code comparing equal to `errc::operation_not_supported`.
   */
-  virtual result<transaction> begin_transaction() noexcept = 0;
+  virtual result<std::unique_ptr<transaction>> begin_transaction() noexcept = 0;
 };
 
 class basic_key_value_store::transaction : public basic_key_value_store
@@ -484,7 +492,8 @@ public:
 /*! \brief Create a new key value store, or open or truncate an existing key value store, using the given URI.
 
 Query the system and/or process registry of key value store providers for an implementation capable of using
-a store at `uri` with the specified key size and features. Guaranteed built-in providers are:
+a store at `uri` with the specified key size and features. If no provider scores the URI as suitable, an error
+comparing equal to `errc::protocol_not_supported` is returned. Built-in providers are:
 
 - `file://` based providers:
 
@@ -494,7 +503,7 @@ a store at `uri` with the specified key size and features. Guaranteed built-in p
     `stage/01234/5678/90ab/cdef`, then once fully written they are atomically renamed into `store`.
     This store implements only `features::stable_values`, and is very widely compatible, including with
     networked drives. Its major downside is potential allocation wastage for many small sized values too
-    big to be stored in the inode, but substantially below the allocation granularity.
+    big to be stored in the inode, but substantially below the allocation granularity. *Not implemented yet.*
 
     - `directory_modern`: A much more complex file based store which implements `features::history`,
     `features::stable_values`, `features::stable_keys`, `features::update_deltas`, `features::atomic_snapshots`
@@ -504,31 +513,37 @@ a store at `uri` with the specified key size and features. Guaranteed built-in p
     `store/01234/5678/90ab/cdef/values/count`, where the monotonic count is atomically incremented every update.
     `store/01234/5678/90ab/cdef/deltas` is where 4Kb update deltas are kept if the value is larger than 64Kb.
     `store/01234/5678/90ab/cdef/latest` is the count of the latest value, its size, and if deltas need to be
-    applied.
-
-    - `single_file`: Initially all keys and values are kept in memory. Upon first URI fetch after first creation,
-    a single file is created comprising all the keys and values associatively mapped. This single file can be
-    then be mapped as shared memory into multiple processes, thus enabling multiple concurrent C++ programs to
-    collaborate on a shared store where only values are mutable (and not resizeable). Only one process may pin
-    a value at a time concurrently.
+    applied. *Not implemented yet.*
+
+    - `single_file`: A URI of the form `file://path` names a single file which is mapped as shared memory
+    into every process using the store, thus enabling multiple concurrent C++ programs to collaborate on a
+    shared store. Until the first write or URI fetch, the file contains only a header, and the quotas and key
+    index size may be set. Thereafter the file is extended to its full size in one go, laid out as an associative
+    table of keys followed by an append only heap of values, and the store becomes frozen. Values are written
+    whole, and each write appends a new value which replaces the previous one, so this store implements
+    `features::shared_memory`, `features::stable_values` and `features::atomic_snapshots`. Values read are
+    returned as buffers pointing into the map, and snapshots are read only. `open()` and `begin_transaction()`
+    are not supported, and the bytes quota limits the total of all values ever written rather than just
+    those current.
 
 URIs may of course specify other sources of key value store than on the file system. Third parties may have
 registered system-wide implementations available to all programs. The local process may have registered
 additional implementations as well.
 */
-LLFIO_HEADERS_ONLY_FUNC_SPEC result<basic_key_value_store> create_kvstore(const basic_key_value_store::uri_type &uri,                                              //
-                                                                          basic_key_value_store::size_type key_size,                                               //
-                                                                          basic_key_value_store::features _features,                                               //
-                                                                          basic_key_value_store::mode _mode = basic_key_value_store::mode::write,                  //
-                                                                          basic_key_value_store::creation _creation = basic_key_value_store::creation::if_needed,  //
-                                                                          basic_key_value_store::caching _caching = basic_key_value_store::caching::all);
+LLFIO_HEADERS_ONLY_FUNC_SPEC result<std::unique_ptr<basic_key_value_store>> create_kvstore(const basic_key_value_store::uri_type &uri,                                              //
+                                                                                           basic_key_value_store::size_type key_size,                                               //
+                                                                                           basic_key_value_store::features _features,                                               //
+                                                                                           basic_key_value_store::mode _mode = basic_key_value_store::mode::write,                  //
+                                                                                           basic_key_value_store::creation _creation = basic_key_value_store::creation::if_needed,  //
+                                                                                           basic_key_value_store::caching _caching = basic_key_value_store::caching::all);
 /*! \brief Open an existing key value store. A convenience overload for `create_kvstore()`.
 */
-LLFIO_HEADERS_ONLY_FUNC_SPEC result<basic_key_value_store> open_kvstore(const basic_key_value_store::uri_type &uri,                              //
-                                                                        basic_key_value_store::mode _mode = basic_key_value_store::mode::write,  //
-                                                                        basic_key_value_store::caching _caching = basic_key_value_store::caching::all);
+LLFIO_HEADERS_ONLY_FUNC_SPEC result<std::unique_ptr<basic_key_value_store>> open_kvstore(const basic_key_value_store::uri_type &uri,                              //
+                                                                                         basic_key_value_store::mode _mode = basic_key_value_store::mode::write,  //
+                                                                                         basic_key_value_store::caching _caching = basic_key_value_store::caching::all);
 
-/*! \brief Fill an array with information about all the key value stores available to this process.
+/*! \brief Fill an array with information about all the key value stores available to this process,
+returning the portion of the array filled.
 */
 LLFIO_HEADERS_ONLY_FUNC_SPEC result<span<basic_key_value_store_info>> enumerate_kvstores(span<basic_key_value_store_info> lst);
 
@@ -597,4 +612,10 @@ LLFIO_HEADERS_ONLY_FUNC_SPEC const key_value_store<void *, llfio::section_handle
 
 KVSTORE_V1_NAMESPACE_END
 
+#if LLFIO_HEADERS_ONLY == 1 && !defined(DOXYGEN_SHOULD_SKIP_THIS)
+#define LLFIO_INCLUDED_BY_HEADER 1
+#include "detail/impl/kvstore.ipp"
+#undef LLFIO_INCLUDED_BY_HEADER
+#endif
+
 #endif
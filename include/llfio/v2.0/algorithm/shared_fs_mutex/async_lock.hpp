@@ -0,0 +1,324 @@
+/* Lock a shared filing system resource without blocking the calling thread
+
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License in the accompanying file
+Licence.txt or at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+
+Distributed under the Boost Software License, Version 1.0.
+    (See accompanying file Licence.txt or copy at
+          http://www.boost.org/LICENSE_1_0.txt)
+*/
+
+#ifndef LLFIO_SHARED_FS_MUTEX_ASYNC_LOCK_HPP
+#define LLFIO_SHARED_FS_MUTEX_ASYNC_LOCK_HPP
+
+#include "../../io_service.hpp"
+#include "base.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+#include <vector>
+
+//! \file async_lock.hpp Provides algorithm::shared_fs_mutex::async_lock()
+
+LLFIO_V2_NAMESPACE_BEGIN
+
+namespace algorithm
+{
+  namespace shared_fs_mutex
+  {
+    namespace async_lock_detail
+    {
+      /* A process wide thread which retries the lock requests of async_lock() until they
+      succeed, fail or time out, handing each outcome to the io_service of its request.
+
+      Every implementation of shared_fs_mutex can try a lock without blocking, so rather
+      than block a thread per waiting lock in the kernel, this one thread polls all of them,
+      backing each off exponentially between _min_interval() and _max_interval().
+      */
+      class waiter
+      {
+        using entities_guard = shared_fs_mutex::entities_guard;
+
+      public:
+        struct request
+        {
+          shared_fs_mutex *parent{nullptr};
+          shared_fs_mutex::entities_type entities;
+          shared_fs_mutex::entity_type entity;
+          bool single{false};
+          std::chrono::steady_clock::time_point began, expires, next_try;
+          std::chrono::nanoseconds interval{_min_interval()};
+          bool waiting{false};  // whether the parent has been told we are waiting
+          LLFIO_V2_NAMESPACE::detail::function_ptr<void(result<entities_guard>)> complete;
+
+          entities_guard guard() { return single ? entities_guard(parent, entity) : entities_guard(parent, entities); }
+          shared_fs_mutex::entities_type locking() { return single ? shared_fs_mutex::entities_type(&entity, 1) : entities; }
+          // Tells the parent we are still waiting, so exclusive lockers aren't starved by blocking shared lockers
+          void wait()
+          {
+            parent->_async_waiting(locking(), !waiting);
+            waiting = true;
+          }
+        };
+
+      private:
+        std::mutex _lock;
+        std::condition_variable _changed;
+        std::vector<std::unique_ptr<request>> _pending;
+        bool _added{false}, _done{false};
+        std::thread _thread;
+
+        static std::chrono::nanoseconds _min_interval() noexcept { return std::chrono::microseconds(10); }
+        static std::chrono::nanoseconds _max_interval() noexcept { return std::chrono::milliseconds(10); }
+
+        waiter()
+            : _thread([this] { _run(); })
+        {
+        }
+
+        // Tries the lock once, returning true if the request has been completed
+        static bool _attempt(request &r, std::chrono::steady_clock::time_point now)
+        {
+          entities_guard g(r.guard());
+          auto ret = r.parent->_lock(g, deadline(std::chrono::seconds(0)), false);
+          if(r.waiting && (ret || ret.error() != errc::timed_out || now >= r.expires))
+          {
+            r.parent->_async_stops_waiting(r.locking());
+          }
+          if(ret)
+          {
+            r.parent->_note_lock(g, r.began, true);
+            r.complete(result<entities_guard>(std::move(g)));
+            return true;
+          }
+          if(ret.error() != errc::timed_out || now >= r.expires)
+          {
+            r.parent->_note_lock(g, r.began, false);
+            r.complete(result<entities_guard>(ret.error()));
+            return true;
+          }
+          return false;
+        }
+
+        void _run()
+        {
+          std::unique_lock<std::mutex> g(_lock);
+          while(!_done)
+          {
+            if(_pending.empty())
+            {
+              _changed.wait(g, [this] { return _done || _added; });
+              _added = false;
+              continue;
+            }
+            _added = false;
+            // Try the locks without holding our mutex, so submitters never wait upon the kernel
+            auto pending = std::move(_pending);
+            _pending.clear();
+            g.unlock();
+            const auto now = std::chrono::steady_clock::now();
+            auto next = now + _max_interval();
+            for(auto &r : pending)
+            {
+              if(r->next_try <= now)
+              {
+                if(_attempt(*r, now))
+                {
+                  r.reset();
+                  continue;
+                }
+                r->wait();
+                r->interval = std::min(r->interval * 2, _max_interval());
+                r->next_try = std::min(now + r->interval, r->expires);
+              }
+              next = std::min(next, r->next_try);
+            }
+            g.lock();
+            for(auto &r : pending)
+            {
+              if(r)
+              {
+                _pending.push_back(std::move(r));
+              }
+            }
+            _changed.wait_until(g, next, [this] { return _done || _added; });
+          }
+        }
+
+      public:
+        waiter(const waiter &) = delete;
+        waiter(waiter &&) = delete;
+        waiter &operator=(const waiter &) = delete;
+        waiter &operator=(waiter &&) = delete;
+        ~waiter()
+        {
+          {
+            std::lock_guard<std::mutex> g(_lock);
+            _done = true;
+          }
+          _changed.notify_all();
+          _thread.join();
+        }
+
+        //! The process wide instance, whose thread is started upon first use
+        static waiter &instance()
+        {
+          static waiter v;
+          return v;
+        }
+
+        //! Makes a request whose completion posts \em c to \em service
+        template <class CompletionRoutine> static std::unique_ptr<request> make_request(shared_fs_mutex &parent, io_service &service, deadline d, CompletionRoutine &&c)
+        {
+          std::unique_ptr<request> r(new request);
+          r->parent = &parent;
+          r->began = std::chrono::steady_clock::now();
+          r->expires = std::chrono::steady_clock::time_point::max();
+          if(d)
+          {
+            if(d.steady)
+            {
+              r->expires = r->began + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(d.nsecs));
+            }
+            else
+            {
+              r->expires = r->began + std::chrono::duration_cast<std::chrono::steady_clock::duration>(d.to_time_point() - std::chrono::system_clock::now());
+            }
+          }
+          r->next_try = r->began + r->interval;
+          r->complete = LLFIO_V2_NAMESPACE::detail::make_function_ptr<void(result<entities_guard>)>([&service, c = std::forward<CompletionRoutine>(c)](result<entities_guard> ret) mutable {  //
+            service.post([c = std::move(c), ret = std::move(ret)](io_service * /*unused*/) mutable { c(std::move(ret)); });
+          });
+          return r;
+        }
+
+        //! Tries the request immediately, queuing it for retry if it is contended
+        result<void> submit(std::unique_ptr<request> r)
+        {
+          if(!r->parent->_thread_agnostic())
+          {
+            return errc::operation_not_supported;
+          }
+          if(_attempt(*r, r->began))
+          {
+            return success();
+          }
+          r->wait();
+          {
+            std::lock_guard<std::mutex> g(_lock);
+            _pending.push_back(std::move(r));
+            _added = true;
+          }
+          _changed.notify_one();
+          return success();
+        }
+      };
+    }  // namespace async_lock_detail
+
+    /*! \brief Lock all of a sequence of entities for exclusive or shared access without blocking the calling thread.
+
+    The completion routine \em c is invoked with a `result<shared_fs_mutex::entities_guard>` by the
+    thread running `service.run()`, even if the lock was acquired immediately. If the entities are
+    contended, a process wide thread retries them with exponential backoff of between ten microseconds
+    and ten milliseconds until they are acquired, an error other than `errc::timed_out` occurs, or the
+    deadline passes, in which case \em c sees `errc::timed_out`. Whilst retrying, exclusive requests count
+    as waiting exclusive lockers to any fairness policy of \em mutex, see `memory_map::set_fairness_policy()`. Unlike the other implementation functions,
+    that thread calls `shared_fs_mutex::_lock()` concurrently with your threads, so do not use an
+    implementation which is not thread safe for any other purpose while it has locks outstanding.
+
+    \em mutex, \em service and the sequence \em entities refer to must all remain alive until \em c has
+    been invoked. Completion routines of requests still outstanding at process exit are never invoked.
+
+    \errors `errc::operation_not_supported` if \em mutex requires locks to be released by the thread
+    which took them, as `safe_byte_ranges` does on POSIX.
+    */
+    template <class CompletionRoutine> inline result<void> async_lock(shared_fs_mutex &mutex, io_service &service, shared_fs_mutex::entities_type entities, deadline d, CompletionRoutine &&c)
+    {
+      auto r = async_lock_detail::waiter::make_request(mutex, service, d, std::forward<CompletionRoutine>(c));
+      r->entities = entities;
+      return async_lock_detail::waiter::instance().submit(std::move(r));
+    }
+    //! \overload Lock a single entity for exclusive or shared access without blocking the calling thread
+    template <class CompletionRoutine> inline result<void> async_lock(shared_fs_mutex &mutex, io_service &service, shared_fs_mutex::entity_type entity, deadline d, CompletionRoutine &&c)
+    {
+      auto r = async_lock_detail::waiter::make_request(mutex, service, d, std::forward<CompletionRoutine>(c));
+      r->entity = entity;
+      r->single = true;
+      return async_lock_detail::waiter::instance().submit(std::move(r));
+    }
+
+#if defined(__cpp_coroutines) || defined(DOXYGEN_IS_IN_THE_HOUSE)
+    /*! \brief An awaitable locking entities for exclusive or shared access, resuming execution on the
+    kernel thread running the i/o service once the lock is acquired. This is a convenience wrapper for
+    `async_lock()`, with the same requirements upon object lifetimes.
+    */
+    class awaitable_lock
+    {
+      shared_fs_mutex *_mutex;
+      io_service *_service;
+      shared_fs_mutex::entities_type _entities;
+      shared_fs_mutex::entity_type _entity;
+      bool _single;
+      deadline _d;
+      result<shared_fs_mutex::entities_guard> _ret{errc::operation_in_progress};
+
+    public:
+      //! Constructor, takes the entities to lock and the i/o service whose kernel thread we are to resume upon
+      awaitable_lock(shared_fs_mutex &mutex, io_service &service, shared_fs_mutex::entities_type entities, deadline d = deadline())
+          : _mutex(&mutex)
+          , _service(&service)
+          , _entities(entities)
+          , _single(false)
+          , _d(d)
+      {
+      }
+      //! \overload
+      awaitable_lock(shared_fs_mutex &mutex, io_service &service, shared_fs_mutex::entity_type entity, deadline d = deadline())
+          : _mutex(&mutex)
+          , _service(&service)
+          , _entity(entity)
+          , _single(true)
+          , _d(d)
+      {
+      }
+
+      bool await_ready() { return false; }
+      bool await_suspend(coroutine_handle<> co)
+      {
+        auto c = [this, co](result<shared_fs_mutex::entities_guard> ret) {
+          _ret = std::move(ret);
+          co.resume();
+        };
+        auto submitted = _single ? async_lock(*_mutex, *_service, _entity, _d, std::move(c)) : async_lock(*_mutex, *_service, _entities, _d, std::move(c));
+        if(!submitted)
+        {
+          _ret = submitted.error();
+          return false;
+        }
+        return true;
+      }
+      result<shared_fs_mutex::entities_guard> await_resume() { return std::move(_ret); }
+    };
+#endif
+
+  }  // namespace shared_fs_mutex
+}  // namespace algorithm
+
+LLFIO_V2_NAMESPACE_END
+
+
+#endif
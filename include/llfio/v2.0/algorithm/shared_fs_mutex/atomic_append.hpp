@@ -86,18 +86,23 @@ namespace algorithm
 
     - Compatible with networked file systems (NFS too if the special nfs_compatibility flag is true.
     Note turning this on is not free of cost if you don't need NFS compatibility).
-    - Nearly constant time to number of entities being locked.
+    - Nearly constant time to number of entities being locked. Requests for more than twelve entities
+    are appended as multiple consecutive records, up to `max_entities`.
     - Nearly constant time to number of processes concurrently using the lock (i.e. number of waiters).
     - Can sleep until a lock becomes free in a power-efficient manner.
     - Sudden power loss during use is recovered from.
+    - Sudden process exit with locks held is recovered from. Each requester holds an exclusive byte range
+    lock on its lock request records until it unlocks, which the system releases if the process exits.
+    Records over five seconds old whose byte range lock can be taken are cleared as abandoned by other users.
 
     Caveats:
     - Much slower than byte_ranges for few waiters or small number of entities.
-    - Sudden process exit with locks held will deadlock all other users.
-    - Maximum of twelve entities may be locked concurrently.
-    - Wasteful of disk space if used on a non-extents based filing system (e.g. FAT32, ext3).
-    It is best used in `/tmp` if possible (`file_handle::temp_file()`). If you really must use a non-extents based filing
-    system, destroy and recreate the object instance periodically to force resetting the lock
+    - Maximum of `max_entities` (384) entities may be locked concurrently.
+    - Wasteful of disk space if used on a non-extents based filing system (e.g. FAT32, ext3), as
+    consumed records are hole punched every megabyte. It is best used in `/tmp` if possible (`file_handle::temp_file()`).
+    The lock file is truncated back to its header when it exceeds a megabyte, no lock requests are outstanding,
+    and only one instance has it open. If you really must use a non-extents based filing system with many
+    concurrent users, destroy and recreate the object instances periodically to force resetting the lock
     file's length to zero.
     - Similarly older operating systems (e.g. Linux < 3.0) do not implement extent hole punching
     and therefore will also see excessive disk space consumption. Note at the time of writing
@@ -105,8 +110,6 @@ namespace algorithm
     - If your OS doesn't have sane byte range locks (OS X, BSD, older Linuxes) and multiple
     objects in your process use the same lock file, misoperation will occur. Use lock_files instead.
 
-    \todo Implement hole punching once I port that code from LLFIO v1.
-    \todo Decide on some resolution mechanism for sudden process exit.
     \todo There is a 1 out of 2^64-2 chance of unique id collision. It would be nice if we
     actually formally checked that our chosen unique id is actually unique.
     */
@@ -119,6 +122,11 @@ namespace algorithm
       uint64 _unique_id;                     // My (very random) unique id
       atomic_append_detail::header _header;  // Header as of the last time I read it
 
+      static constexpr size_t _entities_per_record = sizeof(atomic_append_detail::lock_request::entities) / sizeof(atomic_append_detail::lock_request::entities[0]);
+      static constexpr size_t _max_records = 32;  // 4Kb of lock request
+      static constexpr file_handle::extent_type _compaction_threshold = 1024U * 1024U;
+      static constexpr long long _abandoned_grace_us = 5000000;  // a requester has this long to lock its records
+
       atomic_append(file_handle &&h, file_handle::extent_guard &&guard, bool nfs_compatibility, bool skip_hashing)
           : _h(std::move(h))
           , _guard(std::move(guard))
@@ -161,11 +169,94 @@ namespace algorithm
         return success();
       }
 
+      // Requesters hold an exclusive lock on their records until unlock, which the system releases if they die.
+      // If a record is older than the grace period and that lock can be taken, its requester is dead, and the
+      // record is marked as completed. Returns true if the record was cleared.
+      bool _clear_if_abandoned(const atomic_append_detail::lock_request *record, file_handle::extent_type record_offset) noexcept
+      {
+        if(record->unique_id == _unique_id)
+        {
+          return false;
+        }
+        // A torn read of a record being appended must never be mistaken for an old record
+        if(!_skip_hashing && record->hash != QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((reinterpret_cast<const char *>(record)) + 16, sizeof(atomic_append_detail::lock_request) - 16))
+        {
+          return false;
+        }
+        auto count = std::chrono::system_clock::now() - std::chrono::system_clock::from_time_t(_header.time_offset);
+        if(std::chrono::duration_cast<std::chrono::microseconds>(count).count() < static_cast<long long>(record->us_count) + _abandoned_grace_us)
+        {
+          return false;
+        }
+        // Set the top bit to use the shadow lock space on Windows
+        auto probe = _h.try_lock(record_offset | (1ULL << 63U), sizeof(atomic_append_detail::lock_request), false);
+        if(!probe)
+        {
+          return false;
+        }
+        // Whilst the probe is held no requester can lock this offset, so compare and clear under it. The
+        // file may have been compacted since the record was read, and a new request appended at the same
+        // offset is waiting on the probe to check that its record survived. Clearing that would lose it.
+        atomic_append_detail::lock_request current;
+        auto currentread = _h.read(record_offset, {{reinterpret_cast<byte *>(&current), sizeof(current)}});
+        if(!currentread || currentread.value() < sizeof(current) || 0 != memcmp(&current, record, sizeof(current)))
+        {
+          return false;
+        }
+        LLFIO_LOG_WARN(this, "atomic_append: clearing lock request abandoned by dead process");
+        memset(&current, 0, sizeof(current));
+        (void) _h.write(record_offset, {{reinterpret_cast<byte *>(&current), sizeof(current)}});
+        return true;
+      }
+
+      // If I am the only user of the lock file and no lock requests are outstanding, truncate the file back to its header
+      result<void> _try_compact() noexcept
+      {
+        // Everybody holds a shared lock on the last byte of the header, so swap mine for an exclusive
+        // lock which can only succeed if nobody else has the lock file open
+        _guard.unlock();
+        auto relock = undoer([this] {
+          auto guard = _h.lock(sizeof(atomic_append_detail::header) - 1, 1, false);
+          if(!guard)
+          {
+            LLFIO_LOG_FATAL(this, "atomic_append::_try_compact() failed to retake the in use lock");
+            std::terminate();
+          }
+          _guard = std::move(guard).value();
+          // Whilst unlocked a new opener may have found the file unused and reinitialised the header,
+          // including the time_offset all lock request ages are measured from
+          (void) _read_header();
+        });
+        auto exclusive = _h.try_lock(sizeof(atomic_append_detail::header) - 1, 1, true);
+        if(!exclusive)
+        {
+          return success();
+        }
+        OUTCOME_TRY(length, _h.maximum_extent());
+        OUTCOME_TRYV(_read_header());
+        if(length != _header.first_known_good)
+        {
+          return success();
+        }
+        OUTCOME_TRYV(_h.truncate(sizeof(atomic_append_detail::header)));
+        _header.first_known_good = sizeof(atomic_append_detail::header);
+        _header.first_after_hole_punch = sizeof(atomic_append_detail::header);
+        ++_header.generation;
+        if(!_skip_hashing)
+        {
+          _header.hash = QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((reinterpret_cast<char *>(&_header)) + 16, sizeof(_header) - 16);
+        }
+        OUTCOME_TRYV(_h.write(0, {{reinterpret_cast<byte *>(&_header), 48}}));
+        return success();
+      }
+
     public:
       //! The type of an entity id
       using entity_type = shared_fs_mutex::entity_type;
       //! The type of a sequence of entities
       using entities_type = shared_fs_mutex::entities_type;
+      //! The maximum number of entities which can be locked by a single lock request
+      static constexpr size_t max_entities = _entities_per_record * _max_records;
 
       //! No copy construction
       atomic_append(const atomic_append &) = delete;
@@ -173,7 +264,7 @@ namespace algorithm
       atomic_append &operator=(const atomic_append &) = delete;
       ~atomic_append() = default;
       //! Move constructor
-      atomic_append(atomic_append &&o) noexcept : _h(std::move(o._h)), _guard(std::move(o._guard)), _nfs_compatibility(o._nfs_compatibility), _skip_hashing(o._skip_hashing), _unique_id(o._unique_id), _header(o._header) { _guard.set_handle(&_h); }
+      atomic_append(atomic_append &&o) noexcept : shared_fs_mutex(std::move(o)), _h(std::move(o._h)), _guard(std::move(o._guard)), _nfs_compatibility(o._nfs_compatibility), _skip_hashing(o._skip_hashing), _unique_id(o._unique_id), _header(o._header) { _guard.set_handle(&_h); }
       //! Move assign
       atomic_append &operator=(atomic_append &&o) noexcept
       {
@@ -241,11 +332,15 @@ namespace algorithm
       LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<void> _lock(entities_guard &out, deadline d, bool spin_not_sleep) noexcept final
       {
         LLFIO_LOG_FUNCTION_CALL(this);
-        atomic_append_detail::lock_request lock_request;
-        if(out.entities.size() > sizeof(lock_request.entities) / sizeof(lock_request.entities[0]))
+        // A request for more than twelve entities is written as multiple consecutive records. Each
+        // record is a complete lock request in its own right, so other lockers need not know they are related.
+        atomic_append_detail::lock_request lock_requests[_max_records];
+        const size_t records = out.entities.empty() ? 1 : (out.entities.size() + _entities_per_record - 1) / _entities_per_record;
+        if(records > _max_records)
         {
           return errc::argument_list_too_long;
         }
+        atomic_append_detail::lock_request &lock_request = lock_requests[0];
 
         std::chrono::steady_clock::time_point began_steady;
         std::chrono::system_clock::time_point end_utc;
@@ -264,15 +359,21 @@ namespace algorithm
         auto disableunlock = undoer([&] { out.release(); });
 
         // Write my lock request immediately
-        memset(&lock_request, 0, sizeof(lock_request));
-        lock_request.unique_id = _unique_id;
+        memset(lock_requests, 0, sizeof(lock_request) * records);
         auto count = std::chrono::system_clock::now() - std::chrono::system_clock::from_time_t(_header.time_offset);
-        lock_request.us_count = std::chrono::duration_cast<std::chrono::microseconds>(count).count();
-        lock_request.items = out.entities.size();
-        memcpy(lock_request.entities, out.entities.data(), sizeof(lock_request.entities[0]) * out.entities.size());
-        if(!_skip_hashing)
+        for(size_t r = 0, n = 0; r < records; r++)
         {
-          lock_request.hash = QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((reinterpret_cast<char *>(&lock_request)) + 16, sizeof(lock_request) - 16);
+          atomic_append_detail::lock_request &req = lock_requests[r];
+          const size_t items = (out.entities.size() - n < _entities_per_record) ? (out.entities.size() - n) : _entities_per_record;
+          req.unique_id = _unique_id;
+          req.us_count = std::chrono::duration_cast<std::chrono::microseconds>(count).count();
+          req.items = items;
+          memcpy(req.entities, out.entities.data() + n, sizeof(req.entities[0]) * items);
+          n += items;
+          if(!_skip_hashing)
+          {
+            req.hash = QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((reinterpret_cast<char *>(&req)) + 16, sizeof(req) - 16);
+          }
         }
         // My lock request will be the file's current length or higher
         OUTCOME_TRY(my_lock_request_offset, _h.maximum_extent());
@@ -288,7 +389,7 @@ namespace algorithm
             OUTCOME_TRY(append_guard_, _h.lock(my_lock_request_offset, lastbyte, true));
             append_guard = std::move(append_guard_);
           }
-          OUTCOME_TRYV(_h.write(0, {{reinterpret_cast<byte *>(&lock_request), sizeof(lock_request)}}));
+          OUTCOME_TRYV(_h.write(0, {{reinterpret_cast<byte *>(lock_requests), sizeof(lock_request) * records}}));
         }
 
         // Find the record I just wrote
@@ -320,21 +421,33 @@ namespace algorithm
           }
         }
 
-        // extent_guard is now valid and will be unlocked on error
-        out.hint = my_lock_request_offset;
-        disableunlock.dismiss();
-
-        // Lock my request for writing so others can sleep on me
-        file_handle::extent_guard my_request_guard;
-        if(!spin_not_sleep)
+        // Lock my request for writing until unlock() so others can sleep on me, and can tell if I die
         {
           auto lock_offset = my_lock_request_offset;
           // Set the top bit to use the shadow lock space on Windows
           lock_offset |= (1ULL << 63U);
-          OUTCOME_TRY(my_request_guard_, _h.lock(lock_offset, sizeof(lock_request), true));
-          my_request_guard = std::move(my_request_guard_);
+          auto my_request_guard = _h.lock(lock_offset, sizeof(lock_request) * records, true);
+          if(!my_request_guard)
+          {
+            // Mark my request as completed before failing
+            memset(lock_requests, 0, sizeof(lock_request) * records);
+            (void) _h.write(my_lock_request_offset, {{reinterpret_cast<byte *>(lock_requests), sizeof(lock_request) * records}});
+            return std::move(my_request_guard).error();
+          }
+          // If I was so delayed before taking the lock that somebody cleared my request as abandoned, give up
+          atomic_append_detail::lock_request check;
+          OUTCOME_TRY(checkread, _h.read(my_lock_request_offset, {{reinterpret_cast<byte *>(&check), sizeof(check)}}));
+          if(checkread < sizeof(check) || check.unique_id != _unique_id || check.hash != lock_request.hash)
+          {
+            return errc::timed_out;
+          }
+          my_request_guard.value().release();
         }
 
+        // extent_guard is now valid and will be unlocked on error
+        out.hint = my_lock_request_offset;
+        disableunlock.dismiss();
+
         // Read every record preceding mine until header.first_known_good inclusive
         auto record_offset = my_lock_request_offset - sizeof(atomic_append_detail::lock_request);
         do
@@ -382,6 +495,7 @@ namespace algorithm
             {
               if(record->hash != QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((reinterpret_cast<const char *>(record)) + 16, sizeof(atomic_append_detail::lock_request) - 16))
               {
+                _note_retry();
                 goto reload;
               }
             }
@@ -407,15 +521,28 @@ namespace algorithm
           continue;
 
         beginwait:
+          _note_contention();
+          if(_clear_if_abandoned(record, record_offset))
+          {
+            _note_retry();
+            goto reload;
+          }
           // Sleep until this record is freed using a shared lock
           // on the record in our way. Note there is a race here
           // between when the lock requester writes the lock
           // request and when he takes an exclusive lock on it,
           // so if our shared lock succeeds we need to immediately
-          // unlock and retry based on the data.
+          // unlock and retry based on the data. Never do this on
+          // records of this instance, as on POSIX that would convert
+          // and then release its exclusive lock on them.
           std::this_thread::yield();
-          if(!spin_not_sleep)
+          if(spin_not_sleep || record->unique_id == _unique_id)
+          {
+            _note_spin();
+          }
+          else
           {
+            _note_sleep();
             deadline nd;
             if(d)
             {
@@ -466,7 +593,6 @@ namespace algorithm
     public:
       LLFIO_HEADERS_ONLY_VIRTUAL_SPEC void unlock(entities_type entities, unsigned long long hint) noexcept final
       {
-        (void) entities;
         LLFIO_LOG_FUNCTION_CALL(this);
         if(hint == 0u)
         {
@@ -474,11 +600,13 @@ namespace algorithm
           return;
         }
         auto my_lock_request_offset = static_cast<file_handle::extent_type>(hint);
+        const size_t records = entities.empty() ? 1 : (entities.size() + _entities_per_record - 1) / _entities_per_record;
+        const file_handle::extent_type my_lock_request_bytes = sizeof(atomic_append_detail::lock_request) * records;
         {
-          atomic_append_detail::lock_request record;
+          atomic_append_detail::lock_request record[_max_records];
 #ifdef _DEBUG
-          (void) _h.read(my_lock_request_offset, {{(byte *) &record, sizeof(record)}});
-          if(!record.unique_id)
+          (void) _h.read(my_lock_request_offset, {{(byte *) record, sizeof(record[0])}});
+          if(!record[0].unique_id)
           {
             LLFIO_LOG_FATAL(this, "atomic_append::unlock() I have been previously unlocked!");
             std::terminate();
@@ -490,12 +618,14 @@ namespace algorithm
             std::terminate();
           }
 #endif
-          memset(&record, 0, sizeof(record));
-          (void) _h.write(my_lock_request_offset, {{reinterpret_cast<byte *>(&record), sizeof(record)}});
+          memset(record, 0, static_cast<size_t>(my_lock_request_bytes));
+          (void) _h.write(my_lock_request_offset, {{reinterpret_cast<byte *>(record), static_cast<size_t>(my_lock_request_bytes)}});
+          // Release the lock on my records taken by _lock(), waking anybody sleeping on me
+          _h.unlock(my_lock_request_offset | (1ULL << 63U), my_lock_request_bytes);
         }
 
         // Every 32 records or so, bump _header.first_known_good
-        if((my_lock_request_offset & 4095U) == 0U)
+        if((my_lock_request_offset & 4095U) == 0U || (my_lock_request_offset & ~4095ULL) != ((my_lock_request_offset + my_lock_request_bytes - 1) & ~4095ULL))
         {
           //_read_header();
 
@@ -527,19 +657,26 @@ namespace algorithm
               {
                 _header.first_known_good += sizeof(atomic_append_detail::lock_request);
               }
+              else if(_clear_if_abandoned(record, _header.first_known_good))
+              {
+                _header.first_known_good += sizeof(atomic_append_detail::lock_request);
+              }
               else
               {
+                done = true;
                 break;
               }
             }
           }
           // Hole punch if >= 1Mb of zeros exists
-          if(_header.first_known_good - _header.first_after_hole_punch >= 1024U * 1024U)
+          if(_header.first_known_good - _header.first_after_hole_punch >= _compaction_threshold)
           {
-            handle::extent_type holepunchend = _header.first_known_good & ~(1024U * 1024U - 1);
+            handle::extent_type holepunchend = _header.first_known_good & ~(_compaction_threshold - 1);
 #ifdef _DEBUG
             fprintf(stderr, "hole_punch(%llx, %llx)\n", _header.first_after_hole_punch, holepunchend - _header.first_after_hole_punch);
 #endif
+            // Consumed records are all zeros, so deallocating their extents changes nothing anybody can read
+            (void) _h.zero(_header.first_after_hole_punch, holepunchend - _header.first_after_hole_punch);
             _header.first_after_hole_punch = holepunchend;
           }
           ++_header.generation;
@@ -549,6 +686,15 @@ namespace algorithm
           }
           // Rewrite the first part of the header only
           (void) _h.write(0, {{reinterpret_cast<byte *>(&_header), 48}});
+          // If no lock requests are outstanding and the file has grown large, try resetting it to just the header
+          if(_header.first_known_good >= _compaction_threshold)
+          {
+            auto length = _h.maximum_extent();
+            if(length && length.value() == _header.first_known_good)
+            {
+              (void) _try_compact();
+            }
+          }
         }
       }
     };
@@ -39,6 +39,9 @@ Distributed under the Boost Software License, Version 1.0.
 #include "../../quickcpplib/include/algorithm/hash.hpp"
 #endif
 
+#include <atomic>
+#include <memory>
+
 
 //! \file base.hpp Provides algorithm::shared_fs_mutex::shared_fs_mutex
 
@@ -54,6 +57,107 @@ namespace algorithm
     //! Unsigned 128 bit integer
     using uint128 = QUICKCPPLIB_NAMESPACE::integers128::uint128;
 
+    /*! \brief How an implementation arbitrates between shared and exclusive lockers of the same entity.
+
+    Policies are a property of the locker, not of the lock file, so users of the same lock file may
+    use differing policies. Exclusive lockers always advertise that they are waiting, so a shared locker
+    with a policy other than `none` will defer to them no matter what policy they themselves use.
+    */
+    enum class fairness_policy
+    {
+      none,               //!< Whoever retries first after a release wins. Exclusive lockers can starve under a steady stream of shared lockers.
+      writer_preferring,  //!< Shared lockers defer to waiting exclusive lockers. Shared lockers can starve under a steady stream of exclusive lockers.
+      phase_fair          //!< Shared lockers defer to waiting exclusive lockers, but only until one exclusive phase has completed since they began waiting.
+    };
+
+    /*! \brief A log-linear histogram of durations in nanoseconds.
+
+    Each power of two is split into four sub-buckets, so any duration is known to within 25%,
+    in the manner of a HDR histogram but small enough to copy about freely.
+    */
+    struct lock_histogram
+    {
+      //! The number of buckets
+      static constexpr size_t buckets = 252;
+      //! Count of durations falling into each bucket
+      uint64 counts[buckets]{};
+      //! The longest duration recorded
+      uint64 max{0};
+
+      //! Returns the bucket into which a duration of \em ns falls
+      static size_t bucket_for(uint64 ns) noexcept
+      {
+        if(ns < 4)
+        {
+          return static_cast<size_t>(ns);
+        }
+        unsigned msb = 0;
+        for(unsigned shift = 32; shift != 0; shift >>= 1)
+        {
+          if((ns >> (msb + shift)) != 0)
+          {
+            msb += shift;
+          }
+        }
+        return (msb - 1) * 4 + static_cast<size_t>((ns >> (msb - 2)) & 3);
+      }
+      //! Returns the largest duration which falls into bucket \em idx
+      static uint64 bucket_upper_bound(size_t idx) noexcept
+      {
+        if(idx < 4)
+        {
+          return idx;
+        }
+        const unsigned msb = static_cast<unsigned>(idx / 4) + 1;
+        return ((4 + static_cast<uint64>(idx % 4)) << (msb - 2)) + (static_cast<uint64>(1) << (msb - 2)) - 1;
+      }
+      //! Returns the number of durations recorded
+      uint64 total() const noexcept
+      {
+        uint64 ret = 0;
+        for(auto i : counts)
+        {
+          ret += i;
+        }
+        return ret;
+      }
+      //! Returns an upper bound on the duration within which \em fraction (e.g. 0.99) of durations fell
+      uint64 percentile(double fraction) const noexcept
+      {
+        const auto wanted = static_cast<uint64>(static_cast<double>(total()) * fraction);
+        uint64 seen = 0;
+        for(size_t n = 0; n < buckets; n++)
+        {
+          seen += counts[n];
+          if(seen != 0 && seen >= wanted)
+          {
+            const uint64 ret = bucket_upper_bound(n);
+            return (ret < max) ? ret : max;
+          }
+        }
+        return max;
+      }
+    };
+
+    //! A snapshot of the statistics gathered by a `shared_fs_mutex`, see `shared_fs_mutex::statistics()`.
+    struct lock_statistics
+    {
+      uint64 acquisitions{0};  //!< Lock operations which succeeded
+      uint64 failures{0};      //!< Lock operations which failed, usually by timing out
+      uint64 contentions{0};   //!< Times an entity was found already locked by somebody else
+      uint64 spins{0};         //!< Times a contended entity was retried after at most yielding the timeslice
+      uint64 sleeps{0};        //!< Times the thread went to sleep waiting for a contended entity
+      uint64 retries{0};       //!< Times locking restarted from the beginning after releasing or reloading everything
+      uint64 shuffles{0};      //!< Times the entities were randomised before a retry
+      lock_histogram wait;     //!< Durations of lock operations, successful or not
+      lock_histogram hold;     //!< Durations from acquisition to unlock through an `entities_guard`
+    };
+
+    namespace async_lock_detail
+    {
+      class waiter;
+    }
+
     /*! \class shared_fs_mutex
     \brief Abstract base class for an object which protects shared filing system resources
 
@@ -65,6 +169,8 @@ namespace algorithm
     */
     class shared_fs_mutex
     {
+      friend class async_lock_detail::waiter;
+
     public:
       //! The type of an entity id
       struct entity_type
@@ -106,6 +212,15 @@ namespace algorithm
       using entities_type = span<entity_type>;
 
     protected:
+      // The live counters behind lock_statistics, only allocated if statistics are enabled
+      struct _statistics
+      {
+        std::atomic<uint64> acquisitions, failures, contentions, spins, sleeps, retries, shuffles;
+        std::atomic<uint64> wait[lock_histogram::buckets], hold[lock_histogram::buckets];
+        std::atomic<uint64> wait_max, hold_max;
+      };
+      std::unique_ptr<_statistics> _stats;
+
       constexpr shared_fs_mutex() {}  // NOLINT
       shared_fs_mutex(const shared_fs_mutex &) = default;
       shared_fs_mutex(shared_fs_mutex &&) = default;
@@ -144,6 +259,64 @@ namespace algorithm
         }
       }
 
+      //! True if this instance is gathering statistics
+      bool statistics_enabled() const noexcept { return _stats != nullptr; }
+      /*! \brief Starts or stops gathering statistics about the locking done through this instance.
+
+      When enabled, each lock operation costs two reads of the steady clock plus a few relaxed
+      atomic increments, and each entity found contended costs a few more. When disabled, the
+      cost is a single null pointer check. Stopping discards everything gathered so far. Not
+      thread safe with concurrent use of this instance.
+
+      Implementations which block inside the kernel cannot see whether they were made to wait,
+      so for those only `lock_statistics::wait` will show the contention.
+      \errors `errc::not_enough_memory` if the counters could not be allocated.
+      */
+      result<void> enable_statistics(bool enable = true) noexcept
+      {
+        if(!enable)
+        {
+          _stats.reset();
+          return success();
+        }
+        if(_stats == nullptr)
+        {
+          _stats.reset(new(std::nothrow) _statistics());
+          if(_stats == nullptr)
+          {
+            return errc::not_enough_memory;
+          }
+        }
+        return success();
+      }
+      /*! \brief Returns a snapshot of the statistics gathered so far, all zero if not enabled.
+
+      Each counter is read individually, so if other threads are locking concurrently the
+      counters may be slightly inconsistent with one another.
+      */
+      lock_statistics statistics() const noexcept
+      {
+        lock_statistics ret;
+        if(_stats != nullptr)
+        {
+          ret.acquisitions = _stats->acquisitions.load(std::memory_order_relaxed);
+          ret.failures = _stats->failures.load(std::memory_order_relaxed);
+          ret.contentions = _stats->contentions.load(std::memory_order_relaxed);
+          ret.spins = _stats->spins.load(std::memory_order_relaxed);
+          ret.sleeps = _stats->sleeps.load(std::memory_order_relaxed);
+          ret.retries = _stats->retries.load(std::memory_order_relaxed);
+          ret.shuffles = _stats->shuffles.load(std::memory_order_relaxed);
+          for(size_t n = 0; n < lock_histogram::buckets; n++)
+          {
+            ret.wait.counts[n] = _stats->wait[n].load(std::memory_order_relaxed);
+            ret.hold.counts[n] = _stats->hold[n].load(std::memory_order_relaxed);
+          }
+          ret.wait.max = _stats->wait_max.load(std::memory_order_relaxed);
+          ret.hold.max = _stats->hold_max.load(std::memory_order_relaxed);
+        }
+        return ret;
+      }
+
       //! RAII holder for a lock on a sequence of entities
       class entities_guard
       {
@@ -153,6 +326,8 @@ namespace algorithm
         shared_fs_mutex *parent{nullptr};
         entities_type entities;
         unsigned long long hint{0};
+        //! When the lock was acquired, if the parent is gathering statistics
+        std::chrono::steady_clock::time_point acquired;
         entities_guard() = default;
         entities_guard(shared_fs_mutex *_parent, entities_type _entities)
             : parent(_parent)
@@ -169,7 +344,7 @@ namespace algorithm
         }
         entities_guard(const entities_guard &) = delete;
         entities_guard &operator=(const entities_guard &) = delete;
-        entities_guard(entities_guard &&o) noexcept : _entity(o._entity), parent(o.parent), entities(o.entities), hint(o.hint)
+        entities_guard(entities_guard &&o) noexcept : _entity(o._entity), parent(o.parent), entities(o.entities), hint(o.hint), acquired(o.acquired)
         {
           if(entities.data() == &o._entity)
           {
@@ -200,6 +375,7 @@ namespace algorithm
           if(parent != nullptr)
           {
             parent->unlock(entities, hint);
+            parent->_note_hold(acquired);
             release();
           }
         }
@@ -212,19 +388,104 @@ namespace algorithm
       };
 
       virtual result<void> _lock(entities_guard &out, deadline d, bool spin_not_sleep) noexcept = 0;
+      //! True if a lock taken by one thread may be released by another, as `async_lock()` requires
+      virtual bool _thread_agnostic() const noexcept { return true; }
+      /*! Called by `async_lock()` between polls of contended \em entities, so implementations which prefer
+      waiting exclusive lockers can see it waiting. \em first is true for the first call of a lock request.
+      */
+      virtual void _async_waiting(entities_type /*unused*/, bool /*unused*/) noexcept {}
+      //! Called by `async_lock()` once a lock request for which `_async_waiting()` was called completes
+      virtual void _async_stops_waiting(entities_type /*unused*/) noexcept {}
+
+    protected:
+      static void _record(std::atomic<uint64> *histogram, std::atomic<uint64> &max, std::chrono::steady_clock::duration duration) noexcept
+      {
+        const auto ns = static_cast<uint64>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+        histogram[lock_histogram::bucket_for(ns)].fetch_add(1, std::memory_order_relaxed);
+        uint64 was = max.load(std::memory_order_relaxed);
+        while(ns > was && !max.compare_exchange_weak(was, ns, std::memory_order_relaxed))
+        {
+        }
+      }
+      // Calls _lock(), timing it if statistics are enabled
+      result<void> _timed_lock(entities_guard &out, deadline d, bool spin_not_sleep) noexcept
+      {
+        if(_stats == nullptr)
+        {
+          return _lock(out, d, spin_not_sleep);
+        }
+        const auto began = std::chrono::steady_clock::now();
+        auto ret = _lock(out, d, spin_not_sleep);
+        _note_lock(out, began, !!ret);
+        return ret;
+      }
+      // Records a lock operation which began at began, if statistics are enabled
+      void _note_lock(entities_guard &out, std::chrono::steady_clock::time_point began, bool succeeded) noexcept
+      {
+        if(_stats != nullptr)
+        {
+          out.acquired = std::chrono::steady_clock::now();
+          _record(_stats->wait, _stats->wait_max, out.acquired - began);
+          (succeeded ? _stats->acquisitions : _stats->failures).fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      void _note_hold(std::chrono::steady_clock::time_point acquired) noexcept
+      {
+        if(_stats != nullptr && acquired != std::chrono::steady_clock::time_point())
+        {
+          _record(_stats->hold, _stats->hold_max, std::chrono::steady_clock::now() - acquired);
+        }
+      }
+      // Called by implementations as they lock
+      void _note_contention() noexcept
+      {
+        if(_stats != nullptr)
+        {
+          _stats->contentions.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      void _note_spin() noexcept
+      {
+        if(_stats != nullptr)
+        {
+          _stats->spins.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      void _note_sleep() noexcept
+      {
+        if(_stats != nullptr)
+        {
+          _stats->sleeps.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      void _note_retry() noexcept
+      {
+        if(_stats != nullptr)
+        {
+          _stats->retries.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      void _note_shuffle() noexcept
+      {
+        if(_stats != nullptr)
+        {
+          _stats->shuffles.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
 
+    public:
       //! Lock all of a sequence of entities for exclusive or shared access
       result<entities_guard> lock(entities_type entities, deadline d = deadline(), bool spin_not_sleep = false) noexcept
       {
         entities_guard ret(this, entities);
-        OUTCOME_TRYV(_lock(ret, d, spin_not_sleep));
+        OUTCOME_TRYV(_timed_lock(ret, d, spin_not_sleep));
         return std::move(ret);
       }
       //! Lock a single entity for exclusive or shared access
       result<entities_guard> lock(entity_type entity, deadline d = deadline(), bool spin_not_sleep = false) noexcept
       {
         entities_guard ret(this, entity);
-        OUTCOME_TRYV(_lock(ret, d, spin_not_sleep));
+        OUTCOME_TRYV(_timed_lock(ret, d, spin_not_sleep));
         return std::move(ret);
       }
       //! Try to lock all of a sequence of entities for exclusive or shared access
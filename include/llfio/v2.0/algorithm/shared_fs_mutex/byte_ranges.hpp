@@ -40,6 +40,8 @@ Distributed under the Boost Software License, Version 1.0.
 #include "../../quickcpplib/include/algorithm/small_prng.hpp"
 #endif
 
+#include <algorithm>  // for sort()
+
 //! \file byte_ranges.hpp Provides algorithm::shared_fs_mutex::byte_ranges
 
 LLFIO_V2_NAMESPACE_BEGIN
@@ -62,6 +64,7 @@ namespace algorithm
     - Linear complexity to number of concurrent users.
     - Exponential complexity to number of entities being concurrently locked, though some OSs
     provide linear complexity so long as total concurrent waiting processes is CPU core count or less.
+    If `set_ordered_acquisition()` is used, complexity is linear to the number of entities.
     - Does a reasonable job of trying to sleep the thread if any of the entities are locked.
     - Sudden process exit with lock held is recovered from.
     - Sudden power loss during use is recovered from.
@@ -83,6 +86,7 @@ namespace algorithm
     class byte_ranges : public shared_fs_mutex
     {
       file_handle _h;
+      bool _ordered{false};
 
       explicit byte_ranges(file_handle &&h)
           : _h(std::move(h))
@@ -101,11 +105,13 @@ namespace algorithm
       byte_ranges &operator=(const byte_ranges &) = delete;
       ~byte_ranges() = default;
       //! Move constructor
-      byte_ranges(byte_ranges &&o) noexcept : _h(std::move(o._h)) {}
+      byte_ranges(byte_ranges &&o) noexcept : shared_fs_mutex(std::move(o)), _h(std::move(o._h)), _ordered(o._ordered) {}
       //! Move assign
       byte_ranges &operator=(byte_ranges &&o) noexcept
       {
+        shared_fs_mutex::operator=(std::move(o));
         _h = std::move(o._h);
+        _ordered = o._ordered;
         return *this;
       }
 
@@ -121,6 +127,19 @@ namespace algorithm
       //! Return the handle to file being used for this lock
       const file_handle &handle() const noexcept { return _h; }
 
+      //! True if multiple entities are acquired in ascending entity order rather than by randomise and retry
+      bool ordered_acquisition() const noexcept { return _ordered; }
+      /*! \brief Sets whether multiple entities are acquired in ascending entity order, sleeping in the kernel
+      on each in turn while holding the preceding ones, rather than backing out, randomising and retrying
+      on contention.
+
+      This is deadlock free because every ordered locker acquires in the same order, and randomise and retry
+      lockers never wait while holding anything, so the two modes can be mixed freely between processes using
+      the same lock file. Note that the entities passed to `lock()` are sorted in place.
+      Not thread safe with concurrent use of this instance.
+      */
+      void set_ordered_acquisition(bool v) noexcept { _ordered = v; }
+
     protected:
       LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<void> _lock(entities_guard &out, deadline d, bool spin_not_sleep) noexcept final
       {
@@ -141,6 +160,73 @@ namespace algorithm
         // Fire this if an error occurs
         auto disableunlock = undoer([&] { out.release(); });
         size_t n;
+        if(_ordered)
+        {
+          // Every ordered locker acquires in ascending order and sleeps on each entity in turn while holding
+          // the preceding ones. No cycle of waiters can form, so no backing off is needed.
+          std::sort(out.entities.begin(), out.entities.end(), [](const entity_type &a, const entity_type &b) { return a.value < b.value; });
+          n = 0;
+          auto undo = undoer([&] {
+            while(n > 0)
+            {
+              --n;
+              _h.unlock(out.entities[n].value, 1);
+            }
+          });
+          for(; n < out.entities.size(); n++)
+          {
+            for(;;)
+            {
+              deadline nd = spin_not_sleep ? deadline(std::chrono::seconds(0)) : deadline();
+              if(!spin_not_sleep && d)
+              {
+                if((d).steady)
+                {
+                  std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>((began_steady + std::chrono::nanoseconds((d).nsecs)) - std::chrono::steady_clock::now());
+                  nd = deadline(ns.count() < 0 ? std::chrono::nanoseconds(0) : ns);
+                }
+                else
+                {
+                  nd = d;
+                }
+              }
+              auto outcome = _h.lock(out.entities[n].value, 1, out.entities[n].exclusive != 0u, nd);
+              if(outcome)
+              {
+                outcome.value().release();
+                break;
+              }
+              if(outcome.error() != errc::timed_out || !spin_not_sleep)
+              {
+                return std::move(outcome).error();
+              }
+              _note_contention();
+              _note_spin();
+              // Spinning, so check the deadline ourselves
+              if(d)
+              {
+                if((d).steady)
+                {
+                  if(std::chrono::steady_clock::now() >= (began_steady + std::chrono::nanoseconds((d).nsecs)))
+                  {
+                    return errc::timed_out;
+                  }
+                }
+                else
+                {
+                  if(std::chrono::system_clock::now() >= end_utc)
+                  {
+                    return errc::timed_out;
+                  }
+                }
+              }
+            }
+          }
+          // Everything is locked, exit
+          undo.dismiss();
+          disableunlock.dismiss();
+          return success();
+        }
         for(;;)
         {
           auto was_contended = static_cast<size_t>(-1);
@@ -162,7 +248,7 @@ namespace algorithm
             {
               deadline nd;
               // Only for very first entity will we sleep until its lock becomes available
-              if(n != 0u)
+              if(n != 0u || spin_not_sleep)
               {
                 nd = deadline(std::chrono::seconds(0));
               }
@@ -192,6 +278,7 @@ namespace algorithm
               auto outcome = _h.lock(out.entities[n].value, 1, out.entities[n].exclusive != 0u, nd);
               if(!outcome)
               {
+                _note_contention();
                 was_contended = n;
                 goto failed;
               }
@@ -225,8 +312,16 @@ namespace algorithm
           auto front = out.entities.begin();
           ++front;
           QUICKCPPLIB_NAMESPACE::algorithm::small_prng::random_shuffle(front, out.entities.end());
-          if(!spin_not_sleep)
+          _note_shuffle();
+          _note_retry();
+          // Unless spinning, the retry sleeps in the kernel until the contended entity, now first, is available
+          if(spin_not_sleep)
+          {
+            _note_spin();
+          }
+          else
           {
+            _note_sleep();
             std::this_thread::yield();
           }
         }
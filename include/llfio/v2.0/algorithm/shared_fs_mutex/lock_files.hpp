@@ -103,7 +103,7 @@ namespace algorithm
       lock_files &operator=(const lock_files &) = delete;
       ~lock_files() = default;
       //! Move constructor
-      lock_files(lock_files &&o) noexcept : _path(o._path), _hs(std::move(o._hs)) {}
+      lock_files(lock_files &&o) noexcept : shared_fs_mutex(std::move(o)), _path(o._path), _hs(std::move(o._hs)) {}
       //! Move assign
       lock_files &operator=(lock_files &&o) noexcept
       {
@@ -177,6 +177,7 @@ namespace algorithm
                   return std::move(ret).error();
                 }
                 // Collided with another locker
+                _note_contention();
                 was_contended = n;
                 break;
               }
@@ -211,6 +212,9 @@ namespace algorithm
             auto front = out.entities.begin();
             ++front;
             QUICKCPPLIB_NAMESPACE::algorithm::small_prng::random_shuffle(front, out.entities.end());
+            _note_shuffle();
+            _note_retry();
+            _note_spin();
             // Sleep for a very short time
             if(!spin_not_sleep)
             {
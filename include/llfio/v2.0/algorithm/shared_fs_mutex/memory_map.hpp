@@ -48,6 +48,8 @@ Distributed under the Boost Software License, Version 1.0.
 #include "../../quickcpplib/include/spinlock.hpp"
 #endif
 
+#include <algorithm>  // for sort()
+
 
 //! \file memory_map.hpp Provides algorithm::shared_fs_mutex::memory_map
 
@@ -60,8 +62,9 @@ namespace algorithm
     /*! \class memory_map
     \brief Many entity memory mapped shared/exclusive file system based lock
     \tparam Hasher A STL compatible hash algorithm to use (defaults to `fnv1a_hash`)
-    \tparam HashIndexSize The size in bytes of the hash index to use (defaults to 4Kb)
+    \tparam HashIndexSize The size in bytes of the hash index to use (defaults to 64Kb, which is 1024 cache line sized buckets)
     \tparam SpinlockType The type of spinlock to use (defaults to a `SharedMutex` concept spinlock)
+    \tparam SpinsBeforeSleep How many failed attempts to acquire a contended entity before sleeping on it (defaults to 64)
 
     This is the highest performing filing system mutex in LLFIO, but it comes with a long list of potential
     gotchas. It works by creating a random temporary file somewhere on the system and placing its path
@@ -73,6 +76,17 @@ namespace algorithm
     implementation is entirely implemented in userspace using shared memory without any kernel syscalls,
     performance is probably as fast as any many-arbitrary-entity shared locking system could be.
 
+    Each hash index bucket occupies its own cache line, so entities which hash to different buckets
+    never contend on the same cache line. Each bucket also keeps a count of sleeping waiters and a wake generation. If
+    `spin_not_sleep` is false, a locker which has failed `SpinsBeforeSleep` times on the same bucket
+    registers itself as a waiter and sleeps on the wake generation using `utils::wait_on_shared_address()`,
+    which on Linux is a `FUTEX_WAIT` on the shared mapping. Unlockers only make the wake syscall
+    if the bucket has waiters, so the uncontended case remains free of syscalls.
+
+    Each bucket also keeps a seqlock style sequence counter which is made odd by exclusive lockers and even
+    again on unlock. This enables `try_read_optimistic()` and `validate()`, with which read mostly entities
+    can be read by any number of readers without any atomic read-modify-write operations at all.
+
     As it uses shared memory, this implementation of `shared_fs_mutex` cannot work over a networked
     drive. If you attempt to open this lock on a network drive and the first user of the lock is not
     on this local machine, `errc::no_lock_available` will be returned from the constructor.
@@ -83,11 +97,20 @@ namespace algorithm
     - Safe for multithreaded usage of the same instance.
     - In the lightly contended case, an order of magnitude faster than any other `shared_fs_mutex` algorithm.
 
+    By default whichever locker retries first after a release wins, so exclusive lockers can starve
+    behind a steady stream of shared lockers. See `set_fairness_policy()` for writer preferring and
+    phase fair alternatives.
+
     Caveats:
-    - No ability to sleep until a lock becomes free, so CPUs are spun at 100%.
-    - Sudden process exit with locks held will deadlock all other users.
-    - Exponential complexity to number of entities being concurrently locked.
-    - Exponential complexity to concurrency if entities hash to the same cache line. Most SMP and especially
+    - Sleeping until a lock becomes free is only implemented on Linux. Elsewhere waiters spin,
+    yielding their timeslice after each failed attempt, so CPUs are spun at 100%.
+    - Sudden process exit with exclusive locks held is recovered from after about a second, as each bucket
+    records the `utils::current_process_identity()` and `utils::current_process_namespace()` of its exclusive
+    holder which waiters check for liveness. A holder in another PID namespace is never deemed dead.
+    Sudden process exit with shared locks held, or in the instant between acquiring a bucket and recording
+    the holder, will deadlock all other users.
+    - Exponential complexity to number of entities being concurrently locked, unless `set_ordered_acquisition()` is used.
+    - Exponential complexity to concurrency if entities hash to the same bucket. Most SMP and especially
     NUMA systems have a finite bandwidth for atomic compare and swap operations, and every attempt to
     lock or unlock an entity under this implementation is several of those operations. Under heavy contention,
     whole system performance very noticeably nose dives from excessive atomic operations, things like audio and the
@@ -100,10 +123,8 @@ namespace algorithm
     - If your OS doesn't have sane byte range locks (OS X, BSD, older Linuxes) and multiple
     objects in your process use the same lock file, misoperation will occur.
     - Requires `handle::current_path()` to be working.
-
-    \todo memory_map::_hash_entities needs to hash x16, x8 and x4 at a time to encourage auto vectorisation
     */
-    template <template <class> class Hasher = QUICKCPPLIB_NAMESPACE::algorithm::hash::fnv1a_hash, size_t HashIndexSize = 4096, class SpinlockType = QUICKCPPLIB_NAMESPACE::configurable_spinlock::shared_spinlock<>> class memory_map : public shared_fs_mutex
+    template <template <class> class Hasher = QUICKCPPLIB_NAMESPACE::algorithm::hash::fnv1a_hash, size_t HashIndexSize = 65536, class SpinlockType = QUICKCPPLIB_NAMESPACE::configurable_spinlock::shared_spinlock<>, unsigned SpinsBeforeSleep = 64> class memory_map : public shared_fs_mutex
     {
     public:
       //! The type of an entity id
@@ -116,14 +137,35 @@ namespace algorithm
       using spinlock_type = SpinlockType;
 
     private:
-      static constexpr size_t _container_entries = HashIndexSize / sizeof(spinlock_type);
-      using _hash_index_type = std::array<spinlock_type, _container_entries>;
+      // Each bucket gets its own cache line, so unrelated entities never ping pong the same line between CPUs
+      static constexpr size_t _cache_line_size = 64;
+      struct alignas(_cache_line_size) _bucket
+      {
+        spinlock_type lock;
+        std::atomic<uint32_t> waiters;          // count of threads sleeping on this bucket
+        std::atomic<uint32_t> generation;       // the futex word, bumped by unlockers when there are waiters
+        std::atomic<uint32_t> sequence;         // seqlock counter, odd whilst an exclusive holder is present
+        std::atomic<uint32_t> writers;          // count of exclusive lockers waiting for this bucket
+        std::atomic<uint64_t> owner;            // utils::current_process_identity() of the exclusive holder, if any
+        std::atomic<uint64_t> owner_namespace;  // utils::current_process_namespace() of the exclusive holder, set before owner
+      };
+      static constexpr size_t _container_entries = HashIndexSize / sizeof(_bucket);
+      static_assert(_container_entries > 0, "HashIndexSize is too small to contain a single bucket");
+      using _hash_index_type = std::array<_bucket, _container_entries>;
+      // Never sleep for longer than this in one go, in case a wake is lost e.g. due to a holder dying
+      static std::chrono::nanoseconds _max_sleep() noexcept { return std::chrono::milliseconds(100); }
+      // How long to wait on an exclusively held bucket before checking if its holder has died
+      static std::chrono::nanoseconds _owner_check_interval() noexcept { return std::chrono::seconds(1); }
+      // Never defer to waiting exclusive lockers for longer than this, in case they died or are waiting on us
+      static std::chrono::nanoseconds _max_deferral() noexcept { return std::chrono::seconds(1); }
       static constexpr file_handle::extent_type _initialisingoffset = static_cast<file_handle::extent_type>(1024) * 1024;
       static constexpr file_handle::extent_type _lockinuseoffset = static_cast<file_handle::extent_type>(1024) * 1024 + 1;
 
       file_handle _h, _temph;
       file_handle::extent_guard _hlockinuse;  // shared lock of last byte of _h marking if lock is in use
       map_handle _hmap, _temphmap;
+      bool _ordered{false};
+      fairness_policy _policy{fairness_policy::none};
 
       _hash_index_type &_index() const
       {
@@ -147,7 +189,7 @@ namespace algorithm
       //! No copy assignment
       memory_map &operator=(const memory_map &) = delete;
       //! Move constructor
-      memory_map(memory_map &&o) noexcept : _h(std::move(o._h)), _temph(std::move(o._temph)), _hlockinuse(std::move(o._hlockinuse)), _hmap(std::move(o._hmap)), _temphmap(std::move(o._temphmap)) { _hlockinuse.set_handle(&_h); }
+      memory_map(memory_map &&o) noexcept : shared_fs_mutex(std::move(o)), _h(std::move(o._h)), _temph(std::move(o._temph)), _hlockinuse(std::move(o._hlockinuse)), _hmap(std::move(o._hmap)), _temphmap(std::move(o._temphmap)), _ordered(o._ordered), _policy(o._policy) { _hlockinuse.set_handle(&_h); }
       //! Move assign
       memory_map &operator=(memory_map &&o) noexcept
       {
@@ -290,39 +332,280 @@ namespace algorithm
       //! Return the handle to file being used for this lock
       const file_handle &handle() const noexcept { return _h; }
 
+      //! A version stamp of an entity returned by `try_read_optimistic()`
+      struct optimistic_stamp
+      {
+        unsigned bucket;    //!< The hash index bucket of the entity
+        uint32_t sequence;  //!< The sequence of the bucket when the optimistic read began
+      };
+
+      /*! \brief Begins an optimistic read of \em entity without modifying any shared state.
+
+      This is the reader side of a seqlock. No cache line is modified, so any number of readers in
+      any number of processes can read concurrently without bouncing cache lines between CPUs. After
+      reading whatever the entity protects, call `validate()` with the returned stamp. If it returns
+      false, an exclusive holder may have intervened and the data read must be discarded.
+
+      Exclusive lockers of an entity hashing to the same bucket will also invalidate the stamp, so
+      there may be false invalidations, but never false validations.
+      \errors `errc::timed_out` if an exclusive holder is currently present, in which case take a
+      shared lock instead.
+      \mallocs None.
+      */
+      result<optimistic_stamp> try_read_optimistic(entity_type entity) const noexcept
+      {
+        const unsigned bucket = _bucket_index(entity.value);
+        const uint32_t sequence = _index()[bucket].sequence.load(std::memory_order_acquire);
+        if((sequence & 1) != 0)
+        {
+          return errc::timed_out;
+        }
+        return optimistic_stamp{bucket, sequence};
+      }
+      /*! \brief Returns true if no exclusive holder of the entity has been present since \em stamp
+      was obtained from `try_read_optimistic()`, and thus everything read since is consistent.
+      */
+      bool validate(optimistic_stamp stamp) const noexcept
+      {
+        // Prevent the reads of protected data being reordered after the sequence reload
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return _index()[stamp.bucket].sequence.load(std::memory_order_relaxed) == stamp.sequence;
+      }
+
+      //! True if multiple entities are acquired in ascending bucket order rather than by randomise and retry
+      bool ordered_acquisition() const noexcept { return _ordered; }
+      /*! \brief Sets whether multiple entities are acquired in ascending bucket order, waiting for each in turn
+      while holding the preceding ones, rather than backing out, randomising and retrying on contention.
+
+      Ordered acquisition has linear rather than exponential complexity to the number of entities being
+      concurrently locked. It is deadlock free because every ordered locker acquires in the same order,
+      and randomise and retry lockers never wait while holding anything, so the two modes can be mixed
+      freely between processes using the same lock file. Not thread safe with concurrent use of this instance.
+      */
+      void set_ordered_acquisition(bool v) noexcept { _ordered = v; }
+
+      //! The policy used by this instance when taking shared locks
+      fairness_policy fairness() const noexcept { return _policy; }
+      /*! \brief Sets the policy used by this instance when taking shared locks.
+
+      Each bucket counts the exclusive lockers currently waiting for it. Under `writer_preferring` and
+      `phase_fair`, a shared locker finding waiting exclusive lockers on a bucket treats it as contended,
+      so the bucket drains of shared holders and the exclusive locker gets in. To bound the damage from
+      exclusive lockers which die whilst waiting, or which wait upon a bucket this shared locker already
+      holds from an earlier lock, no shared locker defers for longer than about a second per lock. If no
+      exclusive locker acquired the bucket during that time, the waiting count is reset; live exclusive
+      lockers re-advertise themselves the next time they fail to acquire. Not thread safe with concurrent
+      use of this instance.
+      */
+      void set_fairness_policy(fairness_policy v) noexcept { _policy = v; }
+
     protected:
       struct _entity_idx
       {
         unsigned value : 31;
         unsigned exclusive : 1;
       };
+      static unsigned _bucket_index(entity_type::value_type v) noexcept { return static_cast<unsigned>(hasher_type()(v) % _container_entries); }
       // Create a cache of entities to their indices, eliding collisions where necessary
       static span<_entity_idx> _hash_entities(_entity_idx *entity_to_idx, entities_type &entities)
       {
+        const size_t count = entities.size();
+        size_t n = 0;
+        // Hash four at a time with no dependencies between the lanes to encourage auto vectorisation
+        for(; n + 4 <= count; n += 4)
+        {
+          const unsigned h0 = _bucket_index(entities[n].value), h1 = _bucket_index(entities[n + 1].value), h2 = _bucket_index(entities[n + 2].value), h3 = _bucket_index(entities[n + 3].value);
+          entity_to_idx[n].value = h0;
+          entity_to_idx[n + 1].value = h1;
+          entity_to_idx[n + 2].value = h2;
+          entity_to_idx[n + 3].value = h3;
+          entity_to_idx[n].exclusive = entities[n].exclusive;
+          entity_to_idx[n + 1].exclusive = entities[n + 1].exclusive;
+          entity_to_idx[n + 2].exclusive = entities[n + 2].exclusive;
+          entity_to_idx[n + 3].exclusive = entities[n + 3].exclusive;
+        }
+        for(; n < count; n++)
+        {
+          entity_to_idx[n].value = _bucket_index(entities[n].value);
+          entity_to_idx[n].exclusive = entities[n].exclusive;
+        }
+        // Elide entities hashing to an already seen bucket, merging their exclusivity
         _entity_idx *ep = entity_to_idx;
-        for(size_t n = 0; n < entities.size(); n++)
+        for(n = 0; n < count; n++)
         {
-          ep->value = hasher_type()(entities[n].value) % _container_entries;
-          ep->exclusive = entities[n].exclusive;
-          bool skip = false;
-          for(size_t m = 0; m < n; m++)
+          const _entity_idx i = entity_to_idx[n];
+          _entity_idx *m = entity_to_idx;
+          for(; m != ep; ++m)
           {
-            if(entity_to_idx[m].value == ep->value)
+            if(m->value == i.value)
             {
-              if(ep->exclusive && !entity_to_idx[m].exclusive)
+              if(i.exclusive)
               {
-                entity_to_idx[m].exclusive = true;
+                m->exclusive = true;
               }
-              skip = true;
+              break;
             }
           }
-          if(!skip)
+          if(m == ep)
           {
-            ++ep;
+            *ep++ = i;
           }
         }
         return span<_entity_idx>(entity_to_idx, ep - entity_to_idx);
       }
+      static bool _try_lock_bucket(_bucket &b, bool exclusive) noexcept
+      {
+        if(exclusive)
+        {
+          if(!b.lock.try_lock())
+          {
+            return false;
+          }
+          // Make the sequence odd before anything the exclusive holder writes becomes visible
+          b.sequence.fetch_add(1, std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_release);
+          b.owner_namespace.store(utils::current_process_namespace(), std::memory_order_relaxed);
+          b.owner.store(utils::current_process_identity(), std::memory_order_release);
+          return true;
+        }
+        return b.lock.try_lock_shared();
+      }
+      static void _unlock_bucket(_bucket &b, bool exclusive) noexcept
+      {
+        if(exclusive)
+        {
+          b.owner.store(0, std::memory_order_relaxed);
+          b.sequence.fetch_add(1, std::memory_order_release);
+          b.lock.unlock();
+        }
+        else
+        {
+          b.lock.unlock_shared();
+        }
+        // Pairs with the fetch_add of waiters in _sleep_on_bucket(), so either we see the waiter
+        // or the waiter sees the bucket unlocked
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(b.waiters.load(std::memory_order_relaxed) != 0)
+        {
+          b.generation.fetch_add(1, std::memory_order_release);
+          utils::wake_shared_address(&b.generation);
+        }
+      }
+      // Withdraw one advertisement of a waiting exclusive locker, never wrapping if the count was reset
+      static void _writer_stops_waiting(_bucket &b) noexcept
+      {
+        uint32_t writers = b.writers.load(std::memory_order_relaxed);
+        while(writers != 0 && !b.writers.compare_exchange_weak(writers, writers - 1, std::memory_order_relaxed))
+        {
+        }
+      }
+      // Advertises an async_lock() request as an exclusive locker waiting upon the buckets it locks exclusively.
+      // As for a blocking locker, the advertisement is renewed if a deferring shared locker gave up on it.
+      LLFIO_HEADERS_ONLY_VIRTUAL_SPEC void _async_waiting(entities_type entities, bool first) noexcept final
+      {
+        _hash_index_type &index = _index();
+        span<_entity_idx> entity_to_idx(_hash_entities(reinterpret_cast<_entity_idx *>(alloca(sizeof(_entity_idx) * entities.size())), entities));
+        for(const auto &i : entity_to_idx)
+        {
+          if(i.exclusive && (first || index[i.value].writers.load(std::memory_order_relaxed) == 0))
+          {
+            index[i.value].writers.fetch_add(1, std::memory_order_relaxed);
+          }
+        }
+      }
+      LLFIO_HEADERS_ONLY_VIRTUAL_SPEC void _async_stops_waiting(entities_type entities) noexcept final
+      {
+        _hash_index_type &index = _index();
+        span<_entity_idx> entity_to_idx(_hash_entities(reinterpret_cast<_entity_idx *>(alloca(sizeof(_entity_idx) * entities.size())), entities));
+        for(const auto &i : entity_to_idx)
+        {
+          if(i.exclusive)
+          {
+            _writer_stops_waiting(index[i.value]);
+          }
+        }
+      }
+      // Per lock state of a shared locker deferring to waiting exclusive lockers
+      struct _deferral
+      {
+        unsigned bucket{static_cast<unsigned>(-1)};
+        uint32_t sequence{0};
+        std::chrono::steady_clock::time_point since;
+      };
+      // True if a shared locker should leave bucket idx to waiting exclusive lockers
+      bool _defer_to_writers(_bucket &b, unsigned idx, _deferral &state) const noexcept
+      {
+        uint32_t writers = b.writers.load(std::memory_order_relaxed);
+        if(writers == 0)
+        {
+          return false;
+        }
+        const uint32_t sequence = b.sequence.load(std::memory_order_relaxed);
+        const auto now = std::chrono::steady_clock::now();
+        if(state.bucket != idx)
+        {
+          state.bucket = idx;
+          state.sequence = sequence;
+          state.since = now;
+          return true;
+        }
+        // Each exclusive phase moves the sequence on by two, so once it has moved our turn has come
+        if(_policy == fairness_policy::phase_fair && sequence != state.sequence)
+        {
+          return false;
+        }
+        if(now - state.since >= _max_deferral())
+        {
+          if(sequence == state.sequence)
+          {
+            // Nobody got in for a whole deferral period, so forget whoever is advertised
+            b.writers.compare_exchange_strong(writers, 0, std::memory_order_relaxed);
+          }
+          return false;
+        }
+        return true;
+      }
+      // If the exclusive holder of the bucket has died, unlock the bucket on its behalf
+      static bool _break_if_owner_dead(_bucket &b) noexcept
+      {
+        // The owner and its namespace must both be those of the exclusive holding current when the
+        // sequence was read, else a holder could be looked up in another holder's PID namespace
+        const uint32_t sequence = b.sequence.load(std::memory_order_acquire);
+        uint64_t owner = b.owner.load(std::memory_order_acquire);
+        const uint64_t owner_namespace = b.owner_namespace.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(owner == 0 || (sequence & 1) == 0 || b.sequence.load(std::memory_order_relaxed) != sequence || utils::process_identity_is_running(owner, owner_namespace))
+        {
+          return false;
+        }
+        // Only one waiter may break the lock, and only if nobody has since acquired it
+        if(!b.owner.compare_exchange_strong(owner, 0, std::memory_order_acq_rel))
+        {
+          return false;
+        }
+        LLFIO_LOG_WARN(nullptr, "memory_map: breaking lock of bucket held by dead process");
+        _unlock_bucket(b, true);
+        return true;
+      }
+      /* Returns true if the bucket became available since we last tried, in which case it is now held
+      by the caller. Acquiring rather than peeking is the only way to recheck without missing a wake,
+      and releasing it again would bump the sequence, overwrite the owner and wake every sleeper.
+      try_lock must be the same fairness-aware attempt the caller makes, else a shared locker could
+      take the bucket here ahead of an exclusive locker it is meant to be deferring to.
+      */
+      template <class F> static bool _sleep_on_bucket(_bucket &b, std::chrono::nanoseconds timeout, F &&try_lock) noexcept
+      {
+        b.waiters.fetch_add(1, std::memory_order_seq_cst);
+        const uint32_t generation = b.generation.load(std::memory_order_acquire);
+        if(try_lock())
+        {
+          b.waiters.fetch_sub(1, std::memory_order_relaxed);
+          return true;
+        }
+        utils::wait_on_shared_address(&b.generation, generation, timeout);
+        b.waiters.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+      }
       LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<void> _lock(entities_guard &out, deadline d, bool spin_not_sleep) noexcept final
       {
         LLFIO_LOG_FUNCTION_CALL(this);
@@ -339,12 +622,138 @@ namespace algorithm
             end_utc = (d).to_time_point();
           }
         }
+        auto timed_out = [&]() -> bool {
+          if(d)
+          {
+            if((d).steady)
+            {
+              return std::chrono::steady_clock::now() >= (began_steady + std::chrono::nanoseconds((d).nsecs));
+            }
+            return std::chrono::system_clock::now() >= end_utc;
+          }
+          return false;
+        };
         // alloca() always returns 16 byte aligned addresses
         span<_entity_idx> entity_to_idx(_hash_entities(reinterpret_cast<_entity_idx *>(alloca(sizeof(_entity_idx) * out.entities.size())), out.entities));
         _hash_index_type &index = _index();
+        _deferral deferral;
+        auto try_lock_bucket = [&](const _entity_idx &i) -> bool {
+          if(!i.exclusive && _policy != fairness_policy::none && _defer_to_writers(index[i.value], i.value, deferral))
+          {
+            return false;
+          }
+          return _try_lock_bucket(index[i.value], i.exclusive);
+        };
+        // The bucket we are advertising ourselves as an exclusive locker waiting upon, if any
+        auto waiting_upon = static_cast<unsigned>(-1);
+        auto stop_waiting = undoer([&] {
+          if(waiting_upon != static_cast<unsigned>(-1))
+          {
+            _writer_stops_waiting(index[waiting_upon]);
+          }
+        });
+        // Called after each failure to acquire a contended bucket, returning true if it acquired it
+        std::chrono::steady_clock::time_point next_owner_check;
+        auto wait_for = [&](const _entity_idx &contended, unsigned &spins) -> bool {
+          if(contended.exclusive)
+          {
+            if(waiting_upon != contended.value)
+            {
+              if(waiting_upon != static_cast<unsigned>(-1))
+              {
+                _writer_stops_waiting(index[waiting_upon]);
+              }
+              waiting_upon = contended.value;
+              index[waiting_upon].writers.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if(index[waiting_upon].writers.load(std::memory_order_relaxed) == 0)
+            {
+              // A deferring shared locker gave up on us, so advertise again
+              index[waiting_upon].writers.fetch_add(1, std::memory_order_relaxed);
+            }
+          }
+          if(++spins < SpinsBeforeSleep)
+          {
+            _note_spin();
+            if(!spin_not_sleep)
+            {
+              std::this_thread::yield();
+            }
+            return false;
+          }
+          spins = 0;
+          // Every so often check whether an exclusive holder died without unlocking
+          const auto now = std::chrono::steady_clock::now();
+          if(now >= next_owner_check)
+          {
+            if(next_owner_check != std::chrono::steady_clock::time_point() && _break_if_owner_dead(index[contended.value]))
+            {
+              return false;
+            }
+            next_owner_check = now + _owner_check_interval();
+          }
+          if(spin_not_sleep)
+          {
+            _note_spin();
+            return false;
+          }
+          std::chrono::nanoseconds timeout = _max_sleep();
+          if(d)
+          {
+            std::chrono::nanoseconds remaining = (d).steady ? std::chrono::duration_cast<std::chrono::nanoseconds>((began_steady + std::chrono::nanoseconds((d).nsecs)) - std::chrono::steady_clock::now()) : std::chrono::duration_cast<std::chrono::nanoseconds>(end_utc - std::chrono::system_clock::now());
+            if(remaining < timeout)
+            {
+              timeout = remaining;
+            }
+          }
+          if(timeout.count() > 0)
+          {
+            _note_sleep();
+            return _sleep_on_bucket(index[contended.value], timeout, [&] { return try_lock_bucket(contended); });
+          }
+          return false;
+        };
         // Fire this if an error occurs
         auto disableunlock = undoer([&] { out.release(); });
         size_t n;
+        if(_ordered)
+        {
+          // Every ordered locker acquires buckets in ascending order and waits for each in turn while
+          // holding the preceding ones. No cycle of waiters can form, so no backing off is needed.
+          std::sort(entity_to_idx.begin(), entity_to_idx.end(), [](const _entity_idx &a, const _entity_idx &b) { return a.value < b.value; });
+          n = 0;
+          auto undo = undoer([&] {
+            while(n > 0)
+            {
+              --n;
+              _unlock_bucket(index[entity_to_idx[n].value], entity_to_idx[n].exclusive);
+            }
+          });
+          for(; n < entity_to_idx.size(); n++)
+          {
+            unsigned spins = 0;
+            while(!try_lock_bucket(entity_to_idx[n]))
+            {
+              _note_contention();
+              if(timed_out())
+              {
+                return errc::timed_out;
+              }
+              if(wait_for(entity_to_idx[n], spins))
+              {
+                break;
+              }
+            }
+          }
+          // Everything is locked, exit
+          undo.dismiss();
+          disableunlock.dismiss();
+          return success();
+        }
+        unsigned spins = 0;
+        auto last_contended = static_cast<size_t>(-1);
+        // If waiting acquired the bucket last contended, which is then first
+        bool front_held = false;
         for(;;)
         {
           auto was_contended = static_cast<size_t>(-1);
@@ -357,14 +766,14 @@ namespace algorithm
                 // Now 0 to n needs to be closed
                 for(; n > 0; n--)
                 {
-                  entity_to_idx[n].exclusive ? index[entity_to_idx[n].value].unlock() : index[entity_to_idx[n].value].unlock_shared();
+                  _unlock_bucket(index[entity_to_idx[n].value], entity_to_idx[n].exclusive);
                 }
-                entity_to_idx[0].exclusive ? index[entity_to_idx[0].value].unlock() : index[entity_to_idx[0].value].unlock_shared();
+                _unlock_bucket(index[entity_to_idx[0].value], entity_to_idx[0].exclusive);
               }
             });
-            for(n = 0; n < entity_to_idx.size(); n++)
+            for(n = front_held ? 1 : 0; n < entity_to_idx.size(); n++)
             {
-              if(!(entity_to_idx[n].exclusive ? index[entity_to_idx[n].value].try_lock() : index[entity_to_idx[n].value].try_lock_shared()))
+              if(!try_lock_bucket(entity_to_idx[n]))
               {
                 was_contended = n;
                 goto failed;
@@ -376,32 +785,24 @@ namespace algorithm
             return success();
           }
         failed:
-          if(d)
+          _note_contention();
+          if(timed_out())
           {
-            if((d).steady)
-            {
-              if(std::chrono::steady_clock::now() >= (began_steady + std::chrono::nanoseconds((d).nsecs)))
-              {
-                return errc::timed_out;
-              }
-            }
-            else
-            {
-              if(std::chrono::system_clock::now() >= end_utc)
-              {
-                return errc::timed_out;
-              }
-            }
+            return errc::timed_out;
           }
+          if(entity_to_idx[was_contended].value != last_contended)
+          {
+            last_contended = entity_to_idx[was_contended].value;
+            spins = 0;
+          }
+          front_held = wait_for(entity_to_idx[was_contended], spins);
           // Move was_contended to front and randomise rest of out.entities
           std::swap(entity_to_idx[was_contended], entity_to_idx[0]);
           auto front = entity_to_idx.begin();
           ++front;
           QUICKCPPLIB_NAMESPACE::algorithm::small_prng::random_shuffle(front, entity_to_idx.end());
-          if(!spin_not_sleep)
-          {
-            std::this_thread::yield();
-          }
+          _note_shuffle();
+          _note_retry();
         }
         // return success();
       }
@@ -414,7 +815,7 @@ namespace algorithm
         _hash_index_type &index = _index();
         for(const auto &i : entity_to_idx)
         {
-          i.exclusive ? index[i.value].unlock() : index[i.value].unlock_shared();
+          _unlock_bucket(index[i.value], i.exclusive);
         }
       }
     };
@@ -48,6 +48,18 @@ namespace algorithm
         OUTCOME_TRY(v, byte_ranges::fs_mutex_byte_ranges(base, lockfile));
         return safe_byte_ranges(std::move(v));
       }
+
+      //! The policy used by this instance when taking shared locks
+      fairness_policy fairness() const noexcept { return _policy; }
+      /*! \brief Sets the policy used by this instance when taking shared locks.
+
+      On Microsoft Windows all waiting happens inside the kernel with whatever fairness it implements,
+      so the policy is recorded for portability but has no further effect.
+      */
+      void set_fairness_policy(fairness_policy v) noexcept { _policy = v; }
+
+    private:
+      fairness_policy _policy{fairness_policy::none};
     };
   }  // namespace shared_fs_mutex
 }  // namespace algorithm
@@ -71,6 +83,7 @@ namespace algorithm
     namespace detail
     {
       LLFIO_HEADERS_ONLY_FUNC_SPEC result<std::shared_ptr<shared_fs_mutex>> inode_to_fs_mutex(const path_handle &base, path_view lockfile) noexcept;
+      LLFIO_HEADERS_ONLY_FUNC_SPEC result<void> fair_lock(shared_fs_mutex &p, shared_fs_mutex::entities_guard &out, deadline d, bool spin_not_sleep, fairness_policy policy) noexcept;
     }
 
     /*! \class safe_byte_ranges
@@ -92,7 +105,9 @@ namespace algorithm
     - Keeps a process-wide store of reference counted fd's per lock in the process, thus
     preventing byte range locks ever being dropped unexpectedly.
     - A process-local thread aware layer, allowing byte range locks to be held by a thread
-    and excluding other threads as well as processes.
+    and excluding other threads as well as processes. Its state is sharded by entity, so
+    threads locking unrelated entities do not contend on a common mutex, and acquiring an
+    entity already held by another thread of the process needs no syscall.
     - A thread may add an additional exclusive or shared lock on top of its existing
     exclusive or shared lock, but unlocks always unlock the exclusive lock first. This
     choice of behaviour is to match Microsoft Windows' behaviour to aid writing portable
@@ -111,6 +126,10 @@ namespace algorithm
     - Sudden power loss during use is recovered from.
     - Safe for multithreaded usage.
 
+    Within the process, the thread aware layer counts the threads waiting to lock each entity exclusively,
+    so `set_fairness_policy()` can be used to have shared lockers defer to them rather than starve them.
+    Between processes, waiting is done by the kernel with whatever fairness it implements.
+
     Caveats:
     - When entities being locked is more than one, the algorithm places the contending lock at the
     front of the list during the randomisation after lock failure so we can sleep the thread until
@@ -118,10 +137,12 @@ namespace algorithm
     - Byte range locks need to work properly on your system. Misconfiguring NFS or Samba
     to cause byte range locks to not work right will produce bad outcomes.
     - Unavoidably these locks will be a good bit slower than `byte_ranges`.
+    - As locks belong to the thread which took them, `async_lock()` is not supported.
     */
     class safe_byte_ranges : public shared_fs_mutex
     {
       std::shared_ptr<shared_fs_mutex> _p;
+      fairness_policy _policy{fairness_policy::none};
 
       explicit safe_byte_ranges(std::shared_ptr<shared_fs_mutex> p)
           : _p(std::move(p))
@@ -140,11 +161,13 @@ namespace algorithm
       safe_byte_ranges &operator=(const safe_byte_ranges &) = delete;
       ~safe_byte_ranges() = default;
       //! Move constructor
-      safe_byte_ranges(safe_byte_ranges &&o) noexcept : _p(std::move(o._p)) {}
+      safe_byte_ranges(safe_byte_ranges &&o) noexcept : shared_fs_mutex(std::move(o)), _p(std::move(o._p)), _policy(o._policy) {}
       //! Move assign
       safe_byte_ranges &operator=(safe_byte_ranges &&o) noexcept
       {
+        shared_fs_mutex::operator=(std::move(o));
         _p = std::move(o._p);
+        _policy = o._policy;
         return *this;
       }
 
@@ -156,8 +179,20 @@ namespace algorithm
         return safe_byte_ranges(std::move(ret));
       }
 
+      //! The policy used by this instance when taking shared locks
+      fairness_policy fairness() const noexcept { return _policy; }
+      /*! \brief Sets the policy used by this instance when taking shared locks.
+
+      Only threads within this process are arbitrated by the policy. Shared lockers never defer for
+      longer than about a second per lock, as a waiting writer may be waiting upon a lock this thread
+      already holds. Not thread safe with concurrent use of this instance.
+      */
+      void set_fairness_policy(fairness_policy v) noexcept { _policy = v; }
+
     protected:
-      LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<void> _lock(entities_guard &out, deadline d, bool spin_not_sleep) noexcept final { return _p->_lock(out, d, spin_not_sleep); }
+      LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<void> _lock(entities_guard &out, deadline d, bool spin_not_sleep) noexcept final { return detail::fair_lock(*_p, out, d, spin_not_sleep, _policy); }
+      // The thread aware layer remembers which thread locked what, so locks cannot be handed between threads
+      LLFIO_HEADERS_ONLY_VIRTUAL_SPEC bool _thread_agnostic() const noexcept final { return false; }
 
     public:
       LLFIO_HEADERS_ONLY_VIRTUAL_SPEC void unlock(entities_type entities, unsigned long long hint) noexcept final { return _p->unlock(entities, hint); }
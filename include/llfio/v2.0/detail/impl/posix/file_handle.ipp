@@ -26,6 +26,12 @@ Distributed under the Boost Software License, Version 1.0.
 
 #include "import.hpp"
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
 LLFIO_V2_NAMESPACE_BEGIN
 
 result<file_handle> file_handle::file(const path_handle &base, file_handle::path_view_type path, file_handle::mode _mode, file_handle::creation _creation, file_handle::caching _caching, file_handle::flag flags) noexcept
@@ -360,6 +366,151 @@ result<file_handle::extent_type> file_handle::truncate(file_handle::extent_type
   return newsize;
 }
 
+result<file_handle::extent_type> file_handle::allocate(file_handle::extent_type offset, file_handle::extent_type bytes, file_handle::allocation how) noexcept
+{
+  LLFIO_LOG_FUNCTION_CALL(this);
+  if(offset + bytes < offset)
+  {
+    return errc::value_too_large;
+  }
+#if defined(__linux__)
+  int mode = 0;
+  switch(how)
+  {
+  case allocation::extend:
+    break;
+  case allocation::keep_size:
+    mode = 0x01 /*FALLOC_FL_KEEP_SIZE*/;
+    break;
+  case allocation::collapse_range:
+    mode = 0x08 /*FALLOC_FL_COLLAPSE_RANGE*/;
+    break;
+  case allocation::insert_range:
+    mode = 0x20 /*FALLOC_FL_INSERT_RANGE*/;
+    break;
+  }
+  if(-1 == ::fallocate(_v.fd, mode, offset, bytes))
+  {
+    return posix_error();
+  }
+#elif defined(__APPLE__)
+  if(how != allocation::extend && how != allocation::keep_size)
+  {
+    return errc::operation_not_supported;
+  }
+  struct stat s
+  {
+  };
+  memset(&s, 0, sizeof(s));
+  if(-1 == ::fstat(_v.fd, &s))
+  {
+    return posix_error();
+  }
+  // OS X can only allocate from the physical end of the file
+  if(offset + bytes > static_cast<extent_type>(s.st_size))
+  {
+    fstore_t fs{};
+    memset(&fs, 0, sizeof(fs));
+    fs.fst_flags = F_ALLOCATECONTIG;
+    fs.fst_posmode = F_PEOFPOSMODE;
+    fs.fst_length = offset + bytes - s.st_size;
+    if(-1 == ::fcntl(_v.fd, F_PREALLOCATE, &fs))
+    {
+      // Try again allowing fragmentation
+      fs.fst_flags = F_ALLOCATEALL;
+      if(-1 == ::fcntl(_v.fd, F_PREALLOCATE, &fs))
+      {
+        return posix_error();
+      }
+    }
+    if(how == allocation::extend && -1 == ::ftruncate(_v.fd, offset + bytes))
+    {
+      return posix_error();
+    }
+  }
+#else
+  // posix_fallocate() always extends the file
+  if(how != allocation::extend)
+  {
+    return errc::operation_not_supported;
+  }
+  int errcode = ::posix_fallocate(_v.fd, offset, bytes);
+  if(errcode != 0)
+  {
+    return posix_error(errcode);
+  }
+#endif
+  if(how != allocation::keep_size && are_safety_fsyncs_issued())
+  {
+    fsync(_v.fd);
+  }
+  return bytes;
+}
+
+result<void> file_handle::set_write_lifetime_hint(file_handle::write_lifetime hint, bool whole_inode) noexcept
+{
+  LLFIO_LOG_FUNCTION_CALL(this);
+#ifdef __linux__
+  uint64_t v = static_cast<uint64_t>(hint);
+  if(!whole_inode)
+  {
+    if(-1 != ::fcntl(_v.fd, 1024 + 14 /*F_SET_FILE_RW_HINT*/, &v))
+    {
+      return success();
+    }
+    // Per open file hints were added in Linux 4.13 and removed again in 5.17
+    if(EINVAL != errno)
+    {
+      return posix_error();
+    }
+  }
+  if(-1 == ::fcntl(_v.fd, 1024 + 12 /*F_SET_RW_HINT*/, &v))
+  {
+    if(EINVAL == errno)
+    {
+      return errc::operation_not_supported;
+    }
+    return posix_error();
+  }
+  return success();
+#else
+  (void) hint;
+  (void) whole_inode;
+  return errc::operation_not_supported;
+#endif
+}
+
+result<file_handle::write_lifetime> file_handle::write_lifetime_hint(bool whole_inode) const noexcept
+{
+  LLFIO_LOG_FUNCTION_CALL(this);
+#ifdef __linux__
+  uint64_t v = 0;
+  if(!whole_inode)
+  {
+    if(-1 != ::fcntl(_v.fd, 1024 + 13 /*F_GET_FILE_RW_HINT*/, &v))
+    {
+      return static_cast<write_lifetime>(v);
+    }
+    if(EINVAL != errno)
+    {
+      return posix_error();
+    }
+  }
+  if(-1 == ::fcntl(_v.fd, 1024 + 11 /*F_GET_RW_HINT*/, &v))
+  {
+    if(EINVAL == errno)
+    {
+      return errc::operation_not_supported;
+    }
+    return posix_error();
+  }
+  return static_cast<write_lifetime>(v);
+#else
+  (void) whole_inode;
+  return errc::operation_not_supported;
+#endif
+}
+
 result<std::vector<std::pair<file_handle::extent_type, file_handle::extent_type>>> file_handle::extents() const noexcept
 {
   LLFIO_LOG_FUNCTION_CALL(this);
@@ -445,17 +596,80 @@ result<std::vector<std::pair<file_handle::extent_type, file_handle::extent_type>
   }
 }
 
-result<file_handle::extent_type> file_handle::zero(file_handle::extent_type offset, file_handle::extent_type bytes, deadline d) noexcept
+result<span<file_handle::extent_pair>> file_handle::enumerate_extents(span<file_handle::extent_pair> out, file_handle::extent_type offset) const noexcept
 {
   LLFIO_LOG_FUNCTION_CALL(this);
-#if defined(__linux__)
-  if(-1 == fallocate(_v.fd, 0x02 /*FALLOC_FL_PUNCH_HOLE*/ | 0x01 /*FALLOC_FL_KEEP_SIZE*/, offset, bytes))
+  size_t count = 0;
+  extent_type start = 0, end = offset;
+  while(count < out.size())
   {
-    // The filing system may not support trim
-    if(EOPNOTSUPP != errno)
+#ifdef __linux__
+#ifndef SEEK_DATA
+    errno = EINVAL;
+    break;
+#else
+    start = lseek64(_v.fd, end, SEEK_DATA);
+    if(static_cast<extent_type>(-1) == start)
+    {
+      break;
+    }
+    end = lseek64(_v.fd, start, SEEK_HOLE);
+    if(static_cast<extent_type>(-1) == end)
+    {
+      break;
+    }
+#endif
+#elif defined(__APPLE__)
+    // Can't find any support for extent enumeration in OS X
+    errno = EINVAL;
+    break;
+#elif defined(__FreeBSD__)
+    start = lseek(_v.fd, end, SEEK_DATA);
+    if((extent_type) -1 == start)
+      break;
+    end = lseek(_v.fd, start, SEEK_HOLE);
+    if((extent_type) -1 == end)
+      break;
+#else
+#error Unknown system
+#endif
+    // Data region may have been concurrently deleted
+    if(end > start)
+    {
+      out[count++] = extent_pair(start, end - start);
+    }
+  }
+  if(count < out.size() && ENXIO != errno)
+  {
+    if(EINVAL != errno)
     {
       return posix_error();
     }
+    // If it failed with no output, probably this filing system doesn't support extents
+    if(count == 0)
+    {
+      OUTCOME_TRY(size, file_handle::maximum_extent());
+      if(offset < size)
+      {
+        out[count++] = extent_pair(offset, size - offset);
+      }
+    }
+  }
+  return span<extent_pair>(out.data(), count);
+}
+
+result<file_handle::extent_type> file_handle::zero(file_handle::extent_type offset, file_handle::extent_type bytes, deadline d) noexcept
+{
+  LLFIO_LOG_FUNCTION_CALL(this);
+#if defined(__linux__)
+  if(-1 != fallocate(_v.fd, 0x02 /*FALLOC_FL_PUNCH_HOLE*/ | 0x01 /*FALLOC_FL_KEEP_SIZE*/, offset, bytes))
+  {
+    return bytes;
+  }
+  // The filing system may not support trim
+  if(EOPNOTSUPP != errno)
+  {
+    return posix_error();
   }
 #endif
   // Fall back onto a write of zeros
@@ -489,4 +703,219 @@ result<file_handle::extent_type> file_handle::zero(file_handle::extent_type offs
   }
 }
 
+result<file_handle::clone_extents_result> file_handle::clone_extents_to(file_handle &dest, file_handle::extent_type offset, file_handle::extent_type bytes, deadline d) noexcept
+{
+  LLFIO_LOG_FUNCTION_CALL(this);
+  clone_extents_result ret;
+  ret.offset = offset;
+  OUTCOME_TRY(mylength, maximum_extent());
+  if(offset >= mylength)
+  {
+    return ret;
+  }
+  if(bytes > mylength - offset)
+  {
+    bytes = mylength - offset;
+  }
+  const extent_type end = offset + bytes;
+  OUTCOME_TRY(destlength, dest.maximum_extent());
+  if(destlength < end)
+  {
+    OUTCOME_TRYV(dest.truncate(end));
+  }
+  std::chrono::steady_clock::time_point began_steady;
+  std::chrono::system_clock::time_point end_utc;
+  if(d)
+  {
+    if(d.steady)
+    {
+      began_steady = std::chrono::steady_clock::now();
+    }
+    else
+    {
+      end_utc = d.to_time_point();
+    }
+  }
+  auto timed_out = [&] {
+    if(d)
+    {
+      if(d.steady)
+      {
+        return std::chrono::steady_clock::now() >= (began_steady + std::chrono::nanoseconds(d.nsecs));
+      }
+      return std::chrono::system_clock::now() >= end_utc;
+    }
+    return false;
+  };
+  auto used_method = [&ret](clone_method m) {
+    if(static_cast<int>(m) > static_cast<int>(ret.method))
+    {
+      ret.method = m;
+    }
+  };
+#ifdef __linux__
+  // The kernel accelerated methods need a real fd at both ends. Each is disabled on first failure
+  // indicating that the kernel or filing system does not support it.
+  bool try_reflink = _v.is_valid() && dest._v.is_valid() && !dest._v.is_append_only();
+  bool try_copy_file_range = try_reflink, try_sendfile = try_reflink;
+  struct file_clone_range
+  {
+    int64_t src_fd;
+    uint64_t src_offset;
+    uint64_t src_length;
+    uint64_t dest_offset;
+  };
+#endif
+  byte *buffer = nullptr;
+  size_t blocksize = 0;
+  auto unbufferh = undoer([&buffer, &blocksize] {
+    if(buffer != nullptr)
+    {
+      utils::page_allocator<byte>().deallocate(buffer, blocksize);
+    }
+  });
+  (void) unbufferh;
+  extent_type pos = offset;  // Everything before this has been cloned
+  auto clone_hole = [&](extent_type holeend) -> result<void> {
+    // The extension of the destination above is already a hole, only its previous contents need deallocating
+    if(pos < destlength)
+    {
+      OUTCOME_TRYV(dest.zero(pos, std::min(holeend, destlength) - pos));
+    }
+    return success();
+  };
+  auto clone_data = [&](extent_type start, extent_type finish) -> result<void> {
+    while(start < finish)
+    {
+      if(timed_out())
+      {
+        return errc::timed_out;
+      }
+      // Never ask the kernel for more than 1Gb at a time to avoid overflowing 32 bit quantities
+      const extent_type chunk = std::min(finish - start, static_cast<extent_type>(1) << 30U);
+#ifdef __linux__
+      if(try_reflink)
+      {
+        file_clone_range fcr{_v.fd, start, finish - start, start};
+        if(-1 != ::ioctl(dest._v.fd, _IOW(0x94, 13, file_clone_range) /*FICLONERANGE*/, &fcr))
+        {
+          used_method(clone_method::reflink);
+          start = finish;
+          continue;
+        }
+        // EINVAL usually means this extent is not aligned to the block size, so keep trying for later extents
+        if(EINVAL != errno)
+        {
+          try_reflink = false;
+        }
+      }
+#ifdef __NR_copy_file_range
+      if(try_copy_file_range)
+      {
+        loff_t inoff = start, outoff = start;
+        auto copied = ::syscall(__NR_copy_file_range, _v.fd, &inoff, dest._v.fd, &outoff, static_cast<size_t>(chunk), 0);
+        if(copied > 0)
+        {
+          used_method(clone_method::kernel_copy);
+          start += copied;
+          continue;
+        }
+        if(0 == copied)
+        {
+          // This file was concurrently truncated
+          return success();
+        }
+        if(ENOSYS != errno && EXDEV != errno && EINVAL != errno && EOPNOTSUPP != errno && EBADF != errno)
+        {
+          return posix_error();
+        }
+        try_copy_file_range = false;
+      }
+#endif
+      if(try_sendfile)
+      {
+        off_t inoff = start;
+        if(-1 != ::lseek(dest._v.fd, start, SEEK_SET))
+        {
+          auto copied = ::sendfile(dest._v.fd, _v.fd, &inoff, static_cast<size_t>(chunk));
+          if(copied > 0)
+          {
+            used_method(clone_method::kernel_splice);
+            start += copied;
+            continue;
+          }
+          if(0 == copied)
+          {
+            return success();
+          }
+        }
+        if(ENOSYS != errno && EINVAL != errno && ESPIPE != errno && EOVERFLOW != errno)
+        {
+          return posix_error();
+        }
+        try_sendfile = false;
+      }
+#endif
+      if(buffer == nullptr)
+      {
+        try
+        {
+          blocksize = utils::file_buffer_default_size();
+          buffer = utils::page_allocator<byte>().allocate(blocksize);
+        }
+        catch(...)
+        {
+          return error_from_exception();
+        }
+      }
+      // Use the buffers returned, as the source may be memory mapped
+      buffer_type b{buffer, static_cast<size_type>(std::min(chunk, static_cast<extent_type>(blocksize)))};
+      OUTCOME_TRY(filled, read(io_request<buffers_type>(buffers_type(&b, 1), start)));
+      if(filled.empty() || filled[0].size() == 0)
+      {
+        return success();
+      }
+      OUTCOME_TRY(written, dest.write(start, {{filled[0].data(), filled[0].size()}}));
+      if(0 == written)
+      {
+        return errc::io_error;
+      }
+      used_method(clone_method::buffered_copy);
+      start += written;
+    }
+    return success();
+  };
+  // Walk the extents a batch at a time rather than enumerating the whole file
+  extent_pair _exts[64];
+  for(extent_type from = offset; from < end;)
+  {
+    OUTCOME_TRY(exts, enumerate_extents(_exts, from));
+    for(const auto &ext : exts)
+    {
+      extent_type start = std::max(ext.first, offset), finish = std::min(ext.first + ext.second, end);
+      if(start >= finish)
+      {
+        continue;
+      }
+      if(start > pos)
+      {
+        OUTCOME_TRYV(clone_hole(start));
+      }
+      OUTCOME_TRYV(clone_data(start, finish));
+      pos = finish;
+    }
+    if(exts.size() < sizeof(_exts) / sizeof(_exts[0]))
+    {
+      break;
+    }
+    from = exts[exts.size() - 1].first + exts[exts.size() - 1].second;
+  }
+  if(end > pos)
+  {
+    OUTCOME_TRYV(clone_hole(end));
+  }
+  ret.length = bytes;
+  return ret;
+}
+
 LLFIO_V2_NAMESPACE_END
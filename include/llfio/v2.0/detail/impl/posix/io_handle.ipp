@@ -130,6 +130,69 @@ io_handle::io_result<io_handle::buffers_type> io_handle::read(io_handle::io_requ
   return {reqs.buffers};
 }
 
+result<span<io_handle::range_request>> io_handle::read_cached(span<io_handle::range_request> reqs, span<io_handle::range_request> misses) noexcept
+{
+  LLFIO_LOG_FUNCTION_CALL(this);
+  if(misses.size() < reqs.size())
+  {
+    return errc::invalid_argument;
+  }
+  size_t missed = 0;
+#ifdef RWF_NOWAIT
+  // Direct i/o never reads from the page cache
+  bool nowait = !_v.requires_aligned_io();
+#endif
+  for(auto &req : reqs)
+  {
+    const buffer_type wanted = req.second;
+    size_type got = 0;
+    bool eof = false;
+#ifdef RWF_NOWAIT
+    // A short read may be due to end of file or an uncached page, so keep reading until we know which
+    while(nowait && got < wanted.size())
+    {
+      struct iovec iov
+      {
+      };
+      iov.iov_base = wanted.data() + got;
+      iov.iov_len = wanted.size() - got;
+      ssize_t bytesread = ::preadv2(_v.fd, &iov, 1, req.first + got, RWF_NOWAIT);
+      if(bytesread > 0)
+      {
+        got += bytesread;
+        continue;
+      }
+      if(0 == bytesread)
+      {
+        eof = true;
+        break;
+      }
+      if(EINTR == errno)
+      {
+        continue;
+      }
+      if(EAGAIN == errno || EWOULDBLOCK == errno)
+      {
+        break;
+      }
+      // Kernel or filing system does not support RWF_NOWAIT, so everything else is a miss
+      if(EOPNOTSUPP == errno || ENOSYS == errno)
+      {
+        nowait = false;
+        break;
+      }
+      return posix_error();
+    }
+#endif
+    req.second = buffer_type(wanted.data(), got);
+    if(!eof && got < wanted.size())
+    {
+      misses[missed++] = range_request(req.first + got, buffer_type(wanted.data() + got, wanted.size() - got));
+    }
+  }
+  return span<range_request>(misses.data(), missed);
+}
+
 io_handle::io_result<io_handle::const_buffers_type> io_handle::write(io_handle::io_request<io_handle::const_buffers_type> reqs, deadline d) noexcept
 {
   LLFIO_LOG_FUNCTION_CALL(this);
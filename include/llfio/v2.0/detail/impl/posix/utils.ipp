@@ -38,7 +38,17 @@ Distributed under the Boost Software License, Version 1.0.
 
 #include <mutex>  // for lock_guard
 
+#include <climits>  // for INT_MAX
+#include <csignal>  // for kill()
+#include <thread>  // for yield()
+
+#include <pthread.h>  // for pthread_atfork()
 #include <sys/mman.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
 
 LLFIO_V2_NAMESPACE_BEGIN
 
@@ -212,6 +222,151 @@ namespace utils
     return false;
   }
 
+  void wait_on_shared_address(const std::atomic<uint32_t> *addr, uint32_t expected, std::chrono::nanoseconds timeout) noexcept
+  {
+#ifdef __linux__
+    struct timespec ts
+    {
+    };
+    ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000LL);
+    ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000LL);
+    // Not FUTEX_PRIVATE_FLAG, as the address is usually in a mapping shared with other processes.
+    // EAGAIN (value changed), EINTR and ETIMEDOUT are all normal returns here.
+    ::syscall(SYS_futex, const_cast<std::atomic<uint32_t> *>(addr), FUTEX_WAIT, expected, &ts, nullptr, 0);
+#else
+    (void) addr;
+    (void) expected;
+    (void) timeout;
+    std::this_thread::yield();
+#endif
+  }
+
+  void wake_shared_address(const std::atomic<uint32_t> *addr) noexcept
+  {
+#ifdef __linux__
+    ::syscall(SYS_futex, const_cast<std::atomic<uint32_t> *>(addr), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void) addr;
+#endif
+  }
+
+#ifdef __linux__
+  namespace detail
+  {
+    // Returns the start time in clock ticks since boot of process pid, or zero if it is not running
+    inline uint64_t process_start_time(int pid) noexcept
+    {
+      char path[64];
+      snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+      int h = ::open(path, O_RDONLY | O_CLOEXEC);
+      if(h == -1)
+      {
+        return 0;
+      }
+      auto unh = undoer([&h] { ::close(h); });
+      char buffer[1024];
+      ssize_t bytes = ::read(h, buffer, sizeof(buffer) - 1);
+      if(bytes <= 0)
+      {
+        return 0;
+      }
+      buffer[bytes] = 0;
+      // The process name is in brackets and may contain spaces, so begin after the last closing bracket.
+      // Then comes the state (field 3), and the start time is field 22.
+      const char *p = strrchr(buffer, ')');
+      if(p == nullptr || p[1] != ' ')
+      {
+        return 0;
+      }
+      p += 2;
+      if(*p == 'Z' || *p == 'X')
+      {
+        return 0;  // zombie or dead
+      }
+      for(int field = 3; field < 22; field++)
+      {
+        p = strchr(p, ' ');
+        if(p == nullptr)
+        {
+          return 0;
+        }
+        ++p;
+      }
+      // Never return zero for a running process
+      return strtoull(p, nullptr, 10) | (1ULL << 63U);
+    }
+  }  // namespace detail
+#endif
+
+  uint64_t current_process_identity() noexcept
+  {
+    static std::atomic<uint64_t> cached{0};
+    // A forked child is a different process, so must not inherit its parent's identity
+    static const int atfork = ::pthread_atfork(nullptr, nullptr, [] { cached.store(0, std::memory_order_relaxed); });
+    (void) atfork;
+    uint64_t ret = cached.load(std::memory_order_relaxed);
+    if(ret == 0)
+    {
+      const auto pid = static_cast<uint64_t>(::getpid());
+#ifdef __linux__
+      ret = (pid << 32U) | static_cast<uint32_t>(detail::process_start_time(static_cast<int>(pid)));
+#else
+      ret = pid << 32U;
+#endif
+      cached.store(ret, std::memory_order_relaxed);
+    }
+    return ret;
+  }
+
+  uint64_t current_process_namespace() noexcept
+  {
+#ifdef __linux__
+    static std::atomic<uint64_t> cached{0};
+    // A child forked after unshare(CLONE_NEWPID) is in a different PID namespace to its parent
+    static const int atfork = ::pthread_atfork(nullptr, nullptr, [] { cached.store(0, std::memory_order_relaxed); });
+    (void) atfork;
+    uint64_t ret = cached.load(std::memory_order_relaxed);
+    if(ret == 0)
+    {
+      struct stat s
+      {
+      };
+      if(-1 == ::stat("/proc/self/ns/pid", &s) || s.st_ino == 0)
+      {
+        return 0;
+      }
+      ret = static_cast<uint64_t>(s.st_ino);
+      cached.store(ret, std::memory_order_relaxed);
+    }
+    return ret;
+#else
+    return 1;
+#endif
+  }
+
+  bool process_identity_is_running(uint64_t identity, uint64_t pid_namespace) noexcept
+  {
+    const uint64_t mine = current_process_namespace();
+    if(pid_namespace == 0 || mine == 0 || pid_namespace != mine)
+    {
+      // The process id need not be visible to us and if it is, it may be a different process
+      return true;
+    }
+#ifdef __linux__
+    const auto pid = static_cast<int>(identity >> 32U);
+    const uint64_t start_time = detail::process_start_time(pid);
+    if(start_time == 0)
+    {
+      // If procfs isn't mounted we can't tell either way
+      return -1 == ::access("/proc/self/stat", F_OK);
+    }
+    return static_cast<uint32_t>(start_time) == static_cast<uint32_t>(identity);
+#else
+    const auto pid = static_cast<int>(identity >> 32U);
+    return ::kill(pid, 0) == 0 || errno == EPERM;
+#endif
+  }
+
   namespace detail
   {
     large_page_allocation allocate_large_pages(size_t bytes)
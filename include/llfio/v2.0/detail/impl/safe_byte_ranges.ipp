@@ -47,6 +47,7 @@ Distributed under the Boost Software License, Version 1.0.
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <array>
 #include <condition_variable>
 #include <mutex>
 #include <unordered_map>
@@ -77,9 +78,7 @@ namespace algorithm
         using entities_type = shared_fs_mutex::entities_type;
 
       private:
-        std::mutex _m;
         file_handle _h;
-        std::condition_variable _changed;
         struct _entity_info
         {
           std::vector<unsigned> reader_tids;  // thread ids of all shared lock holders
@@ -96,15 +95,79 @@ namespace algorithm
             }
           }
         };
-        std::unordered_map<entity_type::value_type, _entity_info> _thread_locks;  // entity to thread lock
-        // _m mutex must be held on entry!
-        void _unlock(unsigned mythreadid, entity_type entity)
+        // Entities are spread over shards by value, so threads locking unrelated entities never contend on the same mutex
+        struct _shard
         {
-          auto it = _thread_locks.find(entity.value);  // NOLINT
-          assert(it != _thread_locks.end());
+          std::mutex m;
+          std::condition_variable changed;
+          std::unordered_map<entity_type::value_type, _entity_info> thread_locks;  // entity to thread lock
+          std::unordered_map<entity_type::value_type, unsigned> writers_waiting;   // entity to count of threads waiting to lock exclusively
+          unsigned long long exclusive_releases{0};                                 // bumped whenever any thread releases an exclusive lock
+        };
+        static constexpr size_t _shard_count = 16;
+        std::array<_shard, _shard_count> _shards;
+        _shard &_shard_for(entity_type::value_type value) noexcept { return _shards[value % _shard_count]; }
+        // Fetching the thread id can be a syscall, so only ever do it once per thread
+        static unsigned _this_thread_id() noexcept
+        {
+          static thread_local unsigned tid = QUICKCPPLIB_NAMESPACE::utils::thread::this_thread_id();
+          return tid;
+        }
+        // Never sleep for longer than this in one go, as contention with other processes is not notified
+        static std::chrono::nanoseconds _max_sleep() noexcept { return std::chrono::milliseconds(100); }
+        // Never defer to waiting writers for longer than this, in case they are waiting upon us
+        static std::chrono::nanoseconds _max_deferral() noexcept { return std::chrono::seconds(1); }
+        // s.m mutex must be held on entry!
+        static void _writer_stops_waiting(_shard &s, entity_type::value_type value)
+        {
+          auto it = s.writers_waiting.find(value);
+          assert(it != s.writers_waiting.end());
+          if(--it->second == 0)
+          {
+            s.writers_waiting.erase(it);
+            s.changed.notify_all();
+          }
+        }
+        // Per lock state of a reader deferring to waiting writers
+        struct _deferral
+        {
+          const _shard *shard{nullptr};
+          unsigned long long exclusive_releases{0};
+          std::chrono::steady_clock::time_point since;
+        };
+        // s.m mutex must be held on entry! True if a reader should leave entity to waiting writers.
+        static bool _defer_to_writers(_shard &s, entity_type::value_type value, fairness_policy policy, _deferral &state)
+        {
+          if(s.writers_waiting.find(value) == s.writers_waiting.end())
+          {
+            return false;
+          }
+          const auto now = std::chrono::steady_clock::now();
+          if(state.shard == nullptr)
+          {
+            state.since = now;
+          }
+          if(state.shard != &s)
+          {
+            state.shard = &s;
+            state.exclusive_releases = s.exclusive_releases;
+            return now - state.since < _max_deferral();
+          }
+          if(policy == fairness_policy::phase_fair && s.exclusive_releases != state.exclusive_releases)
+          {
+            return false;
+          }
+          return now - state.since < _max_deferral();
+        }
+        // s.m mutex must be held on entry!
+        void _unlock(_shard &s, unsigned mythreadid, entity_type entity)
+        {
+          auto it = s.thread_locks.find(entity.value);  // NOLINT
+          assert(it != s.thread_locks.end());
           assert(it->second.writer_tid == mythreadid || it->second.writer_tid == 0);
           if(it->second.writer_tid == mythreadid)
           {
+            ++s.exclusive_releases;
             if(!it->second.reader_tids.empty())
             {
               // Downgrade the lock from exclusive to shared
@@ -134,8 +197,37 @@ namespace algorithm
           {
             // Release the lock and delete this entity from the map
             _h.unlock(entity.value, 1);
-            _thread_locks.erase(it);
+            s.thread_locks.erase(it);
+          }
+        }
+        // Returns a deadline for the kernel lock of the nth entity. Only for very first entity will we sleep until its lock becomes available.
+        static deadline _kernel_deadline(size_t n, deadline d, std::chrono::steady_clock::time_point began_steady) noexcept
+        {
+          if(n != 0u)
+          {
+            return deadline(std::chrono::seconds(0));
+          }
+          deadline nd;
+          if(d)
+          {
+            if((d).steady)
+            {
+              std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>((began_steady + std::chrono::nanoseconds((d).nsecs)) - std::chrono::steady_clock::now());
+              if(ns.count() < 0)
+              {
+                (nd).nsecs = 0;
+              }
+              else
+              {
+                (nd).nsecs = ns.count();
+              }
+            }
+            else
+            {
+              (nd) = (d);
+            }
           }
+          return nd;
         }
 
       public:
@@ -144,10 +236,11 @@ namespace algorithm
           LLFIO_LOG_FUNCTION_CALL(0);
           _h = file_handle::file(base, lockfile, file_handle::mode::write, file_handle::creation::if_needed, file_handle::caching::temporary).value();
         }
-        LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<void> _lock(entities_guard &out, deadline d, bool spin_not_sleep) noexcept final
+        LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<void> _lock(entities_guard &out, deadline d, bool spin_not_sleep) noexcept final { return fair_lock(out, d, spin_not_sleep, fairness_policy::none); }
+        result<void> fair_lock(entities_guard &out, deadline d, bool spin_not_sleep, fairness_policy policy) noexcept
         {
           LLFIO_LOG_FUNCTION_CALL(this);
-          unsigned mythreadid = QUICKCPPLIB_NAMESPACE::utils::thread::this_thread_id();
+          unsigned mythreadid = _this_thread_id();
           std::chrono::steady_clock::time_point began_steady;
           std::chrono::system_clock::time_point end_utc;
           if(d)
@@ -164,61 +257,53 @@ namespace algorithm
           // Fire this if an error occurs
           auto disableunlock = undoer([&] { out.release(); });
           size_t n;
+          _deferral deferral;
+          // The entity we are advertising ourselves as a writer waiting upon, if any
+          bool waiting = false;
+          entity_type::value_type waiting_upon = 0;
+          auto stop_waiting = [&] {
+            if(waiting)
+            {
+              _shard &s = _shard_for(waiting_upon);
+              std::lock_guard<std::mutex> g(s.m);
+              _writer_stops_waiting(s, waiting_upon);
+              waiting = false;
+            }
+          };
+          auto stop_waiting_on_exit = undoer(stop_waiting);
           for(;;)
           {
             auto was_contended = static_cast<size_t>(-1);
             bool pls_sleep = true;
-            std::unique_lock<decltype(_m)> guard(_m);
             {
               auto undo = undoer([&] {
                 // 0 to (n-1) need to be closed
-                if(n > 0)
+                while(n > 0)
                 {
                   --n;
-                  // Now 0 to n needs to be closed
-                  for(; n > 0; n--)
-                  {
-                    _unlock(mythreadid, out.entities[n]);
-                  }
-                  _unlock(mythreadid, out.entities[0]);
+                  _shard &s = _shard_for(out.entities[n].value);
+                  std::lock_guard<std::mutex> g(s.m);
+                  _unlock(s, mythreadid, out.entities[n]);
+                  s.changed.notify_all();
                 }
               });
               for(n = 0; n < out.entities.size(); n++)
               {
-                auto it = _thread_locks.find(out.entities[n].value);
-                if(it == _thread_locks.end())
+                _shard &s = _shard_for(out.entities[n].value);
+                std::unique_lock<std::mutex> guard(s.m);
+                auto it = s.thread_locks.find(out.entities[n].value);
+                // Readers may leave the entity to waiting writers, unless they already hold it exclusively
+                if(out.entities[n].exclusive == 0u && policy != fairness_policy::none && (it == s.thread_locks.end() || it->second.writer_tid != mythreadid) && _defer_to_writers(s, out.entities[n].value, policy, deferral))
+                {
+                  was_contended = n;
+                  pls_sleep = true;
+                  goto failed;
+                }
+                if(it == s.thread_locks.end())
                 {
                   // This entity has not been locked before
-                  deadline nd;
-                  // Only for very first entity will we sleep until its lock becomes available
-                  if(n != 0u)
-                  {
-                    nd = deadline(std::chrono::seconds(0));
-                  }
-                  else
-                  {
-                    nd = deadline();
-                    if(d)
-                    {
-                      if((d).steady)
-                      {
-                        std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>((began_steady + std::chrono::nanoseconds((d).nsecs)) - std::chrono::steady_clock::now());
-                        if(ns.count() < 0)
-                        {
-                          (nd).nsecs = 0;
-                        }
-                        else
-                        {
-                          (nd).nsecs = ns.count();
-                        }
-                      }
-                      else
-                      {
-                        (nd) = (d);
-                      }
-                    }
-                  }
-                  // Allow other threads to use this threaded_byte_ranges
+                  deadline nd = _kernel_deadline(n, d, began_steady);
+                  // Allow other threads to use this shard
                   guard.unlock();
                   auto outcome = _h.lock(out.entities[n].value, 1, out.entities[n].exclusive != 0u, nd);
                   guard.lock();
@@ -229,17 +314,18 @@ namespace algorithm
                     goto failed;
                   }
                   // Did another thread already fill this in?
-                  it = _thread_locks.find(out.entities[n].value);
-                  if(it == _thread_locks.end())
+                  it = s.thread_locks.find(out.entities[n].value);
+                  if(it == s.thread_locks.end())
                   {
-                    it = _thread_locks.insert(std::make_pair(static_cast<entity_type::value_type>(out.entities[n].value), _entity_info(out.entities[n].exclusive != 0u, mythreadid, std::move(outcome).value()))).first;
+                    it = s.thread_locks.insert(std::make_pair(static_cast<entity_type::value_type>(out.entities[n].value), _entity_info(out.entities[n].exclusive != 0u, mythreadid, std::move(outcome).value()))).first;
                     continue;
                   }
                   // Otherwise throw away the presumably shared superfluous byte range lock
                   assert(!out.entities[n].exclusive);
                 }
 
-                // If we are here, then this entity has been locked by someone before
+                // If we are here, then this entity has been locked by someone before, and
+                // is already held by this process at the OS level, so no syscall is needed
                 auto reader_tid_it = std::find(it->second.reader_tids.begin(), it->second.reader_tids.end(), mythreadid);
                 bool already_have_shared_lock = (reader_tid_it != it->second.reader_tids.end());
                 // Is somebody already locking this entity exclusively?
@@ -276,36 +362,8 @@ namespace algorithm
                 }
                 // We are thus now upgrading shared to exclusive
                 assert(out.entities[n].exclusive);
-                deadline nd;
-                // Only for very first entity will we sleep until its lock becomes available
-                if(n != 0u)
-                {
-                  nd = deadline(std::chrono::seconds(0));
-                }
-                else
-                {
-                  nd = deadline();
-                  if(d)
-                  {
-                    if((d).steady)
-                    {
-                      std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>((began_steady + std::chrono::nanoseconds((d).nsecs)) - std::chrono::steady_clock::now());
-                      if(ns.count() < 0)
-                      {
-                        (nd).nsecs = 0;
-                      }
-                      else
-                      {
-                        (nd).nsecs = ns.count();
-                      }
-                    }
-                    else
-                    {
-                      (nd) = (d);
-                    }
-                  }
-                }
-                // Allow other threads to use this threaded_byte_ranges
+                deadline nd = _kernel_deadline(n, d, began_steady);
+                // Allow other threads to use this shard
                 guard.unlock();
                 auto outcome = _h.lock(out.entities[n].value, 1, true, nd);
                 guard.lock();
@@ -345,35 +403,61 @@ namespace algorithm
                 }
               }
             }
-            // Move was_contended to front and randomise rest of out.entities
-            std::swap(out.entities[was_contended], out.entities[0]);
-            auto front = out.entities.begin();
-            ++front;
-            QUICKCPPLIB_NAMESPACE::algorithm::small_prng::random_shuffle(front, out.entities.end());
-            if(pls_sleep && !spin_not_sleep)
             {
-              // Sleep until the thread locks next change
-              if((d).steady)
+              const entity_type contended = out.entities[was_contended];
+              if(contended.exclusive != 0u && waiting && waiting_upon != contended.value)
               {
-                std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>((began_steady + std::chrono::nanoseconds((d).nsecs)) - std::chrono::steady_clock::now());
-                _changed.wait_for(guard, ns);
+                // Only ever hold one shard mutex at a time
+                stop_waiting();
               }
-              else
+              _shard &s = _shard_for(contended.value);
+              std::unique_lock<std::mutex> guard(s.m);
+              // Advertise that a writer is waiting so readers with a fairness policy can defer to us
+              if(contended.exclusive != 0u && !waiting)
               {
-                _changed.wait_until(guard, d.to_time_point());
+                ++s.writers_waiting[contended.value];
+                waiting = true;
+                waiting_upon = contended.value;
+              }
+              if(pls_sleep && !spin_not_sleep)
+              {
+                // The holder may have unlocked between our failure and retaking the shard mutex
+                auto it = s.thread_locks.find(contended.value);
+                bool still_contended = (it != s.thread_locks.end() && (contended.exclusive != 0u || it->second.writer_tid != 0)) || (contended.exclusive == 0u && policy != fairness_policy::none && s.writers_waiting.find(contended.value) != s.writers_waiting.end());
+                if(still_contended)
+                {
+                  // Sleep until the thread locks next change
+                  std::chrono::nanoseconds ns = _max_sleep();
+                  if(d)
+                  {
+                    std::chrono::nanoseconds remaining = (d).steady ? std::chrono::duration_cast<std::chrono::nanoseconds>((began_steady + std::chrono::nanoseconds((d).nsecs)) - std::chrono::steady_clock::now()) : std::chrono::duration_cast<std::chrono::nanoseconds>(end_utc - std::chrono::system_clock::now());
+                    if(remaining < ns)
+                    {
+                      ns = remaining;
+                    }
+                  }
+                  s.changed.wait_for(guard, ns);
+                }
               }
             }
+            // Move was_contended to front and randomise rest of out.entities
+            std::swap(out.entities[was_contended], out.entities[0]);
+            auto front = out.entities.begin();
+            ++front;
+            QUICKCPPLIB_NAMESPACE::algorithm::small_prng::random_shuffle(front, out.entities.end());
           }
           // return success();
         }
         LLFIO_HEADERS_ONLY_VIRTUAL_SPEC void unlock(entities_type entities, unsigned long long /*unused*/) noexcept final
         {
           LLFIO_LOG_FUNCTION_CALL(this);
-          unsigned mythreadid = QUICKCPPLIB_NAMESPACE::utils::thread::this_thread_id();
-          std::unique_lock<decltype(_m)> guard(_m);
+          unsigned mythreadid = _this_thread_id();
           for(auto &entity : entities)
           {
-            _unlock(mythreadid, entity);
+            _shard &s = _shard_for(entity.value);
+            std::lock_guard<std::mutex> g(s.m);
+            _unlock(s, mythreadid, entity);
+            s.changed.notify_all();
           }
         }
       };
@@ -388,6 +472,11 @@ namespace algorithm
         static threaded_byte_ranges_list v;
         return v;
       }
+      LLFIO_HEADERS_ONLY_FUNC_SPEC result<void> fair_lock(shared_fs_mutex &p, shared_fs_mutex::entities_guard &out, deadline d, bool spin_not_sleep, fairness_policy policy) noexcept
+      {
+        // inode_to_fs_mutex() only ever makes threaded_byte_ranges
+        return static_cast<threaded_byte_ranges &>(p).fair_lock(out, d, spin_not_sleep, policy);
+      }
       LLFIO_HEADERS_ONLY_FUNC_SPEC result<std::shared_ptr<shared_fs_mutex>> inode_to_fs_mutex(const path_handle &base, path_view lockfile) noexcept
       {
         try
@@ -370,6 +370,48 @@ result<file_handle::extent_type> file_handle::truncate(file_handle::extent_type
   return newsize;
 }
 
+result<file_handle::extent_type> file_handle::allocate(file_handle::extent_type offset, file_handle::extent_type bytes, file_handle::allocation how) noexcept
+{
+  LLFIO_LOG_FUNCTION_CALL(this);
+  if(offset + bytes < offset)
+  {
+    return errc::value_too_large;
+  }
+  // NTFS cannot collapse nor insert ranges
+  if(how != allocation::extend && how != allocation::keep_size)
+  {
+    return errc::operation_not_supported;
+  }
+  OUTCOME_TRY(length, maximum_extent());
+  // Setting an allocation size below the end of file truncates the file, so never do that
+  if(offset + bytes > length)
+  {
+    FILE_ALLOCATION_INFO fai{};
+    fai.AllocationSize.QuadPart = offset + bytes;
+    if(SetFileInformationByHandle(_v.h, FileAllocationInfo, &fai, sizeof(fai)) == 0)
+    {
+      return win32_error();
+    }
+    if(how == allocation::extend)
+    {
+      OUTCOME_TRYV(truncate(offset + bytes));
+    }
+  }
+  return bytes;
+}
+
+result<void> file_handle::set_write_lifetime_hint(file_handle::write_lifetime /*unused*/, bool /*unused*/) noexcept
+{
+  LLFIO_LOG_FUNCTION_CALL(this);
+  return errc::operation_not_supported;
+}
+
+result<file_handle::write_lifetime> file_handle::write_lifetime_hint(bool /*unused*/) const noexcept
+{
+  LLFIO_LOG_FUNCTION_CALL(this);
+  return errc::operation_not_supported;
+}
+
 result<std::vector<std::pair<file_handle::extent_type, file_handle::extent_type>>> file_handle::extents() const noexcept
 {
   windows_nt_kernel::init();
@@ -403,6 +445,7 @@ result<std::vector<std::pair<file_handle::extent_type, file_handle::extent_type>
         return win32_error();
       }
     }
+    ret.resize(bytesout / sizeof(FILE_ALLOCATED_RANGE_BUFFER));
     return ret;
   }
   catch(...)
@@ -411,6 +454,41 @@ result<std::vector<std::pair<file_handle::extent_type, file_handle::extent_type>
   }
 }
 
+result<span<file_handle::extent_pair>> file_handle::enumerate_extents(span<file_handle::extent_pair> out, file_handle::extent_type offset) const noexcept
+{
+  windows_nt_kernel::init();
+  using namespace windows_nt_kernel;
+  LLFIO_LOG_FUNCTION_CALL(this);
+  static_assert(sizeof(extent_pair) == sizeof(FILE_ALLOCATED_RANGE_BUFFER), "FILE_ALLOCATED_RANGE_BUFFER is not equivalent to pair<extent_type, extent_type>!");
+  const extent_type maxlength = (static_cast<extent_type>(1) << 63) - 1;  // See extents() for why
+  if(out.empty() || offset >= maxlength)
+  {
+    return span<extent_pair>(out.data(), 0);
+  }
+  FILE_ALLOCATED_RANGE_BUFFER farb{};
+  farb.FileOffset.QuadPart = offset;
+  farb.Length.QuadPart = maxlength - offset;
+  DWORD bytesout = 0;
+  OVERLAPPED ol{};
+  memset(&ol, 0, sizeof(ol));
+  ol.Internal = static_cast<ULONG_PTR>(-1);
+  if(DeviceIoControl(_v.h, FSCTL_QUERY_ALLOCATED_RANGES, &farb, sizeof(farb), out.data(), static_cast<DWORD>(out.size() * sizeof(FILE_ALLOCATED_RANGE_BUFFER)), &bytesout, &ol) == 0)
+  {
+    // ERROR_MORE_DATA means we filled the buffer, which is fine
+    if(ERROR_MORE_DATA != GetLastError() && ERROR_SUCCESS != GetLastError())
+    {
+      return win32_error();
+    }
+  }
+  size_t count = bytesout / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+  if(count > 0 && out[0].first < offset)
+  {
+    out[0].second -= offset - out[0].first;
+    out[0].first = offset;
+  }
+  return span<extent_pair>(out.data(), count);
+}
+
 result<file_handle::extent_type> file_handle::zero(file_handle::extent_type offset, file_handle::extent_type bytes, deadline /*unused*/) noexcept
 {
   windows_nt_kernel::init();
@@ -445,4 +523,156 @@ result<file_handle::extent_type> file_handle::zero(file_handle::extent_type offs
   return success();
 }
 
+result<file_handle::clone_extents_result> file_handle::clone_extents_to(file_handle &dest, file_handle::extent_type offset, file_handle::extent_type bytes, deadline d) noexcept
+{
+  windows_nt_kernel::init();
+  using namespace windows_nt_kernel;
+  LLFIO_LOG_FUNCTION_CALL(this);
+  clone_extents_result ret;
+  ret.offset = offset;
+  OUTCOME_TRY(mylength, maximum_extent());
+  if(offset >= mylength)
+  {
+    return ret;
+  }
+  if(bytes > mylength - offset)
+  {
+    bytes = mylength - offset;
+  }
+  const extent_type end = offset + bytes;
+  OUTCOME_TRY(destlength, dest.maximum_extent());
+  if(destlength < end)
+  {
+    OUTCOME_TRYV(dest.truncate(end));
+  }
+  LLFIO_WIN_DEADLINE_TO_SLEEP_INIT(d);
+  (void) timeout;
+  auto used_method = [&ret](clone_method m) {
+    if(static_cast<int>(m) > static_cast<int>(ret.method))
+    {
+      ret.method = m;
+    }
+  };
+  // Only ReFS implements this, and it is disabled on first failure indicating no support
+  bool try_reflink = _v.is_valid() && dest._v.is_valid() && !dest._v.is_append_only();
+  struct duplicate_extents_data
+  {
+    HANDLE FileHandle;
+    LARGE_INTEGER SourceFileOffset;
+    LARGE_INTEGER TargetFileOffset;
+    LARGE_INTEGER ByteCount;
+  };
+  byte *buffer = nullptr;
+  size_t blocksize = 0;
+  auto unbufferh = undoer([&buffer, &blocksize] {
+    if(buffer != nullptr)
+    {
+      utils::page_allocator<byte>().deallocate(buffer, blocksize);
+    }
+  });
+  (void) unbufferh;
+  extent_type pos = offset;  // Everything before this has been cloned
+  auto clone_hole = [&](extent_type holeend) -> result<void> {
+    // The extension of the destination above is already a hole, only its previous contents need deallocating
+    if(pos < destlength)
+    {
+      OUTCOME_TRYV(dest.zero(pos, std::min(holeend, destlength) - pos));
+    }
+    return success();
+  };
+  auto clone_data = [&](extent_type start, extent_type finish) -> result<void> {
+    while(start < finish)
+    {
+      LLFIO_WIN_DEADLINE_TO_TIMEOUT(d);
+      if(try_reflink)
+      {
+        duplicate_extents_data ded{};
+        ded.FileHandle = _v.h;
+        ded.SourceFileOffset.QuadPart = start;
+        ded.TargetFileOffset.QuadPart = start;
+        ded.ByteCount.QuadPart = finish - start;
+        DWORD bytesout = 0;
+        OVERLAPPED ol{};
+        memset(&ol, 0, sizeof(ol));
+        ol.Internal = static_cast<ULONG_PTR>(-1);
+        bool done = DeviceIoControl(dest._v.h, 0x00098344 /*FSCTL_DUPLICATE_EXTENTS_TO_FILE*/, &ded, sizeof(ded), nullptr, 0, &bytesout, &ol) != 0;
+        if(!done && ERROR_IO_PENDING == GetLastError())
+        {
+          NTSTATUS ntstat = ntwait(dest._v.h, ol, deadline());
+          done = (ntstat == 0);
+        }
+        if(done)
+        {
+          used_method(clone_method::reflink);
+          start = finish;
+          continue;
+        }
+        // ERROR_INVALID_PARAMETER usually means this extent is not cluster aligned, so keep trying for later extents
+        if(ERROR_INVALID_PARAMETER != GetLastError())
+        {
+          try_reflink = false;
+        }
+      }
+      if(buffer == nullptr)
+      {
+        try
+        {
+          blocksize = utils::file_buffer_default_size();
+          buffer = utils::page_allocator<byte>().allocate(blocksize);
+        }
+        catch(...)
+        {
+          return error_from_exception();
+        }
+      }
+      // Use the buffers returned, as the source may be memory mapped
+      buffer_type b{buffer, static_cast<size_type>(std::min(finish - start, static_cast<extent_type>(blocksize)))};
+      OUTCOME_TRY(filled, read(io_request<buffers_type>(buffers_type(&b, 1), start)));
+      if(filled.empty() || filled[0].size() == 0)
+      {
+        return success();
+      }
+      OUTCOME_TRY(written, dest.write(start, {{filled[0].data(), filled[0].size()}}));
+      if(0 == written)
+      {
+        return errc::io_error;
+      }
+      used_method(clone_method::buffered_copy);
+      start += written;
+    }
+    return success();
+  };
+  // Walk the extents a batch at a time rather than enumerating the whole file
+  extent_pair _exts[64];
+  for(extent_type from = offset; from < end;)
+  {
+    OUTCOME_TRY(exts, enumerate_extents(_exts, from));
+    for(const auto &ext : exts)
+    {
+      extent_type start = std::max(ext.first, offset), finish = std::min(ext.first + ext.second, end);
+      if(start >= finish)
+      {
+        continue;
+      }
+      if(start > pos)
+      {
+        OUTCOME_TRYV(clone_hole(start));
+      }
+      OUTCOME_TRYV(clone_data(start, finish));
+      pos = finish;
+    }
+    if(exts.size() < sizeof(_exts) / sizeof(_exts[0]))
+    {
+      break;
+    }
+    from = exts[exts.size() - 1].first + exts[exts.size() - 1].second;
+  }
+  if(end > pos)
+  {
+    OUTCOME_TRYV(clone_hole(end));
+  }
+  ret.length = bytes;
+  return ret;
+}
+
 LLFIO_V2_NAMESPACE_END
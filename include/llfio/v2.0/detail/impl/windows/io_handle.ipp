@@ -32,6 +32,26 @@ size_t io_handle::max_buffers() const noexcept
   return 1;  // async_file_handle may override this virtual function
 }
 
+result<span<io_handle::range_request>> io_handle::read_cached(span<io_handle::range_request> reqs, span<io_handle::range_request> misses) noexcept
+{
+  LLFIO_LOG_FUNCTION_CALL(this);
+  if(misses.size() < reqs.size())
+  {
+    return errc::invalid_argument;
+  }
+  // Windows has no way of reading only from the cache, so everything is a miss
+  size_t missed = 0;
+  for(auto &req : reqs)
+  {
+    if(req.second.size() > 0)
+    {
+      misses[missed++] = req;
+    }
+    req.second = buffer_type(req.second.data(), 0);
+  }
+  return span<range_request>(misses.data(), missed);
+}
+
 template <class BuffersType, class Syscall> inline io_handle::io_result<BuffersType> do_read_write(const native_handle_type &nativeh, Syscall &&syscall, io_handle::io_request<BuffersType> reqs, deadline d) noexcept
 {
   if(d && !nativeh.is_overlapped())
@@ -27,6 +27,8 @@ Distributed under the Boost Software License, Version 1.0.
 #include "../../../quickcpplib/include/spinlock.hpp"
 #include "import.hpp"
 
+#include <thread>  // for yield()
+
 LLFIO_V2_NAMESPACE_BEGIN
 
 namespace utils
@@ -197,6 +199,65 @@ namespace utils
     return success();
   }
 
+  void wait_on_shared_address(const std::atomic<uint32_t> * /*unused*/, uint32_t /*unused*/, std::chrono::nanoseconds /*unused*/) noexcept
+  {
+    // WaitOnAddress() only works within a single process
+    std::this_thread::yield();
+  }
+
+  void wake_shared_address(const std::atomic<uint32_t> * /*unused*/) noexcept {}
+
+  namespace detail
+  {
+    // Returns the creation time in milliseconds of the process, or zero if it is not running
+    inline uint64_t process_start_time(HANDLE h) noexcept
+    {
+      DWORD exitcode = 0;
+      if(GetExitCodeProcess(h, &exitcode) == 0 || exitcode != STILL_ACTIVE)
+      {
+        return 0;
+      }
+      FILETIME creation{}, exit{}, kernel{}, user{};
+      if(GetProcessTimes(h, &creation, &exit, &kernel, &user) == 0)
+      {
+        return 0;
+      }
+      // Never return zero for a running process
+      return ((static_cast<uint64_t>(creation.dwHighDateTime) << 32U) | creation.dwLowDateTime) / 10000U | (1ULL << 63U);
+    }
+  }  // namespace detail
+
+  uint64_t current_process_identity() noexcept
+  {
+    static std::atomic<uint64_t> cached{0};
+    uint64_t ret = cached.load(std::memory_order_relaxed);
+    if(ret == 0)
+    {
+      ret = (static_cast<uint64_t>(GetCurrentProcessId()) << 32U) | static_cast<uint32_t>(detail::process_start_time(GetCurrentProcess()));
+      cached.store(ret, std::memory_order_relaxed);
+    }
+    return ret;
+  }
+
+  uint64_t current_process_namespace() noexcept { return 1; }
+
+  bool process_identity_is_running(uint64_t identity, uint64_t pid_namespace) noexcept
+  {
+    if(pid_namespace != current_process_namespace())
+    {
+      return true;
+    }
+    HANDLE h = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, static_cast<DWORD>(identity >> 32U));
+    if(h == nullptr)
+    {
+      // ERROR_INVALID_PARAMETER means no such process, anything else we can't tell
+      return GetLastError() != ERROR_INVALID_PARAMETER;
+    }
+    auto unh = undoer([&h] { CloseHandle(h); });
+    const uint64_t start_time = detail::process_start_time(h);
+    return start_time != 0 && static_cast<uint32_t>(start_time) == static_cast<uint32_t>(identity);
+  }
+
   namespace detail
   {
     large_page_allocation allocate_large_pages(size_t bytes)
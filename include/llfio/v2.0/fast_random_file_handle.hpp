@@ -85,6 +85,7 @@ public:
   using dev_t = file_handle::dev_t;
   using ino_t = file_handle::ino_t;
   using path_view_type = file_handle::path_view_type;
+  using extent_pair = file_handle::extent_pair;
   using path_type = io_handle::path_type;
   using extent_type = io_handle::extent_type;
   using size_type = io_handle::size_type;
@@ -216,6 +217,37 @@ public:
     return _length;
   }
 
+  /*! \brief Change the maximum extent of the random file as if storage were allocated, removed or inserted.
+  */
+  LLFIO_MAKE_FREE_FUNCTION
+  LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<extent_type> allocate(extent_type offset, extent_type bytes, allocation how = allocation::extend) noexcept override
+  {
+    OUTCOME_TRY(_perms_check());
+    switch(how)
+    {
+    case allocation::extend:
+      _length = std::max(_length, offset + bytes);
+      break;
+    case allocation::keep_size:
+      break;
+    case allocation::collapse_range:
+      if(offset + bytes >= _length)
+      {
+        return errc::invalid_argument;
+      }
+      _length -= bytes;
+      break;
+    case allocation::insert_range:
+      if(offset >= _length)
+      {
+        return errc::invalid_argument;
+      }
+      _length += bytes;
+      break;
+    }
+    return bytes;
+  }
+
   //! \brief Zero a portion of the random file (does nothing).
   LLFIO_MAKE_FREE_FUNCTION
   LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<extent_type> zero(extent_type /*unused*/, extent_type bytes, deadline /*unused*/ = deadline()) noexcept override
@@ -227,6 +259,17 @@ public:
   //! \brief Return a single extent of the maximum extent
   LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<std::vector<std::pair<extent_type, extent_type>>> extents() const noexcept override { return std::vector<std::pair<extent_type, extent_type>>{{0, _length}}; }
 
+  //! \brief Return a single extent from the offset to the maximum extent
+  LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<span<extent_pair>> enumerate_extents(span<extent_pair> out, extent_type offset = 0) const noexcept override
+  {
+    if(out.empty() || offset >= _length)
+    {
+      return span<extent_pair>(out.data(), 0);
+    }
+    out[0] = extent_pair(offset, _length - offset);
+    return span<extent_pair>(out.data(), 1);
+  }
+
 
   using file_handle::read;
   using file_handle::write;
@@ -245,6 +288,17 @@ public:
   */
   LLFIO_MAKE_FREE_FUNCTION
   LLFIO_HEADERS_ONLY_VIRTUAL_SPEC io_result<buffers_type> read(io_request<buffers_type> reqs, deadline d = deadline()) noexcept override;
+  /*! \brief Read many ranges from the random file, never reporting any as missing.
+  */
+  LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<span<range_request>> read_cached(span<range_request> reqs, span<range_request> misses) noexcept override
+  {
+    for(auto &req : reqs)
+    {
+      OUTCOME_TRY(filled, read(io_request<buffers_type>(buffers_type(&req.second, 1), req.first)));
+      req.second = filled.empty() ? buffer_type(req.second.data(), 0) : filled[0];
+    }
+    return span<range_request>(misses.data(), 0);
+  }
 
   /*! \brief Fails to write to the random file.
 
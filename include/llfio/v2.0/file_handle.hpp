@@ -73,6 +73,44 @@ public:
   using dev_t = fs_handle::dev_t;
   using ino_t = fs_handle::ino_t;
   using path_view_type = fs_handle::path_view_type;
+  //! An extent offset and extent length pair
+  using extent_pair = std::pair<extent_type, extent_type>;
+
+  //! How `allocate()` should change the storage allocated to a file.
+  enum class allocation
+  {
+    extend,          //!< Allocate storage for the range, extending the maximum extent if the range ends beyond it.
+    keep_size,       //!< Allocate storage for the range without changing the maximum extent (`FALLOC_FL_KEEP_SIZE`).
+    collapse_range,  //!< Remove the range from the file, moving all data after it down (`FALLOC_FL_COLLAPSE_RANGE`).
+    insert_range     //!< Insert a hole the size of the range at its offset, moving all data at and after it up (`FALLOC_FL_INSERT_RANGE`).
+  };
+  //! The expected lifetime of data written, used by some storage devices to group data with similar lifetimes.
+  enum class write_lifetime
+  {
+    not_set = 0,    //!< No hint has been set (`RWH_WRITE_LIFE_NOT_SET`).
+    none,           //!< No particular lifetime is expected (`RWH_WRITE_LIFE_NONE`).
+    short_lived,    //!< Data is expected to be overwritten soon (`RWH_WRITE_LIFE_SHORT`).
+    medium_lived,   //!< Data is expected to be overwritten after the short lived data (`RWH_WRITE_LIFE_MEDIUM`).
+    long_lived,     //!< Data is expected to be overwritten after the medium lived data (`RWH_WRITE_LIFE_LONG`).
+    extreme_lived   //!< Data is expected to be rarely if ever overwritten (`RWH_WRITE_LIFE_EXTREME`).
+  };
+
+  //! The facility used by `clone_extents_to()` to duplicate extents, in order of decreasing efficiency.
+  enum class clone_method
+  {
+    none = 0,       //!< Nothing needed to be copied (e.g. the range contained only holes).
+    reflink,        //!< Extents were shared copy-on-write between source and destination (`FICLONERANGE`, `FSCTL_DUPLICATE_EXTENTS_TO_FILE`).
+    kernel_copy,    //!< The kernel copied the data without it entering this process (`copy_file_range()`).
+    kernel_splice,  //!< The kernel spliced the data between the two files (`sendfile()`).
+    buffered_copy   //!< The data was read into and written from page aligned buffers by this process.
+  };
+  //! The outcome of a `clone_extents_to()`
+  struct clone_extents_result
+  {
+    extent_type offset{0};                    //!< The offset of the range cloned.
+    extent_type length{0};                    //!< The bytes of the range cloned, including any holes preserved.
+    clone_method method{clone_method::none};  //!< The least efficient method needed to clone any extent in the range.
+  };
 
 protected:
   io_service *_service{nullptr};
@@ -272,6 +310,55 @@ public:
   LLFIO_MAKE_FREE_FUNCTION
   LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<extent_type> truncate(extent_type newsize) noexcept;
 
+  /*! \brief Change the physical storage allocated to a range of the file.
+
+  Unlike `truncate()`, which avoids allocating physical storage where possible, this call
+  ensures storage is allocated up front, so later writes into the range cannot fail due to lack of
+  free space, and the filing system can lay out the range contiguously rather than fragmenting it
+  as writes arrive. It can also remove or insert ranges in the middle of a file without copying data.
+
+  On Linux this calls `fallocate()`. On other POSIX, only `allocation::extend` and `allocation::keep_size`
+  are supported, via `posix_fallocate()` or `F_PREALLOCATE`. On Windows, only `allocation::extend` and
+  `allocation::keep_size` are supported, and storage is always allocated from the beginning of the file
+  as NTFS has no notion of allocating a range.
+
+  \note `allocation::collapse_range` and `allocation::insert_range` usually require `offset` and `bytes`
+  to be multiples of the filing system block size, and are only supported by some filing systems (ext4, XFS).
+
+  \return The bytes allocated, removed or inserted.
+  \param offset The offset of the range.
+  \param bytes The number of bytes in the range.
+  \param how How to change the allocation.
+  \errors Any of the values POSIX fallocate() or SetFileInformationByHandle() can return, `errc::operation_not_supported`
+  if the kernel or filing system does not implement `how`.
+  \mallocs None.
+  */
+  LLFIO_MAKE_FREE_FUNCTION
+  LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<extent_type> allocate(extent_type offset, extent_type bytes, allocation how = allocation::extend) noexcept;
+
+  /*! \brief Hint to the storage device the expected lifetime of data written through this handle.
+
+  NVMe devices supporting streams use this to place data with similar lifetimes into the same erase
+  blocks, reducing write amplification and garbage collection. This is `F_SET_FILE_RW_HINT` on Linux,
+  which applies to this open handle only. If the kernel does not support per handle hints, or
+  `whole_inode` is true, `F_SET_RW_HINT` is used instead, which applies to all writes to the inode.
+  There is no portable way to hint individual writes: use a separate handle per lifetime instead.
+
+  \param hint The expected lifetime of data written.
+  \param whole_inode Apply the hint to all handles open on this inode.
+  \errors Any of the values POSIX fcntl() can return, `errc::operation_not_supported` on platforms
+  other than Linux.
+  \mallocs None.
+  */
+  LLFIO_HEADERS_ONLY_MEMFUNC_SPEC result<void> set_write_lifetime_hint(write_lifetime hint, bool whole_inode = false) noexcept;
+  /*! \brief Return the lifetime hint in effect for data written through this handle, or for the inode if `whole_inode` is true.
+
+  \errors Any of the values POSIX fcntl() can return, `errc::operation_not_supported` on platforms
+  other than Linux.
+  \mallocs None.
+  */
+  LLFIO_HEADERS_ONLY_MEMFUNC_SPEC result<write_lifetime> write_lifetime_hint(bool whole_inode = false) const noexcept;
+
   /*! \brief Returns a list of currently valid extents for this open file. WARNING: racy!
   \return A vector of pairs of extent offset + extent length representing the valid extents
   in this file. Filing systems which do not support extents return a single extent matching
@@ -280,6 +367,28 @@ public:
   LLFIO_MAKE_FREE_FUNCTION
   LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<std::vector<std::pair<extent_type, extent_type>>> extents() const noexcept;
 
+  /*! \brief Fills a caller supplied buffer with the valid extents at or after an offset. WARNING: racy!
+
+  Unlike `extents()`, this does not enumerate the whole file at once, so the layout of very
+  large sparse files can be walked incrementally without any memory allocation. To resume
+  enumeration, call again with `offset` set to the end of the last extent returned. An extent
+  straddling `offset` is returned clipped to begin at `offset`.
+
+  This uses `SEEK_DATA`/`SEEK_HOLE` on POSIX and `FSCTL_QUERY_ALLOCATED_RANGES` on Windows.
+  Filing systems which do not support extents return a single extent from `offset` to the
+  length of the file.
+
+  \return The front of `out` filled with extents in ascending order. If this is shorter than
+  `out`, there are no more extents after those returned. It is empty if there are no extents at or
+  after `offset`.
+  \param out The buffer to fill with extent offset + extent length pairs.
+  \param offset The offset from which to begin enumerating.
+  \errors Any of the values POSIX lseek() or DeviceIoControl() can return.
+  \mallocs None.
+  */
+  LLFIO_MAKE_FREE_FUNCTION
+  LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<span<extent_pair>> enumerate_extents(span<extent_pair> out, extent_type offset = 0) const noexcept;
+
   /*! \brief Efficiently zero, and possibly deallocate, data on storage.
 
   On most major operating systems and with recent filing systems which are "extents based", one can
@@ -301,6 +410,86 @@ public:
   */
   LLFIO_MAKE_FREE_FUNCTION
   LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<extent_type> zero(extent_type offset, extent_type bytes, deadline d = deadline()) noexcept;
+
+  /*! \brief Efficiently zero, and possibly deallocate, many extents of data on storage.
+
+  The extents are sorted and any overlapping or adjacent extents are coalesced in place, so
+  that the minimum number of calls to `zero()` is made, each issued in ascending offset order.
+
+  \return The bytes zeroed, which may be fewer than the sum of the input extents if any overlapped.
+  \param holes The extents to zero. These are reordered and modified.
+  \param d An optional deadline by which the i/o must complete, else it is cancelled.
+  Note function may return significantly after this deadline if the i/o takes long to cancel.
+  \errors Any of the values `zero()` can return.
+  \mallocs None, apart from any performed by `zero()`.
+  */
+  LLFIO_MAKE_FREE_FUNCTION
+  result<extent_type> punch_holes(span<extent_pair> holes, deadline d = deadline()) noexcept
+  {
+    LLFIO_LOG_FUNCTION_CALL(this);
+    if(holes.empty())
+    {
+      return 0;
+    }
+    std::sort(holes.begin(), holes.end());
+    // Coalesce overlapping and adjacent holes into the front of the span
+    size_t count = 0;
+    for(size_t n = 1; n < holes.size(); n++)
+    {
+      extent_pair &last = holes[count];
+      if(holes[n].first <= last.first + last.second)
+      {
+        extent_type end = std::max(last.first + last.second, holes[n].first + holes[n].second);
+        last.second = end - last.first;
+      }
+      else
+      {
+        holes[++count] = holes[n];
+      }
+    }
+    extent_type ret = 0;
+    for(size_t n = 0; n <= count; n++)
+    {
+      if(holes[n].second > 0)
+      {
+        OUTCOME_TRY(zeroed, zero(holes[n].first, holes[n].second, d));
+        ret += zeroed;
+      }
+    }
+    return ret;
+  }
+
+  /*! \brief Efficiently clone the valid extents of a range of this file into the same range of another file.
+
+  The destination is extended to cover the range if it is shorter. Each valid extent within the
+  range (see `extents()`) is then duplicated using the most efficient facility available, tried in this order:
+
+  1. Copy-on-write sharing of the extent (reflink), which is near instant and consumes no extra storage.
+  This is `FICLONERANGE` on Linux (btrfs, XFS, OCFS2) and `FSCTL_DUPLICATE_EXTENTS_TO_FILE` on
+  Windows (ReFS). It usually requires the extent to be aligned to the filing system block size.
+  2. `copy_file_range()` on Linux, which has the kernel copy the data, possibly server-side on NFS v4.2 and CIFS.
+  3. `sendfile()` on Linux, which splices the data through the page cache.
+  4. A copy by this process through page aligned buffers of `utils::file_buffer_default_size()`.
+
+  Holes in the source range are preserved in the destination: if the destination previously
+  had data there, it is deallocated using `zero()`.
+
+  \warning This call is racy with respect to concurrent modification of either file's extents.
+  On Linux, the `sendfile()` path moves the destination's file pointer, which is not used by
+  LLFIO's own i/o.
+
+  \return The range cloned and the least efficient method which was needed to clone it.
+  \param dest The file handle to clone extents into. It must be writable.
+  \param offset The offset to start cloning from. The same offset is used in the destination.
+  \param bytes The number of bytes to clone. Anything past the maximum extent of this file is ignored.
+  \param d An optional deadline by which the clone must complete, else it fails with `errc::timed_out`.
+  The deadline is checked between extents and copy chunks, so it may be significantly exceeded.
+  \errors Any of the values POSIX `copy_file_range()`, `sendfile()`, `read()` and `write()`, or
+  Windows `DeviceIoControl()`, can return.
+  \mallocs One page allocation if a buffered copy is needed.
+  */
+  LLFIO_MAKE_FREE_FUNCTION
+  LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<clone_extents_result> clone_extents_to(file_handle &dest, extent_type offset = 0, extent_type bytes = static_cast<extent_type>(-1), deadline d = deadline()) noexcept;
 };
 
 //! \brief Constructor for `file_handle`
@@ -408,12 +597,42 @@ inline result<file_handle::extent_type> truncate(file_handle &self, file_handle:
 {
   return self.truncate(std::forward<decltype(newsize)>(newsize));
 }
+/*! \brief Change the physical storage allocated to a range of the file.
+
+\return The bytes allocated, removed or inserted.
+\param self The object whose member function to call.
+\param offset The offset of the range.
+\param bytes The number of bytes in the range.
+\param how How to change the allocation.
+\errors Any of the values POSIX fallocate() or SetFileInformationByHandle() can return, `errc::operation_not_supported`
+if the kernel or filing system does not implement `how`.
+\mallocs None.
+*/
+inline result<file_handle::extent_type> allocate(file_handle &self, file_handle::extent_type offset, file_handle::extent_type bytes, file_handle::allocation how = file_handle::allocation::extend) noexcept
+{
+  return self.allocate(std::forward<decltype(offset)>(offset), std::forward<decltype(bytes)>(bytes), std::forward<decltype(how)>(how));
+}
 /*! \brief Returns a list of currently valid extents for this open file. WARNING: racy!
 */
 inline result<std::vector<std::pair<file_handle::extent_type, file_handle::extent_type>>> extents(const file_handle &self) noexcept
 {
   return self.extents();
 }
+/*! \brief Fills a caller supplied buffer with the valid extents at or after an offset. WARNING: racy!
+
+\return The front of `out` filled with extents in ascending order. If this is shorter than
+`out`, there are no more extents after those returned. It is empty if there are no extents at or
+after `offset`.
+\param self The object whose member function to call.
+\param out The buffer to fill with extent offset + extent length pairs.
+\param offset The offset from which to begin enumerating.
+\errors Any of the values POSIX lseek() or DeviceIoControl() can return.
+\mallocs None.
+*/
+inline result<span<file_handle::extent_pair>> enumerate_extents(const file_handle &self, span<file_handle::extent_pair> out, file_handle::extent_type offset = 0) noexcept
+{
+  return self.enumerate_extents(std::forward<decltype(out)>(out), std::forward<decltype(offset)>(offset));
+}
 /*! \brief Efficiently zero, and possibly deallocate, data on storage.
 
 On most major operating systems and with recent filing systems which are "extents based", one can
@@ -438,6 +657,37 @@ inline result<file_handle::extent_type> zero(file_handle &self, file_handle::ext
 {
   return self.zero(std::forward<decltype(offset)>(offset), std::forward<decltype(bytes)>(bytes), std::forward<decltype(d)>(d));
 }
+/*! \brief Efficiently zero, and possibly deallocate, many extents of data on storage.
+
+\return The bytes zeroed, which may be fewer than the sum of the input extents if any overlapped.
+\param self The object whose member function to call.
+\param holes The extents to zero. These are reordered and modified.
+\param d An optional deadline by which the i/o must complete, else it is cancelled.
+Note function may return significantly after this deadline if the i/o takes long to cancel.
+\errors Any of the values `zero()` can return.
+\mallocs None, apart from any performed by `zero()`.
+*/
+inline result<file_handle::extent_type> punch_holes(file_handle &self, span<file_handle::extent_pair> holes, deadline d = deadline()) noexcept
+{
+  return self.punch_holes(std::forward<decltype(holes)>(holes), std::forward<decltype(d)>(d));
+}
+/*! \brief Efficiently clone the valid extents of a range of this file into the same range of another file.
+
+\return The range cloned and the least efficient method which was needed to clone it.
+\param self The object whose member function to call.
+\param dest The file handle to clone extents into. It must be writable.
+\param offset The offset to start cloning from. The same offset is used in the destination.
+\param bytes The number of bytes to clone. Anything past the maximum extent of this file is ignored.
+\param d An optional deadline by which the clone must complete, else it fails with `errc::timed_out`.
+The deadline is checked between extents and copy chunks, so it may be significantly exceeded.
+\errors Any of the values POSIX `copy_file_range()`, `sendfile()`, `read()` and `write()`, or
+Windows `DeviceIoControl()`, can return.
+\mallocs One page allocation if a buffered copy is needed.
+*/
+inline result<file_handle::clone_extents_result> clone_extents_to(file_handle &self, file_handle &dest, file_handle::extent_type offset = 0, file_handle::extent_type bytes = static_cast<file_handle::extent_type>(-1), deadline d = deadline()) noexcept
+{
+  return self.clone_extents_to(std::forward<decltype(dest)>(dest), std::forward<decltype(offset)>(offset), std::forward<decltype(bytes)>(bytes), std::forward<decltype(d)>(d));
+}
 // END make_free_functions.py
 
 LLFIO_V2_NAMESPACE_END
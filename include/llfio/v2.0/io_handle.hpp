@@ -174,6 +174,8 @@ public:
   // static_assert(std::is_trivially_move_assignable<buffers_type>::value, "buffers_type is not trivially move assignable!");
   static_assert(std::is_standard_layout<buffers_type>::value, "buffers_type is not a standard layout type!");
 #endif
+  //! An offset and the buffer to read into from it, as used by `read_ranges()`.
+  using range_request = std::pair<extent_type, buffer_type>;
   //! The i/o request type used by this handle. Guaranteed to be `TrivialType` apart from construction, and `StandardLayoutType`.
   template <class T> struct io_request
   {
@@ -313,6 +315,121 @@ public:
   LLFIO_MAKE_FREE_FUNCTION
   LLFIO_HEADERS_ONLY_VIRTUAL_SPEC io_result<buffers_type> read(io_request<buffers_type> reqs, deadline d = deadline()) noexcept;
 
+  /*! \brief Read many possibly discontiguous ranges from the open handle, using as few i/o operations as possible.
+
+  The ranges are sorted by offset, and each run of ranges where one range ends at the offset
+  where the next begins is read using a single scatter `read()` of up to `max_buffers()` buffers.
+  Point lookups of records stored next to one another therefore cost one syscall per run,
+  not one syscall per record. A run which `read()` fills only partly is continued from where it
+  stopped, so a range is only returned short if it extends past the end of the file.
+
+  \warning As with `read()`, **very** different buffers may be returned than you supplied.
+  The buffer of each range is updated with the buffer returned by `read()`.
+
+  \return The ranges, sorted by offset, with the buffer of each updated with the bytes read into it.
+  \param reqs The offsets and buffers to read. These are reordered and modified.
+  \param d An optional deadline by which the i/o must complete, else it is cancelled. This is applied
+  to each `read()` issued, so the total may significantly exceed it.
+  \errors Any of the values `read()` can return.
+  \mallocs None, apart from any performed by `read()`.
+  */
+  LLFIO_MAKE_FREE_FUNCTION
+  result<span<range_request>> read_ranges(span<range_request> reqs, deadline d = deadline()) noexcept
+  {
+    LLFIO_LOG_FUNCTION_CALL(this);
+    const size_t maxbuffers = std::min(reqs.size(), max_buffers());
+    if(maxbuffers == 0)
+    {
+      return reqs;
+    }
+    std::sort(reqs.begin(), reqs.end(), [](const range_request &a, const range_request &b) { return a.first < b.first; });
+    auto *buffers = reinterpret_cast<buffer_type *>(alloca(sizeof(buffer_type) * maxbuffers));
+    for(size_t n = 0; n < reqs.size();)
+    {
+      // Gather the run of ranges which follow on from one another
+      size_t count = 0;
+      extent_type end = reqs[n].first;
+      while(n + count < reqs.size() && count < maxbuffers && reqs[n + count].first == end)
+      {
+        buffers[count] = reqs[n + count].second;
+        end += reqs[n + count].second.size();
+        ++count;
+      }
+      // A short read is continued from where it stopped, so ranges are only short at the end of the file
+      extent_type offset = reqs[n].first;
+      size_t first = 0, partial = 0;  // the range being read into, and the bytes of it already read
+      while(first < count)
+      {
+        OUTCOME_TRY(filled, read(io_request<buffers_type>(buffers_type(buffers + first, count - first), offset), d));
+        size_t transferred = 0, next = first + filled.size(), nextpartial = 0, got = 0;
+        bool inplace = true;
+        for(size_t i = 0; i < filled.size() && first + i < count; i++)
+        {
+          got = filled[i].size();
+          transferred += got;
+          if(i == 0 && partial != 0)
+          {
+            reqs[n + first].second = buffer_type(reqs[n + first].second.data(), partial + got);
+          }
+          else
+          {
+            reqs[n + first + i].second = filled[i];
+          }
+          if(got < buffers[first + i].size())
+          {
+            next = first + i;
+            nextpartial = ((i == 0) ? partial : 0) + got;
+            inplace = (filled[i].data() == buffers[first + i].data());
+            break;
+          }
+          got = 0;
+        }
+        if(next >= count)
+        {
+          break;
+        }
+        if(transferred == 0 || !inplace)
+        {
+          // At the end of the file, so nothing more can be read
+          reqs[n + next].second = buffer_type(reqs[n + next].second.data(), nextpartial);
+          for(size_t i = next + 1; i < count; i++)
+          {
+            reqs[n + i].second = buffer_type(reqs[n + i].second.data(), 0);
+          }
+          break;
+        }
+        buffers[next] = buffer_type(buffers[next].data() + got, buffers[next].size() - got);
+        offset += transferred;
+        first = next;
+        partial = nextpartial;
+      }
+      n += count;
+    }
+    return reqs;
+  }
+
+  /*! \brief Read many ranges from the open handle, but only what can be read without blocking on storage,
+  reporting the ranges which could not be read.
+
+  This lets a thread serve hot data inline and hand only the missing ranges to an `async_file_handle`,
+  or to `read_ranges()` on another thread. The misses are themselves range requests pointing into the
+  unfilled remainder of the buffers supplied, so they can be submitted for reading as is.
+
+  On Linux 4.14 and later this uses `preadv2(RWF_NOWAIT)` to read only what is in the page cache. Note
+  that a range is reported as missing from the first byte not in cache, even if later parts of it are
+  cached. Handles which require aligned i/o never read from the page cache, so everything is reported
+  as missing for those, as it is on platforms without the facility. `mapped_file_handle` and
+  `fast_random_file_handle` read everything, and never report misses.
+
+  \return The front of `misses` filled with the ranges which could not be read, in the order of `reqs`.
+  \param reqs The offsets and buffers to read. The buffer of each is updated with the bytes read into it.
+  \param misses Where to write the ranges which could not be read. This must be at least as long as `reqs`.
+  \errors Any of the values POSIX preadv2() can return, `errc::invalid_argument` if `misses` is too short.
+  \mallocs None.
+  */
+  LLFIO_MAKE_FREE_FUNCTION
+  LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<span<range_request>> read_cached(span<range_request> reqs, span<range_request> misses) noexcept;
+
   /*! \brief Write data to the open handle.
 
   \warning Depending on the implementation backend, not all of the buffers input may be written and
@@ -564,6 +681,34 @@ inline io_handle::io_result<io_handle::buffers_type> read(io_handle &self, io_ha
 {
   return self.read(std::forward<decltype(reqs)>(reqs), std::forward<decltype(d)>(d));
 }
+/*! \brief Read many possibly discontiguous ranges from the open handle, using as few i/o operations as possible.
+
+\return The ranges, sorted by offset, with the buffer of each updated with the bytes read into it.
+\param self The object whose member function to call.
+\param reqs The offsets and buffers to read. These are reordered and modified.
+\param d An optional deadline by which the i/o must complete, else it is cancelled. This is applied
+to each `read()` issued, so the total may significantly exceed it.
+\errors Any of the values `read()` can return.
+\mallocs None, apart from any performed by `read()`.
+*/
+inline result<span<io_handle::range_request>> read_ranges(io_handle &self, span<io_handle::range_request> reqs, deadline d = deadline()) noexcept
+{
+  return self.read_ranges(std::forward<decltype(reqs)>(reqs), std::forward<decltype(d)>(d));
+}
+/*! \brief Read many ranges from the open handle, but only what can be read without blocking on storage,
+reporting the ranges which could not be read.
+
+\return The front of `misses` filled with the ranges which could not be read, in the order of `reqs`.
+\param self The object whose member function to call.
+\param reqs The offsets and buffers to read. The buffer of each is updated with the bytes read into it.
+\param misses Where to write the ranges which could not be read. This must be at least as long as `reqs`.
+\errors Any of the values POSIX preadv2() can return, `errc::invalid_argument` if `misses` is too short.
+\mallocs None.
+*/
+inline result<span<io_handle::range_request>> read_cached(io_handle &self, span<io_handle::range_request> reqs, span<io_handle::range_request> misses) noexcept
+{
+  return self.read_cached(std::forward<decltype(reqs)>(reqs), std::forward<decltype(misses)>(misses));
+}
 /*! \brief Write data to the open handle.
 
 \warning Depending on the implementation backend, not all of the buffers input may be written and
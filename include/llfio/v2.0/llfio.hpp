@@ -78,6 +78,9 @@ import LLFIO_MODULE_NAME;
 
 #include "algorithm/handle_adapter/cached_parent.hpp"
 #include "algorithm/handle_adapter/xor.hpp"
+#ifndef LLFIO_LEAN_AND_MEAN
+#include "algorithm/shared_fs_mutex/async_lock.hpp"
+#endif
 #include "algorithm/shared_fs_mutex/atomic_append.hpp"
 #include "algorithm/shared_fs_mutex/byte_ranges.hpp"
 #include "algorithm/shared_fs_mutex/lock_files.hpp"
@@ -358,6 +358,33 @@ public:
   */
   LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<extent_type> truncate(extent_type newsize) noexcept override;
 
+  /*! \brief Change the physical storage allocated to a range of the mapped file, mapping or unmapping
+  any pages up to the reservation to reflect any change in the maximum extent. If the new maximum extent
+  exceeds the reservation, `reserve()` will be called to increase the reservation.
+
+  \return The bytes allocated, removed or inserted.
+  \param offset The offset of the range.
+  \param bytes The number of bytes in the range.
+  \param how How to change the allocation.
+  */
+  LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<extent_type> allocate(extent_type offset, extent_type bytes, allocation how = allocation::extend) noexcept override
+  {
+    OUTCOME_TRY(ret, file_handle::allocate(offset, bytes, how));
+    if(how != allocation::keep_size)
+    {
+      OUTCOME_TRY(length, underlying_file_maximum_extent());
+      if(length > _reservation)
+      {
+        OUTCOME_TRYV(reserve(length));
+      }
+      else
+      {
+        OUTCOME_TRYV(update_map());
+      }
+    }
+    return ret;
+  }
+
   /*! \brief Efficiently update the mapping to match that of the underlying file,
   returning the size of the underlying file.
 
@@ -390,6 +417,20 @@ public:
   \mallocs None.
   */
   LLFIO_HEADERS_ONLY_VIRTUAL_SPEC io_result<buffers_type> read(io_request<buffers_type> reqs, deadline d = deadline()) noexcept override { return _mh.read(reqs, d); }
+  /*! \brief Read many ranges from the mapped file, never reporting any as missing.
+
+  As mapped data is always directly accessible, this is equivalent to calling `read()` for each range.
+  Note that accessing mapped pages not resident in memory will still block on storage.
+  */
+  LLFIO_HEADERS_ONLY_VIRTUAL_SPEC result<span<range_request>> read_cached(span<range_request> reqs, span<range_request> misses) noexcept override
+  {
+    for(auto &req : reqs)
+    {
+      OUTCOME_TRY(filled, read(io_request<buffers_type>(buffers_type(&req.second, 1), req.first)));
+      req.second = filled.empty() ? buffer_type(req.second.data(), 0) : filled[0];
+    }
+    return span<range_request>(misses.data(), 0);
+  }
   /*! \brief Write data to the mapped file.
 
   \note This call traps signals and structured exception throws using `QUICKCPPLIB_NAMESPACE::signal_guard`.
@@ -32,6 +32,9 @@ Distributed under the Boost Software License, Version 1.0.
 
 #include "quickcpplib/include/algorithm/string.hpp"
 
+#include <atomic>
+#include <chrono>
+
 //! \file utils.hpp Provides namespace utils
 
 LLFIO_V2_NAMESPACE_EXPORT_BEGIN
@@ -159,6 +162,47 @@ namespace utils
   LLFIO_HEADERS_ONLY_FUNC_SPEC bool running_under_wsl() noexcept;
 #endif
 
+  /*! \brief Sleeps the calling thread until another thread or process calls `wake_shared_address()` on
+  \em addr, \em timeout elapses, or a spurious wakeup occurs. Returns immediately if `*addr != expected`.
+
+  \em addr may live in memory mapped shared between processes. On Linux this is a `FUTEX_WAIT` on
+  the shared mapping. On other platforms there is currently no cross process address wait facility
+  in use, so this simply yields the calling thread's timeslice.
+  */
+  LLFIO_HEADERS_ONLY_FUNC_SPEC void wait_on_shared_address(const std::atomic<uint32_t> *addr, uint32_t expected, std::chrono::nanoseconds timeout) noexcept;
+
+  /*! \brief Wakes all threads in all processes sleeping in `wait_on_shared_address()` on \em addr.
+  */
+  LLFIO_HEADERS_ONLY_FUNC_SPEC void wake_shared_address(const std::atomic<uint32_t> *addr) noexcept;
+
+  /*! \brief Returns a non-zero value identifying the calling process which, unlike its process id,
+  is not reused by the system in practice.
+
+  The top 32 bits are the process id, the bottom 32 bits are derived from the start time of the
+  process where the platform provides it (Linux, Microsoft Windows). Suitable for recording in memory
+  shared between processes, along with `current_process_namespace()`, so others can determine if the
+  recording process has died. A forked child has its own identity.
+  */
+  LLFIO_HEADERS_ONLY_FUNC_SPEC uint64_t current_process_identity() noexcept;
+
+  /*! \brief Returns a value identifying the PID namespace of the calling process, within which its
+  `current_process_identity()` is meaningful, or zero if it cannot be determined.
+
+  On Linux this is the inode of `/proc/self/ns/pid`. Other platforms have a single namespace.
+  */
+  LLFIO_HEADERS_ONLY_FUNC_SPEC uint64_t current_process_namespace() noexcept;
+
+  /*! \brief Returns false if the process identified by \em identity and \em pid_namespace, which were
+  returned by `current_process_identity()` and `current_process_namespace()` in that process, has
+  definitely exited. Returns true if it is still running, or if this cannot be determined.
+
+  If the start time of the process is available on this platform, a process id which has been reused
+  by a different process is correctly reported as exited. Zombie processes are reported as exited.
+  A process whose PID namespace is not exactly that of the caller, or is unknown, is always reported
+  as running.
+  */
+  LLFIO_HEADERS_ONLY_FUNC_SPEC bool process_identity_is_running(uint64_t identity, uint64_t pid_namespace) noexcept;
+
   namespace detail
   {
     struct large_page_allocation
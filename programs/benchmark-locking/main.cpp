@@ -35,6 +35,7 @@ Distributed under the Boost Software License, Version 1.0.
 
 #include <fstream>
 #include <iostream>
+#include <string>
 #include <vector>
 
 #ifdef _WIN32
@@ -97,12 +98,25 @@ static void child_unlocks(size_t id)
   }
   *shared_memory = (size_t) -1;
 }
+static void child_reads()
+{
+  size_t current = *shared_memory;
+  if(current != (size_t) -1)
+  {
+    std::cerr << "FATAL: Lock algorithm is broken! " << current << " holds the lock exclusively during a shared lock!" << std::endl;
+    std::terminate();
+  }
+}
 
 int main(int argc, char *argv[])
 {
   if(argc < 4)
   {
-    std::cerr << "Usage: " << argv[0] << " [!]<atomic_append|byte_ranges|lock_files|memory_map> <entities> <no of waiters>" << std::endl;
+    std::cerr << "Usage: " << argv[0] << " [!|~]<atomic_append|byte_ranges|lock_files|memory_map|safe_byte_ranges>[@writer_preferring|@phase_fair] <entities> <no of waiters> [<no of readers>]" << std::endl;
+    std::cerr << "  @ sets the fairness policy of memory_map and safe_byte_ranges" << std::endl;
+    std::cerr << "  the first <no of readers> waiters take shared locks, the rest exclusive locks" << std::endl;
+    std::cerr << "  ! means each waiter locks its own unique entities (uncontended)" << std::endl;
+    std::cerr << "  ~ means each waiter locks entities drawn at random from a pool of four times the entities (partially contended)" << std::endl;
     return 1;
   }
   initialise_shared_memory();
@@ -111,17 +125,17 @@ int main(int argc, char *argv[])
   // ******** MASTER PROCESS BEGINS HERE ********
   if(strcmp(argv[1], "spawned") && strcmp(argv[1], "!spawned"))
   {
-    size_t waiters = atoi(argv[3]);
-    if(!waiters || !atoi(argv[2]))
+    size_t waiters = atoi(argv[3]), readers = (argc > 4) ? atoi(argv[4]) : 0;
+    if(!waiters || !atoi(argv[2]) || readers > waiters)
     {
-      std::cerr << "Usage: " << argv[0] << " [!]<atomic_append|byte_ranges|lock_files|memory_map> <entities> <no of waiters>" << std::endl;
+      std::cerr << "Usage: " << argv[0] << " [!|~]<atomic_append|byte_ranges|lock_files|memory_map|safe_byte_ranges>[@writer_preferring|@phase_fair] <entities> <no of waiters> [<no of readers>]" << std::endl;
       return 1;
     }
 
     std::vector<child_process::child_process> children;
     auto mypath = child_process::current_process_path();
 #ifdef UNICODE
-    std::vector<llfio::filesystem::path::string_type> args = {L"spawned", L"", L"", L"", L"00"};
+    std::vector<llfio::filesystem::path::string_type> args = {L"spawned", L"", L"", L"", L"00", L"0"};
     args[1].resize(strlen(argv[1]));
     for(size_t n = 0; n < args[1].size(); n++)
       args[1][n] = argv[1][n];
@@ -131,8 +145,14 @@ int main(int argc, char *argv[])
     args[3].resize(strlen(argv[3]));
     for(size_t n = 0; n < args[3].size(); n++)
       args[3][n] = argv[3][n];
+    if(argc > 4)
+    {
+      args[5].resize(strlen(argv[4]));
+      for(size_t n = 0; n < args[5].size(); n++)
+        args[5][n] = argv[4][n];
+    }
 #else
-    std::vector<llfio::filesystem::path::string_type> args = {"spawned", argv[1], argv[2], argv[3], "00"};
+    std::vector<llfio::filesystem::path::string_type> args = {"spawned", argv[1], argv[2], argv[3], "00", (argc > 4) ? argv[4] : "0"};
 #endif
     auto env = child_process::current_process_env();
     std::cout << "Launching " << waiters << " copies of myself as a child process ..." << std::endl;
@@ -193,6 +213,10 @@ int main(int argc, char *argv[])
     for(auto &child : children)
       child.cin() << "STOP" << std::endl;
     unsigned long long results = 0, result;
+    // Worst 99th percentile and maximum lock wait in nanoseconds of readers and writers
+    unsigned long long p99s[2] = {0, 0}, maxs[2] = {0, 0};
+    // Totals of contentions, spins, sleeps, retries and shuffles
+    unsigned long long stats[5] = {0, 0, 0, 0, 0};
     std::cout << std::endl;
     std::ofstream oh("benchmark_locking.csv");
     for(size_t n = 0; n < children.size(); n++)
@@ -209,14 +233,38 @@ int main(int argc, char *argv[])
         return 1;
       }
       result = atol(&buffer[8]);
-      std::cout << "Child " << n << " reports result " << result << std::endl;
+      const bool writer = n >= readers;
+      unsigned long long p99 = 0, max = 0;
+      if(const char *wait = strstr(buffer, "WAIT("))
+      {
+        p99 = strtoull(wait + 5, nullptr, 10);
+        if(const char *comma = strchr(wait, ','))
+          max = strtoull(comma + 1, nullptr, 10);
+      }
+      std::cout << "Child " << n << " (" << (writer ? "writer" : "reader") << ") reports result " << result << ", p99 wait " << p99 << " ns, max wait " << max << " ns" << std::endl;
       results += result;
+      if(const char *counters = strstr(buffer, "STATS("))
+      {
+        unsigned long long v[5];
+        if(5 == sscanf(counters + 6, "%llu,%llu,%llu,%llu,%llu", &v[0], &v[1], &v[2], &v[3], &v[4]))
+          for(size_t i = 0; i < 5; i++)
+            stats[i] += v[i];
+      }
+      if(p99 > p99s[writer])
+        p99s[writer] = p99;
+      if(max > maxs[writer])
+        maxs[writer] = max;
       if(n)
         oh << ",";
       oh << result;
     }
     results /= BENCHMARK_DURATION;
     std::cout << "Total result: " << results << " ops/sec" << std::endl;
+    if(readers)
+      std::cout << "Readers: worst p99 wait " << p99s[0] << " ns, max wait " << maxs[0] << " ns" << std::endl;
+    if(readers < waiters)
+      std::cout << "Writers: worst p99 wait " << p99s[1] << " ns, max wait " << maxs[1] << " ns" << std::endl;
+    std::cout << "Contentions: " << stats[0] << " spins: " << stats[1] << " sleeps: " << stats[2] << " retries: " << stats[3] << " shuffles: " << stats[4] << std::endl;
     oh << "\n" << results << std::endl;
     return 0;
   }
@@ -234,43 +282,63 @@ int main(int argc, char *argv[])
     atomic_append,
     byte_ranges,
     lock_files,
-    memory_map
+    memory_map,
+    safe_byte_ranges
   } test = lock_algorithm::unknown;
-  bool contended = true;
-  if(!strcmp(argv[2], "atomic_append"))
-    test = lock_algorithm::atomic_append;
-  else if(!strcmp(argv[2], "byte_ranges"))
-    test = lock_algorithm::byte_ranges;
-  else if(!strcmp(argv[2], "lock_files"))
-    test = lock_algorithm::lock_files;
-  else if(!strcmp(argv[2], "memory_map"))
-    test = lock_algorithm::memory_map;
-  else if(!strcmp(argv[2], "!atomic_append"))
+  enum class contention
   {
-    test = lock_algorithm::atomic_append;
-    contended = false;
-  }
-  else if(!strcmp(argv[2], "!byte_ranges"))
+    full,     // everybody locks the same entities
+    none,     // everybody locks their own unique entities
+    partial,  // everybody locks entities drawn at random from a shared pool
+  } contended = contention::full;
+  std::string algorithm_name_storage(argv[2]);
+  auto policy = llfio::algorithm::shared_fs_mutex::fairness_policy::none;
   {
-    test = lock_algorithm::byte_ranges;
-    contended = false;
+    auto at = algorithm_name_storage.find('@');
+    if(at != std::string::npos)
+    {
+      const std::string policy_name = algorithm_name_storage.substr(at + 1);
+      if(policy_name == "writer_preferring")
+        policy = llfio::algorithm::shared_fs_mutex::fairness_policy::writer_preferring;
+      else if(policy_name == "phase_fair")
+        policy = llfio::algorithm::shared_fs_mutex::fairness_policy::phase_fair;
+      else
+      {
+        std::cerr << "ERROR: unknown fairness policy requested" << std::endl;
+        return 1;
+      }
+      algorithm_name_storage.resize(at);
+    }
   }
-  else if(!strcmp(argv[2], "!lock_files"))
+  const char *algorithm_name = algorithm_name_storage.c_str();
+  if(algorithm_name[0] == '!')
   {
-    test = lock_algorithm::lock_files;
-    contended = false;
+    contended = contention::none;
+    ++algorithm_name;
   }
-  else if(!strcmp(argv[2], "!memory_map"))
+  else if(algorithm_name[0] == '~')
   {
-    test = lock_algorithm::memory_map;
-    contended = false;
+    contended = contention::partial;
+    ++algorithm_name;
   }
+  if(!strcmp(algorithm_name, "atomic_append"))
+    test = lock_algorithm::atomic_append;
+  else if(!strcmp(algorithm_name, "byte_ranges"))
+    test = lock_algorithm::byte_ranges;
+  else if(!strcmp(algorithm_name, "lock_files"))
+    test = lock_algorithm::lock_files;
+  else if(!strcmp(algorithm_name, "memory_map"))
+    test = lock_algorithm::memory_map;
+  else if(!strcmp(algorithm_name, "safe_byte_ranges"))
+    test = lock_algorithm::safe_byte_ranges;
   if(test == lock_algorithm::unknown)
   {
     std::cerr << "ERROR: unknown test requested" << std::endl;
     return 1;
   }
-  size_t total_locks = atoi(argv[3]), waiters = atoi(argv[4]), this_child = atoi(argv[5]), count = 0;
+  size_t total_locks = atoi(argv[3]), waiters = atoi(argv[4]), this_child = atoi(argv[5]), readers = (argc > 6) ? atoi(argv[6]) : 0, count = 0;
+  const bool reader = this_child < readers;
+  llfio::algorithm::shared_fs_mutex::lock_statistics stats;
   (void) waiters;
   if(!total_locks)
   {
@@ -281,7 +349,7 @@ int main(int argc, char *argv[])
   std::cout << "READY(" << this_child << ")" << std::endl;
   // Wait for parent to let me proceed
   std::atomic<int> done(-1);
-  std::thread worker([test, contended, total_locks, this_child, &done, &count] {
+  std::thread worker([test, contended, policy, reader, total_locks, this_child, &done, &count, &stats] {
     std::unique_ptr<llfio::algorithm::shared_fs_mutex::shared_fs_mutex> algorithm;
     auto base = llfio::path_handle::path(".").value();
     switch(test)
@@ -327,45 +395,86 @@ int main(int argc, char *argv[])
         std::cerr << "ERROR: Creation of lock algorithm returns " << v.error().message() << std::endl;
         return;
       }
+      v.value().set_fairness_policy(policy);
       algorithm = std::make_unique<llfio::algorithm::shared_fs_mutex::memory_map<QUICKCPPLIB_NAMESPACE::algorithm::hash::passthru_hash>>(std::move(v.value()));
       break;
     }
+    case lock_algorithm::safe_byte_ranges:
+    {
+      auto v = llfio::algorithm::shared_fs_mutex::safe_byte_ranges::fs_mutex_safe_byte_ranges({}, "lockfile");
+      if(v.has_error())
+      {
+        std::cerr << "ERROR: Creation of lock algorithm returns " << v.error().message() << std::endl;
+        return;
+      }
+      v.value().set_fairness_policy(policy);
+      algorithm = std::make_unique<llfio::algorithm::shared_fs_mutex::safe_byte_ranges>(std::move(v.value()));
+      break;
+    }
     case lock_algorithm::unknown:
       break;
     }
+    if(!algorithm)
+      return;
+    algorithm->enable_statistics().value();
     // Create entities named 0 to total_locks
     std::vector<llfio::algorithm::shared_fs_mutex::shared_fs_mutex::entity_type> entities(total_locks);
     for(size_t n = 0; n < total_locks; n++)
     {
-      if(contended)
+      if(contended == contention::none)
       {
-        entities[n].value = n;
-        entities[n].exclusive = true;
+        entities[n].value = (this_child << 4) + n;  // guaranteed unique
+        entities[n].exclusive = !reader;
       }
       else
       {
-        entities[n].value = (this_child << 4) + n;  // guaranteed unique
-        entities[n].exclusive = true;
+        entities[n].value = n;
+        entities[n].exclusive = !reader;
       }
     }
+    // Seeded per child so the children don't all draw the same entities in lock step
+    QUICKCPPLIB_NAMESPACE::algorithm::small_prng::small_prng prng(static_cast<uint32_t>(this_child));
+    // Entities partially contended draw from, which must be distinct within each request
+    std::vector<size_t> pool;
+    if(contended == contention::partial)
+    {
+      pool.resize(total_locks * 4);
+      for(size_t n = 0; n < pool.size(); n++)
+        pool[n] = n;
+    }
     while(done == -1)
       std::this_thread::yield();
     while(!done)
     {
+      if(contended == contention::partial)
+      {
+        // Partial Fisher-Yates shuffle of the first entities.size() of the pool
+        for(size_t n = 0; n < entities.size(); n++)
+        {
+          std::swap(pool[n], pool[n + prng() % (pool.size() - n)]);
+          entities[n].value = pool[n];
+        }
+      }
       auto result = algorithm->lock(entities, llfio::deadline(), false);
       if(result.has_error())
       {
         std::cerr << "ERROR: Algorithm lock returns " << result.error().message() << std::endl;
         return;
       }
-      if(contended)
-        child_locks(this_child);
+      if(contended == contention::full)
+      {
+        if(reader)
+          child_reads();
+        else
+          child_locks(this_child);
+      }
       ++count;
       auto guard = std::move(result.value());
-      if(contended)
+      if(contended == contention::full && !reader)
         child_unlocks(this_child);
       guard.unlock();
     }
+    stats = algorithm->statistics();
   });
   if(!strcmp(argv[1], "!spawned"))
   {
@@ -410,7 +519,7 @@ int main(int argc, char *argv[])
       {
         done = 1;
         worker.join();
-        std::cout << "RESULTS(" << count << ")" << std::endl;
+        std::cout << "RESULTS(" << count << ") WAIT(" << stats.wait.percentile(0.99) << "," << stats.wait.max << ") STATS(" << stats.contentions << "," << stats.spins << "," << stats.sleeps << "," << stats.retries << "," << stats.shuffles << ")" << std::endl;
 #if DEBUG_CSV
         std::ofstream s("benchmark_locking_llfio_log" + std::to_string(this_child) + ".csv");
         s << csv(llfio::log());
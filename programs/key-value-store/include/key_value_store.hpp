@@ -32,6 +32,16 @@ Distributed under the Boost Software License, Version 1.0.
 #include "../../../include/llfio/v2.0/quickcpplib/include/algorithm/open_hash_index.hpp"
 #endif
 
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <queue>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 namespace key_value_store
@@ -59,6 +69,14 @@ namespace key_value_store
     {
     }
   };
+  class outdated_store : std::runtime_error
+  {
+  public:
+    outdated_store()
+        : std::runtime_error("The store was written by an older version of this library whose format is no longer supported, please rebuild it")
+    {
+    }
+  };
   class maximum_writers_reached : std::runtime_error
   {
   public:
@@ -110,16 +128,20 @@ namespace key_value_store
     using namespace QUICKCPPLIB_NAMESPACE::algorithm::open_hash_index;
     struct value_history
     {
-      // Most recent six versions of this value
+      // Most recent four versions of this value, the last of which may instead locate a history record of older versions
       struct item
       {
         uint64_t transaction_counter;   // transaction counter when this was updated
         uint64_t value_offset : 58;     // Shifted left 6 as tail of blob record (value_tail) will always be on 64 byte boundary
         uint64_t value_identifier : 6;  // 0-47 is smallfile identifier, 48-63 is reserved for future usage
-        uint64_t length;                // Length in bytes
+        uint64_t length;                // Length in bytes with any compressed_bit, or removed_length or chained_length
       } history[4];
     };
     static_assert(sizeof(value_history) == 96, "value_history is wrong size");
+    // value_history::item::length of an item recording the removal of its key
+    constexpr uint64_t removed_length = (uint64_t) -1;
+    // value_history::item::length of an item locating the history record of the older items of its key
+    constexpr uint64_t chained_length = (uint64_t) -2;
     /* atomic_linear_memory_policy layout: Total 128 bytes
        - atomic<uint32_t> lock    4 bytes
        - atomic<uint32_t> inuse   4 bytes
@@ -132,261 +154,2363 @@ namespace key_value_store
 
     struct index
     {
-      uint64_t magic;                              // versionmagic, currently "AFIOKV01" for valid, "DEADKV01" for requires repair
-      std::atomic<uint64_t> transaction_counter;   // top 16 bits are number of keys changed this transaction, bottom 48 bits are monotonic counter
+      uint64_t magic;                              // versionmagic, currently "AFIOKV02" for valid, "DEADKV02" for requires repair
+      std::atomic<uint64_t> transaction_counter;   // bottom 16 bits are number of keys changed this transaction, top 48 bits are monotonic counter
       uint128 hash;                                // Optional hash of index file written on last close to guard against systems which don't write mmaps properly
       std::atomic<unsigned> writes_occurring[48];  // Incremented just before an update, decremented after, per writer
       std::atomic<bool> all_writes_synced;         // Set if all writers since the first which has opened this store did so with `O_SYNC` on (i.e. safe during fsck to check small file tails only)
+      std::atomic<unsigned> writers;               // Writers with the store open, not zero when the store is first opened if a writer died
+      std::atomic<uint64_t> checkpoints[48];       // Per smallfile, where the records end which are all either in the index or abandoned by their commit
 
       uint64_t contents_hashed : 1;       // If records written are hashed and checked on fetch
       uint64_t key_is_hash_of_value : 1;  // On read, check hash of value equals key
+      uint64_t has_ordered_index : 1;     // If writers maintain an ordered_index of keys in "ordered"
+      uint64_t moved : 1;                 // If this index has been replaced by a grown index
+      std::atomic<uint16_t> dictionary;   // Dictionary in "dictionary.<n>" with which writers compress values, zero if none. Set with the index update lock held.
+    };
+
+    // The fields of index::transaction_counter, and so of every transaction counter taken from it
+    union transaction_counter_fields {
+      struct
+      {
+        uint64_t values_updated : 16;
+        uint64_t counter : 48;
+      };
+      uint64_t this_transaction_counter;
     };
+    // The monotonic counter of a transaction counter, which orders transactions
+    inline uint64_t counter_of(uint64_t transaction_counter) noexcept { return transaction_counter >> 16; }
 
     struct value_tail
     {
       uint128 hash;  // 128 bit hash of contents
       key_type key;
       uint64_t transaction_counter;  // transaction counter when this was updated
-      uint64_t length;               // (uint64_t)-1 means key was deleted
+      uint64_t length;               // (uint64_t)-1 means key was deleted, history_record_bit set means a history record, compressed_bit set means compressed
     };
     static_assert(sizeof(value_tail) == 48, "value_tail is wrong size");
-  }
+    /* Set in value_tail::length of a history record, whose value is the value_history::items of its key
+    evicted from the index by the commit which wrote it whilst a snapshot could still see them, newest
+    first. Its last item may be chained_length, locating an older history record.
+    */
+    constexpr uint64_t history_record_bit = 1ULL << 63;
+    // Set in value_tail::length and value_history::item::length of a record whose value was compressed by compression::compress()
+    constexpr uint64_t compressed_bit = 1ULL << 62;
 
-  class transaction;
+    /* A B+tree of the keys in the store in the mapped file "ordered", letting keys be iterated
+    in order. It is derived from the smallfiles, from which it is rebuilt if it was never built
+    or a process died whilst updating it. Keys are never removed from the index other than by
+    their removal, so it may contain keys without a value, which users must check for.
 
-  /*! A transactional key-value store.
-  */
-  class basic_key_value_store
-  {
-    friend class transaction;
-    llfio::file_handle _indexfile;
-    llfio::file_handle _mysmallfile;  // append only
-    llfio::file_handle::extent_guard _indexfileguard, _smallfileguard;
-    size_t _mysmallfileidx{(size_t) -1};
-    struct
+    Page 0 is the header, all other pages are nodes. Erasure never merges nodes.
+    */
+    class ordered_index
     {
-      std::vector<llfio::file_handle> blocking;
-      std::vector<llfio::mapped_file_handle> mapped;
-    } _smallfiles;
-    optional<index::open_hash_index> _index;
-    index::index *_indexheader{nullptr};
-    std::mutex _commitlock;
-    size_t _mmap_over_extension{0};
+    public:
+      //! Fills the vector with every key with a value for rebuilding the index
+      using livekeys_type = std::function<void(std::vector<key_type> &)>;
 
-    static constexpr llfio::file_handle::extent_type _indexinuseoffset = INT64_MAX;
-    static constexpr uint64_t _goodmagic = 0x3130564b4f494641;  // "AFIOKV01"
-    static constexpr uint64_t _badmagic = 0x3130564b44414544;   // "DEADKV01"
+    private:
+      static constexpr uint64_t _goodmagic = 0x3130444f564b4641;  // "AFKVOD01"
+      static constexpr size_t _pagesize = 4096;
+      static constexpr llfio::file_handle::extent_type _lockoffset = INT64_MAX;
+      static constexpr uint32_t _leafkeys = 255, _branchkeys = 169;
+      struct _header
+      {
+        uint64_t magic;   // zero whilst being updated
+        uint64_t root;    // page of the root node
+        uint64_t pages;   // pages in use including this one
+        uint64_t height;  // levels of nodes
+      };
+      struct _leaf
+      {
+        uint32_t count;
+        uint32_t isleaf;
+        uint64_t next;  // page of the next leaf in key order, zero if none
+        key_type keys[_leafkeys];
+      };
+      struct _branch
+      {
+        uint32_t count;
+        uint32_t isleaf;
+        uint64_t _unused;
+        key_type keys[_branchkeys];  // keys[n] is the lowest key of children[n + 1]
+        uint64_t children[_branchkeys + 1];
+        uint64_t _padding[2];
+      };
+      static_assert(sizeof(_leaf) == _pagesize, "_leaf is wrong size");
+      static_assert(sizeof(_branch) == _pagesize, "_branch is wrong size");
 
-    static size_t _pad_length(size_t length)
-    {
-      // We append a value_tail record and round up to 64 byte multiple
-      return (length + sizeof(index::value_tail) + 63) & ~63;
-    }
-    void _openfiles(const llfio::path_handle &dir, llfio::file_handle::mode mode, llfio::file_handle::caching caching)
-    {
-      const llfio::file_handle::mode smallfilemode =
-#ifdef _WIN32
-      llfio::file_handle::mode::read
-#else
-      // Linux won't allow taking an exclusive lock on a read only file
-      mode
-#endif
-      ;
-      if(_smallfiles.blocking.empty())
+      llfio::mapped_file_handle _fh;
+      livekeys_type _livekeys;
+      std::mutex _lock;
+
+      _header *_hdr() { return reinterpret_cast<_header *>(_fh.address()); }
+      _leaf *_as_leaf(uint64_t page) { return reinterpret_cast<_leaf *>(_fh.address() + page * _pagesize); }
+      _branch *_as_branch(uint64_t page) { return reinterpret_cast<_branch *>(_fh.address() + page * _pagesize); }
+
+      // Map anything other processes have appended
+      void _refresh()
       {
-        // Open the small files, choosing the first unclaimed small file as "mine"
-        std::string name;
-        _smallfiles.blocking.reserve(48);
-        for(size_t n = 0; n < 48; n++)
+        auto length = _fh.underlying_file_maximum_extent().value();
+        if(length > _fh.maximum_extent().value())
         {
-          name = std::to_string(n);
-          auto fh = llfio::file_handle::file(dir, name, smallfilemode, llfio::file_handle::creation::open_existing, llfio::file_handle::caching::all, llfio::file_handle::flag::disable_prefetching);
-          if(fh)
+          if(length > _fh.capacity())
           {
-          retry:
-            bool claimed = false;
-            if(mode == llfio::file_handle::mode::write && !_mysmallfile.is_valid())
-            {
-              // Try to claim this small file
-              auto smallfileclaimed = fh.value().try_lock(_indexinuseoffset, 1, true);
-              if(smallfileclaimed)
-              {
-                _mysmallfile = llfio::file_handle::file(dir, name, llfio::file_handle::mode::write, llfio::file_handle::creation::open_existing, caching).value();
-                _mysmallfile.set_append_only(true).value();
-                _smallfileguard = std::move(smallfileclaimed).value();
-                _mysmallfileidx = n;
-                _smallfiles.blocking.push_back(std::move(fh).value());
-                _smallfileguard.set_handle(&_smallfiles.blocking.back());
-                claimed = true;
-              }
-            }
-            if(!claimed)
-            {
-#ifndef _WIN32
-              // We really need this to only have read only perms, otherwise any mmaps will extend the file ludicrously
-              fh = llfio::file_handle::file(dir, name, llfio::file_handle::mode::read, llfio::file_handle::creation::open_existing, llfio::file_handle::caching::all, llfio::file_handle::flag::disable_prefetching);
-#endif
-              _smallfiles.blocking.push_back(std::move(fh).value());
-            }
-            continue;
+            _fh.reserve(length * 2).value();
           }
-          else if(mode == llfio::file_handle::mode::write && !_mysmallfile.is_valid())
+          _fh.update_map().value();
+        }
+      }
+      bool _valid() { return _fh.maximum_extent().value() >= 2 * _pagesize && _hdr()->magic == _goodmagic; }
+      // Ensures that allocating this many pages will not need to remap
+      void _reserve_pages(uint64_t pages)
+      {
+        const llfio::file_handle::extent_type needed = (_hdr()->pages + pages) * _pagesize, length = _fh.maximum_extent().value();
+        if(needed > length)
+        {
+          _fh.truncate(std::max(needed, length * 2)).value();
+        }
+      }
+      uint64_t _allocate(bool isleaf)
+      {
+        const uint64_t page = _hdr()->pages++;
+        memset(_as_leaf(page), 0, _pagesize);
+        _as_leaf(page)->isleaf = isleaf;
+        return page;
+      }
+      void _rebuild()
+      {
+        std::vector<key_type> keys;
+        _livekeys(keys);
+        std::sort(keys.begin(), keys.end(), less);
+        _hdr()->pages = 1;
+        _reserve_pages(1);
+        _hdr()->root = _allocate(true);
+        _hdr()->height = 1;
+        for(const auto &key : keys)
+        {
+          _insert(key);
+        }
+      }
+      static void _insert(_branch *branch, size_t idx, const key_type &separator, uint64_t right)
+      {
+        std::copy_backward(branch->keys + idx, branch->keys + branch->count, branch->keys + branch->count + 1);
+        std::copy_backward(branch->children + idx + 1, branch->children + branch->count + 1, branch->children + branch->count + 2);
+        branch->keys[idx] = separator;
+        branch->children[idx + 1] = right;
+        branch->count++;
+      }
+      // Returns true if the node split, setting separator to the lowest key of the new node right
+      bool _insert(uint64_t page, const key_type &key, key_type &separator, uint64_t &right)
+      {
+        _leaf *leaf = _as_leaf(page);
+        if(leaf->isleaf)
+        {
+          key_type *pos = std::lower_bound(leaf->keys, leaf->keys + leaf->count, key, less);
+          if(pos != leaf->keys + leaf->count && *pos == key)
           {
-            // Going to need a new smallfile
-            fh = llfio::file_handle::file(dir, name, llfio::file_handle::mode::write, llfio::file_handle::creation::only_if_not_exist, caching);
-            if(fh)
+            return false;
+          }
+          const bool split = (leaf->count == _leafkeys);
+          if(split)
+          {
+            // Move the upper half into a new leaf
+            right = _allocate(true);
+            _leaf *r = _as_leaf(right);
+            const uint32_t half = leaf->count / 2;
+            std::copy(leaf->keys + half, leaf->keys + leaf->count, r->keys);
+            r->count = leaf->count - half;
+            leaf->count = half;
+            r->next = leaf->next;
+            leaf->next = right;
+            separator = r->keys[0];
+            if(!less(key, separator))
             {
-              fh.value().truncate(64).value();
-              goto retry;
+              leaf = r;
             }
-            continue;
+            pos = std::lower_bound(leaf->keys, leaf->keys + leaf->count, key, less);
           }
-          break;
+          std::copy_backward(pos, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+          *pos = key;
+          leaf->count++;
+          return split;
         }
-        if(mode == llfio::file_handle::mode::write && !_mysmallfile.is_valid())
+        _branch *branch = _as_branch(page);
+        const size_t idx = std::upper_bound(branch->keys, branch->keys + branch->count, key, less) - branch->keys;
+        key_type childseparator;
+        uint64_t childright;
+        if(!_insert(branch->children[idx], key, childseparator, childright))
         {
-          throw maximum_writers_reached();
+          return false;
         }
-        // Set up the index, either r/w or read only with copy on write
-        llfio::section_handle::flag mapflags = (mode == llfio::file_handle::mode::write) ? llfio::section_handle::flag::readwrite : (llfio::section_handle::flag::read | llfio::section_handle::flag::cow);
-        llfio::section_handle sh = llfio::section_handle::section(_indexfile, 0, mapflags).value();
-        llfio::file_handle::extent_type len = sh.length().value();
-        len -= sizeof(index::index);
-        len /= sizeof(index::open_hash_index::value_type);
-        size_t offset = sizeof(index::index);
-        _index.emplace(sh, len, offset, mapflags);
-        _indexheader = reinterpret_cast<index::index *>((char *) _index->container().data() - offset);
-        if(_indexheader->writes_occurring[_mysmallfileidx] != 0)
+        if(branch->count < _branchkeys)
         {
-          _indexheader->magic = _badmagic;
-          throw corrupted_store();
+          _insert(branch, idx, childseparator, childright);
+          return false;
+        }
+        // Move the upper half into a new branch, promoting the middle key
+        right = _allocate(false);
+        _branch *r = _as_branch(right);
+        const uint32_t half = branch->count / 2;
+        separator = branch->keys[half];
+        std::copy(branch->keys + half + 1, branch->keys + branch->count, r->keys);
+        std::copy(branch->children + half + 1, branch->children + branch->count + 1, r->children);
+        r->count = branch->count - half - 1;
+        branch->count = half;
+        if(idx <= half)
+        {
+          _insert(branch, idx, childseparator, childright);
+        }
+        else
+        {
+          _insert(r, idx - half - 1, childseparator, childright);
+        }
+        return true;
+      }
+      void _insert(const key_type &key)
+      {
+        // Enough for a split at every level plus a new root
+        _reserve_pages(_hdr()->height + 1);
+        key_type separator;
+        uint64_t right;
+        if(_insert(_hdr()->root, key, separator, right))
+        {
+          const uint64_t root = _allocate(false);
+          _branch *branch = _as_branch(root);
+          branch->count = 1;
+          branch->keys[0] = separator;
+          branch->children[0] = _hdr()->root;
+          branch->children[1] = right;
+          _hdr()->root = root;
+          _hdr()->height++;
+        }
+      }
+      // Returns the leaf which would contain key
+      _leaf *_find_leaf(const key_type &key)
+      {
+        uint64_t page = _hdr()->root;
+        while(!_as_leaf(page)->isleaf)
+        {
+          _branch *branch = _as_branch(page);
+          page = branch->children[std::upper_bound(branch->keys, branch->keys + branch->count, key, less) - branch->keys];
+        }
+        return _as_leaf(page);
+      }
+      void _erase(const key_type &key)
+      {
+        _leaf *leaf = _find_leaf(key);
+        key_type *pos = std::lower_bound(leaf->keys, leaf->keys + leaf->count, key, less);
+        if(pos != leaf->keys + leaf->count && *pos == key)
+        {
+          std::copy(pos + 1, leaf->keys + leaf->count, pos);
+          leaf->count--;
         }
       }
-    }
 
-  public:
-    basic_key_value_store(const basic_key_value_store &) = delete;
-    basic_key_value_store(basic_key_value_store &&) = delete;
-    basic_key_value_store &operator=(const basic_key_value_store &) = delete;
-    basic_key_value_store &operator=(basic_key_value_store &&) = delete;
+    public:
+      //! Orders keys by their value as unsigned 128 bit integers
+      static bool less(const key_type &a, const key_type &b) noexcept { return (a.as_longlongs[1] < b.as_longlongs[1]) || (a.as_longlongs[1] == b.as_longlongs[1] && a.as_longlongs[0] < b.as_longlongs[0]); }
+      //! The key after a key, wrapping to zero
+      static key_type next(key_type key) noexcept
+      {
+        if(++key.as_longlongs[0] == 0)
+        {
+          ++key.as_longlongs[1];
+        }
+        return key;
+      }
+      //! The key before a key, wrapping to all bits one
+      static key_type previous(key_type key) noexcept
+      {
+        if(key.as_longlongs[0]-- == 0)
+        {
+          --key.as_longlongs[1];
+        }
+        return key;
+      }
 
-    basic_key_value_store(const llfio::path_handle &dir, size_t hashtableentries, bool enable_integrity = false, llfio::file_handle::mode mode = llfio::file_handle::mode::write, llfio::file_handle::caching caching = llfio::file_handle::caching::all)
-        : _indexfile(llfio::file_handle::file(dir, "index", mode, (mode == llfio::file_handle::mode::write) ? llfio::file_handle::creation::if_needed : llfio::file_handle::creation::open_existing, caching, llfio::file_handle::flag::disable_prefetching).value())
-    {
-      if(mode == llfio::file_handle::mode::write)
+      //! Opens the index in the directory, creating it if writable
+      ordered_index(const llfio::path_handle &dir, bool writable, livekeys_type livekeys)
+          : _fh(llfio::mapped_file_handle::mapped_file(256 * 1024 * 1024, dir, "ordered", writable ? llfio::file_handle::mode::write : llfio::file_handle::mode::read, writable ? llfio::file_handle::creation::if_needed : llfio::file_handle::creation::open_existing).value())
+          , _livekeys(std::move(livekeys))
       {
-        // Try an exclusive lock on inuse byte of the index file
-        auto indexinuse = _indexfile.try_lock(_indexinuseoffset, 1, true);
-        if(indexinuse.has_value())
+        if(writable && _fh.maximum_extent().value() < 2 * _pagesize)
         {
-          // I am the first entrant into this data store
-          if(_indexfile.maximum_extent().value() == 0)
-          {
-            llfio::file_handle::extent_type size = sizeof(index::index) + (hashtableentries) * sizeof(index::open_hash_index::value_type);
-            size = llfio::utils::round_up_to_page_size(size, llfio::utils::page_size());
-            _indexfile.truncate(size).value();
-            index::index i;
-            memset(&i, 0, sizeof(i));
-            i.magic = _goodmagic;
-            i.all_writes_synced = _indexfile.are_writes_durable();
-            i.contents_hashed = enable_integrity;
-            _indexfile.write(0, {{(llfio::byte *) &i, sizeof(i)}}).value();
-          }
-          else
+          auto fileguard = _fh.lock(_lockoffset, 1, true).value();
+          if(_fh.underlying_file_maximum_extent().value() < 2 * _pagesize)
           {
-            /* TODO: Check consistency of index by checking that every item's transaction counter is within 2^47 of head's
-            and that no item has a transaction counter later than head's.
-
-            Check that every smallfile's tail points to a complete set of value records which matches the one in the history in the index
-            or that that key's latest value exists and is valid.
-            */
-            //_openfiles(dir, writable);
-            if(_indexheader->contents_hashed)
-            {
-            }
-            // Now we've finished the checks, reset writes_occurring and all_writes_synced
-            index::index i;
-            _indexfile.read(0, {{(llfio::byte *) &i, sizeof(i)}}).value();
-            memset(i.writes_occurring, 0, sizeof(i.writes_occurring));
-            i.all_writes_synced = _indexfile.are_writes_durable();
-            memset(&i.hash, 0, sizeof(i.hash));
-            _indexfile.write(0, {{(llfio::byte *) &i, sizeof(i)}}).value();
+            // A zeroed header will be rebuilt when first used
+            _fh.truncate(2 * _pagesize).value();
           }
         }
       }
-      // Take a shared lock, blocking if someone is still setting things up
-      _indexfileguard = _indexfile.lock(_indexinuseoffset, 1, false).value();
+
+      //! Inserts and erases keys, rebuilding the index first if necessary
+      void update(span<const key_type> inserts, span<const key_type> erases)
       {
-        llfio::byte buffer[8];
-        _indexfile.read(0, {{buffer, 8}}).value();
-        auto goodmagic = _goodmagic;
-        auto badmagic = _badmagic;
-        if(!memcmp(buffer, &badmagic, 8))
-          throw corrupted_store();
-        if(memcmp(buffer, &goodmagic, 8))
-          throw unknown_store();
+        std::lock_guard<decltype(_lock)> g(_lock);
+        auto fileguard = _fh.lock(_lockoffset, 1, true).value();
+        _refresh();
+        if(_hdr()->magic != _goodmagic)
+        {
+          _rebuild();
+        }
+        else if(inserts.empty() && erases.empty())
+        {
+          return;
+        }
+        _hdr()->magic = 0;
+        for(const auto &key : inserts)
+        {
+          _insert(key);
+        }
+        for(const auto &key : erases)
+        {
+          _erase(key);
+        }
+        _hdr()->magic = _goodmagic;
       }
-      // Open our smallfiles and map our index for shared usage
-      _openfiles(dir, mode, caching);
-      if(!_indexfile.are_writes_durable())
+
+      //! Appends up to `maxkeys` keys from `first` to `last` inclusive to `keys` in key order
+      void collect(key_type first, key_type last, std::vector<key_type> &keys, size_t maxkeys)
       {
-        _indexheader->all_writes_synced = false;
+        for(;;)
+        {
+          {
+            std::lock_guard<decltype(_lock)> g(_lock);
+            auto fileguard = _fh.lock(_lockoffset, 1, false).value();
+            _refresh();
+            if(_valid())
+            {
+              _leaf *leaf = _find_leaf(first);
+              size_t idx = std::lower_bound(leaf->keys, leaf->keys + leaf->count, first, less) - leaf->keys;
+              while(maxkeys > 0)
+              {
+                if(idx == leaf->count)
+                {
+                  if(leaf->next == 0)
+                  {
+                    break;
+                  }
+                  leaf = _as_leaf(leaf->next);
+                  idx = 0;
+                  continue;
+                }
+                if(less(last, leaf->keys[idx]))
+                {
+                  break;
+                }
+                keys.push_back(leaf->keys[idx++]);
+                maxkeys--;
+              }
+              return;
+            }
+          }
+          if(!_fh.is_writable())
+          {
+            throw corrupted_store();
+          }
+          update({}, {});
+        }
       }
-    }
-    //! \overload
-    basic_key_value_store(const llfio::path_view &dir, size_t hashtableentries, bool enable_integrity = false, llfio::file_handle::mode mode = llfio::file_handle::mode::write, llfio::file_handle::caching caching = llfio::file_handle::caching::all)
-        : basic_key_value_store(llfio::directory_handle::directory({}, dir, llfio::directory_handle::mode::write, llfio::directory_handle::creation::if_needed).value(), hashtableentries, enable_integrity, mode, caching)
+    };
+  }
+
+  /* A byte oriented LZ77 compression of values after the LZ4 block format, optionally using a
+  dictionary of content typical of values as if it preceded each value. A compressed value is a
+  header followed by sequences, each of a token whose top four bits are the length of the literals
+  following it and whose bottom four bits are the length less four of a match after them, either
+  of which is extended by following bytes added whilst they are 255, then the literals, then the
+  two byte little endian distance back to the match. The last sequence has only literals.
+  */
+  namespace compression
+  {
+    struct header
+    {
+      uint32_t length;      // length of the value decompressed
+      uint16_t dictionary;  // identifier of the dictionary used, zero if none
+      uint16_t _unused;
+    };
+    static_assert(sizeof(header) == 8, "header is wrong size");
+
+    constexpr size_t _minmatch = 4, _maxdistance = 65535;
+    // No byte of sequences decompresses to more than this, as each length extension byte adds at most 255
+    constexpr size_t _maxexpansion = 255;
+    inline uint32_t _read32(const char *p) noexcept
     {
+      uint32_t v;
+      memcpy(&v, p, sizeof(v));
+      return v;
     }
-    //! Opens the store for read only access
-    basic_key_value_store(const llfio::path_view &dir)
-        : basic_key_value_store(llfio::path_handle::path(dir).value(), 0, false, llfio::file_handle::mode::read)
+    inline uint64_t _read64(const char *p) noexcept
     {
+      uint64_t v;
+      memcpy(&v, p, sizeof(v));
+      return v;
     }
-    ~basic_key_value_store()
+    inline size_t _hash(uint32_t v, unsigned bits) noexcept { return (v * 2654435761U) >> (32 - bits); }
+
+    //! A dictionary of content typical of values, with an index of where four byte sequences occur in it
+    class dictionary
     {
-      // Release my smallfile
-      _smallfileguard.unlock();
-      _mysmallfile.close().value();
-      // Try to lock the index exclusively
-      _indexfileguard.unlock();
-      auto indexfileguard = _indexfile.try_lock(_indexinuseoffset, 1, true);
-      if(indexfileguard)
+      static constexpr unsigned _hashbits = 16;
+      uint16_t _id;
+      std::vector<char> _data;
+      std::vector<uint32_t> _table;  // one past the last position of each hash of four bytes, zero if none
+
+    public:
+      //! Matches can reach no further back than this
+      static constexpr size_t max_size = _maxdistance;
+
+      dictionary(uint16_t id, std::vector<char> data)
+          : _id(id)
+          , _data(std::move(data))
+          , _table(size_t(1) << _hashbits, 0)
       {
-        // I am the last user
-        if(_indexheader->contents_hashed)
+        if(_data.size() > max_size)
+        {
+          _data.erase(_data.begin(), _data.end() - max_size);
+        }
+        for(size_t n = 0; n + _minmatch <= _data.size(); n++)
         {
-          _indexheader->hash = QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((char *) _indexheader, _indexfile.maximum_extent().value());
+          _table[_hash(_read32(_data.data() + n), _hashbits)] = static_cast<uint32_t>(n + 1);
         }
       }
-    }
-
-    /*! \brief Sets whether to use mmaps for fetches and appends.
+      uint16_t id() const noexcept { return _id; }
+      span<const char> data() const noexcept { return {_data.data(), _data.size()}; }
+      //! One past the last position in the dictionary of four bytes with the same hash, zero if none
+      uint32_t candidate(uint32_t sequence) const noexcept { return _table[_hash(sequence, _hashbits)]; }
+    };
 
-    Requires lots of virtual address space as the entire
-    of all the small files is mapped into memory with additional `overextension`. Also requires a kernel
-    page cache implementation which correctly updates appends to the smallfile into the mapped view
-    without `msync(MS_INVALIDATE)`.
+    /*! Returns the length of a compressed value once decompressed, or `(size_t) -1` if it is too short to
+    be one or claims a length its sequences could not decompress to, so it can be trusted to size a buffer.
     */
-    void use_mmaps(size_t overextension = 1024ULL * 1024 * 1024)
+    inline size_t decompressed_length(span<const char> src) noexcept
     {
-      if(_mmap_over_extension != 0)
-        return;
-      _smallfiles.mapped.reserve(_smallfiles.blocking.size());
-      for(size_t n = 0; n < _smallfiles.blocking.size(); n++)
+      header h;
+      if(src.size() < sizeof(h))
       {
-        auto currentlength = _smallfiles.blocking[n].maximum_extent().value();
-        _smallfiles.mapped.push_back(llfio::mapped_file_handle(std::move(_smallfiles.blocking[n]), currentlength + overextension));
+        return (size_t) -1;
       }
-      _smallfileguard.set_handle(&_smallfiles.mapped[_mysmallfileidx]);
-      _smallfiles.blocking.clear();
-      _mmap_over_extension = overextension;
+      memcpy(&h, src.data(), sizeof(h));
+      if(h.length > (src.size() - sizeof(h)) * _maxexpansion + _minmatch + 15)
+      {
+        return (size_t) -1;
+      }
+      return h.length;
     }
-
+    //! Returns the identifier of the dictionary with which a value was compressed, zero if none
+    inline uint16_t dictionary_of(span<const char> src) noexcept
+    {
+      header h;
+      if(src.size() < sizeof(h))
+      {
+        return 0;
+      }
+      memcpy(&h, src.data(), sizeof(h));
+      return h.dictionary;
+    }
+
+    //! Compresses `src` into `dst`, returning the bytes written, or zero if they would not fit
+    inline size_t compress(span<char> dst, span<const char> src, const dictionary *dict = nullptr)
+    {
+      if(dst.size() < sizeof(header) || src.size() > UINT32_MAX)
+      {
+        return 0;
+      }
+      header h;
+      h.length = static_cast<uint32_t>(src.size());
+      h.dictionary = (dict != nullptr) ? dict->id() : 0;
+      h._unused = 0;
+      memcpy(dst.data(), &h, sizeof(h));
+      const char *dictdata = (dict != nullptr) ? dict->data().data() : nullptr;
+      const size_t dictsize = (dict != nullptr) ? dict->data().size() : 0;
+      const char *in = src.data();
+      const size_t length = src.size();
+      char *out = dst.data() + sizeof(header), *const outend = dst.data() + dst.size();
+      auto extend = [&](size_t count) {
+        for(; count >= 255; count -= 255)
+        {
+          *out++ = (char) 255;
+        }
+        *out++ = (char) count;
+      };
+      auto emit = [&](size_t literals, const char *from, size_t matchlength, size_t distance) {
+        const size_t worstcase = 1 + literals / 255 + 1 + literals + 2 + matchlength / 255 + 1;
+        if(static_cast<size_t>(outend - out) < worstcase)
+        {
+          return false;
+        }
+        const size_t extra = (matchlength != 0) ? matchlength - _minmatch : 0;
+        *out++ = (char) ((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(extra, 15));
+        if(literals >= 15)
+        {
+          extend(literals - 15);
+        }
+        memcpy(out, from, literals);
+        out += literals;
+        if(matchlength != 0)
+        {
+          *out++ = (char) (distance & 0xff);
+          *out++ = (char) (distance >> 8);
+          if(extra >= 15)
+          {
+            extend(extra - 15);
+          }
+        }
+        return true;
+      };
+      // Small values need only a small table of where four byte sequences were last seen
+      unsigned bits = 8;
+      while(bits < 14 && (size_t(1) << bits) < length)
+      {
+        bits++;
+      }
+      std::vector<uint32_t> table(size_t(1) << bits, 0);
+      size_t anchor = 0, pos = 0;
+      while(pos + _minmatch <= length)
+      {
+        const uint32_t sequence = _read32(in + pos);
+        uint32_t &last = table[_hash(sequence, bits)];
+        const size_t candidate = last;
+        last = static_cast<uint32_t>(pos + 1);
+        size_t matchlength = 0, distance = 0;
+        if(candidate != 0 && pos + 1 - candidate <= _maxdistance && _read32(in + candidate - 1) == sequence)
+        {
+          distance = pos + 1 - candidate;
+          matchlength = _minmatch;
+          while(pos + matchlength < length && in[candidate - 1 + matchlength] == in[pos + matchlength])
+          {
+            matchlength++;
+          }
+        }
+        else if(dict != nullptr)
+        {
+          const size_t dictcandidate = dict->candidate(sequence);
+          if(dictcandidate != 0 && dictsize + 1 - dictcandidate + pos <= _maxdistance && _read32(dictdata + dictcandidate - 1) == sequence)
+          {
+            distance = dictsize + 1 - dictcandidate + pos;
+            matchlength = _minmatch;
+            // The match may run off the end of the dictionary into the value
+            for(size_t from = dictcandidate - 1 + matchlength; pos + matchlength < length; from++, matchlength++)
+            {
+              if(((from < dictsize) ? dictdata[from] : in[from - dictsize]) != in[pos + matchlength])
+              {
+                break;
+              }
+            }
+          }
+        }
+        if(matchlength == 0)
+        {
+          pos++;
+          continue;
+        }
+        if(!emit(pos - anchor, in + anchor, matchlength, distance))
+        {
+          return 0;
+        }
+        pos += matchlength;
+        anchor = pos;
+      }
+      if(!emit(length - anchor, in + anchor, 0, 0))
+      {
+        return 0;
+      }
+      return out - dst.data();
+    }
+
+    //! Decompresses `src` into `dst` using the dictionary it was compressed with, returning false if it is malformed or `dst` is too small
+    inline bool decompress(span<char> dst, span<const char> src, const dictionary *dict = nullptr)
+    {
+      header h;
+      if(src.size() < sizeof(h))
+      {
+        return false;
+      }
+      memcpy(&h, src.data(), sizeof(h));
+      if(h.dictionary != ((dict != nullptr) ? dict->id() : 0) || dst.size() < h.length)
+      {
+        return false;
+      }
+      const char *dictdata = (dict != nullptr) ? dict->data().data() : nullptr;
+      const size_t dictsize = (dict != nullptr) ? dict->data().size() : 0;
+      const unsigned char *in = reinterpret_cast<const unsigned char *>(src.data()) + sizeof(h), *const end = reinterpret_cast<const unsigned char *>(src.data()) + src.size();
+      char *out = dst.data(), *const outend = dst.data() + h.length;
+      auto extend = [&](size_t &count) {
+        if(count == 15)
+        {
+          unsigned char b;
+          do
+          {
+            if(in == end)
+            {
+              return false;
+            }
+            b = *in++;
+            count += b;
+          } while(b == 255);
+        }
+        return true;
+      };
+      while(in < end)
+      {
+        const unsigned token = *in++;
+        size_t literals = token >> 4;
+        if(!extend(literals) || static_cast<size_t>(end - in) < literals || static_cast<size_t>(outend - out) < literals)
+        {
+          return false;
+        }
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if(in == end)
+        {
+          break;
+        }
+        if(end - in < 2)
+        {
+          return false;
+        }
+        const size_t distance = size_t(in[0]) | (size_t(in[1]) << 8);
+        in += 2;
+        size_t matchlength = token & 15;
+        if(!extend(matchlength))
+        {
+          return false;
+        }
+        matchlength += _minmatch;
+        const size_t produced = out - dst.data();
+        if(distance == 0 || distance > produced + dictsize || static_cast<size_t>(outend - out) < matchlength)
+        {
+          return false;
+        }
+        const char *from = out - distance;
+        if(distance > produced)
+        {
+          // The match begins in the dictionary, and may run on into the value
+          for(size_t n = dictsize + produced - distance; matchlength > 0 && n < dictsize; matchlength--)
+          {
+            *out++ = dictdata[n++];
+          }
+          from = dst.data();
+        }
+        if(static_cast<size_t>(out - from) >= matchlength)
+        {
+          memcpy(out, from, matchlength);
+          out += matchlength;
+        }
+        else
+        {
+          // Overlapping matches repeat what they copy
+          while(matchlength-- > 0)
+          {
+            *out++ = *from++;
+          }
+        }
+      }
+      return out == outend;
+    }
+
+    /*! \brief Builds the content of a dictionary of at most `max_size` bytes from samples of values.
+
+    After the cover algorithm of zstd's dictionary builder, repeatedly chooses the 64 byte segment
+    of the samples containing the most eight byte sequences which occur in other samples and are not
+    already in a segment chosen. The best segments go nearest the end, where matches are closest.
+    */
+    inline std::vector<char> train(span<const span<const char>> samples, size_t max_size = dictionary::max_size)
+    {
+      constexpr size_t segment = 64, step = 16, sequence = 8;
+      // How many samples contain each eight byte sequence
+      std::unordered_map<uint64_t, uint32_t> counts;
+      std::vector<uint64_t> sequences;
+      for(const auto &sample : samples)
+      {
+        sequences.clear();
+        for(size_t n = 0; n + sequence <= sample.size(); n++)
+        {
+          sequences.push_back(_read64(sample.data() + n));
+        }
+        std::sort(sequences.begin(), sequences.end());
+        sequences.erase(std::unique(sequences.begin(), sequences.end()), sequences.end());
+        for(const auto &v : sequences)
+        {
+          counts[v]++;
+        }
+      }
+      auto score = [&](span<const char> sample, size_t offset) {
+        uint64_t ret = 0;
+        const size_t end = std::min(offset + segment, sample.size());
+        for(size_t n = offset; n + sequence <= end; n++)
+        {
+          auto it = counts.find(_read64(sample.data() + n));
+          if(it != counts.end() && it->second > 1)
+          {
+            ret += it->second - 1;
+          }
+        }
+        return ret;
+      };
+      struct candidate
+      {
+        uint64_t score;
+        size_t sample, offset;
+        bool operator<(const candidate &o) const noexcept { return score < o.score; }
+      };
+      std::priority_queue<candidate> queue;
+      for(size_t idx = 0; idx < samples.size(); idx++)
+      {
+        for(size_t offset = 0; offset < samples[idx].size(); offset += step)
+        {
+          const uint64_t s = score(samples[idx], offset);
+          if(s > 0)
+          {
+            queue.push({s, idx, offset});
+          }
+        }
+      }
+      std::vector<span<const char>> chosen;
+      size_t size = 0;
+      while(!queue.empty() && size < max_size)
+      {
+        candidate c = queue.top();
+        queue.pop();
+        // Scores only fall as segments are chosen, so a rescored segment still best is the best
+        const uint64_t s = score(samples[c.sample], c.offset);
+        if(s == 0)
+        {
+          continue;
+        }
+        if(s < c.score)
+        {
+          c.score = s;
+          queue.push(c);
+          continue;
+        }
+        const span<const char> &sample = samples[c.sample];
+        const size_t length = std::min({segment, sample.size() - c.offset, max_size - size});
+        chosen.push_back({sample.data() + c.offset, length});
+        size += length;
+        for(size_t n = c.offset; n + sequence <= c.offset + length; n++)
+        {
+          auto it = counts.find(_read64(sample.data() + n));
+          if(it != counts.end())
+          {
+            it->second = 0;
+          }
+        }
+      }
+      std::vector<char> ret;
+      ret.reserve(size);
+      for(auto it = chosen.rbegin(); it != chosen.rend(); ++it)
+      {
+        ret.insert(ret.end(), it->data(), it->data() + it->size());
+      }
+      return ret;
+    }
+  }
+
+  class transaction;
+
+  /*! A transactional key-value store.
+  */
+  class basic_key_value_store
+  {
+    friend class transaction;
+    llfio::file_handle _indexfile;
+    llfio::file_handle _mysmallfile;  // append only
+    llfio::file_handle::extent_guard _indexfileguard, _smallfileguard;
+    size_t _mysmallfileidx{(size_t) -1};
+    struct
+    {
+      std::vector<llfio::file_handle> blocking;
+      std::vector<llfio::mapped_file_handle> mapped;
+      // Smallfiles opened, which only grows, so readers can check a smallfile is open without locking.
+      // Both vectors reserve all 48 so opening more never moves those open.
+      std::atomic<size_t> count{0};
+      std::mutex lock;  // held whilst opening smallfiles created by writers since the store was opened
+    } _smallfiles;
+    // A pointer to the current index, which may be switched to a grown index whilst other threads use it
+    template <class T> struct _switchable
+    {
+      std::atomic<T *> p{nullptr};
+      T *get() const noexcept { return p.load(std::memory_order_acquire); }
+      T *operator->() const noexcept { return get(); }
+      _switchable &operator=(T *v) noexcept
+      {
+        p.store(v, std::memory_order_release);
+        return *this;
+      }
+    };
+    // Every index mapped, the last being current. Indices replaced by a grown index stay mapped
+    // until destruction as other threads may still be using them.
+    std::deque<index::open_hash_index> _indices;
+    _switchable<index::open_hash_index> _index;
+    _switchable<index::index> _indexheader;
+    // Commits and consolidation share this whilst updating the index, growing it takes it exclusively
+    std::shared_timed_mutex _indexupdatelock;
+    struct
+    {
+      std::mutex lock;
+      size_t count{0};
+      llfio::file_handle::extent_guard guard;  // shared on _indexupdateoffset whilst count is not zero
+    } _indexupdaters;
+    std::mutex _commitlock;
+    size_t _mmap_over_extension{0};
+    // Appends to my smallfile prepared by commits, written in groups by whichever committer
+    // becomes the leader so that many commits share each write syscall and barrier
+    struct _appends
+    {
+      struct entry
+      {
+        std::vector<llfio::file_handle::const_buffer_type> reqs;
+        bool barrier{false};  // if the smallfile needs a barrier after writing this
+        bool done{false};
+        std::exception_ptr failure;
+      };
+      std::mutex lock;
+      std::condition_variable changed;
+      std::deque<entry *> pending;
+      size_t unwritten{0};                      // entries enqueued but not yet written
+      llfio::file_handle::extent_type end{0};  // where the next append lands if unwritten is not zero
+      bool leading{false};
+      size_t max_batch{1};
+      std::chrono::microseconds max_delay{0};
+    } _appends;
+    std::mutex _pinlock;
+    std::multiset<llfio::file_handle::extent_type> _pinned;  // offsets of records in my smallfile being viewed by a keyvalue_info
+    llfio::path_handle _dir;
+    std::mutex _orderedlock;
+    optional<index::ordered_index> _ordered;
+    /* Snapshots pinned by every user of the store are published in the mapped file "snapshots", in
+    which each user taking snapshots claims a slot holding the oldest transaction counter pinned by
+    its snapshots plus one. After those slots each writer has a slot holding the lowest transaction
+    counter its commits may yet take plus one, until they have updated the index. Zero means none.
+    Transaction counters here and in snapshots are counters as returned by index::counter_of().
+    */
+    struct
+    {
+      std::mutex lock;
+      llfio::mapped_file_handle file;
+      llfio::file_handle::extent_guard guard;  // exclusive on the slot claimed
+      size_t slot{(size_t) -1};
+      std::multiset<uint64_t> pinned;  // transaction counters pinned by my snapshots
+      std::mutex committinglock;
+      std::multiset<uint64_t> committing;  // transaction counters my commits may yet take
+    } _snapshots;
+    // Regions of my smallfile examined by consolidate_free_space() awaiting deallocation until no
+    // snapshot taken before epoch remains, oldest first. Guarded by _commitlock.
+    struct _reclaimable
+    {
+      uint64_t epoch;
+      llfio::file_handle::extent_type start, end;
+    };
+    std::deque<_reclaimable> _reclaim;
+    // Dictionaries loaded from the files "dictionary.<n>" by n, which never change once written
+    struct
+    {
+      std::mutex lock;
+      std::map<uint16_t, std::shared_ptr<const compression::dictionary>> loaded;
+      std::atomic<size_t> min_length{(size_t) -1};  // my commits compress values at least this long
+    } _compression;
+
+    // A chunk of memory into which small values are copied, freed once the last value copied into it is destroyed
+    struct _arena_chunk
+    {
+      std::atomic<size_t> refs{1};  // one per value, plus one while this is its thread's current chunk
+      size_t used{0};
+      llfio::byte data[1024 * 1024 - 64];
+
+      void release() noexcept
+      {
+        if(1 == refs.fetch_sub(1, std::memory_order_acq_rel))
+        {
+          delete this;
+        }
+      }
+    };
+    struct _arena
+    {
+      _arena_chunk *current{nullptr};
+
+      _arena() = default;
+      _arena(const _arena &) = delete;
+      _arena &operator=(const _arena &) = delete;
+      ~_arena()
+      {
+        if(current != nullptr)
+        {
+          current->release();
+        }
+      }
+      // Returns the chunk into which bytes have been allocated, with a reference taken for the caller
+      _arena_chunk *allocate(size_t bytes, llfio::byte *&out)
+      {
+        if(current != nullptr && current->refs.load(std::memory_order_acquire) == 1)
+        {
+          // Every value copied into it has been destroyed, so start again from the beginning
+          current->used = 0;
+        }
+        if(current == nullptr || current->used + bytes > sizeof(current->data))
+        {
+          auto *chunk = new _arena_chunk;
+          if(current != nullptr)
+          {
+            current->release();
+          }
+          current = chunk;
+        }
+        out = current->data + current->used;
+        current->used += (bytes + 63) & ~63;
+        current->refs.fetch_add(1, std::memory_order_relaxed);
+        return current;
+      }
+    };
+    static _arena &_this_thread_arena()
+    {
+      static thread_local _arena v;
+      return v;
+    }
+    // Values with records larger than this are mapped rather than copied when not using mmaps
+    static size_t _mapped_value_threshold() { return 64 * 1024; }
+
+    // Returns where the next append to my smallfile will land. Call with _commitlock held.
+    llfio::file_handle::extent_type _next_append_offset(bool *pending = nullptr)
+    {
+      std::lock_guard<decltype(_appends.lock)> g(_appends.lock);
+      if(pending != nullptr)
+      {
+        *pending = (_appends.unwritten != 0);
+      }
+      return (_appends.unwritten != 0) ? _appends.end : _mysmallfile.maximum_extent().value();
+    }
+    // Queues appends which will end at end. Call with _commitlock held.
+    void _enqueue_append(_appends::entry &e, llfio::file_handle::extent_type end)
+    {
+      {
+        std::lock_guard<decltype(_appends.lock)> g(_appends.lock);
+        _appends.pending.push_back(&e);
+        _appends.unwritten++;
+        _appends.end = end;
+      }
+      _appends.changed.notify_all();
+    }
+    // Waits until the appends queued have been written, leading a group of them if nobody else is
+    void _append(_appends::entry &e)
+    {
+      std::unique_lock<decltype(_appends.lock)> g(_appends.lock);
+      while(!e.done)
+      {
+        if(_appends.leading)
+        {
+          _appends.changed.wait(g);
+          continue;
+        }
+        _appends.leading = true;
+        // Give other committers up to max_delay to join this group
+        const auto until = std::chrono::steady_clock::now() + _appends.max_delay;
+        while(_appends.pending.size() < _appends.max_batch && _appends.changed.wait_until(g, until) != std::cv_status::timeout)
+        {
+        }
+        size_t count = std::min(_appends.pending.size(), _appends.max_batch);
+        std::vector<_appends::entry *> group(_appends.pending.begin(), _appends.pending.begin() + count);
+        _appends.pending.erase(_appends.pending.begin(), _appends.pending.begin() + count);
+        g.unlock();
+        std::exception_ptr failure;
+        llfio::file_handle::extent_type groupstart = 0;
+        bool started = false;
+        try
+        {
+          groupstart = _mysmallfile.maximum_extent().value();
+          started = true;
+          const size_t maxbuffers = std::max<size_t>(_mysmallfile.max_buffers(), 16);
+          std::vector<llfio::file_handle::const_buffer_type> reqs;
+          reqs.reserve(maxbuffers);
+          bool barrier = false;
+          for(auto *i : group)
+          {
+            barrier = barrier || i->barrier;
+            for(const auto &req : i->reqs)
+            {
+              reqs.push_back(req);
+              if(reqs.size() == maxbuffers)
+              {
+                _mysmallfile.write({reqs, 0}).value();
+                reqs.clear();
+              }
+            }
+          }
+          if(!reqs.empty())
+          {
+            _mysmallfile.write({reqs, 0}).value();
+          }
+          if(barrier)
+          {
+            _mysmallfile.barrier().value();
+          }
+        }
+        catch(...)
+        {
+          failure = std::current_exception();
+          // Don't leave part of the group in the smallfile for the next group to be written after
+          if(started)
+          {
+            (void) _mysmallfile.truncate(groupstart);
+          }
+        }
+        g.lock();
+        if(failure)
+        {
+          // Everything queued behind the group was laid out to follow it, so fails with it. Once nothing
+          // is queued, the next commit lays out its appends from the smallfile's actual end.
+          group.insert(group.end(), _appends.pending.begin(), _appends.pending.end());
+          count = group.size();
+          _appends.pending.clear();
+        }
+        for(auto *i : group)
+        {
+          i->failure = failure;
+          i->done = true;
+        }
+        _appends.unwritten -= count;
+        _appends.leading = false;
+        _appends.changed.notify_all();
+      }
+      if(e.failure)
+      {
+        std::rethrow_exception(e.failure);
+      }
+    }
+
+    void _pin(llfio::file_handle::extent_type offset)
+    {
+      std::lock_guard<decltype(_pinlock)> g(_pinlock);
+      _pinned.insert(offset);
+    }
+    void _unpin(llfio::file_handle::extent_type offset) noexcept
+    {
+      std::lock_guard<decltype(_pinlock)> g(_pinlock);
+      _pinned.erase(_pinned.find(offset));
+    }
+
+    std::atomic<uint64_t> *_snapshot_slots() noexcept { return reinterpret_cast<std::atomic<uint64_t> *>(_snapshots.file.address()); }
+    // Opens "snapshots", creating it if necessary
+    void _open_snapshots()
+    {
+      _snapshots.file = llfio::mapped_file_handle::mapped_file(_snapshotsfilesize, _dir, "snapshots", llfio::file_handle::mode::write, llfio::file_handle::creation::if_needed).value();
+      if(_snapshots.file.maximum_extent().value() < _snapshotsfilesize)
+      {
+        auto fileguard = _snapshots.file.lock(_indexinuseoffset, 1, true).value();
+        if(_snapshots.file.underlying_file_maximum_extent().value() < _snapshotsfilesize)
+        {
+          _snapshots.file.truncate(_snapshotsfilesize).value();
+        }
+        else
+        {
+          _snapshots.file.update_map().value();
+        }
+      }
+    }
+    // Returns the oldest transaction counter pinned by a snapshot of any user of the store, or
+    // (uint64_t) -1 if there are none. Writers always have "snapshots" open.
+    uint64_t _oldest_snapshot() noexcept
+    {
+      const std::atomic<uint64_t> *slots = _snapshot_slots();
+      uint64_t ret = (uint64_t) -1;
+      for(size_t n = 0; n < _snapshotslots; n++)
+      {
+        const uint64_t v = slots[n].load(std::memory_order_seq_cst);
+        if(v != 0 && v - 1 < ret)
+        {
+          ret = v - 1;
+        }
+      }
+      return ret;
+    }
+    // Publishes that a commit is about to take a transaction counter after the current one, returning
+    // what to pass to _end_committing() once it has updated the index. Call before taking it.
+    uint64_t _begin_committing()
+    {
+      const uint64_t counter = index::counter_of(_indexheader->transaction_counter.load(std::memory_order_seq_cst)) + 1;
+      std::lock_guard<decltype(_snapshots.committinglock)> g(_snapshots.committinglock);
+      _snapshots.committing.insert(counter);
+      _snapshot_slots()[_snapshotslots + _mysmallfileidx].store(*_snapshots.committing.begin() + 1, std::memory_order_seq_cst);
+      return counter;
+    }
+    void _end_committing(uint64_t counter) noexcept
+    {
+      std::lock_guard<decltype(_snapshots.committinglock)> g(_snapshots.committinglock);
+      _snapshots.committing.erase(_snapshots.committing.find(counter));
+      _snapshot_slots()[_snapshotslots + _mysmallfileidx].store(_snapshots.committing.empty() ? 0 : *_snapshots.committing.begin() + 1, std::memory_order_seq_cst);
+      if(_snapshots.committing.empty())
+      {
+        _checkpoint();
+      }
+    }
+    /* Publishes that every record in my smallfile is either in the index or was abandoned by its
+    commit, so that recovery after I die need only scan the records appended after now. Call with
+    _snapshots.committinglock held when none of my commits are between _begin_committing() and
+    _end_committing(), as only those can have appended records not yet in the index.
+    */
+    void _checkpoint() noexcept
+    {
+      auto length = _mysmallfile.maximum_extent();
+      if(length)
+      {
+        _indexheader->checkpoints[_mysmallfileidx].store(length.value(), std::memory_order_release);
+      }
+    }
+    // Waits until no writer is still committing a transaction counter at or before counter
+    void _wait_for_commits(uint64_t counter)
+    {
+      std::atomic<uint64_t> *committing = _snapshot_slots() + _snapshotslots;
+      for(size_t spins = 0;; spins++)
+      {
+        bool waiting = false;
+        for(size_t idx = 0; idx < 48; idx++)
+        {
+          uint64_t v = committing[idx].load(std::memory_order_seq_cst);
+          if(v != 0 && v - 1 <= counter)
+          {
+            // A writer which exited whilst committing leaves its slot set until its smallfile is next claimed
+            if((spins % 1000) == 999 && !_smallfile_claimed(idx))
+            {
+              committing[idx].compare_exchange_strong(v, 0);
+              continue;
+            }
+            waiting = true;
+          }
+        }
+        if(!waiting)
+        {
+          return;
+        }
+        std::this_thread::yield();
+      }
+    }
+    // True if a writer has claimed the smallfile
+    bool _smallfile_claimed(size_t idx)
+    {
+      if(idx == _mysmallfileidx)
+      {
+        return true;
+      }
+      auto fh = llfio::file_handle::file(_dir, std::to_string(idx), llfio::file_handle::mode::read, llfio::file_handle::creation::open_existing);
+      return fh && !fh.value().try_lock(_indexinuseoffset, 1, false);
+    }
+    void _unpin_snapshot(uint64_t counter) noexcept
+    {
+      std::lock_guard<decltype(_snapshots.lock)> g(_snapshots.lock);
+      _snapshots.pinned.erase(_snapshots.pinned.find(counter));
+      _snapshot_slots()[_snapshots.slot].store(_snapshots.pinned.empty() ? 0 : *_snapshots.pinned.begin() + 1, std::memory_order_seq_cst);
+    }
+
+    static bool _is_history_record(uint64_t length) noexcept { return length != (uint64_t) -1 && (length & index::history_record_bit) != 0; }
+    static bool _is_history_record(const index::value_tail &vt) noexcept { return _is_history_record(vt.length); }
+    // True if the item is a value rather than empty, a removal or a link to a history record
+    static bool _has_value(const index::value_history::item &item) noexcept { return item.transaction_counter != 0 && item.length != index::removed_length && item.length != index::chained_length; }
+    // Fills a history record preserving the items of a key evicted from the index, which will end at
+    // recordend in my smallfile, returning the item linking to it
+    index::value_history::item _fill_history_record(llfio::byte *record, key_type key, uint64_t transaction_counter, const index::value_history::item *evicted, size_t count, llfio::file_handle::extent_type recordend)
+    {
+      memset(record, 0, _history_record_size);
+      memcpy(record, evicted, count * sizeof(index::value_history::item));
+      index::value_tail *vt = reinterpret_cast<index::value_tail *>(record + _history_record_size - sizeof(index::value_tail));
+      vt->key = key;
+      vt->transaction_counter = transaction_counter;
+      vt->length = index::history_record_bit | (count * sizeof(index::value_history::item));
+      if(_indexheader->contents_hashed)
+      {
+        vt->hash = QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((char *) record, _history_record_size);
+      }
+      index::value_history::item link;
+      link.transaction_counter = transaction_counter;
+      link.value_offset = recordend / 64;
+      link.value_identifier = _mysmallfileidx;
+      link.length = index::chained_length;
+      return link;
+    }
+    // Appends the items of the history record located by link to items
+    void _read_history_record(key_type key, const index::value_history::item &link, std::vector<index::value_history::item> &items)
+    {
+      _open_smallfile(link.value_identifier);
+      llfio::byte record[_history_record_size];
+      const llfio::file_handle::extent_type recordoffset = link.value_offset * 64 - _history_record_size;
+      if(!_smallfiles.mapped.empty())
+      {
+        memcpy(record, _mapped_smallfile(link.value_identifier, link.value_offset * 64) + recordoffset, _history_record_size);
+      }
+      else
+      {
+        _smallfiles.blocking[link.value_identifier].read(recordoffset, {{record, _history_record_size}}).value();
+      }
+      index::value_tail *vt = reinterpret_cast<index::value_tail *>(record + _history_record_size - sizeof(index::value_tail));
+      const uint64_t length = vt->length & ~index::history_record_bit;
+      if(!_is_history_record(*vt) || vt->key != key || vt->transaction_counter != link.transaction_counter || length > _history_record_size - sizeof(index::value_tail) || (length % sizeof(index::value_history::item)) != 0)
+      {
+        _indexheader->magic = _badmagic;
+        throw corrupted_store();
+      }
+      if(_indexheader->contents_hashed)
+      {
+        uint128 tocheck = vt->hash;
+        memset(&vt->hash, 0, sizeof(vt->hash));
+        if(tocheck != QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((char *) record, _history_record_size))
+        {
+          _indexheader->magic = _badmagic;
+          throw corrupted_store();
+        }
+      }
+      const index::value_history::item *evicted = reinterpret_cast<const index::value_history::item *>(record);
+      items.insert(items.end(), evicted, evicted + length / sizeof(index::value_history::item));
+    }
+    // Returns the first of the revisions of a key from newest to oldest for which pick(item, revision)
+    // is true, following the history records of revisions evicted from the index, else an empty item
+    template <class F> index::value_history::item _resolve(key_type key, const index::value_history &vh, F &&pick)
+    {
+      size_t revision = 0;
+      for(const auto &item : vh.history)
+      {
+        if(item.length == index::chained_length)
+        {
+          std::vector<index::value_history::item> items;
+          _read_history_record(key, item, items);
+          for(size_t n = 0; n < items.size(); n++)
+          {
+            const index::value_history::item older = items[n];
+            if(older.length == index::chained_length)
+            {
+              _read_history_record(key, older, items);
+            }
+            else if(pick(older, revision++))
+            {
+              return older;
+            }
+          }
+          break;
+        }
+        if(pick(item, revision++))
+        {
+          return item;
+        }
+      }
+      index::value_history::item none;
+      memset(&none, 0, sizeof(none));
+      return none;
+    }
+    /* Deallocates the regions of my smallfile examined by consolidation which no snapshot could still
+    need, oldest first, up to the first record still being viewed by a keyvalue_info. Deallocated
+    regions read as zeros, which is how later consolidations know where to begin, so they must be
+    deallocated in order. Call with _commitlock held.
+    */
+    llfio::file_handle::extent_type _release_reclaimable()
+    {
+      llfio::file_handle::extent_type ret = 0;
+      const uint64_t oldest = _oldest_snapshot();
+      if(_reclaim.empty() || _reclaim.front().epoch > oldest)
+      {
+        return ret;
+      }
+      // zero() may fall back onto writing zeros, which mustn't append
+      _mysmallfile.set_append_only(false).value();
+      auto restoreappend = undoer([this] { (void) _mysmallfile.set_append_only(true); });
+      while(!_reclaim.empty() && _reclaim.front().epoch <= oldest)
+      {
+        _reclaimable &r = _reclaim.front();
+        llfio::file_handle::extent_type releaseend = r.end;
+        {
+          std::lock_guard<decltype(_pinlock)> g(_pinlock);
+          auto pinit = _pinned.lower_bound(r.start);
+          if(pinit != _pinned.end() && *pinit < releaseend)
+          {
+            releaseend = *pinit;
+          }
+        }
+        if(releaseend > r.start)
+        {
+          ret += _mysmallfile.zero(r.start, releaseend - r.start).value();
+          r.start = releaseend;
+        }
+        if(r.start < r.end)
+        {
+          break;
+        }
+        _reclaim.pop_front();
+      }
+      return ret;
+    }
+
+    // Returns the dictionary in "dictionary.<id>", loading it if necessary
+    std::shared_ptr<const compression::dictionary> _dictionary(uint16_t id)
+    {
+      std::lock_guard<decltype(_compression.lock)> g(_compression.lock);
+      auto it = _compression.loaded.find(id);
+      if(it != _compression.loaded.end())
+      {
+        return it->second;
+      }
+      auto fh = llfio::file_handle::file(_dir, "dictionary." + std::to_string(id), llfio::file_handle::mode::read, llfio::file_handle::creation::open_existing);
+      if(!fh)
+      {
+        throw corrupted_store();
+      }
+      std::vector<char> data(static_cast<size_t>(fh.value().maximum_extent().value()));
+      fh.value().read(0, {{reinterpret_cast<llfio::byte *>(data.data()), data.size()}}).value();
+      auto ret = std::make_shared<compression::dictionary>(id, std::move(data));
+      _compression.loaded.emplace(id, ret);
+      return ret;
+    }
+    // Returns a value compressed with the current dictionary if that saves space in its record, else empty
+    std::vector<char> _compress(span<const char> value)
+    {
+      std::vector<char> ret;
+      if(value.size() < _compression.min_length.load(std::memory_order_relaxed))
+      {
+        return ret;
+      }
+      const uint16_t id = _indexheader->dictionary.load(std::memory_order_acquire);
+      std::shared_ptr<const compression::dictionary> dict;
+      if(id != 0)
+      {
+        dict = _dictionary(id);
+      }
+      // Only worth it if the record shrinks by at least one 64 byte block
+      const size_t padded = _pad_length(value.size());
+      if(padded < 64 + sizeof(index::value_tail) + sizeof(compression::header))
+      {
+        return ret;
+      }
+      ret.resize(padded - 64 - sizeof(index::value_tail));
+      const size_t written = compression::compress({ret.data(), ret.size()}, value, dict.get());
+      ret.resize(written);
+      return ret;
+    }
+
+    // Calls f(recordstart, recordend, tail) for each record in the first length bytes of a smallfile
+    // from newest to oldest, stopping at space already deallocated by consolidate_free_space()
+    template <class F> void _for_each_record(size_t idx, llfio::file_handle::extent_type length, F &&f)
+    {
+      if(!_smallfiles.mapped.empty())
+      {
+        _mapped_smallfile(idx, length);
+      }
+      _walk_records(length,
+                    [this, idx](llfio::file_handle::extent_type offset, llfio::byte *buffer, size_t bytes) {
+                      if(_smallfiles.mapped.empty())
+                      {
+                        _smallfiles.blocking[idx].read(offset, {{buffer, bytes}}).value();
+                      }
+                      else
+                      {
+                        _smallfiles.mapped[idx].read(offset, {{buffer, bytes}}).value();
+                      }
+                    },
+                    std::forward<F>(f));
+    }
+    // As _for_each_record(), but reading the smallfile using read(offset, buffer, bytes)
+    template <class Read, class F> void _walk_records(llfio::file_handle::extent_type length, Read &&read, F &&f)
+    {
+      // Walk the tails backwards from the end, reading in windows as tails never straddle a 64 byte boundary
+      std::vector<llfio::byte> window(65536);
+      llfio::file_handle::extent_type windowstart = length;
+      for(llfio::file_handle::extent_type recordend = length; recordend > 64;)
+      {
+        if(recordend - sizeof(index::value_tail) < windowstart)
+        {
+          windowstart = (recordend > window.size()) ? recordend - window.size() : 0;
+          read(windowstart, window.data(), recordend - windowstart);
+        }
+        const index::value_tail *vt = reinterpret_cast<const index::value_tail *>(window.data() + (recordend - sizeof(index::value_tail) - windowstart));
+        if(vt->transaction_counter == 0)
+        {
+          break;
+        }
+        const llfio::file_handle::extent_type recordlength = (vt->length == (uint64_t) -1) ? 64 : _pad_length(static_cast<size_t>(vt->length & ~(index::history_record_bit | index::compressed_bit)));
+        if(recordlength > recordend - 64)
+        {
+          _indexheader->magic = _badmagic;
+          throw corrupted_store();
+        }
+        f(recordend - recordlength, recordend, *vt);
+        recordend -= recordlength;
+      }
+    }
+
+    // Fills keys with every key whose newest record in any smallfile is not a removal
+    void _live_keys(std::vector<key_type> &keys)
+    {
+      struct seen_type
+      {
+        key_type key;
+        uint64_t counter;
+        bool removal;
+      };
+      std::vector<seen_type> seen;
+      const size_t smallfiles = _smallfiles.mapped.empty() ? _smallfiles.blocking.size() : _smallfiles.mapped.size();
+      for(size_t idx = 0; idx < smallfiles; idx++)
+      {
+        const llfio::file_handle::extent_type length = _smallfiles.mapped.empty() ? _smallfiles.blocking[idx].maximum_extent().value() : _smallfiles.mapped[idx].underlying_file_maximum_extent().value();
+        _for_each_record(idx, length, [&](llfio::file_handle::extent_type /*unused*/, llfio::file_handle::extent_type /*unused*/, const index::value_tail &vt) {
+          if(_is_history_record(vt))
+          {
+            return;
+          }
+          seen.push_back({vt.key, index::counter_of(vt.transaction_counter), vt.length == (uint64_t) -1});
+        });
+      }
+      std::sort(seen.begin(), seen.end(), [](const seen_type &a, const seen_type &b) { return index::ordered_index::less(a.key, b.key) || (a.key == b.key && a.counter > b.counter); });
+      for(size_t n = 0; n < seen.size(); n++)
+      {
+        if((n == 0 || !(seen[n - 1].key == seen[n].key)) && !seen[n].removal)
+        {
+          keys.push_back(seen[n].key);
+        }
+      }
+    }
+    // Returns the ordered index if the store has one, opening it if another writer enabled it
+    index::ordered_index *_ordered_index()
+    {
+      if(!_indexheader->has_ordered_index)
+      {
+        return nullptr;
+      }
+      std::lock_guard<decltype(_orderedlock)> g(_orderedlock);
+      if(!_ordered)
+      {
+        _ordered.emplace(_dir, _mysmallfile.is_valid(), [this](std::vector<key_type> &keys) { _live_keys(keys); });
+      }
+      return &*_ordered;
+    }
+    // Calls f for each key from first to last inclusive where (key & mask) == bits with a latest value
+    template <class F> void _scan(key_type first, key_type last, key_type mask, key_type bits, F &f, size_t batch)
+    {
+      index::ordered_index *ordered = _ordered_index();
+      if(ordered == nullptr)
+        throw std::invalid_argument("the store has no ordered index, call use_ordered_index() first");
+      if(batch == 0)
+        batch = 1;
+      std::vector<key_type> keys;
+      for(;;)
+      {
+        keys.clear();
+        ordered->collect(first, last, keys, batch);
+        if(keys.empty())
+        {
+          return;
+        }
+        const bool more = (keys.size() == batch) && !(keys.back() == last);
+        first = index::ordered_index::next(keys.back());
+        keys.erase(std::remove_if(keys.begin(), keys.end(),
+                                  [&](const key_type &key) {
+                                    return (key.as_longlongs[0] & mask.as_longlongs[0]) != bits.as_longlongs[0] || (key.as_longlongs[1] & mask.as_longlongs[1]) != bits.as_longlongs[1];
+                                  }),
+                   keys.end());
+        for(auto &kvi : find_many(keys))
+        {
+          if(kvi && !f(kvi))
+          {
+            return;
+          }
+        }
+        if(!more)
+        {
+          return;
+        }
+      }
+    }
+
+    // Maps the hash index in an index file, keeping it mapped until destruction
+    index::open_hash_index *_map_index(llfio::file_handle &fh)
+    {
+      llfio::section_handle::flag mapflags = fh.is_writable() ? llfio::section_handle::flag::readwrite : (llfio::section_handle::flag::read | llfio::section_handle::flag::cow);
+      llfio::section_handle sh = llfio::section_handle::section(fh, 0, mapflags).value();
+      llfio::file_handle::extent_type len = sh.length().value();
+      len -= sizeof(index::index);
+      len /= sizeof(index::open_hash_index::value_type);
+      size_t offset = sizeof(index::index);
+      _indices.emplace_back(sh, len, offset, mapflags);
+      return &_indices.back();
+    }
+    static index::index *_header_of(index::open_hash_index *idx) { return reinterpret_cast<index::index *>((char *) idx->container().data() - sizeof(index::index)); }
+    void _use_index(index::open_hash_index *idx)
+    {
+      _indexheader = _header_of(idx);
+      _index = idx;
+    }
+    // Held whilst modifying the index to stop any user of the store growing it
+    class _index_update_guard
+    {
+      basic_key_value_store *_parent;
+
+    public:
+      explicit _index_update_guard(basic_key_value_store &parent)
+          : _parent(&parent)
+      {
+        for(;;)
+        {
+          _parent->_indexupdatelock.lock_shared();
+          try
+          {
+            // Byte range locks belong to the file description not the thread, so only the
+            // first of our updaters takes the lock and only the last releases it
+            std::lock_guard<decltype(_parent->_indexupdaters.lock)> g(_parent->_indexupdaters.lock);
+            if(_parent->_indexupdaters.count == 0)
+            {
+              _parent->_indexupdaters.guard = _parent->_indexfile.lock(_indexupdateoffset, 1, false).value();
+            }
+            _parent->_indexupdaters.count++;
+          }
+          catch(...)
+          {
+            _parent->_indexupdatelock.unlock_shared();
+            throw;
+          }
+          if(!_parent->_indexheader->moved)
+          {
+            return;
+          }
+          release();
+          _parent = &parent;
+          _parent->_switch_index();
+        }
+      }
+      _index_update_guard(const _index_update_guard &) = delete;
+      _index_update_guard &operator=(const _index_update_guard &) = delete;
+      ~_index_update_guard() { release(); }
+      void release() noexcept
+      {
+        if(_parent != nullptr)
+        {
+          {
+            std::lock_guard<decltype(_parent->_indexupdaters.lock)> g(_parent->_indexupdaters.lock);
+            if(--_parent->_indexupdaters.count == 0)
+            {
+              _parent->_indexupdaters.guard.unlock();
+            }
+          }
+          _parent->_indexupdatelock.unlock_shared();
+          _parent = nullptr;
+        }
+      }
+    };
+    // Switches to the index which replaced ours if another user of the store grew it
+    void _check_index()
+    {
+      if(_indexheader->moved)
+      {
+        _switch_index();
+      }
+    }
+    void _switch_index()
+    {
+      std::lock_guard<decltype(_indexupdatelock)> g(_indexupdatelock);
+      while(_indexheader->moved)
+      {
+        llfio::file_handle fh = llfio::file_handle::file(_dir, "index", _indexfile.is_writable() ? llfio::file_handle::mode::write : llfio::file_handle::mode::read, llfio::file_handle::creation::open_existing, _indexfile.kernel_caching(), llfio::file_handle::flag::disable_prefetching).value();
+        auto inuse = fh.lock(_indexinuseoffset, 1, false).value();
+        _indexfileguard.unlock();
+        _indexfile = std::move(fh);
+        _indexfileguard = std::move(inuse);
+        _indexfileguard.set_handle(&_indexfile);
+        _use_index(_map_index(_indexfile));
+      }
+    }
+    /* Copies the index into a new index file of at least hashtableentries entries, atomically replaces
+    the index file with it, and marks the old index as moved so its users switch to the new one.
+    Readers carry on using the old index whilst it is copied, but updates of the index wait.
+    */
+    void _resize_index(size_t hashtableentries)
+    {
+      std::lock_guard<decltype(_indexupdatelock)> g(_indexupdatelock);
+      auto updateguard = _indexfile.lock(_indexupdateoffset, 1, true).value();
+      if(_indexheader->moved)
+      {
+        // Someone else grew it whilst we waited, our caller will switch to theirs
+        return;
+      }
+      // Nobody can update the index whilst we hold the update lock, so its entries in use are every key
+      // to copy, including those whose history holds only removals or locates history records. As the
+      // layout of open_hash_index::value_type above shows, an entry is in use if its second four bytes
+      // are not zero, and its key begins sixteen bytes in.
+      std::vector<key_type> keys;
+      for(const auto &entry : _index->container())
+      {
+        const auto *raw = reinterpret_cast<const char *>(&entry);
+        if(reinterpret_cast<const std::atomic<uint32_t> *>(raw + 4)->load(std::memory_order_acquire) != 0)
+        {
+          keys.push_back(*reinterpret_cast<const key_type *>(raw + 16));
+        }
+      }
+      for(;;)
+      {
+        llfio::file_handle newfile = llfio::file_handle::file(_dir, "index.grow", llfio::file_handle::mode::write, llfio::file_handle::creation::truncate, _indexfile.kernel_caching(), llfio::file_handle::flag::disable_prefetching).value();
+        llfio::file_handle::extent_type size = sizeof(index::index) + (hashtableentries) * sizeof(index::open_hash_index::value_type);
+        size = llfio::utils::round_up_to_page_size(size, llfio::utils::page_size());
+        newfile.truncate(size).value();
+        newfile.write(0, {{(const llfio::byte *) _indexheader.get(), sizeof(index::index)}}).value();
+        index::open_hash_index *newindex = _map_index(newfile);
+        bool full = false;
+        for(const auto &key : keys)
+        {
+          auto it = _index->find_shared(key);
+          if(it != _index->end() && newindex->insert({key, it->second}).first == newindex->end())
+          {
+            full = true;
+            break;
+          }
+        }
+        if(full)
+        {
+          _indices.pop_back();
+          hashtableentries *= 2;
+          continue;
+        }
+        index::index *newheader = _header_of(newindex);
+        memset(&newheader->hash, 0, sizeof(newheader->hash));
+        newheader->moved = false;
+        // Commits waiting to update the index took their transaction counters from the old index,
+        // and a few more may yet do so before seeing it moved, so leave plenty of room for them
+        index::transaction_counter_fields _;
+        _.this_transaction_counter = _indexheader->transaction_counter.load(std::memory_order_acquire);
+        _.counter += _resize_counter_gap;
+        newheader->transaction_counter.store(_.this_transaction_counter, std::memory_order_release);
+        // Replace the index file, then tell the users of the old one to switch
+        auto inuse = newfile.lock(_indexinuseoffset, 1, false).value();
+        newfile.relink(_dir, "index").value();
+        _indexheader->moved = true;
+        updateguard.unlock();
+        _indexfileguard.unlock();
+        _indexfile = std::move(newfile);
+        _indexfileguard = std::move(inuse);
+        _indexfileguard.set_handle(&_indexfile);
+        _use_index(newindex);
+        return;
+      }
+    }
+
+    static constexpr llfio::file_handle::extent_type _indexinuseoffset = INT64_MAX;
+    static constexpr llfio::file_handle::extent_type _indexupdateoffset = INT64_MAX - 1;
+    static constexpr uint64_t _goodmagic = 0x3230564b4f494641;  // "AFIOKV02"
+    static constexpr uint64_t _badmagic = 0x3230564b44414544;   // "DEADKV02"
+    // Before writers and checkpoints were added to the index header
+    static constexpr uint64_t _oldgoodmagic = 0x3130564b4f494641;  // "AFIOKV01"
+    static constexpr uint64_t _oldbadmagic = 0x3130564b44414544;   // "DEADKV01"
+    // Throws unless the index file begins with the magic of this version
+    void _check_magic()
+    {
+      uint64_t magic = 0;
+      _indexfile.read(0, {{(llfio::byte *) &magic, sizeof(magic)}}).value();
+      if(magic == _badmagic)
+        throw corrupted_store();
+      if(magic == _oldgoodmagic || magic == _oldbadmagic)
+        throw outdated_store();
+      if(magic != _goodmagic)
+        throw unknown_store();
+    }
+    static constexpr size_t _snapshotslots = 448;                // slots for users taking snapshots in "snapshots", followed by one per writer
+    static constexpr size_t _snapshotsfilesize = 4096;
+    static_assert((_snapshotslots + 48) * sizeof(uint64_t) <= _snapshotsfilesize, "snapshots file is too small");
+    static constexpr size_t _history_record_size = 128;  // _pad_length() of two value_history::items
+    static constexpr uint64_t _resize_counter_gap = 65536;  // transactions a grown index's counter skips, for commits still using the old index
+
+    static size_t _pad_length(size_t length)
+    {
+      // We append a value_tail record and round up to 64 byte multiple
+      return (length + sizeof(index::value_tail) + 63) & ~63;
+    }
+
+    // A record found by _recover() after the checkpoint of its smallfile
+    struct _recovered_record
+    {
+      key_type key;
+      uint64_t transaction_counter;
+      uint64_t length;  // as in its value_tail
+      size_t smallfile;
+      llfio::file_handle::extent_type end;
+    };
+    /* Appends to records those of a smallfile from its end back to start, where its checkpointed
+    records end, returning where they end. A writer dying part way through appending leaves a torn
+    record, or with mmaps zeros, after the last record it appended, so this is the end nearest the
+    end of the smallfile from which valid records lead back to exactly start.
+    */
+    llfio::file_handle::extent_type _scan_tail(llfio::file_handle &fh, size_t idx, llfio::file_handle::extent_type start, llfio::file_handle::extent_type length, std::vector<_recovered_record> &records)
+    {
+      // Reads are served from a window which slides backwards as the tails are walked
+      std::vector<llfio::byte> window(65536);
+      llfio::file_handle::extent_type windowstart = 0, windowend = 0;
+      auto at = [&](llfio::file_handle::extent_type offset, size_t bytes) {
+        if(offset < windowstart || offset + bytes > windowend)
+        {
+          if(bytes > window.size())
+          {
+            window.resize(bytes);
+          }
+          windowend = offset + bytes;
+          windowstart = (windowend - start > window.size()) ? windowend - window.size() : start;
+          fh.read(windowstart, {{window.data(), static_cast<size_t>(windowend - windowstart)}}).value();
+        }
+        return window.data() + (offset - windowstart);
+      };
+      // Returns the tail of the record ending at recordend if it is valid and begins at or after start
+      auto valid = [&](llfio::file_handle::extent_type recordend, llfio::file_handle::extent_type &recordstart) -> const index::value_tail * {
+        const index::value_tail *vt = reinterpret_cast<const index::value_tail *>(at(recordend - sizeof(index::value_tail), sizeof(index::value_tail)));
+        if(vt->transaction_counter == 0)
+        {
+          return nullptr;
+        }
+        const uint64_t bytes = (vt->length == (uint64_t) -1) ? 0 : (vt->length & ~(index::history_record_bit | index::compressed_bit));
+        if(bytes > recordend - start)
+        {
+          return nullptr;
+        }
+        const llfio::file_handle::extent_type recordlength = (vt->length == (uint64_t) -1) ? 64 : _pad_length(static_cast<size_t>(bytes));
+        if(recordlength > recordend - start || (_is_history_record(*vt) && recordlength != _history_record_size))
+        {
+          return nullptr;
+        }
+        if(_indexheader->contents_hashed)
+        {
+          llfio::byte *record = at(recordend - recordlength, static_cast<size_t>(recordlength));
+          index::value_tail *tail = reinterpret_cast<index::value_tail *>(record + recordlength - sizeof(index::value_tail));
+          const uint128 tocheck = tail->hash;
+          memset(&tail->hash, 0, sizeof(tail->hash));
+          const bool matches = (tocheck == QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((char *) record, static_cast<size_t>(recordlength)));
+          tail->hash = tocheck;
+          if(!matches)
+          {
+            return nullptr;
+          }
+          vt = tail;
+        }
+        recordstart = recordend - recordlength;
+        return vt;
+      };
+      const size_t first = records.size();
+      for(llfio::file_handle::extent_type end = length & ~63ULL; end > start; end -= 64)
+      {
+        llfio::file_handle::extent_type recordend = end, recordstart = 0;
+        const index::value_tail *vt;
+        while(recordend > start && (vt = valid(recordend, recordstart)) != nullptr)
+        {
+          records.push_back({vt->key, vt->transaction_counter, vt->length, idx, recordend});
+          recordend = recordstart;
+        }
+        if(recordend == start)
+        {
+          return end;
+        }
+        records.resize(first);
+      }
+      return start;
+    }
+    /* Called by the first user of the store to open it for writing if a writer died whilst it was open,
+    with the index mapped. Truncates any record torn by a writer dying part way through appending it,
+    and completes the update of the index by any commit which died part way through it. A commit's
+    records are all appended before it updates the index, and a writer's checkpoint is only published
+    when none of its commits are between appending and updating the index, so only the records after
+    the checkpoint of each smallfile need be scanned, which is done in parallel. Appends to keys the
+    keys of those records, whose entries in any ordered index may need updating.
+    */
+    void _recover(std::vector<key_type> &keys)
+    {
+      index::index *header = _indexheader.get();
+      const bool writerdied = (header->writers.load(std::memory_order_acquire) != 0);
+      struct smallfile_type
+      {
+        size_t idx;
+        llfio::file_handle fh;
+        llfio::file_handle::extent_type start, length, end;
+        std::vector<_recovered_record> records;
+        std::exception_ptr failure;
+      };
+      std::vector<smallfile_type> smallfiles;
+      for(size_t idx = 0; idx < 48; idx++)
+      {
+        auto fh = llfio::file_handle::file(_dir, std::to_string(idx), llfio::file_handle::mode::write, llfio::file_handle::creation::open_existing, llfio::file_handle::caching::all, llfio::file_handle::flag::disable_prefetching);
+        if(!fh)
+        {
+          break;
+        }
+        const llfio::file_handle::extent_type length = fh.value().maximum_extent().value();
+        const llfio::file_handle::extent_type start = std::max<llfio::file_handle::extent_type>(64, header->checkpoints[idx].load(std::memory_order_acquire));
+        if(start > length || (start % 64) != 0)
+        {
+          // Records before the checkpoint were lost, which a process dying cannot do
+          header->magic = _badmagic;
+          throw corrupted_store();
+        }
+        if(start == length)
+        {
+          continue;
+        }
+        smallfiles.push_back({idx, std::move(fh).value(), start, length, start, {}, {}});
+      }
+      if(!writerdied && smallfiles.empty())
+      {
+        return;
+      }
+      std::atomic<size_t> next{0};
+      auto scan = [&] {
+        for(size_t n; (n = next.fetch_add(1, std::memory_order_relaxed)) < smallfiles.size();)
+        {
+          smallfile_type &sf = smallfiles[n];
+          try
+          {
+            sf.end = _scan_tail(sf.fh, sf.idx, sf.start, sf.length, sf.records);
+          }
+          catch(...)
+          {
+            sf.failure = std::current_exception();
+          }
+        }
+      };
+      std::vector<std::thread> threads;
+      for(size_t n = 1; n < std::min<size_t>(smallfiles.size(), std::max(1U, std::thread::hardware_concurrency())); n++)
+      {
+        threads.emplace_back(scan);
+      }
+      if(writerdied)
+      {
+        // Release the locks on entries of the index held by the dead writer, which as the layout
+        // of open_hash_index::value_type above shows are the first four bytes of each entry
+        auto *entries = _index->container().data();
+        for(size_t n = 0, count = _index->container().size(); n < count; n++)
+        {
+          auto *lock = (std::atomic<uint32_t> *) &entries[n];
+          if(lock->load(std::memory_order_relaxed) != 0)
+          {
+            lock->store(0, std::memory_order_relaxed);
+          }
+        }
+      }
+      scan();
+      for(auto &thread : threads)
+      {
+        thread.join();
+      }
+      std::vector<_recovered_record> records;
+      for(auto &sf : smallfiles)
+      {
+        if(sf.failure)
+        {
+          std::rethrow_exception(sf.failure);
+        }
+        if(sf.end < sf.length)
+        {
+          sf.fh.truncate(sf.end).value();
+        }
+        records.insert(records.end(), sf.records.begin(), sf.records.end());
+      }
+
+      // Transaction counters after the head's were lost with the index, so the head must follow them
+      // Counters are 48 bits which may wrap, so a counter up to half their range after the head's is later
+      uint64_t head = header->transaction_counter.load(std::memory_order_acquire);
+      for(const auto &r : records)
+      {
+        const uint64_t ahead = (index::counter_of(r.transaction_counter) - index::counter_of(head)) & 0xffffffffffffULL;
+        if(ahead != 0 && ahead < (1ULL << 47))
+        {
+          head = r.transaction_counter;
+        }
+      }
+      header->transaction_counter.store(head, std::memory_order_release);
+      auto age = [head](uint64_t transaction_counter) { return (index::counter_of(head) - index::counter_of(transaction_counter)) & 0xffffffffffffULL; };
+
+      // Each transaction's records are appended together, so group them oldest first
+      std::sort(records.begin(), records.end(), [&](const _recovered_record &a, const _recovered_record &b) {
+        if(a.transaction_counter != b.transaction_counter)
+        {
+          return age(a.transaction_counter) > age(b.transaction_counter) || (age(a.transaction_counter) == age(b.transaction_counter) && a.transaction_counter < b.transaction_counter);
+        }
+        return a.smallfile < b.smallfile || (a.smallfile == b.smallfile && a.end < b.end);
+      });
+      std::vector<const _recovered_record *> values;
+      for(auto it = records.begin(); it != records.end();)
+      {
+        const uint64_t transaction_counter = it->transaction_counter;
+        auto end = std::find_if(it, records.end(), [&](const _recovered_record &r) { return r.transaction_counter != transaction_counter; });
+        values.clear();
+        for(auto i = it; i != end; ++i)
+        {
+          if(!_is_history_record(i->length))
+          {
+            values.push_back(&*i);
+            keys.push_back(i->key);
+          }
+        }
+        auto begin = it;
+        it = end;
+        // The bottom 16 bits of a transaction counter are the number of keys it changed, and any
+        // fewer mean its appending was torn, so it never began updating the index
+        if((values.size() & 0xffff) != (transaction_counter & 0xffff))
+        {
+          continue;
+        }
+        auto applied = [&](const index::value_history &vh) {
+          return std::any_of(std::begin(vh.history), std::end(vh.history), [&](const index::value_history::item &h) { return h.transaction_counter == transaction_counter; });
+        };
+        bool begun = false;
+        for(const auto *r : values)
+        {
+          auto vit = _index->find_shared(r->key);
+          if(vit != _index->end() && applied(vit->second))
+          {
+            begun = true;
+            break;
+          }
+        }
+        for(const auto *r : values)
+        {
+          auto vit = _index->find_exclusive(r->key);
+          if(vit == _index->end())
+          {
+            continue;
+          }
+          index::value_history &vh = vit->second;
+          if(!begun)
+          {
+            // The commit died whilst inserting its new keys into the index, or aborted
+            const index::value_history empty{};
+            if(0 == memcmp(&vh, &empty, sizeof(vh)))
+            {
+              _index->erase(std::move(vit));
+            }
+            continue;
+          }
+          if(applied(vh) || age(vh.history[0].transaction_counter) <= age(transaction_counter))
+          {
+            continue;
+          }
+          // Complete the commit's update of this key as it would have done
+          index::value_history::item item;
+          item.transaction_counter = transaction_counter;
+          if(r->length == (uint64_t) -1)
+          {
+            item.value_offset = 0;
+            item.value_identifier = 0;
+            item.length = index::removed_length;
+          }
+          else
+          {
+            item.value_offset = r->end / 64;
+            item.value_identifier = r->smallfile;
+            item.length = r->length;
+          }
+          memmove(vh.history + 1, vh.history, sizeof(vh.history) - sizeof(vh.history[0]));
+          vh.history[0] = item;
+          auto link = std::find_if(begin, end, [&](const _recovered_record &h) { return _is_history_record(h.length) && h.key == r->key && h.smallfile == r->smallfile && h.end == r->end + _history_record_size; });
+          if(link != end)
+          {
+            vh.history[3].transaction_counter = transaction_counter;
+            vh.history[3].value_offset = link->end / 64;
+            vh.history[3].value_identifier = link->smallfile;
+            vh.history[3].length = index::chained_length;
+          }
+          if(std::none_of(std::begin(vh.history), std::end(vh.history), [](const index::value_history::item &h) { return h.length == index::chained_length || _has_value(h); }))
+          {
+            _index->erase(std::move(vit));
+          }
+        }
+      }
+      for(const auto &sf : smallfiles)
+      {
+        header->checkpoints[sf.idx].store(sf.end, std::memory_order_release);
+      }
+      header->writers.store(0, std::memory_order_release);
+    }
+    void _openfiles(const llfio::path_handle &dir, llfio::file_handle::mode mode, llfio::file_handle::caching caching)
+    {
+      const llfio::file_handle::mode smallfilemode =
+#ifdef _WIN32
+      llfio::file_handle::mode::read
+#else
+      // Linux won't allow taking an exclusive lock on a read only file
+      mode
+#endif
+      ;
+      if(_smallfiles.blocking.empty())
+      {
+        // Open the small files, choosing the first unclaimed small file as "mine"
+        std::string name;
+        _smallfiles.blocking.reserve(48);
+        for(size_t n = 0; n < 48; n++)
+        {
+          name = std::to_string(n);
+          auto fh = llfio::file_handle::file(dir, name, smallfilemode, llfio::file_handle::creation::open_existing, llfio::file_handle::caching::all, llfio::file_handle::flag::disable_prefetching);
+          if(fh)
+          {
+          retry:
+            bool claimed = false;
+            if(mode == llfio::file_handle::mode::write && !_mysmallfile.is_valid())
+            {
+              // Try to claim this small file
+              auto smallfileclaimed = fh.value().try_lock(_indexinuseoffset, 1, true);
+              if(smallfileclaimed)
+              {
+                _mysmallfile = llfio::file_handle::file(dir, name, llfio::file_handle::mode::write, llfio::file_handle::creation::open_existing, caching).value();
+                _mysmallfile.set_append_only(true).value();
+                _smallfileguard = std::move(smallfileclaimed).value();
+                _mysmallfileidx = n;
+                _smallfiles.blocking.push_back(std::move(fh).value());
+                _smallfileguard.set_handle(&_smallfiles.blocking.back());
+                claimed = true;
+              }
+            }
+            if(!claimed)
+            {
+#ifndef _WIN32
+              // We really need this to only have read only perms, otherwise any mmaps will extend the file ludicrously
+              fh = llfio::file_handle::file(dir, name, llfio::file_handle::mode::read, llfio::file_handle::creation::open_existing, llfio::file_handle::caching::all, llfio::file_handle::flag::disable_prefetching);
+#endif
+              _smallfiles.blocking.push_back(std::move(fh).value());
+            }
+            continue;
+          }
+          else if(mode == llfio::file_handle::mode::write && !_mysmallfile.is_valid())
+          {
+            // Going to need a new smallfile
+            fh = llfio::file_handle::file(dir, name, llfio::file_handle::mode::write, llfio::file_handle::creation::only_if_not_exist, caching);
+            if(fh)
+            {
+              fh.value().truncate(64).value();
+              goto retry;
+            }
+            continue;
+          }
+          break;
+        }
+        if(mode == llfio::file_handle::mode::write && !_mysmallfile.is_valid())
+        {
+          throw maximum_writers_reached();
+        }
+        _smallfiles.count.store(_smallfiles.blocking.size(), std::memory_order_release);
+        // Set up the index, either r/w or read only with copy on write, unless recovery already has
+        if(_index.get() == nullptr)
+        {
+          _use_index(_map_index(_indexfile));
+        }
+        if(_indexheader->writes_occurring[_mysmallfileidx] != 0)
+        {
+          // The last writer of my smallfile died updating the index whilst others had the store
+          // open, which will be recovered once the store is next opened by its first user
+          throw corrupted_store();
+        }
+      }
+    }
+
+  public:
+    basic_key_value_store(const basic_key_value_store &) = delete;
+    basic_key_value_store(basic_key_value_store &&) = delete;
+    basic_key_value_store &operator=(const basic_key_value_store &) = delete;
+    basic_key_value_store &operator=(basic_key_value_store &&) = delete;
+
+    basic_key_value_store(const llfio::path_handle &dir, size_t hashtableentries, bool enable_integrity = false, llfio::file_handle::mode mode = llfio::file_handle::mode::write, llfio::file_handle::caching caching = llfio::file_handle::caching::all)
+        : _indexfile(llfio::file_handle::file(dir, "index", mode, (mode == llfio::file_handle::mode::write) ? llfio::file_handle::creation::if_needed : llfio::file_handle::creation::open_existing, caching, llfio::file_handle::flag::disable_prefetching).value())
+        , _dir(dir.clone().value())
+    {
+      std::vector<key_type> recovered;  // keys of the records scanned by recovery
+      if(mode == llfio::file_handle::mode::write)
+      {
+        // Try an exclusive lock on inuse byte of the index file
+        auto indexinuse = _indexfile.try_lock(_indexinuseoffset, 1, true);
+        if(indexinuse.has_value())
+        {
+          // I am the first entrant into this data store
+          if(_indexfile.maximum_extent().value() == 0)
+          {
+            llfio::file_handle::extent_type size = sizeof(index::index) + (hashtableentries) * sizeof(index::open_hash_index::value_type);
+            size = llfio::utils::round_up_to_page_size(size, llfio::utils::page_size());
+            _indexfile.truncate(size).value();
+            index::index i;
+            memset(&i, 0, sizeof(i));
+            i.magic = _goodmagic;
+            i.all_writes_synced = _indexfile.are_writes_durable();
+            i.contents_hashed = enable_integrity;
+            _indexfile.write(0, {{(llfio::byte *) &i, sizeof(i)}}).value();
+          }
+          else
+          {
+            // An older layout of the index header must not be written to as if it were this one
+            uint64_t magic = 0;
+            _indexfile.read(0, {{(llfio::byte *) &magic, sizeof(magic)}}).value();
+            if(magic == _oldgoodmagic || magic == _oldbadmagic)
+              throw outdated_store();
+            // Repair anything left half done by a writer which died whilst the store was open
+            _use_index(_map_index(_indexfile));
+            if(_indexheader->magic == _goodmagic)
+            {
+              _recover(recovered);
+            }
+            // Now we've finished the checks, reset writes_occurring and all_writes_synced
+            for(auto &i : _indexheader->writes_occurring)
+            {
+              i.store(0, std::memory_order_relaxed);
+            }
+            _indexheader->all_writes_synced = _indexfile.are_writes_durable();
+            memset(&_indexheader->hash, 0, sizeof(_indexheader->hash));
+          }
+        }
+      }
+      // Take a shared lock, blocking if someone is still setting things up
+      _indexfileguard = _indexfile.lock(_indexinuseoffset, 1, false).value();
+      _check_magic();
+      // Open our smallfiles and map our index for shared usage
+      _openfiles(dir, mode, caching);
+      if(_mysmallfile.is_valid())
+      {
+        // Anything published by a previous writer using my smallfile is stale
+        _open_snapshots();
+        _snapshot_slots()[_snapshotslots + _mysmallfileidx].store(0, std::memory_order_seq_cst);
+        _indexheader->writers.fetch_add(1, std::memory_order_acq_rel);
+        if(!recovered.empty() && _indexheader->has_ordered_index)
+        {
+          // Commits recovered, or which died before updating the ordered index, may have changed which keys have values
+          std::vector<key_type> inserts, erases;
+          std::sort(recovered.begin(), recovered.end(), index::ordered_index::less);
+          recovered.erase(std::unique(recovered.begin(), recovered.end()), recovered.end());
+          for(const auto &key : recovered)
+          {
+            auto it = _index->find_shared(key);
+            (it != _index->end() && _has_value(it->second.history[0]) ? inserts : erases).push_back(key);
+          }
+          _ordered_index()->update(inserts, erases);
+        }
+      }
+      if(!_indexfile.are_writes_durable())
+      {
+        _indexheader->all_writes_synced = false;
+      }
+    }
+    //! \overload
+    basic_key_value_store(const llfio::path_view &dir, size_t hashtableentries, bool enable_integrity = false, llfio::file_handle::mode mode = llfio::file_handle::mode::write, llfio::file_handle::caching caching = llfio::file_handle::caching::all)
+        : basic_key_value_store(llfio::directory_handle::directory({}, dir, llfio::directory_handle::mode::write, llfio::directory_handle::creation::if_needed).value(), hashtableentries, enable_integrity, mode, caching)
+    {
+    }
+    //! Opens the store for read only access
+    basic_key_value_store(const llfio::path_view &dir)
+        : basic_key_value_store(llfio::path_handle::path(dir).value(), 0, false, llfio::file_handle::mode::read)
+    {
+    }
+    ~basic_key_value_store()
+    {
+      if(_mysmallfile.is_valid())
+      {
+        // All my commits have finished, so none of my records are left for recovery
+        _checkpoint();
+        _indexheader->writers.fetch_sub(1, std::memory_order_acq_rel);
+      }
+      // Release my smallfile
+      _smallfileguard.unlock();
+      _mysmallfile.close().value();
+      // Try to lock the index exclusively
+      _indexfileguard.unlock();
+      auto indexfileguard = _indexfile.try_lock(_indexinuseoffset, 1, true);
+      if(indexfileguard)
+      {
+        // I am the last user
+        if(_indexheader->contents_hashed)
+        {
+          _indexheader->hash = QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((char *) _indexheader.get(), _indexfile.maximum_extent().value());
+        }
+      }
+    }
+
+    /*! \brief Sets whether to use mmaps for fetches and appends.
+
+    Requires lots of virtual address space as the entire
+    of all the small files is mapped into memory with additional `overextension`. Also requires a kernel
+    page cache implementation which correctly updates appends to the smallfile into the mapped view
+    without `msync(MS_INVALIDATE)`.
+    */
+    void use_mmaps(size_t overextension = 1024ULL * 1024 * 1024)
+    {
+      if(_mmap_over_extension != 0)
+        return;
+      _smallfiles.mapped.reserve(48);
+      for(size_t n = 0; n < _smallfiles.blocking.size(); n++)
+      {
+        auto currentlength = _smallfiles.blocking[n].maximum_extent().value();
+        _smallfiles.mapped.push_back(llfio::mapped_file_handle(std::move(_smallfiles.blocking[n]), currentlength + overextension));
+      }
+      _smallfileguard.set_handle(&_smallfiles.mapped[_mysmallfileidx]);
+      _smallfiles.blocking.clear();
+      _mmap_over_extension = overextension;
+    }
+
+    /*! \brief Sets how commits by concurrent threads are grouped into shared appends.
+
+    Each commit prepares its records and queues them to be appended to my smallfile. The first
+    committer to find nobody writing becomes the leader: it waits up to `max_delay` for up to
+    `max_batch` commits to be queued, then appends all their records using gather writes of up
+    to `IOV_MAX` buffers, issuing a barrier if any were written through mmaps and the store was
+    opened with durable caching, before releasing all the commits in the group. As durable caching
+    makes each write syscall durable, a group costs far fewer syncs than its commits would alone.
+    The default of a batch of one with no delay appends each commit's records as soon as possible.
+    */
+    void use_group_commit(size_t max_batch, std::chrono::microseconds max_delay = std::chrono::microseconds(100))
+    {
+      std::lock_guard<decltype(_appends.lock)> g(_appends.lock);
+      _appends.max_batch = (max_batch == 0) ? 1 : max_batch;
+      _appends.max_delay = max_delay;
+    }
+
+    /*! \brief Rehashes the index into a new index of `hashtableentries` entries, doubling that until every key fits.
+
+    Commits which find the index full do this with double the entries, so a store need only be created
+    with an index big enough for its initial contents. The new index is built in a new file which then
+    atomically replaces the index file. Whilst it is built, `find()` carries on using the old index but
+    the commits of every user of the store wait. Each user switches to the new index when next it uses
+    the store, keeping the old index mapped until destruction as its other threads may still be using it.
+    */
+    void resize_index(size_t hashtableentries)
+    {
+      if(!_mysmallfile.is_valid())
+        throw std::invalid_argument("the store must be opened for writing to resize its index");
+      _check_index();
+      _resize_index(std::max<size_t>(hashtableentries, 1));
+      _check_index();
+    }
+
+    //! Statistics about a free space consolidation
+    struct consolidation_info
+    {
+      //! Bytes of the oldest records examined
+      llfio::file_handle::extent_type examined{0};
+      //! Bytes of still in use records copied to the end of the smallfile
+      llfio::file_handle::extent_type copied{0};
+      //! Bytes of the smallfile deallocated
+      llfio::file_handle::extent_type released{0};
+    };
+    /*! \brief Consolidates the free space in the oldest `bytes` of my smallfile.
+
+    Records still referenced by any revision in the index are copied to the end of my smallfile
+    and the index is repointed to the copy under an exclusive lock on that key, after which the
+    whole of the region examined is deallocated using `file_handle::zero()`. Deallocated regions
+    read as zeros, which is how later consolidations know where to begin.
+
+    This may be called from a background thread concurrently with `find()` and `commit()`, though
+    commits by this store instance will wait until it has finished. Records still being viewed by
+    values returned by `find()` of this store instance are not deallocated, nor is anything after
+    them, until a later consolidation. Nor are regions examined whilst any user of the store had
+    pinned a snapshot, whose history records may still refer to them, which instead wait in a
+    reclamation list until every snapshot older than the consolidation has been released. Each
+    consolidation deallocates what it can of that list, and examines from after the regions in it.
+    */
+    consolidation_info consolidate_free_space(llfio::file_handle::extent_type bytes = 1024ULL * 1024)
+    {
+      consolidation_info ret;
+      if(!_mysmallfile.is_valid() || bytes == 0)
+      {
+        return ret;
+      }
+      if(_indexheader->magic != _goodmagic)
+        throw corrupted_store();
+      std::lock_guard<decltype(_commitlock)> commitlockguard(_commitlock);
+      _check_index();
+      {
+        // Let the appends of commits already prepared land first
+        std::unique_lock<decltype(_appends.lock)> g(_appends.lock);
+        _appends.changed.wait(g, [this] { return _appends.unwritten == 0; });
+      }
+      const llfio::file_handle::extent_type length = _mysmallfile.maximum_extent().value();
+      // Records after my checkpoint may belong to commits yet to update the index, and recovery
+      // relies on nothing after it being deallocated
+      const llfio::file_handle::extent_type checkpointed = std::min(length, _indexheader->checkpoints[_mysmallfileidx].load(std::memory_order_acquire));
+      const llfio::file_handle::extent_type examinedend = _reclaim.empty() ? 0 : _reclaim.back().end;
+      std::vector<std::pair<llfio::file_handle::extent_type, llfio::file_handle::extent_type>> records;  // newest first
+      _for_each_record(_mysmallfileidx, checkpointed, [&](llfio::file_handle::extent_type recordstart, llfio::file_handle::extent_type recordend, const index::value_tail & /*unused*/) {
+        if(recordstart >= examinedend)
+        {
+          records.emplace_back(recordstart, recordend);
+        }
+      });
+      auto read = [this](llfio::file_handle::extent_type offset, llfio::byte *buffer, size_t length) {
+        if(_smallfiles.mapped.empty())
+        {
+          _smallfiles.blocking[_mysmallfileidx].read(offset, {{buffer, length}}).value();
+        }
+        else
+        {
+          _smallfiles.mapped[_mysmallfileidx].read(offset, {{buffer, length}}).value();
+        }
+      };
+      if(records.empty())
+      {
+        ret.released = _release_reclaimable();
+        return ret;
+      }
+      // Copy forward the oldest records still in use
+      llfio::file_handle::extent_type appendoffset = length;
+      std::vector<llfio::byte> buffer;
+      _index_update_guard updating(*this);
+      auto rit = records.rbegin();
+      for(; rit != records.rend() && ret.examined < bytes; ++rit)
+      {
+        const size_t recordlength = static_cast<size_t>(rit->second - rit->first);
+        ret.examined += recordlength;
+        buffer.resize(recordlength);
+        read(rit->first, buffer.data(), recordlength);
+        const index::value_tail *vt = reinterpret_cast<const index::value_tail *>(buffer.data() + recordlength - sizeof(index::value_tail));
+        if(vt->length == (uint64_t) -1)
+        {
+          // Deletion records are never referenced by the index
+          continue;
+        }
+        auto it = _index->find_exclusive(vt->key);
+        if(it == _index->end())
+        {
+          continue;
+        }
+        auto references = [&](const index::value_history::item &h) { return h.transaction_counter == vt->transaction_counter && h.value_identifier == _mysmallfileidx && h.value_offset == rit->second / 64; };
+        if(std::none_of(std::begin(it->second.history), std::end(it->second.history), references))
+        {
+          continue;
+        }
+        _mysmallfile.write(appendoffset, {{buffer.data(), recordlength}}).value();
+        appendoffset += recordlength;
+        ret.copied += recordlength;
+        _indexheader->writes_occurring[_mysmallfileidx].fetch_add(1);
+        for(auto &h : it->second.history)
+        {
+          if(references(h))
+          {
+            h.value_offset = appendoffset / 64;
+          }
+        }
+        _indexheader->writes_occurring[_mysmallfileidx].fetch_sub(1);
+      }
+      updating.release();
+      {
+        // The copies are in the index already
+        std::lock_guard<decltype(_snapshots.committinglock)> g(_snapshots.committinglock);
+        if(_snapshots.committing.empty())
+        {
+          _checkpoint();
+        }
+      }
+      // Nothing in the region examined is referenced by the index any more, though snapshots taken
+      // before now may still see its records through history records
+      _reclaim.push_back({index::counter_of(_indexheader->transaction_counter.load(std::memory_order_seq_cst)), records.back().first, (rit - 1)->second});
+      ret.released = _release_reclaimable();
+      return ret;
+    }
+
     //! Retrieve when keys were last updated by setting the second to the latest transaction counter.
     //! Note that counter will be `(uint64_t)-1` for any unknown keys. Never throws exceptions.
     void last_updated(span<std::pair<key_type, uint64_t>> keys) noexcept
     {
+      if(_indexheader->moved)
+      {
+        // Switching to the grown index may throw, whereas the old index is still readable
+        try
+        {
+          _switch_index();
+        }
+        catch(...)
+        {
+        }
+      }
       for(auto &key : keys)
       {
         auto it = _index->find_shared(key.first);
@@ -394,146 +2518,682 @@ namespace key_value_store
         {
           key.second = (uint64_t) -1;
         }
-        else
+        else
+        {
+          key.second = it->second.history[0].transaction_counter;
+        }
+      }
+    }
+    //! Information about a key value
+    struct keyvalue_info
+    {
+      friend class basic_key_value_store;
+      friend class transaction;
+      //! The key
+      key_type key;
+      //! The value
+      span<const char> value;
+      //! When this value was last modified
+      uint64_t transaction_counter;
+
+      keyvalue_info(keyvalue_info &&o) noexcept : key(std::move(o.key)),
+                                                  value(std::move(o.value)),
+                                                  transaction_counter(std::move(o.transaction_counter)),
+                                                  _chunk(o._chunk),
+                                                  _mapping(std::move(o._mapping)),
+                                                  _pinner(o._pinner),
+                                                  _pinned_at(o._pinned_at),
+                                                  _decompressed(std::move(o._decompressed)),
+                                                  _compressed(o._compressed)
+      {
+        o._chunk = nullptr;
+        o._mapping.reset();
+        o._pinner = nullptr;
+      }
+      keyvalue_info &operator=(keyvalue_info &&o) noexcept
+      {
+        this->~keyvalue_info();
+        new(this) keyvalue_info(std::move(o));
+        return *this;
+      }
+      ~keyvalue_info()
+      {
+        if(_chunk != nullptr)
+        {
+          _chunk->release();
+        }
+        if(_pinner != nullptr)
+        {
+          _pinner->_unpin(_pinned_at);
+        }
+      }
+
+      //! True if this info contains a valid value
+      explicit operator bool() const noexcept { return transaction_counter != (uint64_t) -1; }
+
+    private:
+      keyvalue_info()
+          : key(0)
+          , transaction_counter((uint64_t) -1)
+      {
+      }
+      keyvalue_info(key_type _key)
+          : key(_key)
+          , transaction_counter((uint64_t) -1)
+      {
+      }
+      _arena_chunk *_chunk{nullptr};              // arena chunk holding a copy of the value
+      optional<llfio::mapped<char>> _mapping;     // map of the value's record in its smallfile
+      basic_key_value_store *_pinner{nullptr};    // store in whose smallfile the value's record is pinned
+      llfio::file_handle::extent_type _pinned_at;  // offset of the pinned record
+      std::unique_ptr<char[]> _decompressed;      // decompression of a value too big for the arena
+      bool _compressed{false};                    // if value is still compressed
+    };
+
+    /*! \brief A consistent view of the store as of a transaction counter, for `find()` and `find_many()`.
+
+    Whilst any user of the store has a snapshot pinned, the commits of every writer preserve the
+    revisions which it could see in history records chained from the index, and consolidation of
+    free space does not deallocate any records which it could still need. Keep snapshots short lived,
+    and destroy them before the store.
+    */
+    class snapshot
+    {
+      friend class basic_key_value_store;
+      basic_key_value_store *_parent{nullptr};
+      uint64_t _pinned{0};   // the transaction counter published as pinned
+      uint64_t _counter{0};  // the transaction counter of the last commit visible
+
+      snapshot(basic_key_value_store *parent, uint64_t pinned, uint64_t counter)
+          : _parent(parent)
+          , _pinned(pinned)
+          , _counter(counter)
+      {
+      }
+
+    public:
+      snapshot(snapshot &&o) noexcept : _parent(o._parent), _pinned(o._pinned), _counter(o._counter) { o._parent = nullptr; }
+      snapshot &operator=(snapshot &&o) noexcept
+      {
+        this->~snapshot();
+        new(this) snapshot(std::move(o));
+        return *this;
+      }
+      ~snapshot()
+      {
+        if(_parent != nullptr)
+        {
+          _parent->_unpin_snapshot(_pinned);
+        }
+      }
+      //! The counter of the last commit visible to this snapshot, which is its transaction counter shifted right 16 bits
+      uint64_t transaction_counter() const noexcept { return _counter; }
+    };
+    /*! \brief Pins a snapshot of the store as of the latest commit.
+
+    The snapshot is published in the file "snapshots" in the store's directory, which requires
+    write access to it. Commits of any writer which took an earlier transaction counter are
+    waited for until they have updated the index, so a snapshot sees all or none of each commit.
+    */
+    snapshot take_snapshot()
+    {
+      _check_index();
+      if(_indexheader->magic != _goodmagic)
+        throw corrupted_store();
+      uint64_t pinned, counter;
+      {
+        std::lock_guard<decltype(_snapshots.lock)> g(_snapshots.lock);
+        if(!_snapshots.file.is_valid())
+        {
+          _open_snapshots();
+        }
+        std::atomic<uint64_t> *slots = _snapshot_slots();
+        if(_snapshots.slot == (size_t) -1)
+        {
+          // Claim the first free slot, clearing any left set by users which exited with snapshots pinned
+          for(size_t n = 0; n < _snapshotslots; n++)
+          {
+            if(_snapshots.slot != (size_t) -1 && slots[n].load(std::memory_order_relaxed) == 0)
+            {
+              continue;
+            }
+            auto claimed = _snapshots.file.try_lock(n, 1, true);
+            if(!claimed)
+            {
+              continue;
+            }
+            slots[n].store(0, std::memory_order_seq_cst);
+            if(_snapshots.slot == (size_t) -1)
+            {
+              _snapshots.slot = n;
+              _snapshots.guard = std::move(claimed).value();
+            }
+          }
+          if(_snapshots.slot == (size_t) -1)
+            throw std::runtime_error("every user slot in the store's snapshots file has been claimed");
+        }
+        pinned = index::counter_of(_indexheader->transaction_counter.load(std::memory_order_seq_cst));
+        _snapshots.pinned.insert(pinned);
+        slots[_snapshots.slot].store(*_snapshots.pinned.begin() + 1, std::memory_order_seq_cst);
+        // Commits which read the pins before they were published took no later a transaction counter
+        counter = index::counter_of(_indexheader->transaction_counter.load(std::memory_order_seq_cst));
+      }
+      snapshot ret(this, pinned, counter);
+      _wait_for_commits(counter);
+      return ret;
+    }
+
+  private:
+    // Opens the smallfiles up to idx if writers created them since the store was opened
+    void _open_smallfile(size_t idx)
+    {
+      if(idx < _smallfiles.count.load(std::memory_order_acquire))
+      {
+        return;
+      }
+      std::lock_guard<std::mutex> g(_smallfiles.lock);
+      for(size_t n = _smallfiles.count.load(std::memory_order_relaxed); n <= idx; n++)
+      {
+        if(n >= 48)
+        {
+          throw corrupted_store();
+        }
+        // As in _openfiles(), others' smallfiles are only ever read
+        auto fh = llfio::file_handle::file(_dir, std::to_string(n), llfio::file_handle::mode::read, llfio::file_handle::creation::open_existing, llfio::file_handle::caching::all, llfio::file_handle::flag::disable_prefetching);
+        if(!fh)
+        {
+          // The index locates a record in a smallfile which doesn't exist
+          throw corrupted_store();
+        }
+        if(_smallfiles.mapped.empty())
+        {
+          _smallfiles.blocking.push_back(std::move(fh).value());
+        }
+        else
+        {
+          auto currentlength = fh.value().maximum_extent().value();
+          _smallfiles.mapped.push_back(llfio::mapped_file_handle(std::move(fh).value(), currentlength + _mmap_over_extension));
+        }
+        _smallfiles.count.store(n + 1, std::memory_order_release);
+      }
+    }
+    // Returns the address of a mapped smallfile, extending its map to cover at least end
+    llfio::byte *_mapped_smallfile(size_t idx, llfio::file_handle::extent_type end)
+    {
+      auto mappedlength = _smallfiles.mapped[idx].maximum_extent().value();
+      if(end > mappedlength)
+      {
+        // Update mapping to match the underlying file
+        mappedlength = _smallfiles.mapped[idx].update_map().value();
+        if(mappedlength > _smallfiles.mapped[idx].capacity())
+        {
+          // Need to remap into a new space
+          mappedlength = _smallfiles.mapped[idx].reserve(mappedlength + _mmap_over_extension).value();
+        }
+      }
+      return _smallfiles.mapped[idx].address();
+    }
+    // Maps a record into the value which will view it
+    llfio::byte *_map_record(keyvalue_info &kvi, size_t idx, llfio::file_handle::extent_type offset, size_t length)
+    {
+      // Copy on write, as checking the hash modifies the tail
+      kvi._mapping.emplace(_smallfiles.blocking[idx], length, 0, offset, llfio::section_handle::flag::read | llfio::section_handle::flag::cow);
+      return reinterpret_cast<llfio::byte *>(kvi._mapping->data());
+    }
+    void _pin(keyvalue_info &kvi, llfio::file_handle::extent_type offset)
+    {
+      _pin(offset);
+      kvi._pinner = this;
+      kvi._pinned_at = offset;
+    }
+    // Checks the tail of a fetched record matches what the index said, and if so sets the value to it
+    void _check_record(keyvalue_info &kvi, llfio::byte *buffer, uint64_t length, size_t smallfilelength, uint64_t transaction_counter)
+    {
+      const size_t bytes = static_cast<size_t>(length & ~index::compressed_bit);
+      index::value_tail *vt = reinterpret_cast<index::value_tail *>(buffer + smallfilelength - sizeof(index::value_tail));
+      if(_indexheader->contents_hashed || _indexheader->key_is_hash_of_value)
+      {
+        uint128 tocheck = vt->hash;
+        memset(&vt->hash, 0, sizeof(vt->hash));
+        uint128 thishash = QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((char *) buffer, _indexheader->contents_hashed ? smallfilelength : bytes);
+        if(tocheck != thishash)
+        {
+          _indexheader->magic = _badmagic;
+          throw corrupted_store();
+        }
+      }
+      if(vt->key != kvi.key)
+      {
+        _indexheader->magic = _badmagic;
+        throw corrupted_store();
+      }
+      if(vt->length != length)
+      {
+        _indexheader->magic = _badmagic;
+        throw corrupted_store();
+      }
+      if(vt->transaction_counter != transaction_counter)
+      {
+        _indexheader->magic = _badmagic;
+        throw corrupted_store();
+      }
+      kvi.value = span<const char>((const char *) buffer, bytes);
+      kvi.transaction_counter = transaction_counter;
+      kvi._compressed = (length & index::compressed_bit) != 0;
+    }
+    // Returns the dictionary with which a value was compressed, null if none
+    std::shared_ptr<const compression::dictionary> _dictionary_of(span<const char> compressed)
+    {
+      const uint16_t id = compression::dictionary_of(compressed);
+      return (id != 0) ? _dictionary(id) : nullptr;
+    }
+    // Replaces the compressed value viewed by kvi with its decompression
+    void _decompress(keyvalue_info &kvi)
+    {
+      const size_t length = compression::decompressed_length(kvi.value);
+      if(length == (size_t) -1)
+      {
+        _indexheader->magic = _badmagic;
+        throw corrupted_store();
+      }
+      auto dict = _dictionary_of(kvi.value);
+      llfio::byte *out;
+      _arena_chunk *chunk = nullptr;
+      std::unique_ptr<char[]> decompressed;
+      if(length <= _mapped_value_threshold())
+      {
+        chunk = _this_thread_arena().allocate(length, out);
+      }
+      else
+      {
+        decompressed.reset(new char[length]);
+        out = reinterpret_cast<llfio::byte *>(decompressed.get());
+      }
+      if(!compression::decompress({(char *) out, length}, kvi.value, dict.get()))
+      {
+        if(chunk != nullptr)
+        {
+          chunk->release();
+        }
+        _indexheader->magic = _badmagic;
+        throw corrupted_store();
+      }
+      // The record is no longer viewed
+      if(kvi._chunk != nullptr)
+      {
+        kvi._chunk->release();
+      }
+      kvi._chunk = chunk;
+      kvi._mapping.reset();
+      if(kvi._pinner != nullptr)
+      {
+        kvi._pinner->_unpin(kvi._pinned_at);
+        kvi._pinner = nullptr;
+      }
+      kvi._decompressed = std::move(decompressed);
+      kvi._compressed = false;
+      kvi.value = span<const char>((const char *) out, length);
+    }
+
+    // Returns a picker of the revision visible to a snapshot for _resolve()
+    static auto _visible_to(uint64_t counter)
+    {
+      return [counter](const index::value_history::item &item, size_t /*unused*/) { return item.transaction_counter != 0 && index::counter_of(item.transaction_counter) <= counter; };
+    }
+    // Returns a picker of a revision for _resolve()
+    static auto _revision(size_t revision)
+    {
+      return [revision](const index::value_history::item & /*unused*/, size_t r) { return r == revision; };
+    }
+    template <class F> keyvalue_info _find(key_type key, F &&pick, bool decompress = true)
+    {
+      _check_index();
+      if(_indexheader->magic != _goodmagic)
+        throw corrupted_store();
+      keyvalue_info ret(key);
+      auto it = _index->find_shared(key);
+      if(it == _index->end())
+      {
+        // No value as no key
+        return ret;
+      }
+      else
+      {
+        const index::value_history::item item = _resolve(key, it->second, pick);
+        if(!_has_value(item))
+        {
+          // No value on the key at this revision
+          return ret;
+        }
+        const uint64_t length = item.length;
+        const size_t smallfilelength = _pad_length(static_cast<size_t>(length & ~index::compressed_bit));
+        _open_smallfile(item.value_identifier);
+        const llfio::file_handle::extent_type recordoffset = item.value_offset * 64 - smallfilelength;
+        llfio::byte *buffer;
+        if(!_smallfiles.mapped.empty())
+        {
+          buffer = _mapped_smallfile(item.value_identifier, item.value_offset * 64) + recordoffset;
+        }
+        else if(smallfilelength <= _mapped_value_threshold())
+        {
+          ret._chunk = _this_thread_arena().allocate(smallfilelength, buffer);
+          _smallfiles.blocking[item.value_identifier].read(recordoffset, {{buffer, smallfilelength}}).value();
+        }
+        else
+        {
+          buffer = _map_record(ret, item.value_identifier, recordoffset, smallfilelength);
+        }
+        if(ret._chunk == nullptr && item.value_identifier == _mysmallfileidx)
+        {
+          // We hold the shared lock on the key, so consolidation cannot yet have repointed it
+          _pin(ret, recordoffset);
+        }
+        _check_record(ret, buffer, length, smallfilelength, item.transaction_counter);
+        if(decompress && ret._compressed)
+        {
+          _decompress(ret);
+        }
+        return ret;
+      }
+    }
+    template <class F> std::vector<keyvalue_info> _find_many(span<const key_type> keys, F &&pick)
+    {
+      _check_index();
+      if(_indexheader->magic != _goodmagic)
+        throw corrupted_store();
+      std::vector<keyvalue_info> ret;
+      ret.reserve(keys.size());
+      for(const auto &key : keys)
+      {
+        ret.push_back(keyvalue_info(key));
+      }
+      // Take the shared locks in key order as commits do, so we cannot deadlock with them
+      std::vector<size_t> order(keys.size());
+      for(size_t n = 0; n < order.size(); n++)
+      {
+        order[n] = n;
+      }
+      std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+      struct fetch_type
+      {
+        size_t idx;
+        size_t smallfile;
+        llfio::file_handle::extent_type offset;
+        uint64_t length;
+        size_t smallfilelength;
+        uint64_t transaction_counter;
+        llfio::byte *buffer;
+      };
+      std::vector<fetch_type> fetches;
+      fetches.reserve(keys.size());
+      std::vector<index::open_hash_index::const_iterator> shared_locks;
+      shared_locks.reserve(keys.size());
+      std::vector<size_t> duplicates;
+      for(size_t n = 0; n < order.size(); n++)
+      {
+        const size_t idx = order[n];
+        if(n > 0 && keys[order[n - 1]] == keys[idx])
+        {
+          duplicates.push_back(idx);
+          continue;
+        }
+        auto it = _index->find_shared(keys[idx]);
+        if(it == _index->end())
+        {
+          continue;
+        }
+        const index::value_history::item item = _resolve(keys[idx], it->second, pick);
+        if(!_has_value(item))
+        {
+          continue;
+        }
+        _open_smallfile(item.value_identifier);
+        const size_t smallfilelength = _pad_length(static_cast<size_t>(item.length & ~index::compressed_bit));
+        fetches.push_back({idx, item.value_identifier, item.value_offset * 64 - smallfilelength, item.length, smallfilelength, item.transaction_counter, nullptr});
+        shared_locks.push_back(std::move(it));
+      }
+      std::sort(fetches.begin(), fetches.end(), [](const fetch_type &a, const fetch_type &b) { return (a.smallfile < b.smallfile) || (a.smallfile == b.smallfile && a.offset < b.offset); });
+      if(!_smallfiles.mapped.empty())
+      {
+        // Touch the mapped records in order
+        for(auto &f : fetches)
         {
-          key.second = it->second.history[0].transaction_counter;
+          f.buffer = _mapped_smallfile(f.smallfile, f.offset + f.smallfilelength) + f.offset;
         }
       }
-    }
-    //! Information about a key value
-    struct keyvalue_info
-    {
-      friend class basic_key_value_store;
-      friend class transaction;
-      //! The key
-      key_type key;
-      //! The value
-      span<const char> value;
-      //! When this value was last modified
-      uint64_t transaction_counter;
-
-      keyvalue_info(keyvalue_info &&o) noexcept : key(std::move(o.key)), value(std::move(o.value)), transaction_counter(std::move(o.transaction_counter)), _value_buffer(std::move(o._value_buffer)) { o._value_buffer = nullptr; }
-      keyvalue_info &operator=(keyvalue_info &&o) noexcept
+      else
       {
-        this->~keyvalue_info();
-        new(this) keyvalue_info(std::move(o));
-        return *this;
+        llfio::byte gap[4096];
+        std::vector<llfio::file_handle::buffer_type> reqs;
+        for(size_t n = 0; n < fetches.size();)
+        {
+          fetch_type &first = fetches[n];
+          if(first.smallfilelength > _mapped_value_threshold())
+          {
+            first.buffer = _map_record(ret[first.idx], first.smallfile, first.offset, first.smallfilelength);
+            ++n;
+            continue;
+          }
+          // Scatter read a run of small records, reading any gaps between them into scratch
+          auto &fh = _smallfiles.blocking[first.smallfile];
+          const size_t maxbuffers = std::max<size_t>(fh.max_buffers(), 16);
+          llfio::file_handle::extent_type readend = first.offset;
+          reqs.clear();
+          for(; n < fetches.size(); n++)
+          {
+            fetch_type &f = fetches[n];
+            if(f.smallfile != first.smallfile || f.smallfilelength > _mapped_value_threshold() || f.offset - readend > sizeof(gap) || reqs.size() + 2 > maxbuffers)
+            {
+              break;
+            }
+            if(f.offset > readend)
+            {
+              reqs.push_back({gap, static_cast<size_t>(f.offset - readend)});
+            }
+            ret[f.idx]._chunk = _this_thread_arena().allocate(f.smallfilelength, f.buffer);
+            reqs.push_back({f.buffer, f.smallfilelength});
+            readend = f.offset + f.smallfilelength;
+          }
+          fh.read({reqs, first.offset}).value();
+        }
       }
-      ~keyvalue_info()
+      for(auto &f : fetches)
       {
-        if(_value_buffer != nullptr)
+        keyvalue_info &kvi = ret[f.idx];
+        if(kvi._chunk == nullptr && f.smallfile == _mysmallfileidx)
+        {
+          _pin(kvi, f.offset);
+        }
+        _check_record(kvi, f.buffer, f.length, f.smallfilelength, f.transaction_counter);
+        if(kvi._compressed)
         {
-          free(_value_buffer);
+          _decompress(kvi);
         }
       }
-
-      //! True if this info contains a valid value
-      explicit operator bool() const noexcept { return transaction_counter != (uint64_t) -1; }
-
-    private:
-      keyvalue_info()
-          : key(0)
-          , transaction_counter((uint64_t) -1)
+      shared_locks.clear();
+      for(size_t idx : duplicates)
       {
+        ret[idx] = _find(keys[idx], pick);
       }
-      keyvalue_info(key_type _key)
-          : key(_key)
-          , transaction_counter((uint64_t) -1)
+      return ret;
+    }
+
+    template <class F> size_t _read(key_type key, span<char> buffer, F &&pick)
+    {
+      keyvalue_info kvi = _find(key, pick, false);
+      if(!kvi)
       {
+        return (size_t) -1;
       }
-      keyvalue_info(key_type _key, span<char> buffer, bool free_on_destruct, uint64_t tc)
-          : key(_key)
-          , value(buffer)
-          , transaction_counter(tc)
-          , _value_buffer(free_on_destruct ? buffer.data() : nullptr)
+      if(!kvi._compressed)
       {
+        if(kvi.value.size() <= buffer.size())
+        {
+          memcpy(buffer.data(), kvi.value.data(), kvi.value.size());
+        }
+        return kvi.value.size();
       }
-      char *_value_buffer{nullptr};
-    };
-    //! Retrieve the latest value for a key. May throw `corrupted_store`
-    keyvalue_info find(key_type key, size_t revision = 0)
-    {
-      if(_indexheader->magic != _goodmagic)
-        throw corrupted_store();
-      if(revision >= 4)
-        throw std::invalid_argument("valid revision is 0-3");
-      auto it = _index->find_shared(key);
-      if(it == _index->end())
+      const size_t length = compression::decompressed_length(kvi.value);
+      if(length == (size_t) -1 || (length <= buffer.size() && !compression::decompress(buffer, kvi.value, _dictionary_of(kvi.value).get())))
       {
-        // No value as no key
-        return keyvalue_info(key);
+        _indexheader->magic = _badmagic;
+        throw corrupted_store();
       }
-      else
+      return length;
+    }
+
+  public:
+    /*! \brief Retrieve the latest value for a key, or an earlier revision of it. May throw `corrupted_store`
+
+    Revision 0 is the latest, 1 the one before and so on, with removals of the key counting as revisions.
+    The latest four revisions are kept in the index, and older revisions only whilst a snapshot which
+    could see them was pinned, as commits evicting them from the index preserve them in history records.
+
+    If the store is using mmaps, the value returned is a view of the mapped smallfile. Otherwise
+    values whose records are larger than 64Kb are returned as a view of a new map of their record,
+    and smaller values are copied into a chunk of memory belonging to this thread, which is
+    freed once every value copied into it has been destroyed. Views of records in my smallfile
+    stop `consolidate_free_space()` deallocating them until the value is destroyed.
+    */
+    keyvalue_info find(key_type key, size_t revision = 0) { return _find(key, _revision(revision)); }
+    //! \brief Retrieve the value of a key as of a snapshot. May throw `corrupted_store`
+    keyvalue_info find(key_type key, const snapshot &s) { return _find(key, _visible_to(s.transaction_counter())); }
+    /*! \brief Retrieve the values of many keys at once. May throw `corrupted_store`
+
+    Returns the same as calling `find()` for each key in turn, but first looks up all the keys in
+    the index, then fetches their records sorted by smallfile and offset. When not using mmaps,
+    runs of records separated by less than 4Kb are fetched with a single scatter read.
+    */
+    std::vector<keyvalue_info> find_many(span<const key_type> keys, size_t revision = 0) { return _find_many(keys, _revision(revision)); }
+    //! \brief Retrieve the values of many keys at once as of a snapshot. May throw `corrupted_store`
+    std::vector<keyvalue_info> find_many(span<const key_type> keys, const snapshot &s) { return _find_many(keys, _visible_to(s.transaction_counter())); }
+    /*! \brief Copies the latest value for a key, or an earlier revision of it, into a buffer. May throw `corrupted_store`
+
+    Compressed values are decompressed straight into the buffer rather than via memory of this thread.
+    Returns the length of the value, which is copied only if the buffer is big enough for it, or
+    `(size_t) -1` if there is no value.
+    */
+    size_t read(key_type key, span<char> buffer, size_t revision = 0) { return _read(key, buffer, _revision(revision)); }
+    //! \brief Copies the value of a key as of a snapshot into a buffer. May throw `corrupted_store`
+    size_t read(key_type key, span<char> buffer, const snapshot &s) { return _read(key, buffer, _visible_to(s.transaction_counter())); }
+
+    /*! \brief Sets whether the commits of this store instance compress values at least `min_length` long.
+
+    Each value is compressed with `compression::compress()` using the store's current dictionary,
+    if `train_dictionary()` has made one, and is stored compressed only if that makes its record at
+    least 64 bytes shorter. The record is marked as compressed by `index::compressed_bit` in its
+    length, and every user of the store decompresses it on fetch. Values are compressed before the
+    commit serialises with other commits. A `min_length` of `(size_t) -1` turns compression off.
+    */
+    void use_compression(size_t min_length = 256) { _compression.min_length.store(min_length, std::memory_order_relaxed); }
+    /*! \brief Builds a dictionary from samples of values with which all writers will compress values.
+
+    The dictionary, of at most 64Kb, is written to a new file "dictionary.<n>" in the store's directory,
+    which is never changed as records compressed with it name it, then becomes the store's current
+    dictionary. Returns its `n`.
+    */
+    uint16_t train_dictionary(span<const span<const char>> samples, size_t max_size = compression::dictionary::max_size)
+    {
+      if(!_mysmallfile.is_valid())
+        throw std::invalid_argument("the store must be opened for writing to train a dictionary");
+      _check_index();
+      std::vector<char> data = compression::train(samples, std::min(max_size, size_t(compression::dictionary::max_size)));
+      for(auto id = static_cast<uint16_t>(_indexheader->dictionary.load(std::memory_order_acquire) + 1); id != 0; id++)
       {
-        // TODO Depending on length, make a mapped_span instead
-        const auto &item = it->second.history[revision];
-        if(item.transaction_counter == 0)
+        auto fh = llfio::file_handle::file(_dir, "dictionary." + std::to_string(id), llfio::file_handle::mode::write, llfio::file_handle::creation::only_if_not_exist);
+        if(!fh)
         {
-          // No value on the key at this revision
-          return keyvalue_info(key);
+          // Another writer trained that one
+          continue;
         }
-        size_t length = item.length, smallfilelength = _pad_length(length);
-        if(item.value_identifier >= _smallfiles.blocking.size() && item.value_identifier >= _smallfiles.mapped.size())
+        fh.value().write(0, {{reinterpret_cast<const llfio::byte *>(data.data()), data.size()}}).value();
+        fh.value().barrier().value();
         {
-          // TODO: Open newly created smallfiles
-          abort();
+          std::lock_guard<decltype(_compression.lock)> g(_compression.lock);
+          _compression.loaded.emplace(id, std::make_shared<compression::dictionary>(id, std::move(data)));
         }
-        llfio::byte *buffer;
-        bool free_on_destruct = _smallfiles.mapped.empty();
-        if(!free_on_destruct)
+        // Publish in the index header under the update lock, so an index being grown can't copy the header
+        // from before it, and a newer dictionary another writer published whilst we trained is kept
+        for(;;)
         {
-          auto mappedlength = _smallfiles.mapped[item.value_identifier].maximum_extent().value();
-          if(item.value_offset * 64 > mappedlength)
+          _check_index();
+          std::lock_guard<decltype(_indexupdatelock)> g(_indexupdatelock);
+          auto updateguard = _indexfile.lock(_indexupdateoffset, 1, true).value();
+          if(_indexheader->moved)
           {
-            // Update mapping to match the underlying file
-            mappedlength = _smallfiles.mapped[item.value_identifier].update_map().value();
-            if(mappedlength > _smallfiles.mapped[item.value_identifier].capacity())
-            {
-              // Need to remap into a new space
-              mappedlength = _smallfiles.mapped[item.value_identifier].reserve(mappedlength + _mmap_over_extension).value();
-            }
+            continue;
           }
-          buffer = _smallfiles.mapped[item.value_identifier].address() + item.value_offset * 64 - smallfilelength;
-        }
-        else
-        {
-          buffer = (llfio::byte *) malloc(smallfilelength);
-          if(!buffer)
+          if(_indexheader->dictionary.load(std::memory_order_relaxed) < id)
           {
-            throw std::bad_alloc();
+            _indexheader->dictionary.store(id, std::memory_order_release);
           }
-          _smallfiles.blocking[item.value_identifier].read(item.value_offset * 64 - smallfilelength, {{buffer, smallfilelength}}).value();
+          return id;
         }
-        index::value_tail *vt = reinterpret_cast<index::value_tail *>(buffer + smallfilelength - sizeof(index::value_tail));
-        if(_indexheader->contents_hashed || _indexheader->key_is_hash_of_value)
+      }
+      throw std::runtime_error("every dictionary identifier has been used");
+    }
+
+    /*! \brief Enables iterating keys in order using `scan()` and `match()` for all users of the store.
+
+    A B+tree of the keys is kept in the file "ordered", and is updated by every commit of every writer
+    after the index, so a commit may be briefly visible to `find()` before it is to `scan()`. It
+    is built from the records in the smallfiles when first used, and rebuilt if a process died
+    whilst updating it. Requires the store to have been opened for writing.
+    */
+    void use_ordered_index()
+    {
+      if(!_mysmallfile.is_valid())
+        throw std::invalid_argument("the store must be opened for writing to enable its ordered index");
+      _indexheader->has_ordered_index = true;
+      _ordered_index()->update({}, {});
+    }
+    /*! \brief Calls `f(keyvalue_info &)` in key order for each key from `begin` up to but not including
+    `end` which has a latest value, until `f` returns false. Requires `use_ordered_index()`.
+
+    Keys are ordered by their value as unsigned 128 bit integers. Keys are fetched from the ordered
+    index in batches of `batch` using `find_many()`, and no locks are held whilst `f` is called, so
+    values are streamed rather than the whole range being fetched first. Keys updated concurrently
+    with the scan may or may not be seen.
+    */
+    template <class F> void scan(key_type begin, key_type end, F &&f, size_t batch = 256)
+    {
+      if(index::ordered_index::less(begin, end))
+      {
+        key_type mask;
+        mask.as_longlongs[0] = mask.as_longlongs[1] = 0;
+        _scan(begin, index::ordered_index::previous(end), mask, mask, f, batch);
+      }
+    }
+    /*! \brief Calls `f(keyvalue_info &)` in key order for each key where `(key & mask) == bits` which
+    has a latest value, until `f` returns false. Requires `use_ordered_index()`.
+
+    Only the keys between those matching the leading one bits of `mask` are visited, so matching a
+    prefix of the key is efficient, whereas any further bits of `mask` are matched by filtering
+    those keys. A default initialised mask and bits matches all keys. See `scan()`.
+    */
+    template <class F> void match(key_type mask, key_type bits, F &&f, size_t batch = 256)
+    {
+      key_type first, last;
+      bool prefix = true;
+      for(size_t n = 2; n-- > 0;)
+      {
+        uint64_t prefixmask = 0;
+        for(size_t bit = 64; prefix && bit-- > 0;)
         {
-          QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash hasher;
-          uint128 tocheck = vt->hash;
-          memset(&vt->hash, 0, sizeof(vt->hash));
-          uint128 thishash = QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((char *) buffer, _indexheader->contents_hashed ? smallfilelength : length);
-          if(tocheck != thishash)
+          if(mask.as_longlongs[n] & (1ULL << bit))
           {
-            _indexheader->magic = _badmagic;
-            throw corrupted_store();
+            prefixmask |= 1ULL << bit;
+          }
+          else
+          {
+            prefix = false;
           }
         }
-        if(vt->key != key)
-        {
-          _indexheader->magic = _badmagic;
-          throw corrupted_store();
-        }
-        if(vt->length != length)
-        {
-          _indexheader->magic = _badmagic;
-          throw corrupted_store();
-        }
-        if(vt->transaction_counter != item.transaction_counter)
-        {
-          _indexheader->magic = _badmagic;
-          throw corrupted_store();
-        }
-        return keyvalue_info(key, span<char>((char *) buffer, length), free_on_destruct, item.transaction_counter);
+        bits.as_longlongs[n] &= mask.as_longlongs[n];
+        first.as_longlongs[n] = bits.as_longlongs[n] & prefixmask;
+        last.as_longlongs[n] = first.as_longlongs[n] | ~prefixmask;
       }
+      _scan(first, last, mask, bits, f, batch);
     }
   };
 
@@ -547,12 +3207,17 @@ namespace key_value_store
     {
       basic_key_value_store::keyvalue_info kvi;   // the item's value when fetched
       llfio::optional<span<const char>> towrite;  // the value to be written on commit
+      std::vector<char> compressed;               // towrite compressed on commit, if that saves space
       bool remove;                                // true if to remove
       _item(basic_key_value_store::keyvalue_info &&_kvi)
           : kvi(std::move(_kvi))
           , remove(false)
       {
       }
+      // What is written of the value
+      span<const char> stored() const { return compressed.empty() ? *towrite : span<const char>(compressed.data(), compressed.size()); }
+      // The length of what is written with any compressed_bit
+      uint64_t stored_length() const { return compressed.empty() ? towrite->size() : (compressed.size() | index::compressed_bit); }
     };
     std::vector<_item> _items;
 
@@ -663,6 +3328,15 @@ namespace key_value_store
       // in the same order, thus preventing deadlock.
       _items.erase(std::remove_if(_items.begin(), _items.end(), [](const auto &item) { return !item.towrite.has_value() && !item.remove; }), _items.end());
       std::sort(_items.begin(), _items.end(), [](const _item &a, const _item &b) { return a.kvi.key < b.kvi.key; });
+      // Compress values before serialising with other commits of this store instance
+      for(auto &item : _items)
+      {
+        item.compressed.clear();
+        if(item.towrite.has_value())
+        {
+          item.compressed = _parent->_compress(*item.towrite);
+        }
+      }
 
       // The update list, filled in as we progress
       struct toupdate_type
@@ -670,8 +3344,12 @@ namespace key_value_store
         const key_type key;
         const uint64_t old_transaction_counter;
         const bool insertion, update, removal;
+        bool inserted{false};  // if the key was inserted into the index by this commit
         index::value_history::item history_item{};
         index::open_hash_index::iterator it{};
+        index::value_history seen{};  // the key's history when its record was prepared
+        size_t chained{0};            // items of seen evicted from the index preserved in a history record
+        index::value_history::item link{};
         toupdate_type(key_type _key, uint64_t _old_transaction_counter, bool _insertion, bool _update, bool _removal)
             : key(_key)
             , old_transaction_counter(_old_transaction_counter)
@@ -683,273 +3361,382 @@ namespace key_value_store
       };
       std::vector<toupdate_type> toupdate;
       toupdate.reserve(_items.size());
-      // Serialise multiple threads issuing commit using the same store
-      std::lock_guard<decltype(_parent->_commitlock)> commitlockguard(_parent->_commitlock);
-
-      // Take out shared locks on all the items in my commit with existing values, early checking if we will abort
-      std::vector<index::open_hash_index::const_iterator> shared_locks;
-      shared_locks.reserve(_items.size());
-      for(const auto &item : _items)
+      // The records to be appended to my smallfile, with storage for their tails
+      basic_key_value_store::_appends::entry appends;
+      std::vector<llfio::byte> tailbuffers, historybuffers;
+      bool appending = false;
+      // Lets snapshots wait for this commit to update the index once it may have taken a transaction counter
+      uint64_t committing = (uint64_t) -1;
+      auto landed = undoer([&] {
+        if(committing != (uint64_t) -1)
+        {
+          _parent->_end_committing(committing);
+        }
+      });
       {
-        bool insertion = false, update = false, removal = false;
-        if(item.towrite.has_value() || item.remove)
+        // Serialise multiple threads preparing commits using the same store
+        std::lock_guard<decltype(_parent->_commitlock)> commitlockguard(_parent->_commitlock);
+        _parent->_check_index();
+
+        // Take out shared locks on all the items in my commit with existing values, early checking if we will abort
+        std::vector<index::open_hash_index::const_iterator> shared_locks;
+        shared_locks.reserve(_items.size());
+        for(const auto &item : _items)
         {
-          auto it = _parent->_index->find_shared(item.kvi.key);
-          if(it != _parent->_index->end())
+          bool insertion = false, update = false, removal = false;
+          index::value_history seen{};
+          if(item.towrite.has_value() || item.remove)
           {
-            // If item was fetched before update and it has since changed, abort
-            if(item.kvi.transaction_counter != (uint64_t) -1 && it->second.history[0].transaction_counter != item.kvi.transaction_counter)
+            auto it = _parent->_index->find_shared(item.kvi.key);
+            if(it != _parent->_index->end())
             {
-              throw transaction_aborted(item.kvi.key);
+              // If item was fetched before update and it has since changed, abort
+              if(item.kvi.transaction_counter != (uint64_t) -1 && it->second.history[0].transaction_counter != item.kvi.transaction_counter)
+              {
+                throw transaction_aborted(item.kvi.key);
+              }
+              seen = it->second;
+              shared_locks.push_back(std::move(it));
+              removal = item.remove;
+              update = !item.remove;
+            }
+            else
+            {
+              insertion = true;
             }
-            shared_locks.push_back(std::move(it));
-            removal = item.remove;
-            update = !item.remove;
-          }
-          else
-          {
-            insertion = true;
           }
+          assert(insertion + update + removal == 1);
+          toupdate.emplace_back(item.kvi.key, item.kvi.transaction_counter, insertion, update, removal);
+          toupdate.back().seen = seen;
         }
-        assert(insertion + update + removal == 1);
-        toupdate.emplace_back(item.kvi.key, item.kvi.transaction_counter, insertion, update, removal);
-      }
-      // Atomically increment the transaction counter to set this latest transaction
-      uint64_t this_transaction_counter = 0;
-      {
-        uint64_t old_transaction_counter;
-        union {
-          struct
-          {
-            uint64_t values_updated : 16;
-            uint64_t counter : 48;
-          };
-          uint64_t this_transaction_counter;
-        } _;
-        do
-        {
-          _.this_transaction_counter = old_transaction_counter = _parent->_indexheader->transaction_counter.load(std::memory_order_acquire);
-          // Increment bottom 48 bits, letting it wrap if necessary
-          _.counter++;
-          _.values_updated = _items.size();
-        } while(!_parent->_indexheader->transaction_counter.compare_exchange_weak(old_transaction_counter, _.this_transaction_counter, std::memory_order_release, std::memory_order_relaxed));
-        this_transaction_counter = _.this_transaction_counter;
-      }
-
-      bool items_written = false;
-      if(!_parent->_smallfiles.mapped.empty())
-      {
-        llfio::file_handle::extent_type original_length = _parent->_mysmallfile.maximum_extent().value();
-        // How big does this map need to be?
-        size_t totalcommitsize = 0;
-        for(size_t n = 0; n < _items.size(); n++)
+        // Atomically increment the transaction counter to set this latest transaction
+        uint64_t this_transaction_counter = 0;
+        committing = _parent->_begin_committing();
         {
-          toupdate_type &thisupdate = toupdate[n];
-          const transaction::_item &item = _items[n];
-          totalcommitsize += thisupdate.removal ? 64 : _parent->_pad_length(item.towrite->size());
+          uint64_t old_transaction_counter;
+          index::transaction_counter_fields _;
+          do
+          {
+            _.this_transaction_counter = old_transaction_counter = _parent->_indexheader->transaction_counter.load(std::memory_order_acquire);
+            // Increment top 48 bits, letting it wrap if necessary
+            _.counter++;
+            _.values_updated = _items.size();
+          } while(!_parent->_indexheader->transaction_counter.compare_exchange_weak(old_transaction_counter, _.this_transaction_counter, std::memory_order_release, std::memory_order_relaxed));
+          this_transaction_counter = _.this_transaction_counter;
         }
-        if(totalcommitsize >= 4096)
+        // Items about to be evicted from the index which a snapshot pinned before now could still see
+        // are preserved in a history record after the item's record, as are any chained from them.
+        // Snapshots pinned after now have a later transaction counter, so can only see newer items.
+        size_t history_records = 0;
         {
-          auto &mfh = _parent->_smallfiles.mapped[_parent->_mysmallfileidx];
-          llfio::file_handle::extent_type new_length = original_length + totalcommitsize;
-          if(new_length > mfh.capacity())
+          uint64_t oldest_snapshot = 0;
+          bool oldest_snapshot_read = false;
+          for(toupdate_type &item : toupdate)
           {
-            mfh.reserve(new_length + _parent->_mmap_over_extension).value();
+            const index::value_history::item *h = item.seen.history;
+            if(item.insertion || (h[3].transaction_counter == 0 && h[3].length == 0))
+            {
+              continue;
+            }
+            if(!oldest_snapshot_read)
+            {
+              oldest_snapshot = _parent->_oldest_snapshot();
+              oldest_snapshot_read = true;
+            }
+            if(oldest_snapshot < index::counter_of(h[1].transaction_counter))
+            {
+              item.chained = (oldest_snapshot < index::counter_of(h[2].transaction_counter)) ? 2 : 1;
+              history_records++;
+            }
           }
-          mfh.truncate(new_length).value();
-          llfio::byte *value = mfh.address() + original_length;
-          llfio::file_handle::extent_type value_offset = original_length;
+        }
+
+        // Where my records will land, allowing for appends of other commits not yet written
+        bool appends_pending = false;
+        const llfio::file_handle::extent_type original_length = _parent->_next_append_offset(&appends_pending);
+        bool items_written = false;
+        if(!_parent->_smallfiles.mapped.empty() && !appends_pending)
+        {
+          // How big does this map need to be?
+          size_t totalcommitsize = 0;
           for(size_t n = 0; n < _items.size(); n++)
           {
             toupdate_type &thisupdate = toupdate[n];
             const transaction::_item &item = _items[n];
-            size_t totalwrite = 0;
-            if(thisupdate.removal)
+            totalcommitsize += thisupdate.removal ? 64 : _parent->_pad_length(item.stored().size());
+          }
+          totalcommitsize += history_records * _parent->_history_record_size;
+          if(totalcommitsize >= 4096)
+          {
+            auto &mfh = _parent->_smallfiles.mapped[_parent->_mysmallfileidx];
+            llfio::file_handle::extent_type new_length = original_length + totalcommitsize;
+            if(new_length > mfh.capacity())
             {
-              totalwrite = 64;
+              mfh.reserve(new_length + _parent->_mmap_over_extension).value();
             }
-            else
+            mfh.truncate(new_length).value();
+            llfio::byte *value = mfh.address() + original_length;
+            llfio::file_handle::extent_type value_offset = original_length;
+            for(size_t n = 0; n < _items.size(); n++)
+            {
+              toupdate_type &thisupdate = toupdate[n];
+              const transaction::_item &item = _items[n];
+              size_t totalwrite = 0;
+              if(thisupdate.removal)
+              {
+                totalwrite = 64;
+              }
+              else
+              {
+                memcpy(value, item.stored().data(), item.stored().size());
+                totalwrite = _parent->_pad_length(item.stored().size());
+              }
+              index::value_tail *vt = reinterpret_cast<index::value_tail *>(value + totalwrite - sizeof(index::value_tail));
+              vt->key = thisupdate.key;
+              vt->transaction_counter = this_transaction_counter;
+              index::value_history::item &history_item = thisupdate.history_item;
+              history_item.transaction_counter = this_transaction_counter;
+              if(thisupdate.removal)
+              {
+                vt->length = (uint64_t) -1;  // this key is being deleted
+                history_item.value_offset = 0;
+                history_item.value_identifier = 0;
+                history_item.length = index::removed_length;
+              }
+              else
+              {
+                vt->length = item.stored_length();
+                history_item.value_offset = (value_offset + totalwrite) / 64;
+                history_item.value_identifier = _parent->_mysmallfileidx;
+                history_item.length = vt->length;
+              }
+              if(_parent->_indexheader->contents_hashed)
+              {
+                vt->hash = QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((char *) value, totalwrite);
+              }
+              value += totalwrite;
+              value_offset += totalwrite;
+              if(thisupdate.chained != 0)
+              {
+                thisupdate.link = _parent->_fill_history_record(value, thisupdate.key, this_transaction_counter, thisupdate.seen.history + 2, thisupdate.chained, value_offset + _parent->_history_record_size);
+                value += _parent->_history_record_size;
+                value_offset += _parent->_history_record_size;
+              }
+            }
+            items_written = true;
+            // Writes through the map are not made durable by the smallfile's caching, so need a barrier
+            if(_parent->_mysmallfile.are_writes_durable())
             {
-              memcpy(value, item.towrite->data(), item.towrite->size());
-              totalwrite = _parent->_pad_length(item.towrite->size());
+              appends.barrier = true;
+              _parent->_enqueue_append(appends, new_length);
+              appending = true;
             }
-            index::value_tail *vt = reinterpret_cast<index::value_tail *>(value + totalwrite - sizeof(index::value_tail));
+          }
+        }
+        if(!items_written)
+        {
+          // Gather append all my items to my smallfile, with the writes issued by whichever
+          // committer leads the group commit this joins
+          llfio::file_handle::extent_type value_offset = original_length;
+          assert((value_offset % 64) == 0);
+          appends.reqs.reserve(_items.size() * 2 + history_records);
+          // Tails occupy the end of a 128 byte buffer per item
+          tailbuffers.resize(_items.size() * 128);
+          historybuffers.resize(history_records * _parent->_history_record_size);
+          llfio::byte *historybuffer = historybuffers.data();
+          for(size_t n = 0; n < _items.size(); n++)
+          {
+            llfio::byte *tailbuffer = tailbuffers.data() + n * 128;
+            index::value_tail *vt = reinterpret_cast<index::value_tail *>(tailbuffer + 128 - sizeof(index::value_tail));
+            toupdate_type &thisupdate = toupdate[n];
+            const transaction::_item &item = _items[n];
             vt->key = thisupdate.key;
             vt->transaction_counter = this_transaction_counter;
+            size_t totalwrite = 0;
             if(thisupdate.removal)
             {
               vt->length = (uint64_t) -1;  // this key is being deleted
-              memset(&thisupdate.history_item, 0, sizeof(thisupdate.history_item));
+              totalwrite = 64;
+              appends.reqs.push_back({tailbuffer + 64, 64});
+              if(_parent->_indexheader->contents_hashed)
+              {
+                QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash hasher;
+                memset(&vt->hash, 0, sizeof(vt->hash));
+                hasher.add((const char *) appends.reqs.back().data(), appends.reqs.back().size());
+                vt->hash = hasher.finalise();
+              }
+              index::value_history::item &history_item = thisupdate.history_item;
+              history_item.transaction_counter = this_transaction_counter;
+              history_item.value_offset = 0;
+              history_item.value_identifier = 0;
+              history_item.length = index::removed_length;
             }
             else
             {
-              vt->length = item.towrite->size();
+              vt->length = item.stored_length();
+              totalwrite = _parent->_pad_length(item.stored().size());
+              size_t tailbytes = totalwrite - item.stored().size();
+              assert(tailbytes < 128);
+              appends.reqs.push_back({(llfio::byte *) item.stored().data(), item.stored().size()});
+              appends.reqs.push_back({tailbuffer + 128 - tailbytes, tailbytes});
+              if(_parent->_indexheader->contents_hashed)
+              {
+                QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash hasher;
+                memset(&vt->hash, 0, sizeof(vt->hash));
+                auto rit = appends.reqs.end();
+                rit -= 2;
+                hasher.add((char *) rit->data(), rit->size());
+                ++rit;
+                hasher.add((char *) rit->data(), rit->size());
+                vt->hash = hasher.finalise();
+              }
               index::value_history::item &history_item = thisupdate.history_item;
               history_item.transaction_counter = this_transaction_counter;
               history_item.value_offset = (value_offset + totalwrite) / 64;
               history_item.value_identifier = _parent->_mysmallfileidx;
               history_item.length = vt->length;
             }
-            if(_parent->_indexheader->contents_hashed)
+            value_offset += totalwrite;
+            if(thisupdate.chained != 0)
             {
-              vt->hash = QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash::hash((char *) value, totalwrite);
+              thisupdate.link = _parent->_fill_history_record(historybuffer, thisupdate.key, this_transaction_counter, thisupdate.seen.history + 2, thisupdate.chained, value_offset + _parent->_history_record_size);
+              appends.reqs.push_back({historybuffer, _parent->_history_record_size});
+              historybuffer += _parent->_history_record_size;
+              value_offset += _parent->_history_record_size;
             }
-            value += totalwrite;
-            value_offset += totalwrite;
           }
-          items_written = true;
+          _parent->_enqueue_append(appends, value_offset);
+          appending = true;
         }
+        // Leaving this scope releases the shared locks on the existing items we are about to
+        // update, as the exclusive locks taken below recheck for changes
       }
-      if(!items_written)
+      if(appending)
       {
-        // Gather append write all my items to my smallfile
-        llfio::file_handle::extent_type value_offset = _parent->_mysmallfile.maximum_extent().value();
-        assert((value_offset % 64) == 0);
-        // POSIX guarantees that at least 16 gather buffers can be written in a single shot
-        std::vector<llfio::file_handle::const_buffer_type> reqs;
-        reqs.reserve(16);
-        // With tails, that's eight items per syscall
-        llfio::byte tailbuffers[8][128];
-        memset(tailbuffers, 0, sizeof(tailbuffers));
-        for(size_t n = 0; n < _items.size(); n++)
-        {
-          llfio::byte *tailbuffer = tailbuffers[n % 8];
-          index::value_tail *vt = reinterpret_cast<index::value_tail *>(tailbuffer + 128 - sizeof(index::value_tail));
-          toupdate_type &thisupdate = toupdate[n];
-          const transaction::_item &item = _items[n];
-          vt->key = thisupdate.key;
-          vt->transaction_counter = this_transaction_counter;
-          size_t totalwrite = 0;
-          if(thisupdate.removal)
-          {
-            vt->length = (uint64_t) -1;  // this key is being deleted
-            totalwrite = 64;
-            reqs.push_back({tailbuffer + 64, 64});
-            if(_parent->_indexheader->contents_hashed)
-            {
-              QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash hasher;
-              memset(&vt->hash, 0, sizeof(vt->hash));
-              hasher.add((const char *) reqs.back().data(), reqs.back().size());
-              vt->hash = hasher.finalise();
-            }
-            memset(&thisupdate.history_item, 0, sizeof(thisupdate.history_item));
-          }
-          else
-          {
-            vt->length = item.towrite->size();
-            totalwrite = _parent->_pad_length(item.towrite->size());
-            size_t tailbytes = totalwrite - item.towrite->size();
-            assert(tailbytes < 128);
-            reqs.push_back({(llfio::byte *) item.towrite->data(), item.towrite->size()});
-            reqs.push_back({tailbuffer + 128 - tailbytes, tailbytes});
-            if(_parent->_indexheader->contents_hashed)
+        _parent->_append(appends);
+      }
+
+      for(;;)
+      {
+        // Stop anyone growing the index whilst we update it
+        basic_key_value_store::_index_update_guard updating(*_parent);
+        // Bail out if store has become corrupted
+        if(_parent->_indexheader->magic != _parent->_goodmagic)
+          throw corrupted_store();
+        bool full = false;
+        {
+          // Remove any newly inserted keys if we abort
+          auto removeinserted = undoer([this, &toupdate] {
+            for(auto updit = toupdate.rbegin(); updit != toupdate.rend(); ++updit)
             {
-              QUICKCPPLIB_NAMESPACE::algorithm::hash::fast_hash hasher;
-              memset(&vt->hash, 0, sizeof(vt->hash));
-              auto rit = reqs.end();
-              rit -= 2;
-              hasher.add((char *) rit->data(), rit->size());
-              ++rit;
-              hasher.add((char *) rit->data(), rit->size());
-              vt->hash = hasher.finalise();
+              if(updit->inserted)
+              {
+                _parent->_index->erase(std::move(updit->it));
+                updit->inserted = false;
+              }
             }
-            index::value_history::item &history_item = thisupdate.history_item;
-            history_item.transaction_counter = this_transaction_counter;
-            history_item.value_offset = (value_offset + totalwrite) / 64;
-            history_item.value_identifier = _parent->_mysmallfileidx;
-            history_item.length = vt->length;
-          }
-          value_offset += totalwrite;
-          if((n % 8) == 7)
+          });
+          // Take exclusive locks on all items in this transaction, inserting new keys if necessary
+          for(toupdate_type &item : toupdate)
           {
-            _parent->_mysmallfile.write({reqs, 0}).value();
-            reqs.clear();
+            auto it = _parent->_index->find_exclusive(item.key);
+            if(it != _parent->_index->end())
+            {
+              if(item.insertion || (item.update && item.old_transaction_counter != (uint64_t) -1 && it->second.history[0].transaction_counter != item.old_transaction_counter))
+              {
+                // Item has changed since transaction begun
+                throw transaction_aborted(item.key);
+              }
+              if(item.chained != 0 && 0 != memcmp(it->second.history + 2, item.seen.history + 2, item.chained * sizeof(index::value_history::item)))
+              {
+                // The items preserved in the history record are no longer those being evicted
+                throw transaction_aborted(item.key);
+              }
+            }
+            else
+            {
+              if(item.update || item.removal)
+              {
+                // Item has changed since transaction begun
+                throw transaction_aborted(item.key);
+              }
+              // Insert a new key with empty history
+              index::value_history vh;
+              memset(&vh, 0, sizeof(vh));
+              it = _parent->_index->insert({item.key, std::move(vh)}).first;
+              if(it == _parent->_index->end())
+              {
+                full = true;
+                break;
+              }
+              item.inserted = true;
+            }
+            // Store the exclusive lock away for later
+            item.it = std::move(it);
           }
-        }
-        if(!reqs.empty())
-        {
-          _parent->_mysmallfile.write({reqs, 0}).value();
-        }
-      }
 
-      // Release all the shared locks on the existing items we are about to update
-      shared_locks.clear();
-      // Bail out if store has become corrupted
-      if(_parent->_indexheader->magic != _parent->_goodmagic)
-        throw corrupted_store();
-      // Remove any newly inserted keys if we abort
-      auto removeinserted = undoer([this, &toupdate] {
-        for(auto updit = toupdate.rend(); updit != toupdate.rbegin(); ++updit)
-        {
-          if(updit->insertion && updit->it != _parent->_index->end())
+          if(!full)
           {
-            _parent->_index->erase(std::move(updit->it));
+            if(_parent->_indexheader->magic != _parent->_goodmagic)
+              throw corrupted_store();
+            // Finally actually perform the update as quickly as possible to reduce the
+            // possibility of a partially issued update which is expensive to repair.
+            // This can no longer abort, so dismiss the removeinserter
+            removeinserted.dismiss();
+            _parent->_indexheader->writes_occurring[_parent->_mysmallfileidx].fetch_add(1);
+            for(auto &item : toupdate)
+            {
+              // Update existing value's latest revision
+              index::value_history &value = item.it->second;
+              memmove(value.history + 1, value.history, sizeof(value.history) - sizeof(value.history[0]));
+              value.history[0] = item.history_item;
+              if(item.chained != 0)
+              {
+                value.history[3] = item.link;
+              }
+              if(item.removal)
+              {
+                bool alldeleted = true;
+                for(const auto &h : value.history)
+                {
+                  if(h.length == index::chained_length || _parent->_has_value(h))
+                  {
+                    alldeleted = false;
+                    break;
+                  }
+                }
+                if(alldeleted)
+                {
+                  _parent->_index->erase(std::move(item.it));
+                }
+              }
+            }
+            _parent->_indexheader->writes_occurring[_parent->_mysmallfileidx].fetch_sub(1);
           }
         }
-      });
-      // Take exclusive locks on all items in this transaction, inserting new keys if necessary
-      for(toupdate_type &item : toupdate)
-      {
-        auto it = _parent->_index->find_exclusive(item.key);
-        if(it != _parent->_index->end())
+        if(!full)
         {
-          if(item.insertion || (item.update && it->second.history[0].transaction_counter != item.old_transaction_counter))
-          {
-            // Item has changed since transaction begun
-            throw transaction_aborted(item.key);
-          }
+          break;
         }
-        else
+        // Release the exclusive locks still held, then grow the index and try again
+        for(auto &item : toupdate)
         {
-          if(item.update || item.removal)
-          {
-            // Item has changed since transaction begun
-            throw transaction_aborted(item.key);
-          }
-          // Insert a new key with empty history
-          index::value_history vh;
-          memset(&vh, 0, sizeof(vh));
-          it = _parent->_index->insert({item.key, std::move(vh)}).first;
-          if(it == _parent->_index->end())
-          {
-            throw index_full();
-          }
+          item.it = index::open_hash_index::iterator();
         }
-        // Store the exclusive lock away for later
-        item.it = std::move(it);
+        updating.release();
+        _parent->_resize_index(_parent->_index->container().size() * 2);
       }
-
-      if(_parent->_indexheader->magic != _parent->_goodmagic)
-        throw corrupted_store();
-      // Finally actually perform the update as quickly as possible to reduce the
-      // possibility of a partially issued update which is expensive to repair.
-      // This can no longer abort, so dismiss the removeinserter
-      removeinserted.dismiss();
-      _parent->_indexheader->writes_occurring[_parent->_mysmallfileidx].fetch_add(1);
-      for(auto &item : toupdate)
+      // Keep any ordered index in step with which keys have values
+      index::ordered_index *ordered = _parent->_ordered_index();
+      if(ordered != nullptr)
       {
-        // Update existing value's latest revision
-        index::value_history &value = item.it->second;
-        memmove(value.history + 1, value.history, sizeof(value.history) - sizeof(value.history[0]));
-        value.history[0] = item.history_item;
-        if(item.removal)
+        std::vector<key_type> inserts, erases;
+        for(const auto &item : toupdate)
         {
-          bool alldeleted = true;
-          for(const auto &h : value.history)
-          {
-            if(h.transaction_counter != 0)
-            {
-              alldeleted = false;
-              break;
-            }
-          }
-          if(alldeleted)
-          {
-            _parent->_index->erase(std::move(item.it));
-          }
+          (item.removal ? erases : inserts).push_back(item.key);
         }
+        ordered->update(inserts, erases);
       }
-      _parent->_indexheader->writes_occurring[_parent->_mysmallfileidx].fetch_sub(1);
     }
   };
 }
@@ -24,6 +24,8 @@ Distributed under the Boost Software License, Version 1.0.
 
 #include "include/key_value_store.hpp"
 
+#include <thread>
+
 namespace stackoverflow
 {
   namespace filesystem = LLFIO_V2_NAMESPACE::filesystem;
@@ -139,6 +141,55 @@ void benchmark(key_value_store::basic_key_value_store &store, const char *desc)
     auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
     std::cout << "  Fetched at " << (1000000000ULL / diff) << " items per sec" << std::endl;
   }
+  std::cout << "  Retrieving 1M key-value pairs in batches of 64 ..." << std::endl;
+  {
+    std::vector<key_value_store::key_type> keys;
+    auto begin = std::chrono::high_resolution_clock::now();
+    for(size_t n = 0; n < values.size(); n += 64)
+    {
+      keys.clear();
+      for(size_t m = n; m < n + 64 && m < values.size(); m++)
+      {
+        keys.push_back(values[m].first);
+      }
+      for(auto &kvi : store.find_many(keys))
+      {
+        if(!kvi)
+          abort();
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    std::cout << "  Fetched at " << (1000000000ULL / diff) << " items per sec" << std::endl;
+  }
+}
+
+void benchmark_commits(key_value_store::basic_key_value_store &store, const char *desc, size_t threads)
+{
+  std::cout << "\n" << desc << ":" << std::endl;
+  const size_t commits = 1000;
+  const std::string value = LLFIO_V2_NAMESPACE::utils::random_string(1024 / 2);
+  std::cout << "  " << threads << " threads each committing " << commits << " single item transactions ..." << std::endl;
+  auto begin = std::chrono::high_resolution_clock::now();
+  std::vector<std::thread> committers;
+  for(size_t t = 0; t < threads; t++)
+  {
+    committers.emplace_back([&, t] {
+      for(size_t n = 0; n < commits; n++)
+      {
+        key_value_store::transaction tr(store);
+        tr.update_unsafe(10000000 + t * commits + n, value);
+        tr.commit();
+      }
+    });
+  }
+  for(auto &i : committers)
+  {
+    i.join();
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+  std::cout << "  Committed at " << (threads * commits * 1000ULL / (diff + 1)) << " transactions per sec" << std::endl;
 }
 
 int main()
@@ -208,6 +259,252 @@ int main()
           std::cerr << "FAILURE: Revision 1Key 78 was not found!" << std::endl;
         }
       }
+      // test free space consolidation
+      {
+        for(size_t n = 0; n < 8; n++)
+        {
+          std::string value = "revision " + std::to_string(n);
+          key_value_store::transaction tr(store);
+          tr.update_unsafe(80, value);
+          tr.commit();
+        }
+        auto ci = store.consolidate_free_space((LLFIO_V2_NAMESPACE::file_handle::extent_type) -1);
+        std::cout << "Consolidation examined " << ci.examined << " bytes, copied " << ci.copied << " bytes and released " << ci.released << " bytes" << std::endl;
+        auto kvi = store.find(80, 1);
+        if(kvi && std::string(kvi.value.data(), kvi.value.size()) == "revision 6")
+        {
+          std::cout << "Revision 1 of Key 80 has value " << kvi.value << " after consolidation" << std::endl;
+        }
+        else
+        {
+          std::cerr << "FAILURE: Revision 1 of Key 80 was lost by consolidation!" << std::endl;
+        }
+        if(!store.find(79))
+        {
+          std::cerr << "FAILURE: Key 79 was lost by consolidation!" << std::endl;
+        }
+      }
+      // test a large value in use survives its record being consolidated
+      {
+        const std::string large(256 * 1024, 'n');
+        {
+          key_value_store::transaction tr(store);
+          tr.update_unsafe(81, large);
+          tr.commit();
+        }
+        auto kvi = store.find(81);
+        for(size_t n = 0; n < 4; n++)
+        {
+          key_value_store::transaction tr(store);
+          tr.update_unsafe(81, "small");
+          tr.commit();
+        }
+        store.consolidate_free_space((LLFIO_V2_NAMESPACE::file_handle::extent_type) -1);
+        if(kvi && std::string(kvi.value.data(), kvi.value.size()) == large)
+        {
+          std::cout << "Large value of Key 81 was unaffected by consolidation" << std::endl;
+        }
+        else
+        {
+          std::cerr << "FAILURE: Large value of Key 81 was deallocated while in use!" << std::endl;
+        }
+      }
+      // test a snapshot sees revisions long since evicted from the index
+      {
+        {
+          key_value_store::transaction tr(store);
+          tr.update_unsafe(82, "original");
+          tr.commit();
+        }
+        {
+          auto snapshot = store.take_snapshot();
+          for(size_t n = 0; n < 8; n++)
+          {
+            std::string value = "revision " + std::to_string(n);
+            key_value_store::transaction tr(store);
+            tr.update_unsafe(82, value);
+            tr.commit();
+          }
+          store.consolidate_free_space((LLFIO_V2_NAMESPACE::file_handle::extent_type) -1);
+          auto kvi = store.find(82, snapshot);
+          if(kvi && std::string(kvi.value.data(), kvi.value.size()) == "original" && std::string(store.find(82).value.data(), store.find(82).value.size()) == "revision 7")
+          {
+            std::cout << "Snapshot sees Key 82 with value " << kvi.value << " eight revisions later" << std::endl;
+          }
+          else
+          {
+            std::cerr << "FAILURE: Snapshot did not see the original value of Key 82!" << std::endl;
+          }
+        }
+        {
+          key_value_store::transaction tr(store);
+          tr.update_unsafe(82, "unpinned");
+          tr.commit();
+        }
+        auto ci = store.consolidate_free_space((LLFIO_V2_NAMESPACE::file_handle::extent_type) -1);
+        std::cout << "Consolidation after releasing the snapshot released " << ci.released << " bytes" << std::endl;
+      }
+      // test values are compressed with a trained dictionary
+      {
+        auto record = [](size_t n) {
+          return "{\"id\":" + std::to_string(n) + ",\"name\":\"user" + std::to_string(n * 7919 % 1000) +
+                 "\",\"email\":\"someone@example.com\",\"tags\":[\"alpha\",\"beta\",\"gamma\"],\"active\":" + ((n & 1) ? "true" : "false") +
+                 ",\"address\":{\"street\":\"Main Street\",\"city\":\"Springfield\",\"country\":\"US\"}}";
+        };
+        std::vector<std::string> values;
+        std::vector<key_value_store::span<const char>> samples;
+        for(size_t n = 0; n < 100; n++)
+        {
+          values.push_back(record(n));
+        }
+        for(auto &i : values)
+        {
+          samples.push_back({i.data(), i.size()});
+        }
+        auto id = store.train_dictionary(samples, 4096);
+        store.use_compression(64);
+        auto smallfiles_size = [] {
+          uint64_t ret = 0;
+          for(size_t n = 0; n < 48; n++)
+          {
+            std::error_code ec;
+            auto size = LLFIO_V2_NAMESPACE::filesystem::file_size("teststore/" + std::to_string(n), ec);
+            ret += ec ? 0 : size;
+          }
+          return ret;
+        };
+        const uint64_t before = smallfiles_size();
+        {
+          key_value_store::transaction tr(store);
+          for(size_t n = 0; n < values.size(); n++)
+          {
+            tr.update_unsafe(3000 + n, values[n]);
+          }
+          tr.commit();
+        }
+        // Uncompressed, each value would take its length plus a value_tail rounded up to 64 bytes
+        const uint64_t appended = smallfiles_size() - before;
+        uint64_t uncompressed = 0;
+        for(auto &i : values)
+        {
+          uncompressed += (i.size() + 48 + 63) & ~63;
+        }
+        if(appended < uncompressed)
+        {
+          std::cout << "Compressed values took " << appended << " bytes of smallfile rather than " << uncompressed << std::endl;
+        }
+        else
+        {
+          std::cerr << "FAILURE: Values were not compressed, taking " << appended << " bytes of smallfile rather than less than " << uncompressed << std::endl;
+        }
+        bool allsame = true;
+        size_t stored = 0;
+        for(size_t n = 0; n < values.size(); n++)
+        {
+          auto kvi = store.find(3000 + n);
+          std::vector<char> buffer(values[n].size());
+          if(!kvi || std::string(kvi.value.data(), kvi.value.size()) != values[n] || store.read(3000 + n, buffer) != values[n].size() ||
+             0 != memcmp(buffer.data(), values[n].data(), buffer.size()))
+          {
+            allsame = false;
+          }
+          stored += values[n].size();
+        }
+        if(allsame)
+        {
+          std::cout << "Values of Keys 3000-3099 compressed with dictionary " << id << " read back unchanged (" << stored << " bytes uncompressed)" << std::endl;
+        }
+        else
+        {
+          std::cerr << "FAILURE: Compressed values did not read back unchanged!" << std::endl;
+        }
+      }
+      // test the index grows when full
+      {
+        {
+          key_value_store::transaction tr(store);
+          for(uint64_t key = 1000; key < 2000; key++)
+          {
+            tr.update_unsafe(key, "grown");
+          }
+          tr.commit();
+        }
+        bool allfound = true;
+        for(uint64_t key = 1000; key < 2000; key++)
+        {
+          if(!store.find(key))
+          {
+            allfound = false;
+          }
+        }
+        if(allfound)
+        {
+          std::cout << "Index grew to fit Keys 1000-1999" << std::endl;
+        }
+        else
+        {
+          std::cerr << "FAILURE: Keys were lost by growing the index!" << std::endl;
+        }
+      }
+      // test ordered iteration
+      {
+        store.use_ordered_index();
+        {
+          key_value_store::transaction tr(store);
+          for(uint64_t key = 209; key >= 200; key--)
+          {
+            tr.update_unsafe(key, "ordered");
+          }
+          tr.remove_unsafe(205);
+          tr.commit();
+        }
+        std::vector<uint64_t> scanned;
+        store.scan(200, 210, [&](key_value_store::basic_key_value_store::keyvalue_info &kvi) {
+          scanned.push_back(kvi.key.as_longlongs[0]);
+          return true;
+        });
+        const std::vector<uint64_t> expected = {200, 201, 202, 203, 204, 206, 207, 208, 209};
+        if(scanned == expected)
+        {
+          std::cout << "Scan of Keys 200-209 returned them in order" << std::endl;
+        }
+        else
+        {
+          std::cerr << "FAILURE: Scan of Keys 200-209 returned the wrong keys!" << std::endl;
+        }
+        key_value_store::key_type mask, bits;
+        mask.as_longlongs[0] = ~15ULL;
+        mask.as_longlongs[1] = ~0ULL;
+        bits.as_longlongs[0] = 192;
+        bits.as_longlongs[1] = 0;
+        size_t matched = 0;
+        store.match(mask, bits, [&](key_value_store::basic_key_value_store::keyvalue_info & /*unused*/) {
+          ++matched;
+          return true;
+        });
+        if(matched == 7)
+        {
+          std::cout << "Match of Keys 192-207 returned 7 keys" << std::endl;
+        }
+        else
+        {
+          std::cerr << "FAILURE: Match of Keys 192-207 returned " << matched << " keys!" << std::endl;
+        }
+      }
+    }
+    // test batched retrieval
+    {
+      key_value_store::basic_key_value_store store("teststore");
+      const key_value_store::key_type keys[] = {79, 12345, 78, 79};
+      auto kvis = store.find_many(keys);
+      if(kvis.size() == 4 && kvis[0] && !kvis[1] && !kvis[2] && kvis[3] && kvis[0].value.size() == kvis[3].value.size() && 0 == memcmp(kvis[0].value.data(), kvis[3].value.data(), kvis[0].value.size()))
+      {
+        std::cout << "Batched retrieval of Keys 79, 12345, 78 (removed), 79 returned the expected values" << std::endl;
+      }
+      else
+      {
+        std::cerr << "FAILURE: Batched retrieval of Keys 79, 12345, 78, 79 returned the wrong values!" << std::endl;
+      }
     }
     // test read only
     {
@@ -222,6 +519,83 @@ int main()
         std::cerr << "FAILURE: Key 79 was not found!" << std::endl;
       }
     }
+    // test recovery from a writer dying part way through appending a record
+    {
+      LLFIO_V2_NAMESPACE::file_handle::extent_type length;
+      {
+        auto fh = LLFIO_V2_NAMESPACE::file_handle::file({}, "teststore/0", LLFIO_V2_NAMESPACE::file_handle::mode::write).value();
+        length = fh.maximum_extent().value();
+        std::vector<LLFIO_V2_NAMESPACE::byte> torn(100);
+        memset(torn.data(), 0x5a, torn.size());
+        fh.write(length, {{torn.data(), torn.size()}}).value();
+      }
+      key_value_store::basic_key_value_store store("teststore", 0);
+      {
+        key_value_store::transaction tr(store);
+        tr.update_unsafe(90, "after recovery");
+        tr.commit();
+      }
+      auto kvi = store.find(90);
+      if(store.find(79) && kvi && std::string(kvi.value.data(), kvi.value.size()) == "after recovery")
+      {
+        std::cout << "Recovery removed the torn record after " << length << " bytes of smallfile 0" << std::endl;
+      }
+      else
+      {
+        std::cerr << "FAILURE: Recovery did not remove the torn record!" << std::endl;
+      }
+    }
+    // test recovery completing a commit which died after appending its records, part way through updating the index
+    {
+      {
+        key_value_store::basic_key_value_store store("teststore", 0);
+        for(const char *value : {"before", "rolled forward"})
+        {
+          key_value_store::transaction tr(store);
+          tr.update_unsafe(91, value);
+          tr.update_unsafe(92, value);
+          tr.commit();
+        }
+      }
+      {
+        // Rewind the entry of Key 92 in the index as if the commit never reached it, and mark a writer as having died
+        auto fh = LLFIO_V2_NAMESPACE::file_handle::file({}, "teststore/index", LLFIO_V2_NAMESPACE::file_handle::mode::write).value();
+        std::vector<LLFIO_V2_NAMESPACE::byte> buffer(fh.maximum_extent().value());
+        fh.read(0, {{buffer.data(), buffer.size()}}).value();
+        auto *header = reinterpret_cast<key_value_store::index::index *>(buffer.data());
+        header->writers.store(1);
+        for(auto &checkpoint : header->checkpoints)
+        {
+          checkpoint.store(0);
+        }
+        for(size_t offset = sizeof(key_value_store::index::index); offset + sizeof(key_value_store::index::open_hash_index::value_type) <= buffer.size(); offset += sizeof(key_value_store::index::open_hash_index::value_type))
+        {
+          uint32_t inuse;
+          key_value_store::key_type key;
+          memcpy(&inuse, buffer.data() + offset + 4, sizeof(inuse));
+          memcpy(&key, buffer.data() + offset + 16, sizeof(key));
+          if(inuse != 0 && key.as_longlongs[0] == 92 && key.as_longlongs[1] == 0)
+          {
+            key_value_store::index::value_history vh;
+            memcpy(&vh, buffer.data() + offset + 32, sizeof(vh));
+            memmove(vh.history, vh.history + 1, sizeof(vh.history) - sizeof(vh.history[0]));
+            memset(&vh.history[3], 0, sizeof(vh.history[3]));
+            memcpy(buffer.data() + offset + 32, &vh, sizeof(vh));
+          }
+        }
+        fh.write(0, {{buffer.data(), buffer.size()}}).value();
+      }
+      key_value_store::basic_key_value_store store("teststore", 0);
+      auto kvi = store.find(92);
+      if(kvi && std::string(kvi.value.data(), kvi.value.size()) == "rolled forward")
+      {
+        std::cout << "Recovery completed the update of Key 92 by a commit which died part way through updating the index" << std::endl;
+      }
+      else
+      {
+        std::cerr << "FAILURE: Recovery did not roll forward Key 92!" << std::endl;
+      }
+    }
     {
       std::error_code ec;
       LLFIO_V2_NAMESPACE::filesystem::remove_all("teststore", ec);
@@ -265,6 +639,23 @@ int main()
       store.use_mmaps();
       benchmark(store, "integrity, durability, mmaps");
     }
+    {
+      std::error_code ec;
+      LLFIO_V2_NAMESPACE::filesystem::remove_all("teststore", ec);
+    }
+    {
+      key_value_store::basic_key_value_store store("teststore", 2000000, false, LLFIO_V2_NAMESPACE::file_handle::mode::write, LLFIO_V2_NAMESPACE::file_handle::caching::reads);
+      benchmark_commits(store, "no integrity, durability, read + append", 16);
+    }
+    {
+      std::error_code ec;
+      LLFIO_V2_NAMESPACE::filesystem::remove_all("teststore", ec);
+    }
+    {
+      key_value_store::basic_key_value_store store("teststore", 2000000, false, LLFIO_V2_NAMESPACE::file_handle::mode::write, LLFIO_V2_NAMESPACE::file_handle::caching::reads);
+      store.use_group_commit(16);
+      benchmark_commits(store, "no integrity, durability, read + append, group commit", 16);
+    }
   }
   catch(const std::exception &e)
   {
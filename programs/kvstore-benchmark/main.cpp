@@ -0,0 +1,158 @@
+/* Compares the standard key-value store against the prototype key-value store
+
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License in the accompanying file
+Licence.txt or at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+
+Distributed under the Boost Software License, Version 1.0.
+    (See accompanying file Licence.txt or copy at
+          http://www.boost.org/LICENSE_1_0.txt)
+*/
+
+#include "../../include/kvstore/kvstore.hpp"
+#include "../key-value-store/include/key_value_store.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace llfio = LLFIO_V2_NAMESPACE;
+namespace kvstore = KVSTORE_V1_NAMESPACE;
+
+static constexpr size_t ITEMS = 1000000;
+static constexpr size_t VALUE_SIZE = 1024 / 2;
+
+static std::vector<std::pair<uint64_t, std::string>> values;
+
+static void report(const char *what, std::chrono::high_resolution_clock::time_point begin)
+{
+  auto end = std::chrono::high_resolution_clock::now();
+  auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+  std::cout << "  " << what << " at " << (ITEMS * 1000ULL / (diff + 1)) << " items per sec" << std::endl;
+}
+
+static void benchmark_prototype()
+{
+  std::cout << "\nPrototype key-value store, no integrity, no durability, mmaps:" << std::endl;
+  {
+    std::error_code ec;
+    llfio::filesystem::remove_all("teststore", ec);
+  }
+  key_value_store::basic_key_value_store store("teststore", 2000000);
+  store.use_mmaps();
+  {
+    auto begin = std::chrono::high_resolution_clock::now();
+    for(size_t n = 0; n < values.size(); n += 1024)
+    {
+      key_value_store::transaction tr(store);
+      for(size_t m = n; m < n + 1024 && m < values.size(); m++)
+      {
+        tr.update_unsafe(values[m].first, values[m].second);
+      }
+      tr.commit();
+    }
+    report("Inserted", begin);
+  }
+  {
+    auto begin = std::chrono::high_resolution_clock::now();
+    for(auto &i : values)
+    {
+      if(!store.find(i.first))
+      {
+        abort();
+      }
+    }
+    report("Fetched", begin);
+  }
+}
+
+static void benchmark_standard()
+{
+  std::cout << "\nStandard key-value store, single_file:" << std::endl;
+  {
+    std::error_code ec;
+    llfio::filesystem::remove("teststore.kvs", ec);
+  }
+  auto store = kvstore::create_kvstore("file://teststore.kvs", sizeof(uint64_t), kvstore::basic_key_value_store::features::stable_values | kvstore::basic_key_value_store::features::atomic_snapshots).value();
+  kvstore::basic_key_value_store::capacity_type quota;
+  quota.as_longlongs[0] = 2000000;
+  quota.as_longlongs[1] = 0;
+  store->max_size(quota).value();
+  quota.as_longlongs[0] = 2 * ITEMS * (VALUE_SIZE + 64);
+  store->max_bytes_stored(quota).value();
+  {
+    auto begin = std::chrono::high_resolution_clock::now();
+    for(auto &i : values)
+    {
+      kvstore::basic_key_value_store::const_buffer_type reqs[] = {{reinterpret_cast<const llfio::byte *>(i.second.data()), i.second.size()}};
+      store->write({reinterpret_cast<const llfio::byte *>(&i.first), sizeof(i.first)}, {reqs, 0}).value();
+    }
+    report("Inserted", begin);
+  }
+  {
+    auto begin = std::chrono::high_resolution_clock::now();
+    for(auto &i : values)
+    {
+      kvstore::basic_key_value_store::buffer_type reqs[] = {{nullptr, 0}};
+      if(store->read({reqs, 0}, {reinterpret_cast<const llfio::byte *>(&i.first), sizeof(i.first)}).value()[0].size() != VALUE_SIZE)
+      {
+        abort();
+      }
+    }
+    report("Fetched", begin);
+  }
+  {
+    auto snapshot = store->snapshot().value();
+    // Replace every value, so every read from the snapshot must walk back one version
+    std::string replacement(VALUE_SIZE, 'x');
+    for(auto &i : values)
+    {
+      kvstore::basic_key_value_store::const_buffer_type reqs[] = {{reinterpret_cast<const llfio::byte *>(replacement.data()), replacement.size()}};
+      store->write({reinterpret_cast<const llfio::byte *>(&i.first), sizeof(i.first)}, {reqs, 0}).value();
+    }
+    auto begin = std::chrono::high_resolution_clock::now();
+    for(auto &i : values)
+    {
+      kvstore::basic_key_value_store::buffer_type reqs[] = {{nullptr, 0}};
+      auto buffers = snapshot->read({reqs, 0}, {reinterpret_cast<const llfio::byte *>(&i.first), sizeof(i.first)}).value();
+      if(0 != memcmp(buffers[0].data(), i.second.data(), VALUE_SIZE))
+      {
+        abort();
+      }
+    }
+    report("Fetched from a snapshot", begin);
+  }
+}
+
+int main()
+{
+  try
+  {
+    std::cout << "Generating " << ITEMS << " key-value pairs ..." << std::endl;
+    for(size_t n = 0; n < ITEMS; n++)
+    {
+      values.push_back({100 + n, llfio::utils::random_string(VALUE_SIZE / 2)});
+    }
+    benchmark_prototype();
+    benchmark_standard();
+    return 0;
+  }
+  catch(const std::exception &e)
+  {
+    std::cerr << "Exception thrown: " << e.what() << std::endl;
+    return 1;
+  }
+}
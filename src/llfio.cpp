@@ -1,3 +1,4 @@
 #define LLFIO_DYN_LINK 1
 #define LLFIO_SOURCE 1
 #include "../include/llfio/llfio.hpp"
+#include "../include/kvstore/kvstore.hpp"
@@ -0,0 +1,143 @@
+/* Integration test kernel for file_handle extents handling
+
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License in the accompanying file
+Licence.txt or at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+
+Distributed under the Boost Software License, Version 1.0.
+    (See accompanying file Licence.txt or copy at
+          http://www.boost.org/LICENSE_1_0.txt)
+*/
+
+#include "../test_kernel_decl.hpp"
+
+static inline void TestFileHandleCloneExtents()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using llfio::byte;
+  static constexpr size_t testbytes = 4 * 1024 * 1024UL;
+  llfio::file_handle src = llfio::file_handle::temp_inode().value();
+  llfio::file_handle dest = llfio::file_handle::temp_inode().value();
+  // Make a sparse source file with data at the beginning and end
+  src.truncate(testbytes).value();
+  std::vector<byte> block(65536);
+  for(size_t n = 0; n < block.size(); n++)
+  {
+    block[n] = static_cast<byte>(n * 7);
+  }
+  src.write(0, {{block.data(), block.size()}}).value();
+  src.write(testbytes - block.size(), {{block.data(), block.size()}}).value();
+  // Give the destination some data where the source has a hole, which must be cleared
+  dest.truncate(testbytes / 2).value();
+  std::vector<byte> junk(65536, static_cast<byte>(0xff));
+  dest.write(testbytes / 4, {{junk.data(), junk.size()}}).value();
+
+  auto cloned = src.clone_extents_to(dest).value();
+  BOOST_CHECK(cloned.offset == 0);
+  BOOST_CHECK(cloned.length == testbytes);
+  BOOST_CHECK(cloned.method != llfio::file_handle::clone_method::none);
+  std::cout << "clone_extents_to() used method " << static_cast<int>(cloned.method) << std::endl;
+  BOOST_REQUIRE(dest.maximum_extent().value() == testbytes);
+
+  std::vector<byte> a(testbytes), b(testbytes);
+  BOOST_REQUIRE(src.read(0, {{a.data(), a.size()}}).value() == testbytes);
+  BOOST_REQUIRE(dest.read(0, {{b.data(), b.size()}}).value() == testbytes);
+  BOOST_CHECK(a == b);
+
+  // Cloning past the end clones nothing
+  auto none = src.clone_extents_to(dest, testbytes * 2).value();
+  BOOST_CHECK(none.length == 0);
+  BOOST_CHECK(none.method == llfio::file_handle::clone_method::none);
+}
+
+static inline void TestFileHandleEnumerateExtents()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using llfio::byte;
+  static constexpr size_t testbytes = 16 * 1024 * 1024UL, blocksize = 65536;
+  llfio::file_handle h = llfio::file_handle::temp_inode().value();
+  h.truncate(testbytes).value();
+  std::vector<byte> block(blocksize, static_cast<byte>(0x78));
+  // Write a block every megabyte
+  for(size_t n = 0; n < testbytes; n += 1024 * 1024)
+  {
+    h.write(n, {{block.data(), block.size()}}).value();
+  }
+  auto all = h.extents().value();
+  // Walk the extents three at a time and make sure they match the whole file enumeration
+  std::vector<llfio::file_handle::extent_pair> walked;
+  llfio::file_handle::extent_pair buffer[3];
+  for(llfio::file_handle::extent_type offset = 0;;)
+  {
+    auto exts = h.enumerate_extents(buffer, offset).value();
+    for(auto &i : exts)
+    {
+      walked.push_back(i);
+    }
+    if(exts.size() < 3)
+    {
+      break;
+    }
+    offset = exts[2].first + exts[2].second;
+  }
+  BOOST_CHECK(walked == all);
+  if(all.size() == 1)
+  {
+    BOOST_TEST_MESSAGE("This filing system does not support extents, so not testing hole punching.");
+    return;
+  }
+  BOOST_CHECK(all.size() == testbytes / (1024 * 1024));
+  // Unsorted, overlapping and adjacent holes get coalesced, and deallocate all but the first block
+  llfio::file_handle::extent_pair holes[] = {{8 * 1024 * 1024, testbytes - 8 * 1024 * 1024}, {1024 * 1024, 4 * 1024 * 1024}, {2 * 1024 * 1024, 6 * 1024 * 1024}};
+  BOOST_CHECK(h.punch_holes(holes).value() == testbytes - 1024 * 1024);
+  all = h.extents().value();
+  BOOST_REQUIRE(all.size() == 1);
+  BOOST_CHECK(all[0].first == 0);
+  BOOST_CHECK(all[0].second == blocksize);
+  BOOST_CHECK(h.maximum_extent().value() == testbytes);
+}
+
+static inline void TestFileHandleAllocate()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  llfio::file_handle h = llfio::file_handle::temp_inode().value();
+  auto r = h.allocate(0, 1024 * 1024, llfio::file_handle::allocation::keep_size);
+  if(!r && r.error() == llfio::errc::operation_not_supported)
+  {
+    BOOST_TEST_MESSAGE("This platform or filing system does not support allocation without extension.");
+  }
+  else
+  {
+    BOOST_CHECK(r.value() == 1024 * 1024);
+    BOOST_CHECK(h.maximum_extent().value() == 0);
+  }
+  BOOST_CHECK(h.allocate(0, 1024 * 1024).value() == 1024 * 1024);
+  BOOST_CHECK(h.maximum_extent().value() == 1024 * 1024);
+  // Allocating within the file never shrinks it
+  BOOST_CHECK(h.allocate(4096, 4096).value() == 4096);
+  BOOST_CHECK(h.maximum_extent().value() == 1024 * 1024);
+  auto hint = h.set_write_lifetime_hint(llfio::file_handle::write_lifetime::short_lived);
+  if(hint)
+  {
+    BOOST_CHECK(h.write_lifetime_hint().value() == llfio::file_handle::write_lifetime::short_lived);
+  }
+  else
+  {
+    BOOST_CHECK(hint.error() == llfio::errc::operation_not_supported);
+  }
+}
+
+KERNELTEST_TEST_KERNEL(integration, llfio, file_handle_extents, allocate, "Tests that llfio::file_handle::allocate() works as expected", TestFileHandleAllocate())
+KERNELTEST_TEST_KERNEL(integration, llfio, file_handle_extents, enumerate_and_punch, "Tests that llfio::file_handle::enumerate_extents() and punch_holes() work as expected", TestFileHandleEnumerateExtents())
+KERNELTEST_TEST_KERNEL(integration, llfio, file_handle_extents, clone, "Tests that llfio::file_handle::clone_extents_to() works as expected", TestFileHandleCloneExtents())
@@ -0,0 +1,135 @@
+/* Integration test kernel for io_handle::read_ranges() and read_cached()
+
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License in the accompanying file
+Licence.txt or at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+
+Distributed under the Boost Software License, Version 1.0.
+    (See accompanying file Licence.txt or copy at
+          http://www.boost.org/LICENSE_1_0.txt)
+*/
+
+#include "../test_kernel_decl.hpp"
+
+static inline void TestFileHandleReadRanges()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using llfio::byte;
+  static constexpr size_t records = 64, recordsize = 4096;
+  llfio::file_handle h = llfio::file_handle::temp_inode().value();
+  std::vector<byte> contents(records * recordsize);
+  for(size_t n = 0; n < contents.size(); n++)
+  {
+    contents[n] = static_cast<byte>(n / recordsize);
+  }
+  h.write(0, {{contents.data(), contents.size()}}).value();
+
+  // Read every other record, plus a contiguous run, supplied out of order
+  std::vector<std::vector<byte>> storage;
+  std::vector<llfio::file_handle::range_request> reqs;
+  for(size_t n = 0; n < records; n += 2)
+  {
+    storage.emplace_back(recordsize);
+  }
+  for(size_t n = 0; n < 8; n++)
+  {
+    storage.emplace_back(recordsize);
+  }
+  size_t idx = 0;
+  for(size_t n = records; n > 0; n -= 2)
+  {
+    reqs.emplace_back((n - 2) * recordsize, llfio::file_handle::buffer_type{storage[idx++].data(), recordsize});
+  }
+  for(size_t n = 0; n < 8; n++)
+  {
+    reqs.emplace_back((n * 2 + 1) * recordsize, llfio::file_handle::buffer_type{storage[idx++].data(), recordsize});
+  }
+  // Past the end of the file reads nothing
+  byte pastend[16];
+  reqs.emplace_back(contents.size() + 4096, llfio::file_handle::buffer_type{pastend, sizeof(pastend)});
+  // A run straddling the end of the file reads up to it
+  byte straddle[200], afterend[16];
+  reqs.emplace_back(contents.size() - 100, llfio::file_handle::buffer_type{straddle, sizeof(straddle)});
+  reqs.emplace_back(contents.size() + 100, llfio::file_handle::buffer_type{afterend, sizeof(afterend)});
+
+  auto done = h.read_ranges(reqs).value();
+  BOOST_REQUIRE(done.size() == reqs.size());
+  for(size_t n = 1; n < done.size(); n++)
+  {
+    BOOST_CHECK(done[n - 1].first <= done[n].first);
+  }
+  for(auto &i : done)
+  {
+    if(i.first >= contents.size())
+    {
+      BOOST_CHECK(i.second.size() == 0);
+    }
+    else if(i.first + recordsize > contents.size())
+    {
+      BOOST_REQUIRE(i.second.size() == contents.size() - i.first);
+      BOOST_CHECK(!memcmp(i.second.data(), contents.data() + i.first, i.second.size()));
+    }
+    else
+    {
+      BOOST_REQUIRE(i.second.size() == recordsize);
+      BOOST_CHECK(!memcmp(i.second.data(), contents.data() + i.first, recordsize));
+    }
+  }
+}
+
+KERNELTEST_TEST_KERNEL(integration, llfio, file_handle_read_ranges, read_ranges, "Tests that llfio::io_handle::read_ranges() works as expected", TestFileHandleReadRanges())
+
+static inline void TestFileHandleReadCached()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using llfio::byte;
+  static constexpr size_t records = 16, recordsize = 4096;
+  llfio::file_handle h = llfio::file_handle::temp_inode().value();
+  std::vector<byte> contents(records * recordsize);
+  for(size_t n = 0; n < contents.size(); n++)
+  {
+    contents[n] = static_cast<byte>(n / recordsize + 1);
+  }
+  h.write(0, {{contents.data(), contents.size()}}).value();
+
+  std::vector<byte> storage(contents.size());
+  std::vector<llfio::file_handle::range_request> reqs, misses(records);
+  for(size_t n = 0; n < records; n++)
+  {
+    reqs.emplace_back(n * recordsize, llfio::file_handle::buffer_type{storage.data() + n * recordsize, recordsize});
+  }
+  auto missed = h.read_cached(reqs, misses).value();
+  std::cout << "read_cached() missed " << missed.size() << " of " << records << " ranges" << std::endl;
+  // Whatever was read must be correct, and the misses must cover exactly what was not read
+  size_t bytesread = 0, bytesmissed = 0;
+  for(auto &i : reqs)
+  {
+    BOOST_CHECK(!memcmp(i.second.data(), contents.data() + i.first, i.second.size()));
+    bytesread += i.second.size();
+  }
+  for(auto &i : missed)
+  {
+    bytesmissed += i.second.size();
+  }
+  BOOST_CHECK(bytesread + bytesmissed == contents.size());
+  // The misses can be read as is
+  auto done = h.read_ranges(missed).value();
+  for(auto &i : done)
+  {
+    BOOST_CHECK(!memcmp(i.second.data(), contents.data() + i.first, i.second.size()));
+  }
+  BOOST_CHECK(storage == contents);
+}
+
+KERNELTEST_TEST_KERNEL(integration, llfio, file_handle_read_ranges, read_cached, "Tests that llfio::io_handle::read_cached() works as expected", TestFileHandleReadCached())
@@ -0,0 +1,164 @@
+/* Integration test kernel for the standard key-value store
+
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License in the accompanying file
+Licence.txt or at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+
+Distributed under the Boost Software License, Version 1.0.
+    (See accompanying file Licence.txt or copy at
+          http://www.boost.org/LICENSE_1_0.txt)
+*/
+
+#include "../../include/kvstore/kvstore.hpp"
+#include "../test_kernel_decl.hpp"
+
+static inline void TestSingleFileKvstore()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  namespace kvstore = KVSTORE_V1_NAMESPACE;
+  using store_type = kvstore::basic_key_value_store;
+  {
+    std::error_code ec;
+    llfio::filesystem::remove("tempstore", ec);
+  }
+  auto key = [](const uint32_t &k) { return store_type::key_type(reinterpret_cast<const llfio::byte *>(&k), sizeof(k)); };
+  auto write = [&](store_type &store, uint32_t k, uint32_t v) {
+    store_type::const_buffer_type reqs[] = {{reinterpret_cast<const llfio::byte *>(&v), sizeof(v)}};
+    return store.write(key(k), {reqs, 0});
+  };
+  auto read = [&](store_type &store, uint32_t k) -> llfio::result<uint32_t> {
+    store_type::buffer_type reqs[] = {{nullptr, 0}};
+    OUTCOME_TRY(buffers, store.read({reqs, 0}, key(k)));
+    if(buffers.size() != 1 || buffers[0].size() != sizeof(uint32_t))
+    {
+      return llfio::errc::illegal_byte_sequence;
+    }
+    uint32_t ret;
+    memcpy(&ret, buffers[0].data(), sizeof(ret));
+    return ret;
+  };
+
+  {
+    auto store = kvstore::create_kvstore("file://tempstore", sizeof(uint32_t), store_type::features::stable_values | store_type::features::atomic_snapshots).value();
+    BOOST_CHECK(store->empty());
+    BOOST_CHECK(!store->frozen());
+    BOOST_CHECK(read(*store, 1).error() == llfio::errc::no_such_file_or_directory);
+    for(uint32_t n = 0; n < 1000; n++)
+    {
+      write(*store, n, n * 2).value();
+    }
+    BOOST_CHECK(store->frozen());
+    BOOST_CHECK(store->size().value().as_longlongs[0] == 1000);
+    BOOST_CHECK(store->bytes_stored().value().as_longlongs[0] == 1000 * sizeof(uint32_t));
+    // Quotas can no longer be changed
+    BOOST_CHECK(!store->max_size(store->max_size().value()));
+    // Values are stable, so only whole values can be written
+    {
+      uint32_t v = 0;
+      store_type::const_buffer_type reqs[] = {{reinterpret_cast<const llfio::byte *>(&v), sizeof(v)}};
+      BOOST_CHECK(store->write(key(5), {reqs, 1}).error() == llfio::errc::invalid_argument);
+    }
+    for(uint32_t n = 0; n < 1000; n++)
+    {
+      BOOST_CHECK(read(*store, n).value() == n * 2);
+    }
+
+    // Snapshots see the values at the moment they were taken
+    auto snapshot = store->snapshot().value();
+    for(uint32_t n = 0; n < 1000; n += 2)
+    {
+      write(*store, n, n * 3).value();
+    }
+    write(*store, 5000, 1).value();
+    for(uint32_t n = 0; n < 1000; n++)
+    {
+      BOOST_CHECK(read(*store, n).value() == ((n & 1) ? n * 2 : n * 3));
+      BOOST_CHECK(read(*snapshot, n).value() == n * 2);
+    }
+    BOOST_CHECK(read(*snapshot, 5000).error() == llfio::errc::no_such_file_or_directory);
+    BOOST_CHECK(!write(*snapshot, 1, 1));
+    BOOST_CHECK(store->size().value().as_longlongs[0] == 1001);
+
+    // Match all keys whose bottom byte is 0x07, of which there are four below 1000
+    {
+      const uint32_t mask = 0xff, bits = 0x07;
+      store_type::filter_state_type state{};
+      size_t count = 0;
+      for(auto k = store->match(state, key(mask), key(bits)); k; k = store->match(state, key(mask), key(bits)))
+      {
+        uint32_t v;
+        memcpy(&v, k.value().data(), sizeof(v));
+        BOOST_CHECK((v & 0xff) == 0x07);
+        count++;
+      }
+      BOOST_CHECK(count == 4);
+    }
+    // Snapshots read values in place, so the store cannot be cleared under them
+    BOOST_CHECK(store->clear().error() == llfio::errc::device_or_resource_busy);
+  }
+  {
+    // Reopening finds the store laid out by the previous handle
+    auto store = kvstore::open_kvstore("file://tempstore").value();
+    BOOST_CHECK(store->key_size() == sizeof(uint32_t));
+    BOOST_CHECK(store->size().value().as_longlongs[0] == 1001);
+    BOOST_CHECK(read(*store, 4).value() == 12);
+    BOOST_CHECK(read(*store, 5).value() == 10);
+    BOOST_CHECK(!store->begin_transaction());
+    // Nor under other handles to the store
+    {
+      auto other = kvstore::open_kvstore("file://tempstore").value();
+      BOOST_CHECK(store->clear().error() == llfio::errc::device_or_resource_busy);
+    }
+    store->clear().value();
+    BOOST_CHECK(store->empty());
+    BOOST_CHECK(read(*store, 4).error() == llfio::errc::no_such_file_or_directory);
+    write(*store, 4, 1).value();
+    BOOST_CHECK(read(*store, 4).value() == 1);
+  }
+  {
+    std::error_code ec;
+    llfio::filesystem::remove("tempstore", ec);
+  }
+  {
+    // Writes of new keys failing their quotas must not use up slots of the table
+    auto store = kvstore::create_kvstore("file://tempstore", sizeof(uint32_t), store_type::features::stable_values).value();
+    auto capacity = [](uint64_t v) {
+      store_type::capacity_type ret;
+      ret.as_longlongs[0] = v;
+      ret.as_longlongs[1] = 0;
+      return ret;
+    };
+    store->max_size(capacity(4)).value();
+    store->max_bytes_stored(capacity(4096)).value();
+    std::vector<llfio::byte> large(65536);
+    for(uint32_t n = 0; n < 256; n++)
+    {
+      store_type::const_buffer_type reqs[] = {{large.data(), large.size()}};
+      BOOST_CHECK(store->write(key(n), {reqs, 0}).error() == llfio::errc::no_space_on_device);
+    }
+    for(uint32_t n = 1000; n < 1004; n++)
+    {
+      BOOST_CHECK(write(*store, n, n));
+    }
+    BOOST_CHECK(write(*store, 1004, 1004).error() == llfio::errc::no_space_on_device);
+    BOOST_CHECK(store->size().value().as_longlongs[0] == 4);
+  }
+  BOOST_CHECK(!kvstore::create_kvstore("http://tempstore", sizeof(uint32_t), store_type::features::none));
+  {
+    std::error_code ec;
+    llfio::filesystem::remove("tempstore", ec);
+  }
+}
+
+KERNELTEST_TEST_KERNEL(integration, llfio, kvstore, single_file, "Tests that the single_file key-value store works as expected", TestSingleFileKvstore())
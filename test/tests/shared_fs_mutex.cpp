@@ -576,6 +576,352 @@ static auto TestSharedFSMutexConstructDestructChildWorker = KERNELTEST_V1_NAMESP
 
 KERNELTEST_TEST_KERNEL(integration, llfio, shared_fs_mutex_memory_map, construct_destruct, "Tests that llfio::algorithm::shared_fs_mutex::memory_map constructor and destructor are race free", [] { TestSharedFSMutexConstructDestruct(shared_memory::memory_map); }())
 
+static void TestMemoryMapDuplicateEntities()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using entity_type = llfio::algorithm::shared_fs_mutex::shared_fs_mutex::entity_type;
+  auto lock = llfio::algorithm::shared_fs_mutex::memory_map<>::fs_mutex_map({}, "lockfile").value();
+  // More than four entities with repeats, some repeats upgrading shared to exclusive
+  entity_type entities[] = {{5, false}, {7, true}, {5, true}, {9, false}, {7, false}, {11, true}, {9, false}, {13, false}, {5, false}};
+  {
+    auto h = lock.lock(entities).value();
+    BOOST_CHECK(!lock.try_lock(entity_type(5, false)));
+    BOOST_CHECK(!lock.try_lock(entity_type(7, false)));
+    BOOST_CHECK(!lock.try_lock(entity_type(11, false)));
+    BOOST_CHECK(!lock.try_lock(entity_type(9, true)));
+    BOOST_CHECK(!lock.try_lock(entity_type(13, true)));
+    // Shared entities can be shared again
+    auto h2 = lock.try_lock(entity_type(9, false));
+    BOOST_CHECK(h2);
+  }
+  // Everything must have been released exactly once
+  auto h = lock.try_lock(entities);
+  BOOST_REQUIRE(h);
+}
+
+KERNELTEST_TEST_KERNEL(integration, llfio, shared_fs_mutex_memory_map, duplicate_entities, "Tests that llfio::algorithm::shared_fs_mutex::memory_map correctly merges duplicate entities", [] { TestMemoryMapDuplicateEntities(); }())
+
+static void TestMemoryMapOrderedAcquisition()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using entity_type = llfio::algorithm::shared_fs_mutex::shared_fs_mutex::entity_type;
+  static constexpr size_t pool_size = 32, entities_per_lock = 20;
+  auto lock = llfio::algorithm::shared_fs_mutex::memory_map<>::fs_mutex_map({}, "lockfile").value();
+  lock.set_ordered_acquisition(true);
+  BOOST_CHECK(lock.ordered_acquisition());
+  std::vector<std::atomic<size_t>> owners(pool_size);
+  for(auto &i : owners)
+  {
+    i = static_cast<size_t>(-1);
+  }
+  std::atomic<bool> done(false), failed(false);
+  std::vector<size_t> counts(std::max(2U, std::thread::hardware_concurrency()), 0);
+  std::vector<std::thread> threads;
+  for(size_t t = 0; t < counts.size(); t++)
+  {
+    threads.emplace_back([&, t] {
+      QUICKCPPLIB_NAMESPACE::algorithm::small_prng::small_prng rand(static_cast<uint32_t>(t));
+      std::vector<entity_type> entities(entities_per_lock);
+      while(!done)
+      {
+        // Random entities in random order, so without ordering lockers would deadlock
+        for(auto &i : entities)
+        {
+          i = entity_type(rand() % pool_size, true);
+        }
+        auto h = lock.lock(entities).value();
+        for(auto &i : entities)
+        {
+          size_t expected = static_cast<size_t>(-1);
+          if(!owners[i.value].compare_exchange_strong(expected, t) && expected != t)
+          {
+            failed = true;
+          }
+        }
+        for(auto &i : entities)
+        {
+          owners[i.value] = static_cast<size_t>(-1);
+        }
+        ++counts[t];
+      }
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+  done = true;
+  for(auto &i : threads)
+  {
+    i.join();
+  }
+  BOOST_CHECK(!failed);
+  for(auto &i : counts)
+  {
+    BOOST_CHECK(i > 0);
+  }
+}
+
+KERNELTEST_TEST_KERNEL(integration, llfio, shared_fs_mutex_memory_map, ordered_acquisition, "Tests that llfio::algorithm::shared_fs_mutex::memory_map ordered acquisition excludes and does not deadlock", [] { TestMemoryMapOrderedAcquisition(); }())
+
+static void TestAtomicAppendManyEntities()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using entity_type = llfio::algorithm::shared_fs_mutex::shared_fs_mutex::entity_type;
+  using llfio::algorithm::shared_fs_mutex::atomic_append;
+  auto lock = atomic_append::fs_mutex_append({}, "lockfile").value();
+  std::vector<entity_type> entities(300);
+  for(size_t n = 0; n < entities.size(); n++)
+  {
+    entities[n] = entity_type(n, true);
+  }
+  for(size_t round = 0; round < 100; round++)
+  {
+    auto h = lock.lock(entities).value();
+    // An entity in the last of the lock request's records must be locked
+    auto h2 = lock.try_lock(entity_type(299, false));
+    BOOST_CHECK(!h2);
+    BOOST_CHECK(h2.error() == llfio::errc::timed_out);
+    BOOST_CHECK(lock.try_lock(entity_type(300, true)));
+  }
+  std::vector<entity_type> toomany(atomic_append::max_entities + 1);
+  BOOST_CHECK(lock.try_lock(toomany).error() == llfio::errc::argument_list_too_long);
+  // After unlock everything must be available again
+  BOOST_CHECK(lock.try_lock(entities));
+}
+
+KERNELTEST_TEST_KERNEL(integration, llfio, shared_fs_mutex_atomic_append, many_entities, "Tests that llfio::algorithm::shared_fs_mutex::atomic_append can lock more than twelve entities", [] { TestAtomicAppendManyEntities(); }())
+
+static void TestProcessIdentity()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  const uint64_t me = llfio::utils::current_process_identity();
+  const uint64_t ns = llfio::utils::current_process_namespace();
+  BOOST_REQUIRE(me != 0);
+  BOOST_REQUIRE(ns != 0);
+  BOOST_CHECK(me == llfio::utils::current_process_identity());
+  BOOST_CHECK(ns == llfio::utils::current_process_namespace());
+  BOOST_CHECK(llfio::utils::process_identity_is_running(me, ns));
+  // No system allocates process ids this large
+  BOOST_CHECK(!llfio::utils::process_identity_is_running((0x3ffff0ULL << 32U) | static_cast<uint32_t>(me), ns));
+#if defined(__linux__) || defined(_WIN32)
+  // My process id with a different start time is a reused process id
+  BOOST_CHECK(!llfio::utils::process_identity_is_running(me ^ 1U, ns));
+#endif
+  // A process id from another or an unknown PID namespace can't be checked, so must be assumed running
+  BOOST_CHECK(llfio::utils::process_identity_is_running((0x3ffff0ULL << 32U) | static_cast<uint32_t>(me), ns + 1));
+  BOOST_CHECK(llfio::utils::process_identity_is_running((0x3ffff0ULL << 32U) | static_cast<uint32_t>(me), 0));
+}
+
+KERNELTEST_TEST_KERNEL(unit, llfio, shared_fs_mutex, process_identity, "Tests that llfio::utils::process_identity_is_running() detects dead lock holders", [] { TestProcessIdentity(); }())
+
+static void TestMemoryMapOptimisticRead()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using entity_type = llfio::algorithm::shared_fs_mutex::shared_fs_mutex::entity_type;
+  auto lock = llfio::algorithm::shared_fs_mutex::memory_map<>::fs_mutex_map({}, "lockfile").value();
+  auto stamp = lock.try_read_optimistic(entity_type(78, false)).value();
+  BOOST_CHECK(lock.validate(stamp));
+  {
+    // Shared holders do not invalidate optimistic readers
+    auto h = lock.lock(entity_type(78, false)).value();
+    BOOST_CHECK(lock.try_read_optimistic(entity_type(78, false)));
+    BOOST_CHECK(lock.validate(stamp));
+  }
+  {
+    // Exclusive holders do
+    auto h = lock.lock(entity_type(78, true)).value();
+    BOOST_CHECK(!lock.try_read_optimistic(entity_type(78, false)));
+    BOOST_CHECK(!lock.validate(stamp));
+  }
+  BOOST_CHECK(!lock.validate(stamp));
+  auto stamp2 = lock.try_read_optimistic(entity_type(78, false)).value();
+  BOOST_CHECK(lock.validate(stamp2));
+}
+
+KERNELTEST_TEST_KERNEL(integration, llfio, shared_fs_mutex_memory_map, optimistic_read, "Tests that llfio::algorithm::shared_fs_mutex::memory_map optimistic reads are invalidated by exclusive lockers", [] { TestMemoryMapOptimisticRead(); }())
+
+static void TestMemoryMapWriterPreferring()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using entity_type = llfio::algorithm::shared_fs_mutex::shared_fs_mutex::entity_type;
+  auto lock = llfio::algorithm::shared_fs_mutex::memory_map<>::fs_mutex_map({}, "lockfile").value();
+  auto h = lock.lock(entity_type(91, false)).value();
+  std::atomic<bool> acquired(false);
+  std::thread writer([&] {
+    auto lock2 = llfio::algorithm::shared_fs_mutex::memory_map<>::fs_mutex_map({}, "lockfile").value();
+    auto h2 = lock2.lock(entity_type(91, true)).value();
+    acquired = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  BOOST_CHECK(!acquired);
+  // Without a policy, shared lockers pass the waiting writer
+  BOOST_CHECK(lock.try_lock(entity_type(91, false)));
+  // With one, they defer to it
+  lock.set_fairness_policy(llfio::algorithm::shared_fs_mutex::fairness_policy::writer_preferring);
+  BOOST_CHECK(!lock.lock(entity_type(91, false), llfio::deadline(std::chrono::milliseconds(50))));
+  h.unlock();
+  writer.join();
+  BOOST_CHECK(acquired);
+}
+
+KERNELTEST_TEST_KERNEL(integration, llfio, shared_fs_mutex_memory_map, writer_preferring, "Tests that llfio::algorithm::shared_fs_mutex::memory_map shared lockers defer to waiting exclusive lockers", [] { TestMemoryMapWriterPreferring(); }())
+
+static void TestSafeByteRangesShardedThreads()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using entity_type = llfio::algorithm::shared_fs_mutex::shared_fs_mutex::entity_type;
+  static constexpr size_t pool_size = 40, entities_per_lock = 4;
+  auto lock = llfio::algorithm::shared_fs_mutex::safe_byte_ranges::fs_mutex_safe_byte_ranges({}, "lockfile").value();
+  // Count of shared holders of each entity, or -1 if held exclusively
+  std::vector<std::atomic<int>> holders(pool_size);
+  for(auto &i : holders)
+  {
+    i = 0;
+  }
+  std::atomic<bool> done(false), failed(false);
+  std::vector<size_t> counts(std::max(2U, std::thread::hardware_concurrency()), 0);
+  std::vector<std::thread> threads;
+  for(size_t t = 0; t < counts.size(); t++)
+  {
+    threads.emplace_back([&, t] {
+      QUICKCPPLIB_NAMESPACE::algorithm::small_prng::small_prng rand(static_cast<uint32_t>(t));
+      std::vector<entity_type> entities(entities_per_lock);
+      while(!done)
+      {
+        // Consecutive entities land in differing shards
+        const size_t first = rand() % pool_size;
+        const bool exclusive = (rand() % 4) == 0;
+        for(size_t n = 0; n < entities_per_lock; n++)
+        {
+          entities[n] = entity_type((first + n) % pool_size, exclusive);
+        }
+        auto h = lock.lock(entities).value();
+        for(auto &i : entities)
+        {
+          int expected = 0;
+          if(exclusive ? !holders[i.value].compare_exchange_strong(expected, -1) : (holders[i.value].fetch_add(1) < 0))
+          {
+            failed = true;
+          }
+        }
+        for(auto &i : entities)
+        {
+          if(exclusive)
+          {
+            holders[i.value] = 0;
+          }
+          else
+          {
+            holders[i.value].fetch_sub(1);
+          }
+        }
+        ++counts[t];
+      }
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+  done = true;
+  for(auto &i : threads)
+  {
+    i.join();
+  }
+  BOOST_CHECK(!failed);
+  for(auto &i : counts)
+  {
+    BOOST_CHECK(i > 0);
+  }
+}
+
+KERNELTEST_TEST_KERNEL(integration, llfio, shared_fs_mutex_safe_byte_ranges_thread, sharded, "Tests that llfio::algorithm::shared_fs_mutex::safe_byte_ranges excludes threads locking entities spread over many shards", [] { TestSafeByteRangesShardedThreads(); }())
+
+static void TestSharedFSMutexStatistics()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using entity_type = llfio::algorithm::shared_fs_mutex::shared_fs_mutex::entity_type;
+  using llfio::algorithm::shared_fs_mutex::lock_histogram;
+  // Buckets are monotonic and each value lies within its bucket
+  for(llfio::algorithm::shared_fs_mutex::uint64 v : {0ULL, 3ULL, 4ULL, 5ULL, 7ULL, 8ULL, 1000ULL, 123456789ULL, ~0ULL})
+  {
+    const size_t idx = lock_histogram::bucket_for(v);
+    BOOST_REQUIRE(idx < lock_histogram::buckets);
+    BOOST_CHECK(v <= lock_histogram::bucket_upper_bound(idx));
+    BOOST_CHECK(idx == 0 || v > lock_histogram::bucket_upper_bound(idx - 1));
+  }
+  auto lock = llfio::algorithm::shared_fs_mutex::memory_map<>::fs_mutex_map({}, "lockfile").value();
+  BOOST_CHECK(!lock.statistics_enabled());
+  BOOST_CHECK(lock.statistics().acquisitions == 0);
+  lock.enable_statistics().value();
+  BOOST_CHECK(lock.statistics_enabled());
+  {
+    auto h = lock.lock(entity_type(55, true)).value();
+    // Contended, so fails
+    BOOST_CHECK(!lock.try_lock(entity_type(55, true)));
+  }
+  auto stats = lock.statistics();
+  BOOST_CHECK(stats.acquisitions == 1);
+  BOOST_CHECK(stats.failures == 1);
+  BOOST_CHECK(stats.contentions >= 1);
+  BOOST_CHECK(stats.wait.total() == 2);
+  BOOST_CHECK(stats.hold.total() == 1);
+  BOOST_CHECK(stats.hold.percentile(1.0) == stats.hold.max);
+  lock.enable_statistics(false).value();
+  BOOST_CHECK(lock.statistics().acquisitions == 0);
+}
+
+KERNELTEST_TEST_KERNEL(unit, llfio, shared_fs_mutex, statistics, "Tests that llfio::algorithm::shared_fs_mutex::shared_fs_mutex gathers statistics", [] { TestSharedFSMutexStatistics(); }())
+
+static void TestSharedFSMutexAsyncLock()
+{
+  namespace llfio = LLFIO_V2_NAMESPACE;
+  using entity_type = llfio::algorithm::shared_fs_mutex::shared_fs_mutex::entity_type;
+  using entities_guard = llfio::algorithm::shared_fs_mutex::shared_fs_mutex::entities_guard;
+  llfio::io_service service;
+  auto lock = llfio::algorithm::shared_fs_mutex::memory_map<>::fs_mutex_map({}, "lockfile").value();
+  auto run_until_done = [&](const bool &done) {
+    while(!done)
+    {
+      service.run_until(std::chrono::milliseconds(10)).value();
+    }
+  };
+  // Uncontended completes through the i/o service
+  {
+    bool done = false;
+    llfio::algorithm::shared_fs_mutex::async_lock(lock, service, entity_type(78, true), {}, [&](llfio::result<entities_guard> r) {
+      BOOST_CHECK(r.has_value());
+      done = true;
+    }).value();
+    BOOST_CHECK(!done);
+    run_until_done(done);
+  }
+  auto h = lock.lock(entity_type(78, true)).value();
+  // Contended times out
+  {
+    bool done = false;
+    llfio::algorithm::shared_fs_mutex::async_lock(lock, service, entity_type(78, true), std::chrono::milliseconds(50), [&](llfio::result<entities_guard> r) {
+      BOOST_REQUIRE(!r);
+      BOOST_CHECK(r.error() == llfio::errc::timed_out);
+      done = true;
+    }).value();
+    run_until_done(done);
+  }
+  // Contended completes once released, and the guard it hands over unlocks
+  {
+    bool done = false;
+    entities_guard acquired;
+    llfio::algorithm::shared_fs_mutex::async_lock(lock, service, entity_type(78, true), {}, [&](llfio::result<entities_guard> r) {
+      acquired = std::move(r).value();
+      done = true;
+    }).value();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    BOOST_CHECK(!done);
+    h.unlock();
+    run_until_done(done);
+    BOOST_CHECK(!lock.try_lock(entity_type(78, true)));
+    acquired.unlock();
+    BOOST_CHECK(lock.try_lock(entity_type(78, true)));
+  }
+}
+
+KERNELTEST_TEST_KERNEL(unit, llfio, shared_fs_mutex, async_lock, "Tests that llfio::algorithm::shared_fs_mutex::async_lock() completes through an io_service", [] { TestSharedFSMutexAsyncLock(); }())
+
 
 /*
 